@@ -15,180 +15,38 @@
  * along with this program; if not, see <http://www.gnu.org/licenses>.
  */
 
+#include <dirent.h>
 #include <mqueue.h>
 #include <stdio.h>
 #include <ctype.h>
 #include "common.h"
 #include "log.h"
+#include "pwl_device_db.h"
+#include "pwl_identity.h"
+#include "pwl_ipc.h"
+#include "pwl_port.h"
 
 static pwl_device_type_t g_device_type = PWL_DEVICE_TYPE_UNKNOWN;
 static char *g_subsysid;
+static pwl_device_identity_t g_identity;
+static gboolean g_identity_valid = FALSE;
+// The port monitor thread updates the mbim port of the published identity
+static pthread_mutex_t g_identity_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 gboolean g_is_iot_ssid = FALSE;
 gboolean g_is_iot_fw = FALSE;
 
-#define IOT_START_INDEX     31
-
-char *usb_devices[] = { "0CBD", "0CC1", "0CC4", "0CB5", "0CB7",
-                        "0CB2", "0CB3", "0CB4", "0CB9", "0CBA",
-                        "0CBB", "0CBC", "0CD9", "0CDA", "0CF4",
-                        "0CE8", "0CF9", "0CF5", "0CF6", "0D5F",
-                        "0D60", "0D5C", "0D5E", "0D47", "0D48",
-                        "0D49", "0D61", "0D4D", "0D4E", "0D4F",
-                        "0D65", //index = 30
-                        //=== IOT ===
-                        "0DF4", "0E39", "0E35", "0E1C", "0E38", 
-                        "0E1D", "0E33", "0E1F", "0E8C", "0E8A", 
-                        "0EA3", "0EAA", "0E26", "0E25", "0E23", 
-                        "0E24", "0E29", "0E31", "0E5F", "0E65", 
-                        "0E5B", "0E69", "0E5D", "0E67", "0DF5", 
-                        "0E40", "0E36", "0E1A", "0E1B", "0E1E", 
-                        "0DF3", "0E34", "0E20", "0E8D", "0E8B", 
-                        "0EA4", "0EAB", "0E28", "0E22", "0E21", 
-                        "0E27", "0E2A", "0E32", "0E60", "0E66", 
-                        "0E5C", "0E6A", "0E5E", "0E68"
-                     };
-
-char *pcie_devices[] = { "0CF4", "0CF5", "0CDD", "0CF1", "0CDB",
-                         "0D4D", "0D4E", "0D4F", "0D65", "0DBD",
-                         //======
-                        "0DBD", "0E1A", "0E38", "0E1B", "0E1D",
-                        "0E1C", "0E1E", "0E33", "0E3C", "0E34",
-                        "0E3D", "0E3A", "0E3B", "0E1F", "0E20",
-                        "0E22", "0E21", "0E25", "0E23", "0E24",
-                        "0E27", "0E31", "0E32", "0E26", "0E28",
-                        "0E3E", "0E3F", "0E82", "0E83", "0E84",
-                        "0E85", "0E5F", "0E65", "0E5B", "0E69",
-                        "0E60", "0E66", "0E5C", "0E6A", "0E5D",
-                        "0E67", "0E5E", "0E68", "0E8A", "0E8C",
-                        "0E8B", "0E8D", "0D85", "0D8A", "0D4D",
-                        "0D4E", "0D4F", "0D65", "0DD0", "0D87",
-                        "0D88"
-                        };
-
-
-const SsidSkuMap ssid_sku_table[] = {
-    { "0CBD", "4131002" },
-    { "0CC1", "4131003" },
-    { "0CC4", "4131003" },
-    { "0CB5", "4131001" },
-    { "0CB7", "4131001" },
-    { "0CB2", "4131001" },
-    { "0CB3", "4131001" },
-    { "0CB4", "4131001" },
-    { "0CB9", "4131001" },
-    { "0CBA", "4131001" },
-    { "0CBB", "4131001" },
-    { "0CBC", "4131001" },
-    { "0CD9", "4131001" },
-    { "0CDA", "4131001" },
-    { "0CF4", "4131007" },
-    { "0CE8", "4131009" },
-    { "0CF9", "4131009" },
-    { "0CF5", "4131008" },
-    { "0CF6", "4131008" },
-    { "0D5F", "4131009" },
-    { "0D60", "4131009" },
-    { "0D5C", "4131009" },
-    { "0D5E", "4131009" },
-    { "0D47", "4131007" },
-    { "0D48", "4131007" },
-    { "0D49", "4131007" },
-    { "0D61", "4131007" },
-    { "0D4D", "4131008" },
-    { "0D4E", "4131008" },
-    { "0D4F", "4131008" },
-    { "0D65", "4131008" },
-    //=== IOT ===
-    { "0DF4", "4131023" },
-    { "0E39", "4131021" },
-    { "0E35", "4131021" },
-    { "0E1C", "4131021" },
-    { "0E38", "4131021" },
-    { "0E1D", "4131022" },
-    { "0E33", "4131021" },
-    { "0E1F", "4131021" },
-    { "0E8C", "4131021" },
-    { "0E8A", "4131023" },
-    { "0EA3", "4131023" },
-    { "0EAA", "4131021" },
-    { "0E26", "4131021" },
-    { "0E25", "4131021" },
-    { "0E23", "4131021" },
-    { "0E24", "4131022" },
-    { "0E29", "4131023" },
-    { "0E31", "4131021" },
-    { "0E5F", "4131021" },
-    { "0E65", "4131021" },
-    { "0E5B", "4131021" },
-    { "0E69", "4131021" },
-    { "0E5D", "4131023" },
-    { "0E67", "4131023" },
-    { "0DF5", "4131027" },
-    { "0E40", "4131026" },
-    { "0E36", "4131026" },
-    { "0E1A", "4131024" },
-    { "0E1B", "4131025" },
-    { "0E1E", "4131026" },
-    { "0DF3", "4131026" },
-    { "0E34", "4131026" },
-    { "0E20", "4131026" },
-    { "0E8D", "4131026" },
-    { "0E8B", "4131027" },
-    { "0EA4", "4131027" },
-    { "0EAB", "4131026" },
-    { "0E28", "4131026" },
-    { "0E22", "4131024" },
-    { "0E21", "4131025" },
-    { "0E27", "4131026" },
-    { "0E2A", "4131027" },
-    { "0E32", "4131026" },
-    { "0E60", "4131026" },
-    { "0E66", "4131026" },
-    { "0E5C", "4131026" },
-    { "0E6A", "4131026" },
-    { "0E5E", "4131027" },
-    { "0E68", "4131027" },
-};
-size_t ssid_sku_table_count = sizeof(ssid_sku_table) / sizeof(ssid_sku_table[0]);
-
-gchar* usbid_info[] = {
-    "413c:8217",
-    "413c:8218",
-    "413c:8219",
-    //===IOT===
-    "413c:81ea",
-    "413c:81eb",
-    "413c:81ec",
-};
-#define USBID_LIST_COUNT        (sizeof(usbid_info) / sizeof(usbid_info[0]))
-
-gchar* pcieid_info[] = {
-    "14c0:4d75",
-    "14c0:0b5e",
-    "14c0:0b63",
-    "14c0:0b62",
-    "14c0:0b68",
-    "14C0:0B68",
-    "14c0:0b64",
-    "14c0:0b66",
-    "14c0:0b65",
-    "14c0:0b5f",
-};
-#define PCIEID_LIST_COUNT       (sizeof(pcieid_info) / sizeof(pcieid_info[0]))
-
-#define SUBSYS_ID_QUERY_CMD "udevadm info --query=all --path=/sys/bus/pci/devices/%s | grep PCI_SUBSYS_ID="
-// #define SUBSYS "1028:5933"
-static const char *SUBSYS_LIST[] = {
-    "1028:5933",
-    "1028:5966",
-    NULL
-};
+// One entry of /sys/bus/usb/devices or /sys/bus/pci/devices
+typedef struct {
+    gchar   name[32];       // sysfs entry, the pci domain address for pcie
+    gchar   id[10];         // vid:pid, lower case like lsusb and lspci
+    gchar   subsys_id[10];  // pcie only, VID:PID upper case like udev PCI_SUBSYS_ID
+} sysfs_device_t;
 
 gboolean pwl_discard_old_messages(const gchar *path) {
     mqd_t mq;
     struct mq_attr attr;
-    msg_buffer_t message;
+    pwl_mq_msg_t message;
     unsigned int msg_prio;
     int count = 0;
 
@@ -248,32 +106,132 @@ gboolean filter_host_info_header(const gchar *header, gchar *info, gchar *buff,
     return FALSE;
 }
 
+gboolean pwl_read_sysfs_attr(const gchar *path, gchar *buff, gint buff_len) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return FALSE;
+
+    memset(buff, 0, buff_len);
+    if (fgets(buff, buff_len, fp) == NULL) {
+        fclose(fp);
+        return FALSE;
+    }
+    fclose(fp);
+    buff[strcspn(buff, "\n")] = 0;
+    return TRUE;
+}
+
+// DMI attributes from sysfs, dmidecode only for kernels without them
+static gboolean get_dmi_info(const gchar *path, const gchar *dmi_header, gchar *buff, gint buff_len) {
+    gchar info[INFO_BUFFER_SIZE];
+
+    if (pwl_read_sysfs_attr(path, info, INFO_BUFFER_SIZE)) {
+        if (strlen(info) + 1 > buff_len) {
+            PWL_LOG_ERR("host info buffer error, %ld, %d, %s", strlen(info), buff_len, info);
+            return FALSE;
+        }
+        strcpy(buff, info);
+        return TRUE;
+    }
+
+    gchar cmd[64];
+    sprintf(cmd, "dmidecode -t 1 | grep '%s'", dmi_header);
+    if (!get_host_info(cmd, info, INFO_BUFFER_SIZE))
+        return FALSE;
+    return filter_host_info_header(dmi_header, info, buff, buff_len);
+}
+
 void pwl_get_manufacturer(gchar *buff, gint buff_len) {
     memset(buff, 0, buff_len);
 
-    gchar manufacturer[INFO_BUFFER_SIZE];
-    if (!get_host_info("dmidecode -t 1 | grep 'Manufacturer:'", manufacturer, INFO_BUFFER_SIZE)) {
+    if (g_identity_valid && strlen(g_identity.manufacturer) < buff_len) {
+        strcpy(buff, g_identity.manufacturer);
+        return;
+    }
+    if (!get_dmi_info(DMI_SYS_VENDOR_PATH, "Manufacturer: ", buff, buff_len)) {
         PWL_LOG_ERR("Get Manufacturer failed!");
-    } else {
-        if (!filter_host_info_header("Manufacturer: ", manufacturer, buff, buff_len)) {
-            PWL_LOG_ERR("Get Manufacturer info failed!");
-        }
     }
 }
 
 void pwl_get_skuid(gchar *buff, gint buff_len) {
     memset(buff, 0, buff_len);
 
-    gchar skuid[INFO_BUFFER_SIZE];
-    if (!get_host_info("dmidecode -t 1 | grep 'SKU Number:'", skuid, INFO_BUFFER_SIZE)) {
+    if (g_identity_valid && strlen(g_identity.skuid) < buff_len) {
+        strcpy(buff, g_identity.skuid);
+        return;
+    }
+    if (!get_dmi_info(DMI_PRODUCT_SKU_PATH, "SKU Number: ", buff, buff_len)) {
         PWL_LOG_ERR("Get SKU Number failed!");
-    } else {
-        if (!filter_host_info_header("SKU Number: ", skuid, buff, buff_len)) {
-            PWL_LOG_ERR("Get SKU Number info failed!");
-        }
     }
 }
 
+// sysfs id attributes are "413c" for usb and "0x14c0" for pci
+static gboolean read_sysfs_id(const gchar *dir, const gchar *name, const gchar *attr, guint *id) {
+    gchar path[300];
+    gchar value[16];
+
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, name, attr);
+    if (!pwl_read_sysfs_attr(path, value, sizeof(value)))
+        return FALSE;
+    *id = strtoul(value, NULL, 16);
+    return TRUE;
+}
+
+static gboolean sysfs_read_device(pwl_device_type_t type, const gchar *name, sysfs_device_t *device) {
+    const gchar *dir = (type == PWL_DEVICE_TYPE_USB) ? SYSFS_USB_DEVICES_PATH : SYSFS_PCI_DEVICES_PATH;
+    const gchar *vendor_attr = (type == PWL_DEVICE_TYPE_USB) ? "idVendor" : "vendor";
+    const gchar *device_attr = (type == PWL_DEVICE_TYPE_USB) ? "idProduct" : "device";
+    guint vid, pid, subsys_vid, subsys_pid;
+
+    // usb interfaces (1-1:1.0) have no ids
+    if (!read_sysfs_id(dir, name, vendor_attr, &vid) ||
+        !read_sysfs_id(dir, name, device_attr, &pid))
+        return FALSE;
+
+    memset(device, 0, sizeof(sysfs_device_t));
+    g_strlcpy(device->name, name, sizeof(device->name));
+    snprintf(device->id, sizeof(device->id), "%04x:%04x", vid, pid);
+    if (type == PWL_DEVICE_TYPE_PCIE &&
+        read_sysfs_id(dir, name, "subsystem_vendor", &subsys_vid) &&
+        read_sysfs_id(dir, name, "subsystem_device", &subsys_pid))
+        snprintf(device->subsys_id, sizeof(device->subsys_id), "%04X:%04X", subsys_vid, subsys_pid);
+    return TRUE;
+}
+
+// Enumerate the bus once, instead of one lsusb/lspci per id. The array grows with the bus,
+// docks and hubs easily have more devices than any fixed cap. Free with g_array_unref().
+static GArray *sysfs_scan_devices(pwl_device_type_t type) {
+    const gchar *dir = (type == PWL_DEVICE_TYPE_USB) ? SYSFS_USB_DEVICES_PATH : SYSFS_PCI_DEVICES_PATH;
+    GArray *devices = g_array_new(FALSE, FALSE, sizeof(sysfs_device_t));
+    DIR *dp = opendir(dir);
+    struct dirent *entry;
+    sysfs_device_t device;
+
+    if (dp == NULL) {
+        PWL_LOG_ERR("Open %s failed", dir);
+        return devices;
+    }
+
+    while ((entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (sysfs_read_device(type, entry->d_name, &device))
+            g_array_append_val(devices, device);
+    }
+    closedir(dp);
+
+    return devices;
+}
+
+static sysfs_device_t *sysfs_find_device(GArray *devices, const gchar *id) {
+    for (guint i = 0; i < devices->len; i++) {
+        sysfs_device_t *device = &g_array_index(devices, sysfs_device_t, i);
+        if (g_ascii_strcasecmp(device->id, id) == 0)
+            return device;
+    }
+    return NULL;
+}
+
 int get_fwupdate_subsysid(char *subsysid) {
     if (g_subsysid == NULL) {
         PWL_LOG_ERR("SUBSYS error");
@@ -311,77 +269,53 @@ int get_fwupdate_subsysid(char *subsysid) {
     return RET_OK;
 }
 
-gboolean pwl_module_device_id_exist(pwl_device_type_t type, gchar *id) {
-
-    gchar *command = NULL;
-    if (type == PWL_DEVICE_TYPE_USB)
-        command = "lsusb | grep ";
-    else
-        command = "lspci -D -n | grep ";
-
-    gchar cmd[strlen(command) + strlen(id) + 1];
-    memset(cmd, 0, sizeof(cmd));
-    sprintf(cmd, "%s%s", command, id);
-
-    FILE *fp = popen(cmd, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("device id check cmd error!!!");
+static gboolean pcie_subsys_supported(sysfs_device_t *device) {
+    if (DEBUG) PWL_LOG_DEBUG("[Notice] id: %s", device->subsys_id);
+    if (!pwl_device_db_subsys_supported(device->subsys_id))
         return FALSE;
+    if (g_subsysid == NULL) {
+        g_subsysid = malloc(20);
+        memset(g_subsysid, 0, 20);
+        strcpy(g_subsysid, device->subsys_id);
+        if (DEBUG) PWL_LOG_DEBUG("[Notice] g_subsysid: %s", g_subsysid);
     }
+    return TRUE;
+}
 
-    char response[200];
-    memset(response, 0, sizeof(response));
-    char *ret = fgets(response, sizeof(response), fp);
+// First device with a modem id of the device db
+static sysfs_device_t *sysfs_find_modem(pwl_device_type_t type, GArray *devices) {
+    guint8 bus = (type == PWL_DEVICE_TYPE_USB) ? PWL_DEVICE_DB_BUS_USB : PWL_DEVICE_DB_BUS_PCIE;
 
-    pclose(fp);
+    for (guint i = 0; i < devices->len; i++) {
+        sysfs_device_t *device = &g_array_index(devices, sysfs_device_t, i);
+        if (pwl_device_db_find_id(bus, device->id) == NULL)
+            continue;
+        if (type == PWL_DEVICE_TYPE_PCIE && !pcie_subsys_supported(device))
+            continue;
+        return device;
+    }
+    return NULL;
+}
 
-    if (ret != NULL && strlen(response) > 0) {
-        if (type == PWL_DEVICE_TYPE_USB) {
-            return TRUE;
-        } else {
-            // check pcie subsys id
-            const char s[2] = " ";
-            char *domain;
-            domain = strtok(response, s);
-            if (!domain) return FALSE;
-
-            char query_cmd[strlen(SUBSYS_ID_QUERY_CMD) + 20];
-            memset(query_cmd, 0, sizeof(query_cmd));
-            sprintf(query_cmd, SUBSYS_ID_QUERY_CMD, domain);
-
-            fp = popen(query_cmd, "r");
-            if (fp == NULL) {
-                PWL_LOG_ERR("device subsys check cmd error!!!");
-                return FALSE;
-            }
+gboolean pwl_module_device_id_exist(pwl_device_type_t type, gchar *id) {
+    GArray *devices = sysfs_scan_devices(type);
+    sysfs_device_t *device = sysfs_find_device(devices, id);
+    gboolean exist = FALSE;
 
-            char subsysid[100];
-            memset(subsysid, 0, sizeof(subsysid));
-            char *ret = fgets(subsysid, sizeof(subsysid), fp);
-            pclose(fp);
-
-            if (strlen(subsysid) > 0) {
-                char* subsys = strstr(subsysid, (char *)"PCI_SUBSYS_ID=");
-                id = subsys + strlen((char *)"PCI_SUBSYS_ID=");
-                if (DEBUG) PWL_LOG_DEBUG("[Notice] id: %s", id);
-                for (int i = 0; SUBSYS_LIST[i] != NULL; i++) {
-                    if (strncmp(id, SUBSYS_LIST[i], strlen(SUBSYS_LIST[i])) == 0) {
-                        if (g_subsysid == NULL) {
-                            g_subsysid = malloc(20);
-                            memset(g_subsysid, 0, 20);
-                            strcpy(g_subsysid, id);
-                            if (DEBUG) PWL_LOG_DEBUG("[Notice] g_subsysid: %s", g_subsysid);
-                        }
-                        return TRUE;
-                    }
-                }
-            }
+    if (device != NULL)
+        exist = (type == PWL_DEVICE_TYPE_USB) || pcie_subsys_supported(device);
+    g_array_unref(devices);
+    return exist;
+}
 
-            return FALSE;
-        }
-    }
+gboolean pwl_find_pcie_device(const gchar *id, gchar *domain, gint domain_len) {
+    GArray *devices = sysfs_scan_devices(PWL_DEVICE_TYPE_PCIE);
+    sysfs_device_t *device = sysfs_find_device(devices, id);
 
-    return FALSE;
+    if (device != NULL)
+        g_strlcpy(domain, device->name, domain_len);
+    g_array_unref(devices);
+    return device != NULL;
 }
 
 int get_fw_main_version(const char *input) {
@@ -445,6 +379,9 @@ gboolean is_iot_ssid() {
 
 pwl_device_type_t pwl_get_device_type() {
     gchar skuid[PWL_MAX_SKUID_SIZE];
+    const pwl_ssid_info_t *info;
+    sysfs_device_t *device;
+    GArray *devices;
 
     if (g_device_type != PWL_DEVICE_TYPE_UNKNOWN)
         return g_device_type;
@@ -452,44 +389,49 @@ pwl_device_type_t pwl_get_device_type() {
     pwl_get_skuid(skuid, PWL_MAX_SKUID_SIZE);
     if (DEBUG) PWL_LOG_DEBUG("SKU Number: %s", skuid);
 
-    size_t usb_count = sizeof(usb_devices) / sizeof(usb_devices[0]);
-    for (int i = 0; i < usb_count; i++) {
-        if (strncmp(skuid, usb_devices[i], strlen(usb_devices[i])) == 0) {
-            for (gint j = 0; j < USBID_LIST_COUNT; j++) {
-                if (pwl_module_device_id_exist(PWL_DEVICE_TYPE_USB, usbid_info[j])) {
-                    PWL_LOG_INFO("Device type usb");
-                    g_device_type = PWL_DEVICE_TYPE_USB;
-
-                    // Check if IOT SSID
-                    if (i >= IOT_START_INDEX)
-                        g_is_iot_ssid = TRUE;
-                    else
-                        g_is_iot_ssid = FALSE;
-
-                    return PWL_DEVICE_TYPE_USB;
-                }
-            }
+    info = pwl_device_db_find_ssid(skuid);
+    if (info == NULL) {
+        if (DEBUG) PWL_LOG_INFO("Device type unknown, SSID not supported");
+        return PWL_DEVICE_TYPE_UNKNOWN;
+    }
+
+    if (info->bus & PWL_DEVICE_DB_BUS_USB) {
+        devices = sysfs_scan_devices(PWL_DEVICE_TYPE_USB);
+        device = sysfs_find_modem(PWL_DEVICE_TYPE_USB, devices);
+        if (device) {
+            PWL_LOG_INFO("Device type usb");
+            g_identity.device_type = PWL_DEVICE_TYPE_USB;
+            g_strlcpy(g_identity.device_name, device->name, sizeof(g_identity.device_name));
+            g_strlcpy(g_identity.device_id, device->id, sizeof(g_identity.device_id));
+            g_device_type = PWL_DEVICE_TYPE_USB;
+            g_is_iot_ssid = info->iot;
         }
-    }
-
-    size_t pcie_count = sizeof(pcie_devices) / sizeof(pcie_devices[0]);
-    for (int i = 0; i < pcie_count; i++) {
-        if (strncmp(skuid, pcie_devices[i], strlen(pcie_devices[i])) == 0) {
-            for (gint j = 0; j < PCIEID_LIST_COUNT; j++) {
-                if (pwl_module_device_id_exist(PWL_DEVICE_TYPE_PCIE, pcieid_info[j])) {
-                    PWL_LOG_INFO("Device type pcie");
-                    g_device_type = PWL_DEVICE_TYPE_PCIE;
-                    return PWL_DEVICE_TYPE_PCIE;
-                }
-            }
+        g_array_unref(devices);
+        if (g_device_type == PWL_DEVICE_TYPE_USB)
+            return PWL_DEVICE_TYPE_USB;
+    }
+
+    if (info->bus & PWL_DEVICE_DB_BUS_PCIE) {
+        devices = sysfs_scan_devices(PWL_DEVICE_TYPE_PCIE);
+        device = sysfs_find_modem(PWL_DEVICE_TYPE_PCIE, devices);
+        if (device) {
+            PWL_LOG_INFO("Device type pcie");
+            g_identity.device_type = PWL_DEVICE_TYPE_PCIE;
+            g_strlcpy(g_identity.device_name, device->name, sizeof(g_identity.device_name));
+            g_strlcpy(g_identity.device_id, device->id, sizeof(g_identity.device_id));
+            g_strlcpy(g_identity.subsys_id, device->subsys_id, sizeof(g_identity.subsys_id));
+            g_device_type = PWL_DEVICE_TYPE_PCIE;
         }
+        g_array_unref(devices);
+        if (g_device_type == PWL_DEVICE_TYPE_PCIE)
+            return PWL_DEVICE_TYPE_PCIE;
     }
 
     if (DEBUG) PWL_LOG_INFO("Device type unknown");
     return PWL_DEVICE_TYPE_UNKNOWN;
 }
 
-pwl_device_type_t pwl_get_device_type_await() {
+static pwl_device_type_t device_type_poll() {
     pwl_device_type_t type = PWL_DEVICE_TYPE_UNKNOWN;
 
     for (gint i = 0; i < 30; i++) {
@@ -501,38 +443,122 @@ pwl_device_type_t pwl_get_device_type_await() {
     return PWL_DEVICE_TYPE_UNKNOWN;
 }
 
+static void identity_apply(pwl_device_identity_t *identity) {
+    g_identity = *identity;
+    g_identity_valid = TRUE;
+    g_device_type = identity->device_type;
+    g_is_iot_ssid = identity->is_iot_ssid;
+    if (g_subsysid == NULL && strlen(identity->subsys_id) > 0) {
+        g_subsysid = malloc(20);
+        memset(g_subsysid, 0, 20);
+        strcpy(g_subsysid, identity->subsys_id);
+    }
+}
+
+// Saved identity is reused only for the same platform with the modem at the same place
+static gboolean identity_match_hardware(pwl_device_identity_t *identity) {
+    gchar skuid[PWL_MAX_SKUID_SIZE];
+    sysfs_device_t device;
+
+    if (identity->device_type != PWL_DEVICE_TYPE_USB && identity->device_type != PWL_DEVICE_TYPE_PCIE)
+        return FALSE;
+
+    if (!get_dmi_info(DMI_PRODUCT_SKU_PATH, "SKU Number: ", skuid, PWL_MAX_SKUID_SIZE) ||
+        strcmp(skuid, identity->skuid) != 0)
+        return FALSE;
+
+    if (!sysfs_read_device(identity->device_type, identity->device_name, &device))
+        return FALSE;
+    return strcmp(device.id, identity->device_id) == 0 &&
+           strcmp(device.subsys_id, identity->subsys_id) == 0;
+}
+
+// Keep the published port current, readers see a new generation
+static void identity_port_event(pwl_port_type_t type, const gchar *path, gboolean added, gpointer user_data) {
+    if (type != PWL_PORT_MBIM)
+        return;
+
+    pthread_mutex_lock(&g_identity_mutex);
+    memset(g_identity.mbim_port, 0, sizeof(g_identity.mbim_port));
+    if (added)
+        g_strlcpy(g_identity.mbim_port, path, sizeof(g_identity.mbim_port));
+    pwl_identity_publish(&g_identity);
+    pthread_mutex_unlock(&g_identity_mutex);
+}
+
+pwl_device_type_t pwl_publish_device_identity() {
+    pwl_device_identity_t identity;
+
+    if (pwl_identity_read(PWL_IDENTITY_SAVE_PATH, &identity) && identity_match_hardware(&identity)) {
+        PWL_LOG_INFO("Reuse saved device identity");
+        identity_apply(&identity);
+    } else {
+        memset(&g_identity, 0, sizeof(g_identity));
+        // Also publish an unknown device, the other daemons stop waiting
+        g_identity.device_type = device_type_poll();
+        g_identity.is_iot_ssid = g_is_iot_ssid;
+        pwl_get_skuid(g_identity.skuid, sizeof(g_identity.skuid));
+        pwl_get_manufacturer(g_identity.manufacturer, sizeof(g_identity.manufacturer));
+        g_identity_valid = TRUE;
+    }
+
+    pthread_mutex_lock(&g_identity_mutex);
+    memset(g_identity.mbim_port, 0, sizeof(g_identity.mbim_port));
+    if (g_device_type != PWL_DEVICE_TYPE_UNKNOWN)
+        pwl_find_mbim_port(g_identity.mbim_port, sizeof(g_identity.mbim_port));
+    pwl_identity_publish(&g_identity);
+    pthread_mutex_unlock(&g_identity_mutex);
+
+    if (g_device_type != PWL_DEVICE_TYPE_UNKNOWN)
+        pwl_port_subscribe(identity_port_event, NULL);
+    return g_device_type;
+}
+
+pwl_device_type_t pwl_get_device_type_await() {
+    pwl_device_identity_t identity;
+
+    // Published by pwl_core, see pwl_publish_device_identity()
+    if (pwl_identity_wait(&identity, 1, PWL_IDENTITY_WAIT_SEC)) {
+        identity_apply(&identity);
+        return g_device_type;
+    }
+
+    PWL_LOG_ERR("No device identity published, detect device");
+    return device_type_poll();
+}
+
 gboolean cond_wait(pthread_mutex_t *mutex, pthread_cond_t *cond, gint wait_time) {
-    pthread_mutex_unlock(mutex);
     pthread_mutex_lock(mutex);
     struct timespec timeout;
     clock_gettime(CLOCK_REALTIME, &timeout);
     timeout.tv_sec += wait_time;
 
     int result = pthread_cond_timedwait(cond, mutex, &timeout);
+    pthread_mutex_unlock(mutex);
     if (result == ETIMEDOUT || result != 0) {
         if (DEBUG) PWL_LOG_ERR("timed out or error!!!");
         return FALSE;
     }
 
-    pthread_mutex_unlock(mutex);
-
     return TRUE;
 }
 
+// request_id is the id of the request being answered, PWL_IPC_REQUEST_ID_NONE when unsolicited
 void send_message_reply(uint32_t cid,
                         uint32_t sender_id,
                         uint32_t dest_id,
+                        uint32_t request_id,
                         pwl_cid_status_t status,
                         char *msg) {
-    mqd_t mq;
-    mq = mq_open(PWL_MQ_PATH(dest_id), O_WRONLY);
-
     // message to be sent
     msg_buffer_t message;
     message.pwl_cid = cid;
     message.sender_id = sender_id;
     message.status = status;
-    strcpy(message.response, msg);
+    message.content[0] = '\0';
+    if (strlen(msg) >= PWL_MSG_MAX_RESP)
+        PWL_LOG_ERR("Reply for cid (%d) truncated to %d bytes", cid, PWL_MSG_MAX_RESP - 1);
+    g_strlcpy(message.response, msg, sizeof(message.response));
 
     if (DEBUG) {
         PWL_LOG_DEBUG("Sending reply msg to %s for cid (%d) %s, status %s (%s)",
@@ -547,8 +573,8 @@ void send_message_reply(uint32_t cid,
                       cid_status_name[message.status]);
     }
 
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    // Echo the id of the request being answered so the sender can match it
+    pwl_ipc_send(dest_id, &message, request_id);
 }
 
 void print_message_info(msg_buffer_t* message) {
@@ -567,38 +593,7 @@ void print_message_info(msg_buffer_t* message) {
 }
 
 gboolean pwl_find_mbim_port(gchar *port_buff_ptr, guint32 port_buff_size) {
-
-    FILE *fp = NULL;
-    pwl_device_type_t type = pwl_get_device_type();
-    if (type == PWL_DEVICE_TYPE_USB) {
-        fp = popen("find /dev/ -name cdc-wdm*", "r");
-    } else if (type == PWL_DEVICE_TYPE_PCIE) {
-        fp = popen("find /dev/ -name wwan0mbim*", "r");
-    }
-
-    if (fp == NULL) {
-        if (DEBUG) PWL_LOG_ERR("find port cmd error!!!");
-        return FALSE;
-    }
-
-    char buffer[50];
-    memset(buffer, 0, sizeof(buffer));
-    char *ret = fgets(buffer, sizeof(buffer), fp);
-    pclose(fp);
-
-    buffer[strcspn(buffer, "\n")] = 0;
-
-    if ((strlen(buffer) + 1) > port_buff_size) {
-        PWL_LOG_ERR("port buffer size %d not enough!!!", port_buff_size);
-        return FALSE;
-    }
-
-    if (strlen(buffer) <= 0)
-        return FALSE;
-
-    strncpy(port_buff_ptr, buffer, strlen(buffer));
-
-    return TRUE;
+    return pwl_port_get(PWL_PORT_MBIM, port_buff_ptr, port_buff_size);
 }
 
 #define PWL_CMD_SET     "mbimcli -d %s -p --compal-query-at-command=\"%s\""
@@ -624,14 +619,17 @@ gboolean pwl_set_command(const gchar *command, gchar **response) {
         return FALSE;
     }
 
-    gchar buff[PWL_MQ_MAX_RESP];
+    gchar buff[PWL_MSG_MAX_RESP];
     memset(buff, 0, sizeof(buff));
     gchar line[100];
     memset(line, 0, sizeof(line));
 
     while (fgets(line, sizeof(line), fp) != NULL) {
         //if (DEBUG) PWL_LOG_DEBUG("query resp: %s", line);
-        strcat(buff, line);
+        if (g_strlcat(buff, line, sizeof(buff)) >= sizeof(buff)) {
+            PWL_LOG_ERR("Command response truncated to %ld bytes", sizeof(buff) - 1);
+            break;
+        }
     }
     pclose(fp);
 
@@ -670,348 +668,6 @@ gboolean pwl_set_command_available() {
     return available;
 }
 
-int fw_update_status_init() {
-    FILE *fp = NULL;
-
-    if (0 == access(FW_UPDATE_STATUS_RECORD, F_OK)) {
-        PWL_LOG_DEBUG("File exist");
-        fp = fopen(FW_UPDATE_STATUS_RECORD, "r");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Open fw_status file error!");
-            return -1;
-        }
-        /*
-        get_fw_update_status_value(FIND_FASTBOOT_RETRY_COUNT, &g_check_fastboot_retry_count);
-        get_fw_update_status_value(WAIT_MODEM_PORT_RETRY_COUNT, &g_wait_modem_port_retry_count);
-        get_fw_update_status_value(WAIT_AT_PORT_RETRY_COUNT, &g_wait_at_port_retry_count);
-        get_fw_update_status_value(FW_UPDATE_RETRY_COUNT, &g_fw_update_retry_count);
-        get_fw_update_status_value(DO_HW_RESET_COUNT, &g_do_hw_reset_count);
-        get_fw_update_status_value(NEED_RETRY_FW_UPDATE, &g_need_retry_fw_update);
-        */
-        fclose(fp);
-    } else {
-        PWL_LOG_DEBUG("File not exist");
-        fp = fopen(FW_UPDATE_STATUS_RECORD, "w");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Create fw_status file error!");
-            return -1;
-        }
-
-        fprintf(fp, "Find_fastboot_retry_count=0\n");
-        fprintf(fp, "Wait_modem_port_retry_count=0\n");
-        fprintf(fp, "Wait_at_port_retry_count=0\n");
-        fprintf(fp, "Fw_update_retry_count=0\n");
-        fprintf(fp, "Do_hw_reset_count=0\n");
-        fprintf(fp, "Need_retry_fw_update=0\n");
-        fprintf(fp, "jp_fcc_config_count=0\n");
-        fclose(fp);
-    }
-    return 0;
-}
-
-int set_fw_update_status_value(char *key, int value) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char new_value_line[STATUS_LINE_LENGTH];
-    char *new_content = NULL;
-
-    fp = fopen(FW_UPDATE_STATUS_RECORD, "r+");
-    int value_len, file_size, new_file_size;
-    value_len = count_int_length(value);
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open fw_status file error!");
-        return -1;
-    }
-
-    // Check size
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-
-    new_file_size = file_size + value_len + 1;
-    new_content = (char *) malloc(new_file_size);
-    memset(new_content, 0, new_file_size);
-
-    fseek(fp, 0, SEEK_SET);
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            sprintf(new_value_line, "%s=%d\n", key, value);
-            strcat(new_content, new_value_line);
-        } else {
-            strcat(new_content, line);
-        }
-    }
-    fclose(fp);
-    fp = fopen(FW_UPDATE_STATUS_RECORD, "w");
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("Create fw_status file error!\n");
-        return -1;
-    }
-    fwrite(new_content, sizeof(char), strlen(new_content), fp);
-    free(new_content);
-    fclose(fp);
-
-    return 0;
-}
-
-int get_fw_update_status_value(char *key, int *result) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char *temp_pos = NULL;
-    char value[5];
-
-    fp = fopen(FW_UPDATE_STATUS_RECORD, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open fw_status file error!");
-        return -1;
-    }
-
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            temp_pos = strchr(line, '=');
-            ++temp_pos;
-            strncpy(value, temp_pos, strlen(temp_pos));
-            if (NULL != strstr(value, "\r\n"))
-            {
-                PWL_LOG_DEBUG("get result string has carriage return\n");
-                value[strlen(temp_pos)-2] = '\0';
-            } else {
-                value[strlen(temp_pos)-1] = '\0';
-            }
-        }
-    }
-    // PWL_LOG_DEBUG("value: %s\n", value);
-    *result = atoi(value);
-    fclose(fp);
-    return 0;
-}
-
-int esim_profile_remove_status_init() {
-    FILE *fp = NULL;
-    if (0 == access(ESIM_PROFILE_REMOVE_RECORD, F_OK)) {
-        PWL_LOG_DEBUG("eSim profile remove record file exist");
-        fp = fopen(ESIM_PROFILE_REMOVE_RECORD, "r");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Open eSim profile remove record file error!");
-            return -1;
-        }
-        fclose(fp);
-    } else {
-        PWL_LOG_DEBUG("File not exist");
-        fp = fopen(ESIM_PROFILE_REMOVE_RECORD, "w");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Create eSim profile remove record file error!");
-            return -1;
-        }
-        fprintf(fp, "Testprofile_Delete_Counter=0\n");
-        fprintf(fp, "Testprofile_Delete_Done=0\n");
-        fclose(fp);
-    }
-    return 0;
-}
-
-int set_esim_profile_remove_status_value(char *key, int value) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char new_value_line[STATUS_LINE_LENGTH];
-    char *new_content = NULL;
-
-    fp = fopen(ESIM_PROFILE_REMOVE_RECORD, "r+");
-    int value_len, file_size, new_file_size;
-    value_len = count_int_length(value);
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open esim profile remove status file error!");
-        return -1;
-    }
-
-    // Check size
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-
-    new_file_size = file_size + value_len + 1;
-    new_content = (char *) malloc(new_file_size);
-    if (new_content == NULL) {
-        PWL_LOG_ERR("malloc new_content failed");
-        fclose(fp);
-        return -1;
-    }
-    memset(new_content, 0, new_file_size);
-
-    fseek(fp, 0, SEEK_SET);
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            sprintf(new_value_line, "%s=%d\n", key, value);
-            strcat(new_content, new_value_line);
-        } else {
-            strcat(new_content, line);
-        }
-    }
-    fclose(fp);
-    fp = fopen(ESIM_PROFILE_REMOVE_RECORD, "w");
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("Create esim profile remove status file error!");
-        free(new_content);
-        new_content = NULL;
-        return -1;
-    }
-    size_t written = fwrite(new_content, sizeof(char), strlen(new_content), fp);
-    if (written != strlen(new_content)) {
-        PWL_LOG_ERR("fwrite failed: expected %zu bytes, wrote %zu", strlen(new_content), written);
-        free(new_content);
-        new_content = NULL;
-        fclose(fp);
-        return -1;
-    }
-
-    free(new_content);
-    new_content = NULL;
-    fclose(fp);
-
-    return 0;
-}
-
-int get_esim_profile_remove_status_value(char *key, int *result) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char *temp_pos = NULL;
-    char value[5];
-
-    fp = fopen(ESIM_PROFILE_REMOVE_RECORD, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open esim profile remove status file error!");
-        return -1;
-    }
-
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            temp_pos = strchr(line, '=');
-            ++temp_pos;
-            strncpy(value, temp_pos, strlen(temp_pos));
-            if (NULL != strstr(value, "\r\n"))
-            {
-                PWL_LOG_DEBUG("get result string has carriage return\n");
-                value[strlen(temp_pos)-2] = '\0';
-            } else {
-                value[strlen(temp_pos)-1] = '\0';
-            }
-        }
-    }
-    // PWL_LOG_DEBUG("value: %s\n", value);
-    *result = atoi(value);
-    fclose(fp);
-    return 0;
-}
-
-int bootup_status_init() {
-    FILE *fp = NULL;
-
-    if (0 == access(BOOTUP_STATUS_RECORD, F_OK)) {
-        PWL_LOG_DEBUG("Bootup record file exist");
-        fp = fopen(BOOTUP_STATUS_RECORD, "r");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Open bootup state record file error!");
-            return -1;
-        }
-        fclose(fp);
-    } else {
-        PWL_LOG_DEBUG("File not exist");
-        fp = fopen(BOOTUP_STATUS_RECORD, "w");
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("Create bootup state record file error!");
-            return -1;
-        }
-        fprintf(fp, "Bootup_failure_count=0\n");
-        fprintf(fp, "esim_enable=1\n");
-        fclose(fp);
-    }
-    return 0;
-}
-
-int set_bootup_status_value(char *key, int value) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char new_value_line[STATUS_LINE_LENGTH];
-    char *new_content = NULL;
-
-    fp = fopen(BOOTUP_STATUS_RECORD, "r+");
-    int value_len, file_size, new_file_size;
-    value_len = count_int_length(value);
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open bootup state record file error!");
-        return -1;
-    }
-
-    // Check size
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-
-    new_file_size = file_size + value_len + 1;
-    new_content = malloc(new_file_size);
-    memset(new_content, 0, new_file_size);
-
-    fseek(fp, 0, SEEK_SET);
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            sprintf(new_value_line, "%s=%d\n", key, value);
-            strcat(new_content, new_value_line);
-        } else {
-            strcat(new_content, line);
-        }
-    }
-    fclose(fp);
-    fp = fopen(BOOTUP_STATUS_RECORD, "w");
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("Create bootup state record file error!\n");
-        return -1;
-    }
-    fwrite(new_content, sizeof(char), strlen(new_content), fp);
-    free(new_content);
-    fclose(fp);
-
-    return 0;
-}
-
-int get_bootup_status_value(char *key, int *result) {
-    FILE *fp = NULL;
-    char line[STATUS_LINE_LENGTH];
-    char *temp_pos = NULL;
-    char value[5];
-
-    memset(value, 0, sizeof(value));
-
-    fp = fopen(BOOTUP_STATUS_RECORD, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("Open bootup state record file error!");
-        return -1;
-    }
-
-    while (fgets(line, STATUS_LINE_LENGTH, fp) != NULL) {
-        if (strstr(line, key)) {
-            temp_pos = strchr(line, '=');
-            ++temp_pos;
-            strncpy(value, temp_pos, strlen(temp_pos));
-            if (NULL != strstr(value, "\r\n")) {
-                PWL_LOG_DEBUG("get result string has carriage return\n");
-                value[strlen(temp_pos) - 2] = '\0';
-            } else {
-                value[strlen(temp_pos) - 1] = '\0';
-            }
-        }
-    }
-    // PWL_LOG_DEBUG("value: %s\n", value);
-    *result = atoi(value);
-    fclose(fp);
-    return 0;
-}
-
 int read_config_from_file(char *file_name, char*key, int *result) {
     FILE *fp = NULL;
     char line[STATUS_LINE_LENGTH];
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "pwl_device_db.h"
+
+// Same as device_db_slots() in pwl_device_db.cmake
+static guint32 device_db_hash(guint32 key) {
+    return (key ^ (key >> 16)) * 73244475u;
+}
+
+static gint device_db_find(const pwl_device_db_slot_t *slots, guint32 mask, guint32 key) {
+    for (guint32 slot = device_db_hash(key) & mask; slots[slot].index >= 0; slot = (slot + 1) & mask) {
+        if (slots[slot].key == key)
+            return slots[slot].index;
+    }
+    return -1;
+}
+
+static gboolean device_db_parse_hex(const gchar *text, gint len, guint32 *value) {
+    gchar buf[8];
+    gchar *end;
+
+    if (text == NULL || strlen(text) < len || len >= sizeof(buf))
+        return FALSE;
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    *value = strtoul(buf, &end, 16);
+    return *end == '\0';
+}
+
+// vid:pid in either case
+static gboolean device_db_parse_id(const gchar *id, guint32 *key) {
+    guint32 vid, pid;
+
+    if (id == NULL || strlen(id) != 9 || id[4] != ':' ||
+        !device_db_parse_hex(id, 4, &vid) || !device_db_parse_hex(id + 5, 4, &pid))
+        return FALSE;
+    *key = (vid << 16) | pid;
+    return TRUE;
+}
+
+// The SSID is the first 4 digits of the SKU number
+const pwl_ssid_info_t *pwl_device_db_find_ssid(const gchar *skuid) {
+    guint32 key;
+    gint index;
+
+    if (!device_db_parse_hex(skuid, 4, &key))
+        return NULL;
+    index = device_db_find(pwl_device_db_ssid_slots, pwl_device_db_ssid_mask, key);
+    return index < 0 ? NULL : &pwl_device_db_ssids[index];
+}
+
+const pwl_modem_id_t *pwl_device_db_find_id(guint8 bus, const gchar *id) {
+    guint32 key;
+    gint index;
+
+    if (!device_db_parse_id(id, &key))
+        return NULL;
+    index = device_db_find(pwl_device_db_id_slots, pwl_device_db_id_mask, key);
+    if (index < 0 || !(pwl_device_db_ids[index].bus & bus))
+        return NULL;
+    return &pwl_device_db_ids[index];
+}
+
+const pwl_modem_id_t *pwl_device_db_autosuspend_id() {
+    for (gint i = 0; i < pwl_device_db_id_count; i++) {
+        if (pwl_device_db_ids[i].autosuspend)
+            return &pwl_device_db_ids[i];
+    }
+    return NULL;
+}
+
+gboolean pwl_device_db_subsys_supported(const gchar *subsys_id) {
+    guint32 key;
+
+    if (!device_db_parse_id(subsys_id, &key))
+        return FALSE;
+    return device_db_find(pwl_device_db_subsys_slots, pwl_device_db_subsys_mask, key) >= 0;
+}
@@ -0,0 +1,199 @@
+# Generate ${PROJECT_BINARY_DIR}/DeviceDbGenerated.c from pwl_device_db.csv,
+# see includes/pwl_device_db.h for the tables and the csv for the format.
+# The hash has to stay the same as device_db_hash() in pwl_device_db.c.
+
+set(DEVICE_DB_CSV ${PROJECT_SOURCE_DIR}/common/pwl_device_db.csv)
+set(DEVICE_DB_OUTPUT ${PROJECT_BINARY_DIR}/DeviceDbGenerated.c)
+
+set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS ${DEVICE_DB_CSV})
+
+# math() only takes hex literals from CMake 3.13 on, convert digit by digit
+function(device_db_hex_value text out)
+    string(TOLOWER "${text}" text)
+    string(LENGTH "${text}" length)
+    set(value 0)
+    set(index 0)
+    while(index LESS length)
+        string(SUBSTRING "${text}" ${index} 1 digit)
+        string(FIND "0123456789abcdef" "${digit}" digit)
+        math(EXPR value "${value} * 16 + ${digit}")
+        math(EXPR index "${index} + 1")
+    endwhile()
+    set(${out} ${value} PARENT_SCOPE)
+endfunction()
+
+function(device_db_hex_key text out)
+    if(NOT text MATCHES "^[0-9A-Fa-f]+$")
+        message(FATAL_ERROR "Device db: invalid hex ${text}")
+    endif()
+    device_db_hex_value(${text} value)
+    set(${out} ${value} PARENT_SCOPE)
+endfunction()
+
+function(device_db_id_key text out)
+    if(NOT text MATCHES "^([0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f]):([0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f])$")
+        message(FATAL_ERROR "Device db: invalid id ${text}")
+    endif()
+    set(low ${CMAKE_MATCH_2})
+    device_db_hex_value(${CMAKE_MATCH_1} high)
+    device_db_hex_value(${low} low)
+    math(EXPR value "(${high} << 16) | ${low}")
+    set(${out} ${value} PARENT_SCOPE)
+endfunction()
+
+# Emit the slot array of <name> for the keys in order, linear probing
+function(device_db_slots name keys out_text)
+    list(LENGTH keys count)
+    set(size 4)
+    math(EXPR limit "${count} * 2")
+    while(size LESS limit)
+        math(EXPR size "${size} * 2")
+    endwhile()
+    math(EXPR mask "${size} - 1")
+
+    set(slot_keys "")
+    set(slot_index "")
+    foreach(i RANGE 1 ${size})
+        list(APPEND slot_keys 0)
+        list(APPEND slot_index -1)
+    endforeach()
+
+    set(index 0)
+    foreach(key IN LISTS keys)
+        math(EXPR slot "((${key} ^ (${key} >> 16)) * 73244475) & ${mask}")
+        list(GET slot_index ${slot} used)
+        while(NOT used EQUAL -1)
+            list(GET slot_keys ${slot} used_key)
+            if(used_key EQUAL key)
+                message(FATAL_ERROR "Device db: duplicate ${name} entry ${key}")
+            endif()
+            math(EXPR slot "(${slot} + 1) & ${mask}")
+            list(GET slot_index ${slot} used)
+        endwhile()
+        list(REMOVE_AT slot_keys ${slot})
+        list(INSERT slot_keys ${slot} ${key})
+        list(REMOVE_AT slot_index ${slot})
+        list(INSERT slot_index ${slot} ${index})
+        math(EXPR index "${index} + 1")
+    endforeach()
+
+    set(text "const pwl_device_db_slot_t pwl_device_db_${name}_slots[] = {\n")
+    foreach(i RANGE 0 ${mask})
+        list(GET slot_keys ${i} key)
+        list(GET slot_index ${i} index)
+        string(APPEND text "    { ${key}, ${index} },\n")
+    endforeach()
+    string(APPEND text "};\nconst guint32 pwl_device_db_${name}_mask = ${mask};\n\n")
+    set(${out_text} "${text}" PARENT_SCOPE)
+endfunction()
+
+function(device_db_bus text out)
+    set(bus 0)
+    if(NOT text STREQUAL "-")
+        string(REPLACE "|" ";" names "${text}")
+        foreach(name IN LISTS names)
+            if(name STREQUAL "usb")
+                math(EXPR bus "${bus} | 1")
+            elseif(name STREQUAL "pcie")
+                math(EXPR bus "${bus} | 2")
+            else()
+                message(FATAL_ERROR "Device db: unknown bus ${name}")
+            endif()
+        endforeach()
+    endif()
+    set(${out} ${bus} PARENT_SCOPE)
+endfunction()
+
+file(STRINGS ${DEVICE_DB_CSV} DEVICE_DB_LINES)
+
+set(SSID_KEYS "")
+set(SSID_TEXT "")
+set(ID_KEYS "")
+set(ID_TEXT "")
+set(SUBSYS_KEYS "")
+foreach(LINE IN LISTS DEVICE_DB_LINES)
+    string(STRIP "${LINE}" LINE)
+    if(LINE STREQUAL "" OR LINE MATCHES "^#")
+        continue()
+    endif()
+    # Keep empty fields
+    string(REPLACE "," ";" FIELDS "${LINE};")
+    list(GET FIELDS 0 TYPE)
+
+    if(TYPE STREQUAL "ssid")
+        list(GET FIELDS 1 SSID)
+        list(GET FIELDS 2 BUS)
+        list(GET FIELDS 3 IOT)
+        list(GET FIELDS 4 OEM_SKU)
+        list(GET FIELDS 5 GPIO)
+        device_db_hex_key(${SSID} KEY)
+        device_db_bus(${BUS} BUS)
+        string(TOUPPER ${SSID} SSID)
+        if(OEM_SKU STREQUAL "")
+            set(OEM_SKU NULL)
+        else()
+            set(OEM_SKU "\"${OEM_SKU}\"")
+        endif()
+        if(GPIO STREQUAL "")
+            set(GPIO PWL_DEVICE_DB_GPIO_UNKNOWN)
+        endif()
+        set(GPIO_CHIP NULL)
+        set(GPIO_LINE -1)
+        list(LENGTH FIELDS FIELD_COUNT)
+        if(FIELD_COUNT GREATER 7)
+            list(GET FIELDS 6 CHIP)
+            list(GET FIELDS 7 LINE_OFFSET)
+            if(NOT CHIP STREQUAL "")
+                if(NOT LINE_OFFSET MATCHES "^[0-9]+$")
+                    message(FATAL_ERROR "Device db: ${SSID} gpio chip without line offset")
+                endif()
+                set(GPIO_CHIP "\"${CHIP}\"")
+                set(GPIO_LINE ${LINE_OFFSET})
+            endif()
+        endif()
+        if(IOT)
+            set(IOT TRUE)
+        else()
+            set(IOT FALSE)
+        endif()
+        list(APPEND SSID_KEYS ${KEY})
+        string(APPEND SSID_TEXT "    { ${KEY}, \"${SSID}\", ${BUS}, ${IOT}, ${OEM_SKU}, ${GPIO}, ${GPIO_CHIP}, ${GPIO_LINE} },\n")
+    elseif(TYPE STREQUAL "id")
+        list(GET FIELDS 1 BUS)
+        list(GET FIELDS 2 ID)
+        list(GET FIELDS 3 FLAG)
+        device_db_bus(${BUS} BUS)
+        device_db_id_key(${ID} KEY)
+        if(FLAG STREQUAL "autosuspend")
+            set(FLAG TRUE)
+        else()
+            set(FLAG FALSE)
+        endif()
+        list(APPEND ID_KEYS ${KEY})
+        string(APPEND ID_TEXT "    { ${KEY}, \"${ID}\", ${BUS}, ${FLAG} },\n")
+    elseif(TYPE STREQUAL "subsys")
+        list(GET FIELDS 1 ID)
+        device_db_id_key(${ID} KEY)
+        list(APPEND SUBSYS_KEYS ${KEY})
+    else()
+        message(FATAL_ERROR "Device db: unknown row ${LINE}")
+    endif()
+endforeach()
+
+list(LENGTH ID_KEYS ID_COUNT)
+device_db_slots(ssid "${SSID_KEYS}" SSID_SLOTS)
+device_db_slots(id "${ID_KEYS}" ID_SLOTS)
+device_db_slots(subsys "${SUBSYS_KEYS}" SUBSYS_SLOTS)
+
+file(WRITE ${DEVICE_DB_OUTPUT}.tmp
+     "// Generated from common/pwl_device_db.csv, do not edit\n\n"
+     "#include \"pwl_device_db.h\"\n\n"
+     "const pwl_ssid_info_t pwl_device_db_ssids[] = {\n${SSID_TEXT}};\n\n"
+     "${SSID_SLOTS}"
+     "const pwl_modem_id_t pwl_device_db_ids[] = {\n${ID_TEXT}};\n"
+     "const gint pwl_device_db_id_count = ${ID_COUNT};\n\n"
+     "${ID_SLOTS}"
+     "${SUBSYS_SLOTS}")
+# Unchanged output keeps the services from being rebuilt
+configure_file(${DEVICE_DB_OUTPUT}.tmp ${DEVICE_DB_OUTPUT} COPYONLY)
+file(REMOVE ${DEVICE_DB_OUTPUT}.tmp)
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_identity.h"
+
+gboolean pwl_identity_read(const gchar *path, pwl_device_identity_t *identity) {
+    FILE *fp = fopen(path, "rb");
+    size_t len;
+
+    if (fp == NULL)
+        return FALSE;
+
+    len = fread(identity, 1, sizeof(*identity), fp);
+    fclose(fp);
+
+    if (len != sizeof(*identity) || identity->magic != PWL_IDENTITY_MAGIC ||
+        identity->version != PWL_IDENTITY_VERSION) {
+        PWL_LOG_ERR("Ignore invalid device identity %s", path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Write to a temporary file and rename, readers never see a partial identity
+static gboolean identity_write(const gchar *path, pwl_device_identity_t *identity) {
+    gchar tmp_path[128];
+    FILE *fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open %s failed: %s", tmp_path, strerror(errno));
+        return FALSE;
+    }
+    if (fwrite(identity, sizeof(*identity), 1, fp) != 1) {
+        PWL_LOG_ERR("Write %s failed", tmp_path);
+        fclose(fp);
+        unlink(tmp_path);
+        return FALSE;
+    }
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+
+    if (rename(tmp_path, path) != 0) {
+        PWL_LOG_ERR("Rename %s failed: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean pwl_identity_publish(pwl_device_identity_t *identity) {
+    pwl_device_identity_t current;
+
+    identity->magic = PWL_IDENTITY_MAGIC;
+    identity->version = PWL_IDENTITY_VERSION;
+    identity->generation = 1;
+    if (pwl_identity_read(PWL_IDENTITY_RUN_PATH, &current))
+        identity->generation = current.generation + 1;
+
+    mkdir(PWL_IDENTITY_RUN_DIR, 0755);
+    if (!identity_write(PWL_IDENTITY_RUN_PATH, identity))
+        return FALSE;
+
+    // Keep for the next boot, failure only costs a detection
+    if (!identity_write(PWL_IDENTITY_SAVE_PATH, identity))
+        PWL_LOG_ERR("Save device identity failed");
+
+    PWL_LOG_INFO("Device identity generation %d, type %d, sku %s, device %s %s",
+                 identity->generation, identity->device_type, identity->skuid,
+                 identity->device_name, identity->device_id);
+    return TRUE;
+}
+
+gboolean pwl_identity_wait(pwl_device_identity_t *identity, uint32_t min_generation, gint timeout_sec) {
+    struct timespec start, now;
+    gint fd, wd;
+    gboolean ret = FALSE;
+
+    mkdir(PWL_IDENTITY_RUN_DIR, 0755);
+
+    // Watch before reading so a publish in between is not missed
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        PWL_LOG_ERR("inotify init failed: %s", strerror(errno));
+        return FALSE;
+    }
+    wd = inotify_add_watch(fd, PWL_IDENTITY_RUN_DIR, IN_MOVED_TO | IN_CLOSE_WRITE);
+    if (wd < 0) {
+        PWL_LOG_ERR("inotify watch %s failed: %s", PWL_IDENTITY_RUN_DIR, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (TRUE) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        gchar events[1024];
+        gint remain_ms;
+
+        if (pwl_identity_read(PWL_IDENTITY_RUN_PATH, identity) &&
+            identity->generation >= min_generation) {
+            ret = TRUE;
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remain_ms = timeout_sec * 1000 - ((now.tv_sec - start.tv_sec) * 1000 +
+                                          (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (remain_ms <= 0)
+            break;
+
+        if (poll(&pfd, 1, remain_ms) < 0 && errno != EINTR)
+            break;
+        // Any change in the directory is a reason to read again
+        while (read(fd, events, sizeof(events)) > 0);
+    }
+
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,835 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_ipc.h"
+#include "pwl_metrics.h"
+#include "pwl_record.h"
+#include "pwl_trace.h"
+
+#define PWL_IPC_MAX_ID          (PWL_MQ_ID_UNLOCK + 1)
+#define PWL_IPC_FULL_WAIT_MS    (PWL_CMD_TIMEOUT_SEC * 1000)
+#define PWL_IPC_ALIGN(x)        (((x) + PWL_IPC_FRAME_ALIGN - 1) & ~(PWL_IPC_FRAME_ALIGN - 1))
+#define PWL_IPC_PATH_LEN        32
+
+typedef struct {
+    gboolean            ring_checked;
+    pwl_ipc_ring_t      *ring[PWL_IPC_LANES];
+    mqd_t               mq;         // blocking, full msg_buffer_t fallback
+    mqd_t               doorbell;   // non-blocking, zero-length wake up
+} pwl_ipc_peer_t;
+
+static pthread_mutex_t g_ipc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pwl_ipc_peer_t g_ipc_peers[PWL_IPC_MAX_ID];
+static gboolean g_ipc_peers_init = FALSE;
+
+static uint32_t g_ipc_self_id = PWL_MQ_ID_INVALID;
+static pwl_ipc_ring_t *gp_ipc_self_ring[PWL_IPC_LANES];
+static mqd_t g_ipc_self_mq = (mqd_t) -1;
+
+// Main loop dispatch, see pwl_ipc_attach()
+static pwl_ipc_handler_t g_ipc_handler = NULL;
+static pthread_t g_ipc_dispatch_thread;
+
+// Messages fetched while a handler waits for its reply, only touched by the dispatch thread
+typedef struct ipc_deferred {
+    struct ipc_deferred *next;
+    uint32_t            request_id;
+    msg_buffer_t        message;
+} ipc_deferred_t;
+
+static ipc_deferred_t *gp_ipc_deferred_head = NULL;
+static ipc_deferred_t *gp_ipc_deferred_tail = NULL;
+
+// Everything not listed here is informational
+static const pwl_ipc_lane_t g_ipc_cid_lane[PWL_CID_MAX] = {
+    [PWL_CID_SWITCH_TO_FASTBOOT] = PWL_IPC_LANE_CONTROL,
+    [PWL_CID_MADPT_RESTART] = PWL_IPC_LANE_CONTROL,
+    [PWL_CID_RESET] = PWL_IPC_LANE_CONTROL,
+    [PWL_CID_GET_ATI] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_BACKUP_SN_IMEI] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_GET_BACKUP_SN_IMEI] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_RESTORE_SN] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_RESTORE_IMEI] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_CHECK_OEM_PRI_VERSION] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_SET_OEM_PRI_VERSION] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_SET_PREF_CARRIER] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_DEL_TUNE_CODE] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_GET_OEM_PRI_RESET_STATE] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_CHECK_ESIM_TEST_PROF] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_DELETE_ESIM_TEST_PROF] = PWL_IPC_LANE_UPDATE,
+    [PWL_CID_SETUP_JP_FCC_CONFIG] = PWL_IPC_LANE_UPDATE,
+};
+
+// Sender side, requests waiting for a reply
+static pthread_mutex_t g_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pending_cond = PTHREAD_COND_INITIALIZER;
+static pwl_ipc_pending_t g_pending[PWL_IPC_MAX_PENDING];
+static uint32_t g_next_request_id = PWL_IPC_REQUEST_ID_NONE;
+static uint32_t g_expired[PWL_IPC_MAX_EXPIRED];
+static uint32_t g_expired_index = 0;
+
+pwl_ipc_lane_t pwl_ipc_cid_lane(uint32_t cid) {
+    if (cid >= PWL_CID_MAX)
+        return PWL_IPC_LANE_INFO;
+    return g_ipc_cid_lane[cid];
+}
+
+static gboolean ipc_lane_path(gchar *path, uint32_t id, int lane) {
+    if (PWL_IPC_RING_PATH(id) == NULL)
+        return FALSE;
+    snprintf(path, PWL_IPC_PATH_LEN, "%s_%d", PWL_IPC_RING_PATH(id), lane);
+    return TRUE;
+}
+
+static void ipc_ring_lock(pwl_ipc_ring_t *ring) {
+    if (pthread_mutex_lock(&ring->lock) == EOWNERDEAD) {
+        // Previous holder died in the middle of a push, head was not moved so the ring is intact
+        pthread_mutex_consistent(&ring->lock);
+    }
+}
+
+static pwl_ipc_ring_t *ipc_ring_map(const gchar *path, gboolean create) {
+    int fd;
+    pwl_ipc_ring_t *ring;
+
+    fd = shm_open(path, create ? (O_CREAT | O_RDWR) : O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+
+    if (create && ftruncate(fd, sizeof(pwl_ipc_ring_t)) != 0) {
+        PWL_LOG_ERR("ring %s ftruncate failed: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    ring = mmap(NULL, sizeof(pwl_ipc_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        PWL_LOG_ERR("ring %s mmap failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (create && ring->magic != PWL_IPC_RING_MAGIC) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&ring->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        ring->size = PWL_IPC_RING_SIZE;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->sleeping = 0;
+        ring->full_waiters = 0;
+        __atomic_store_n(&ring->magic, PWL_IPC_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != PWL_IPC_RING_MAGIC ||
+        ring->size != PWL_IPC_RING_SIZE) {
+        munmap(ring, sizeof(pwl_ipc_ring_t));
+        return NULL;
+    }
+    return ring;
+}
+
+// Shared futex, the ring is mapped by several processes
+static void ipc_futex_wait(uint32_t *addr, uint32_t value, gint timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void ipc_futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Consumer side, frees space and wakes producers that found the ring full
+static void ipc_ring_set_tail(pwl_ipc_ring_t *ring, uint32_t tail) {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->full_waiters, __ATOMIC_SEQ_CST))
+        ipc_futex_wake(&ring->tail);
+}
+
+static gboolean ipc_ring_push(pwl_ipc_ring_t *ring, msg_buffer_t *message, uint32_t request_id) {
+    pwl_ipc_frame_t frame;
+    uint32_t head, tail, offset, need, waste = 0;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.sender_id = message->sender_id;
+    frame.pwl_cid = message->pwl_cid;
+    frame.status = message->status;
+    frame.request_id = request_id;
+    frame.content_len = strnlen(message->content, PWL_MQ_MAX_CONTENT_LEN - 1);
+    frame.response_len = strnlen(message->response, PWL_MSG_MAX_RESP - 1);
+    need = PWL_IPC_ALIGN(sizeof(frame) + frame.content_len + frame.response_len);
+    frame.frame_len = need;
+
+    ipc_ring_lock(ring);
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    offset = head % ring->size;
+
+    // Frames are never split, skip the rest of the lap when it is too short
+    if (ring->size - offset < need)
+        waste = ring->size - offset;
+
+    if ((head - tail) + waste + need > ring->size) {
+        pthread_mutex_unlock(&ring->lock);
+        return FALSE;
+    }
+
+    if (waste >= sizeof(pwl_ipc_frame_t)) {
+        pwl_ipc_frame_t wrap;
+        memset(&wrap, 0, sizeof(wrap));
+        wrap.frame_len = waste;
+        wrap.pwl_cid = PWL_IPC_CID_WRAP;
+        memcpy(ring->data + offset, &wrap, sizeof(wrap));
+    }
+    offset = (head + waste) % ring->size;
+
+    memcpy(ring->data + offset, &frame, sizeof(frame));
+    memcpy(ring->data + offset + sizeof(frame), message->content, frame.content_len);
+    memcpy(ring->data + offset + sizeof(frame) + frame.content_len, message->response, frame.response_len);
+
+    __atomic_store_n(&ring->head, head + waste + need, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+    return TRUE;
+}
+
+// Look for an identical message still queued, returns its request id
+static gboolean ipc_ring_find_duplicate(pwl_ipc_ring_t *ring, msg_buffer_t *message, uint32_t *request_id) {
+    pwl_ipc_frame_t frame;
+    uint32_t head, tail, offset;
+    uint16_t content_len = strnlen(message->content, PWL_MQ_MAX_CONTENT_LEN - 1);
+    uint16_t response_len = strnlen(message->response, PWL_MSG_MAX_RESP - 1);
+    gboolean found = FALSE;
+
+    // Producers hold the lock, so nothing between tail and head is overwritten meanwhile
+    ipc_ring_lock(ring);
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+        offset = tail % ring->size;
+        if (ring->size - offset < sizeof(pwl_ipc_frame_t)) {
+            tail += ring->size - offset;
+            continue;
+        }
+        memcpy(&frame, ring->data + offset, sizeof(frame));
+        if (frame.pwl_cid == message->pwl_cid && frame.sender_id == message->sender_id &&
+            frame.status == message->status && frame.content_len == content_len &&
+            frame.response_len == response_len &&
+            memcmp(ring->data + offset + sizeof(frame), message->content, content_len) == 0 &&
+            memcmp(ring->data + offset + sizeof(frame) + content_len, message->response, response_len) == 0) {
+            *request_id = frame.request_id;
+            found = TRUE;
+            break;
+        }
+        tail += frame.frame_len;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return found;
+}
+
+static gboolean ipc_ring_pop(pwl_ipc_ring_t *ring, msg_buffer_t *message, uint32_t *request_id) {
+    pwl_ipc_frame_t frame;
+    uint32_t head, tail, offset;
+
+    tail = ring->tail;
+    while (1) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return FALSE;
+
+        offset = tail % ring->size;
+        if (ring->size - offset < sizeof(pwl_ipc_frame_t)) {
+            tail += ring->size - offset;
+            continue;
+        }
+
+        memcpy(&frame, ring->data + offset, sizeof(frame));
+        if (frame.pwl_cid == PWL_IPC_CID_WRAP) {
+            tail += frame.frame_len;
+            continue;
+        }
+        break;
+    }
+
+    message->sender_id = frame.sender_id;
+    message->pwl_cid = frame.pwl_cid;
+    message->status = frame.status;
+    *request_id = frame.request_id;
+    memcpy(message->content, ring->data + offset + sizeof(frame), frame.content_len);
+    message->content[frame.content_len] = '\0';
+    memcpy(message->response, ring->data + offset + sizeof(frame) + frame.content_len, frame.response_len);
+    message->response[frame.response_len] = '\0';
+
+    ipc_ring_set_tail(ring, tail + frame.frame_len);
+    return TRUE;
+}
+
+static void ipc_mq_to_message(pwl_mq_msg_t *mq_msg, msg_buffer_t *message) {
+    message->sender_id = mq_msg->sender_id;
+    message->pwl_cid = mq_msg->pwl_cid;
+    message->status = mq_msg->status;
+    g_strlcpy(message->response, mq_msg->response, sizeof(mq_msg->response));
+    g_strlcpy(message->content, mq_msg->content, sizeof(mq_msg->content));
+}
+
+static void ipc_message_to_mq(msg_buffer_t *message, pwl_mq_msg_t *mq_msg) {
+    memset(mq_msg, 0, sizeof(*mq_msg));
+    mq_msg->sender_id = message->sender_id;
+    mq_msg->pwl_cid = message->pwl_cid;
+    mq_msg->status = message->status;
+    if (strnlen(message->response, PWL_MSG_MAX_RESP) >= sizeof(mq_msg->response))
+        PWL_LOG_ERR("cid (%d) on the mqueue, response cut to %d bytes",
+                    message->pwl_cid, PWL_MQ_MAX_RESP - 1);
+    g_strlcpy(mq_msg->response, message->response, sizeof(mq_msg->response));
+    g_strlcpy(mq_msg->content, message->content, sizeof(mq_msg->content));
+}
+
+static gboolean ipc_ring_empty(pwl_ipc_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail;
+}
+
+gboolean pwl_ipc_open_endpoint(uint32_t self_id) {
+    struct mq_attr attr;
+    gchar ring_path[PWL_IPC_PATH_LEN];
+    pwl_ipc_ring_t *ring;
+
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = PWL_MQ_MAX_MSG;
+    attr.mq_msgsize = sizeof(pwl_mq_msg_t);
+    attr.mq_curmsgs = 0;
+
+    // Non-blocking so the fd can be polled by a main loop, pwl_ipc_receive() waits in poll()
+    g_ipc_self_mq = mq_open(PWL_MQ_PATH(self_id), O_CREAT | O_RDONLY | O_NONBLOCK, 0644, &attr);
+    if (g_ipc_self_mq == (mqd_t) -1) {
+        PWL_LOG_ERR("mq_open %s failed: %s", PWL_MQ_PATH(self_id), strerror(errno));
+        return FALSE;
+    }
+    g_ipc_self_id = self_id;
+    pwl_record_init(self_id);
+    pwl_trace_init(self_id);
+    pwl_metrics_init();
+
+    for (int lane = 0; lane < PWL_IPC_LANES; lane++) {
+        if (!ipc_lane_path(ring_path, self_id, lane))
+            return TRUE;
+
+        ring = ipc_ring_map(ring_path, TRUE);
+        if (ring == NULL) {
+            PWL_LOG_ERR("Shared memory ring %s not available, use mqueue only", ring_path);
+            continue;
+        }
+
+        // Drop frames left by the previous instance, same as pwl_discard_old_messages()
+        ipc_ring_lock(ring);
+        if (ring->head != ring->tail)
+            PWL_LOG_INFO("Discarded %u bytes in ring %s", ring->head - ring->tail, ring_path);
+        ipc_ring_set_tail(ring, ring->head);
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ring->lock);
+        gp_ipc_self_ring[lane] = ring;
+    }
+
+    return TRUE;
+}
+
+static void ipc_set_sleeping(uint32_t sleeping) {
+    for (int lane = 0; lane < PWL_IPC_LANES; lane++) {
+        if (gp_ipc_self_ring[lane])
+            __atomic_store_n(&gp_ipc_self_ring[lane]->sleeping, sleeping, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Pop from the highest lane that has something
+static gboolean ipc_lanes_pop(msg_buffer_t *message, uint32_t *request_id) {
+    for (int lane = PWL_IPC_LANES - 1; lane >= 0; lane--) {
+        if (gp_ipc_self_ring[lane] && ipc_ring_pop(gp_ipc_self_ring[lane], message, request_id))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean ipc_lanes_empty() {
+    for (int lane = 0; lane < PWL_IPC_LANES; lane++) {
+        if (gp_ipc_self_ring[lane] && !ipc_ring_empty(gp_ipc_self_ring[lane]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void ipc_received(msg_buffer_t *message, uint32_t request_id) {
+    pwl_record_ipc(PWL_RECORD_IPC_RECV, message->sender_id, message, request_id,
+                   pwl_ipc_cid_lane(message->pwl_cid));
+}
+
+// Fetch the next message, timeout_ms 0 returns at once and -1 waits forever
+static gboolean ipc_fetch(msg_buffer_t *message, uint32_t *request_id, gint timeout_ms) {
+    pwl_mq_msg_t mq_msg;
+    ssize_t bytes_read;
+    struct pollfd pfd;
+    int ret;
+
+    while (1) {
+        if (ipc_lanes_pop(message, request_id)) {
+            ipc_received(message, *request_id);
+            return TRUE;
+        }
+
+        // Announce we are going to sleep, then re-check to not miss a push in between
+        ipc_set_sleeping(1);
+        if (!ipc_lanes_empty()) {
+            ipc_set_sleeping(0);
+            continue;
+        }
+
+        bytes_read = mq_receive(g_ipc_self_mq, (gchar *)&mq_msg, sizeof(mq_msg), NULL);
+        if (bytes_read >= 0) {
+            ipc_set_sleeping(0);
+
+            // Full size message comes from the mqueue fallback or pwl_unlock
+            if (bytes_read == sizeof(mq_msg)) {
+                ipc_mq_to_message(&mq_msg, message);
+                *request_id = PWL_IPC_REQUEST_ID_NONE;
+                ipc_received(message, *request_id);
+                return TRUE;
+            }
+            // Otherwise it is a doorbell, go back to the ring
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN) {
+            PWL_LOG_ERR("mq_receive failed: %s", strerror(errno));
+            return FALSE;
+        }
+        if (timeout_ms == 0)
+            return FALSE;
+
+        pfd.fd = g_ipc_self_mq;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, timeout_ms);
+        if (ret == 0)
+            return FALSE;
+        if (ret < 0 && errno != EINTR) {
+            PWL_LOG_ERR("poll mqueue failed: %s", strerror(errno));
+            return FALSE;
+        }
+    }
+}
+
+gboolean pwl_ipc_receive(msg_buffer_t *message, uint32_t *request_id) {
+    return ipc_fetch(message, request_id, -1);
+}
+
+static void ipc_defer(msg_buffer_t *message, uint32_t request_id) {
+    ipc_deferred_t *deferred = g_new0(ipc_deferred_t, 1);
+
+    deferred->request_id = request_id;
+    deferred->message = *message;
+    if (gp_ipc_deferred_tail)
+        gp_ipc_deferred_tail->next = deferred;
+    else
+        gp_ipc_deferred_head = deferred;
+    gp_ipc_deferred_tail = deferred;
+}
+
+// Handlers run one at a time, a handler waiting for a reply left the rest here
+static void ipc_dispatch_deferred() {
+    ipc_deferred_t *deferred;
+
+    while ((deferred = gp_ipc_deferred_head) != NULL) {
+        gp_ipc_deferred_head = deferred->next;
+        if (gp_ipc_deferred_head == NULL)
+            gp_ipc_deferred_tail = NULL;
+        g_ipc_handler(&deferred->message, deferred->request_id);
+        g_free(deferred);
+    }
+}
+
+static gboolean ipc_deferred_idle(gpointer user_data) {
+    ipc_dispatch_deferred();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean ipc_source_dispatch(gint fd, GIOCondition condition, gpointer user_data) {
+    msg_buffer_t message;
+    uint32_t request_id;
+
+    ipc_dispatch_deferred();
+
+    // Drain everything, the ring is only announced again once the consumer sleeps
+    while (ipc_fetch(&message, &request_id, 0)) {
+        g_ipc_handler(&message, request_id);
+        ipc_dispatch_deferred();
+    }
+
+    return TRUE;
+}
+
+guint pwl_ipc_attach(uint32_t self_id, pwl_ipc_handler_t handler) {
+    guint source_id;
+
+    if (!pwl_ipc_open_endpoint(self_id))
+        return 0;
+
+    g_ipc_handler = handler;
+    g_ipc_dispatch_thread = pthread_self();
+    source_id = g_unix_fd_add(g_ipc_self_mq, G_IO_IN, ipc_source_dispatch, NULL);
+
+    // Pick up anything sent before the source existed and arm the doorbell
+    ipc_source_dispatch(g_ipc_self_mq, G_IO_IN, NULL);
+
+    return source_id;
+}
+
+static pwl_ipc_peer_t *ipc_get_peer(uint32_t dest_id) {
+    pwl_ipc_peer_t *peer;
+
+    if (dest_id == PWL_MQ_ID_INVALID || dest_id >= PWL_IPC_MAX_ID)
+        return NULL;
+
+    pthread_mutex_lock(&g_ipc_mutex);
+    if (!g_ipc_peers_init) {
+        for (int i = 0; i < PWL_IPC_MAX_ID; i++) {
+            g_ipc_peers[i].ring_checked = FALSE;
+            for (int lane = 0; lane < PWL_IPC_LANES; lane++)
+                g_ipc_peers[i].ring[lane] = NULL;
+            g_ipc_peers[i].mq = (mqd_t) -1;
+            g_ipc_peers[i].doorbell = (mqd_t) -1;
+        }
+        g_ipc_peers_init = TRUE;
+    }
+
+    peer = &g_ipc_peers[dest_id];
+    if (!peer->ring_checked && PWL_IPC_RING_PATH(dest_id) != NULL) {
+        // Receiver may not be up yet, keep checking until all its rings show up
+        gchar ring_path[PWL_IPC_PATH_LEN];
+        peer->ring_checked = TRUE;
+        for (int lane = 0; lane < PWL_IPC_LANES; lane++) {
+            if (peer->ring[lane] == NULL && ipc_lane_path(ring_path, dest_id, lane))
+                peer->ring[lane] = ipc_ring_map(ring_path, FALSE);
+            if (peer->ring[lane] == NULL)
+                peer->ring_checked = FALSE;
+        }
+    }
+    if (peer->mq == (mqd_t) -1)
+        peer->mq = mq_open(PWL_MQ_PATH(dest_id), O_WRONLY);
+    if (peer->doorbell == (mqd_t) -1)
+        peer->doorbell = mq_open(PWL_MQ_PATH(dest_id), O_WRONLY | O_NONBLOCK);
+    pthread_mutex_unlock(&g_ipc_mutex);
+
+    return peer;
+}
+
+static void ipc_ring_doorbell(pwl_ipc_peer_t *peer, uint32_t dest_id) {
+    if (peer->doorbell == (mqd_t) -1)
+        return;
+    if (mq_send(peer->doorbell, "", 0, 0) != 0 && errno != EAGAIN)
+        PWL_LOG_ERR("doorbell to %s failed: %s", PWL_MQ_PATH(dest_id), strerror(errno));
+}
+
+static gboolean ipc_deliver(uint32_t dest_id, msg_buffer_t *message, uint32_t request_id, pwl_ipc_pending_t *pending) {
+    pwl_ipc_peer_t *peer = ipc_get_peer(dest_id);
+    pwl_ipc_lane_t lane = pwl_ipc_cid_lane(message->pwl_cid);
+    pwl_ipc_ring_t *ring;
+    pwl_mq_msg_t mq_msg;
+    uint32_t duplicate_id;
+    gboolean merged;
+
+    if (peer == NULL) {
+        PWL_LOG_ERR("Invalid ipc destination %d for cid %d", dest_id, message->pwl_cid);
+        return FALSE;
+    }
+
+    ring = peer->ring[lane];
+    if (ring) {
+        // Ring full means the receiver is busy, wait for it like a blocking mq_send would
+        uint64_t deadline_us = pwl_metrics_now() + PWL_IPC_FULL_WAIT_MS * 1000ULL;
+        while (1) {
+            uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+            uint64_t now_us;
+
+            if (ipc_ring_push(ring, message, request_id)) {
+                // Only pay for a syscall when the receiver is idle
+                if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST))
+                    ipc_ring_doorbell(peer, dest_id);
+                return TRUE;
+            }
+
+            // Never hold the sender for informational requests, a reply has a waiter and always goes through
+            if (lane == PWL_IPC_LANE_INFO && message->status == PWL_CID_STATUS_NONE) {
+                // A frame still in the ring is not answered yet, and its reply cannot be taken
+                // before wire_id is set while g_pending_mutex is held
+                pthread_mutex_lock(&g_pending_mutex);
+                merged = ipc_ring_find_duplicate(ring, message, &duplicate_id);
+                if (merged && pending)
+                    pending->wire_id = duplicate_id;
+                pthread_mutex_unlock(&g_pending_mutex);
+                if (merged) {
+                    PWL_LOG_DEBUG("Lane %s of %s full, cid (%d) merged into queued request",
+                                  ipc_lane_name[lane], PWL_MQ_PATH(dest_id), message->pwl_cid);
+                    return TRUE;
+                }
+                PWL_LOG_ERR("Lane %s of %s full, drop cid (%d)",
+                            ipc_lane_name[lane], PWL_MQ_PATH(dest_id), message->pwl_cid);
+                return FALSE;
+            }
+
+            now_us = pwl_metrics_now();
+            if (now_us >= deadline_us)
+                break;
+            // Sleep until the consumer moves tail, a move since the push returns at once
+            __atomic_add_fetch(&ring->full_waiters, 1, __ATOMIC_SEQ_CST);
+            ipc_futex_wait(&ring->tail, tail, MAX((deadline_us - now_us) / 1000, 1));
+            __atomic_sub_fetch(&ring->full_waiters, 1, __ATOMIC_SEQ_CST);
+        }
+        PWL_LOG_ERR("Lane %s of %s full, fallback to mqueue", ipc_lane_name[lane], PWL_MQ_PATH(dest_id));
+    }
+
+    if (peer->mq == (mqd_t) -1) {
+        PWL_LOG_ERR("mq_open %s failed", PWL_MQ_PATH(dest_id));
+        return FALSE;
+    }
+
+    // mqueue delivers higher priorities first
+    ipc_message_to_mq(message, &mq_msg);
+    if (mq_send(peer->mq, (gchar *)&mq_msg, sizeof(mq_msg), lane) != 0) {
+        PWL_LOG_ERR("mq_send to %s failed: %s", PWL_MQ_PATH(dest_id), strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// pending gets the wire id of the queued message an informational request was merged into
+static gboolean ipc_send(uint32_t dest_id, msg_buffer_t *message, uint32_t request_id, pwl_ipc_pending_t *pending) {
+    // Reply to a request fed by pwl_replay, there is nobody to deliver it to
+    if (dest_id == PWL_MQ_ID_INVALID && message->status != PWL_CID_STATUS_NONE) {
+        pwl_record_ipc(PWL_RECORD_IPC_SEND, dest_id, message, request_id, pwl_ipc_cid_lane(message->pwl_cid));
+        return TRUE;
+    }
+    if (!ipc_deliver(dest_id, message, request_id, pending))
+        return FALSE;
+    pwl_record_ipc(PWL_RECORD_IPC_SEND, dest_id, message, request_id, pwl_ipc_cid_lane(message->pwl_cid));
+    return TRUE;
+}
+
+gboolean pwl_ipc_send(uint32_t dest_id, msg_buffer_t *message, uint32_t request_id) {
+    return ipc_send(dest_id, message, request_id, NULL);
+}
+
+static pwl_ipc_pending_t *ipc_pending_find(uint32_t request_id) {
+    for (int i = 0; i < PWL_IPC_MAX_PENDING; i++) {
+        if (g_pending[i].request_id == request_id)
+            return &g_pending[i];
+    }
+    return NULL;
+}
+
+static gboolean ipc_expired(uint32_t request_id) {
+    for (int i = 0; i < PWL_IPC_MAX_EXPIRED; i++) {
+        if (g_expired[i] == request_id)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Someone else still waits for the same message on the wire
+static gboolean ipc_wire_waited(pwl_ipc_pending_t *self) {
+    for (int i = 0; i < PWL_IPC_MAX_PENDING; i++) {
+        if (&g_pending[i] != self && g_pending[i].request_id != PWL_IPC_REQUEST_ID_NONE &&
+            g_pending[i].wire_id == self->wire_id)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+uint32_t pwl_ipc_request(uint32_t sender_id, uint32_t cid, const char *content, gboolean track) {
+    msg_buffer_t message;
+    pwl_ipc_pending_t *pending = NULL;
+    uint32_t request_id;
+
+    message.pwl_cid = cid;
+    message.sender_id = sender_id;
+    message.status = PWL_CID_STATUS_NONE;
+    message.response[0] = '\0';
+    message.content[0] = '\0';
+    if (content) {
+        if (strlen(content) >= PWL_MQ_MAX_CONTENT_LEN)
+            PWL_LOG_ERR("Content for cid (%d) truncated to %d bytes", cid, PWL_MQ_MAX_CONTENT_LEN - 1);
+        strncpy(message.content, content, PWL_MQ_MAX_CONTENT_LEN - 1);
+        message.content[PWL_MQ_MAX_CONTENT_LEN - 1] = '\0';
+    }
+
+    pthread_mutex_lock(&g_pending_mutex);
+    if (++g_next_request_id == PWL_IPC_REQUEST_ID_NONE)
+        ++g_next_request_id;
+    request_id = g_next_request_id;
+    if (track) {
+        pending = ipc_pending_find(PWL_IPC_REQUEST_ID_NONE);
+        if (pending) {
+            pending->request_id = request_id;
+            pending->wire_id = request_id;
+            pending->pwl_cid = cid;
+            pending->done = FALSE;
+            pending->status = PWL_CID_STATUS_NONE;
+            pending->sent_us = pwl_metrics_now();
+        } else {
+            PWL_LOG_ERR("Too many pending requests, cid (%d) reply will not be tracked", cid);
+        }
+    }
+    pthread_mutex_unlock(&g_pending_mutex);
+
+    if (DEBUG) PWL_LOG_DEBUG("Sending request %u for cid (%d) %s", request_id, cid, cid_name[cid]);
+
+    if (!ipc_send(CID_DESTINATION_ID(cid), &message, request_id, pending)) {
+        if (pending) {
+            pthread_mutex_lock(&g_pending_mutex);
+            pending->request_id = PWL_IPC_REQUEST_ID_NONE;
+            pthread_mutex_unlock(&g_pending_mutex);
+        }
+        return PWL_IPC_REQUEST_ID_NONE;
+    }
+    return request_id;
+}
+
+gboolean pwl_ipc_wait_reply(uint32_t request_id, gint wait_time) {
+    pwl_ipc_pending_t *pending;
+    gboolean done;
+    int result = 0;
+
+    if (request_id == PWL_IPC_REQUEST_ID_NONE)
+        return FALSE;
+
+    pthread_mutex_lock(&g_pending_mutex);
+    pending = ipc_pending_find(request_id);
+    if (pending == NULL) {
+        pthread_mutex_unlock(&g_pending_mutex);
+        return FALSE;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &pending->deadline);
+    pending->deadline.tv_sec += wait_time;
+    if (g_ipc_handler && pthread_equal(pthread_self(), g_ipc_dispatch_thread)) {
+        // The reply is dispatched by this very thread. Only the reply is handled now, the
+        // waiting handler is not finished yet, anything else waits until it returns.
+        while (!pending->done) {
+            struct timespec now;
+            msg_buffer_t message;
+            uint32_t id, wire_id = pending->wire_id, cid = pending->pwl_cid;
+            gint remaining;
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            remaining = (pending->deadline.tv_sec - now.tv_sec) * 1000 +
+                        (pending->deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining <= 0)
+                break;
+
+            pthread_mutex_unlock(&g_pending_mutex);
+            if (ipc_fetch(&message, &id, remaining)) {
+                if (message.status != PWL_CID_STATUS_NONE &&
+                    (id == wire_id || (id == PWL_IPC_REQUEST_ID_NONE && message.pwl_cid == cid)))
+                    g_ipc_handler(&message, id);
+                else
+                    ipc_defer(&message, id);
+            }
+            pthread_mutex_lock(&g_pending_mutex);
+        }
+
+        // Waiting from a D-Bus callback, nothing else drains them
+        if (gp_ipc_deferred_head)
+            g_idle_add(ipc_deferred_idle, NULL);
+    } else {
+        while (!pending->done && result != ETIMEDOUT)
+            result = pthread_cond_timedwait(&g_pending_cond, &g_pending_mutex, &pending->deadline);
+    }
+
+    done = pending->done;
+    if (!done) {
+        PWL_LOG_ERR("Request %u for cid (%d) %s timed out", request_id,
+                    pending->pwl_cid, cid_name[pending->pwl_cid]);
+        pwl_metrics_add(PWL_METRIC_IPC_TIMEOUT, pending->pwl_cid, 1);
+        // Remember it so a late reply is not taken for the next request
+        if (!ipc_wire_waited(pending)) {
+            g_expired[g_expired_index] = pending->wire_id;
+            g_expired_index = (g_expired_index + 1) % PWL_IPC_MAX_EXPIRED;
+        }
+    }
+    pending->request_id = PWL_IPC_REQUEST_ID_NONE;
+    pthread_mutex_unlock(&g_pending_mutex);
+
+    return done;
+}
+
+gboolean pwl_ipc_reply_accept(msg_buffer_t *message, uint32_t *request_id) {
+    gboolean accept = TRUE;
+
+    pthread_mutex_lock(&g_pending_mutex);
+    if (*request_id == PWL_IPC_REQUEST_ID_NONE) {
+        // No id (pwl_unlock or mqueue fallback), give it to the oldest waiter of that cid
+        pwl_ipc_pending_t *oldest = NULL;
+        for (int i = 0; i < PWL_IPC_MAX_PENDING; i++) {
+            if (g_pending[i].request_id != PWL_IPC_REQUEST_ID_NONE && !g_pending[i].done &&
+                g_pending[i].pwl_cid == message->pwl_cid &&
+                (oldest == NULL || (int32_t)(g_pending[i].request_id - oldest->request_id) < 0))
+                oldest = &g_pending[i];
+        }
+        *request_id = oldest ? oldest->wire_id : PWL_IPC_REQUEST_ID_NONE;
+    } else if (ipc_expired(*request_id)) {
+        PWL_LOG_INFO("Drop late reply %u for cid (%d) %s", *request_id,
+                     message->pwl_cid, cid_name[message->pwl_cid]);
+        accept = FALSE;
+    }
+    pthread_mutex_unlock(&g_pending_mutex);
+
+    return accept;
+}
+
+void pwl_ipc_reply_done(uint32_t request_id, pwl_cid_status_t status) {
+    if (request_id == PWL_IPC_REQUEST_ID_NONE)
+        return;
+
+    pthread_mutex_lock(&g_pending_mutex);
+    // Several waiters share the id when requests were merged
+    for (int i = 0; i < PWL_IPC_MAX_PENDING; i++) {
+        if (g_pending[i].request_id != PWL_IPC_REQUEST_ID_NONE && g_pending[i].wire_id == request_id) {
+            if (!g_pending[i].done)
+                pwl_metrics_observe_since(PWL_METRIC_IPC_RTT, g_pending[i].pwl_cid, g_pending[i].sent_us);
+            g_pending[i].done = TRUE;
+            g_pending[i].status = status;
+        }
+    }
+    pthread_cond_broadcast(&g_pending_cond);
+    pthread_mutex_unlock(&g_pending_mutex);
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+
+#define LOG_SHM_PATH            "/pwl_log"
+#define LOG_SHM_MAGIC           0x50574c4c // "PWLL"
+#define LOG_RING_SIZE           (64 * 1024) // per thread, power of 2
+#define LOG_LINE_LEN            512         // longer messages are allocated
+#define LOG_TEXT_MAX            (LOG_RING_SIZE / 8)
+#define LOG_BATCH_MS            20
+#define LOG_WRAP                0xffffffff
+#define LOG_ALIGN(x)            (((x) + 7) & ~7)
+
+typedef struct {
+    uint32_t            magic;
+    int32_t             level;
+} log_shared_t;
+
+typedef struct {
+    uint32_t            len;        // text length, LOG_WRAP: rest of the ring unused
+    int32_t             level;
+    struct timespec     time;
+} log_record_t;                     // followed by the text and '\0'
+
+// Single producer, single consumer
+typedef struct log_ring {
+    struct log_ring     *next;
+    uint32_t            head;       // written by the owner thread
+    uint32_t            tail;       // written by the drain
+    gboolean            dead;       // owner thread exited
+    uint8_t             data[LOG_RING_SIZE];
+} log_ring_t;
+
+static volatile int g_log_local_level = PWL_LOG_LEVEL_DEFAULT;
+volatile int *gp_pwl_log_level = &g_log_local_level;
+
+#if SYS_LOG
+static const int log_syslog_priority[] = {
+    [PWL_LOG_LEVEL_ERR] = LOG_ERR,
+    [PWL_LOG_LEVEL_INFO] = LOG_INFO,
+    [PWL_LOG_LEVEL_DEBUG] = LOG_DEBUG,
+    [PWL_LOG_LEVEL_VERBOSE] = LOG_DEBUG,
+};
+#endif
+
+static gboolean g_log_async = FALSE;
+static int g_log_event = -1;
+static int g_log_pending = 0;
+static FILE *gp_log_file = NULL;
+static log_ring_t *gp_log_rings = NULL;
+static pthread_mutex_t g_log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_log_ring_key;
+static __thread log_ring_t *tp_log_ring = NULL;
+
+static void log_output(int level, const struct timespec *time, const char *text) {
+#if SYS_LOG
+    syslog(log_syslog_priority[level], "%s", text);
+#else
+    FILE *out = gp_log_file ? gp_log_file : (level == PWL_LOG_LEVEL_ERR ? stderr : stdout);
+
+    flockfile(out);
+#if (TIME_LOG)
+    struct tm local_time;
+    localtime_r(&time->tv_sec, &local_time);
+    fprintf(out, "%04d-%02d-%02d %02d:%02d:%02d.%03ld ",
+            local_time.tm_year + 1900, local_time.tm_mon + 1, local_time.tm_mday,
+            local_time.tm_hour, local_time.tm_min, local_time.tm_sec, time->tv_nsec / 1000000);
+#endif
+    fputs(text, out);
+    fputc('\n', out);
+    funlockfile(out);
+#endif
+}
+
+static void log_output_flush() {
+    if (gp_log_file) {
+        fflush(gp_log_file);
+    } else {
+        fflush(stdout);
+        fflush(stderr);
+    }
+}
+
+// The owner thread is gone, the drain frees the ring once it is empty
+static void log_ring_release(void *data) {
+    log_ring_t *ring = data;
+
+    __atomic_store_n(&ring->dead, TRUE, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *log_thread_ring() {
+    if (tp_log_ring)
+        return tp_log_ring;
+
+    tp_log_ring = calloc(1, sizeof(log_ring_t));
+    if (tp_log_ring == NULL)
+        return NULL;
+    pthread_setspecific(g_log_ring_key, tp_log_ring);
+
+    pthread_mutex_lock(&g_log_rings_mutex);
+    tp_log_ring->next = gp_log_rings;
+    gp_log_rings = tp_log_ring;
+    pthread_mutex_unlock(&g_log_rings_mutex);
+    return tp_log_ring;
+}
+
+static gboolean log_push(int level, const struct timespec *time, const char *text, uint32_t len) {
+    log_ring_t *ring = log_thread_ring();
+    log_record_t *record;
+    uint32_t head, tail, offset, pad = 0, need;
+
+    if (ring == NULL)
+        return FALSE;
+
+    if (len > LOG_TEXT_MAX)
+        len = LOG_TEXT_MAX;
+    need = LOG_ALIGN(sizeof(log_record_t) + len + 1);
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    offset = head & (LOG_RING_SIZE - 1);
+    // Records never wrap, skip the end of the ring instead
+    if (offset + need > LOG_RING_SIZE)
+        pad = LOG_RING_SIZE - offset;
+    if (head + pad + need - tail > LOG_RING_SIZE)
+        return FALSE;
+
+    if (pad) {
+        ((log_record_t *) &ring->data[offset])->len = LOG_WRAP;
+        head += pad;
+        offset = 0;
+    }
+    record = (log_record_t *) &ring->data[offset];
+    record->len = len;
+    record->level = level;
+    record->time = *time;
+    memcpy(record + 1, text, len);
+    ((char *) (record + 1))[len] = '\0';
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// Oldest record of the ring, NULL when empty
+static log_record_t *log_ring_peek(log_ring_t *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    log_record_t *record;
+
+    while (ring->tail != head) {
+        uint32_t offset = ring->tail & (LOG_RING_SIZE - 1);
+
+        record = (log_record_t *) &ring->data[offset];
+        if (record->len != LOG_WRAP)
+            return record;
+        __atomic_store_n(&ring->tail, ring->tail + LOG_RING_SIZE - offset, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static gboolean log_time_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Merge all rings by time, then free the rings of exited threads
+static void log_drain() {
+    log_ring_t **link;
+
+    pthread_mutex_lock(&g_log_drain_mutex);
+    while (TRUE) {
+        log_ring_t *oldest_ring = NULL;
+        log_record_t *oldest = NULL;
+
+        pthread_mutex_lock(&g_log_rings_mutex);
+        for (log_ring_t *ring = gp_log_rings; ring; ring = ring->next) {
+            log_record_t *record = log_ring_peek(ring);
+
+            if (record && (oldest == NULL || log_time_before(&record->time, &oldest->time))) {
+                oldest = record;
+                oldest_ring = ring;
+            }
+        }
+        pthread_mutex_unlock(&g_log_rings_mutex);
+        if (oldest == NULL)
+            break;
+
+        log_output(oldest->level, &oldest->time, (const char *) (oldest + 1));
+        __atomic_store_n(&oldest_ring->tail,
+                         oldest_ring->tail + LOG_ALIGN(sizeof(log_record_t) + oldest->len + 1),
+                         __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&g_log_rings_mutex);
+    link = &gp_log_rings;
+    while (*link) {
+        log_ring_t *ring = *link;
+
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+            ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&g_log_rings_mutex);
+
+    log_output_flush();
+    pthread_mutex_unlock(&g_log_drain_mutex);
+}
+
+static void *log_drain_thread(void *data) {
+    struct pollfd pfd = { .fd = g_log_event, .events = POLLIN };
+    eventfd_t value;
+
+    while (TRUE) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        eventfd_read(g_log_event, &value);
+        // Let a burst collect, then write it out at once
+        g_usleep(LOG_BATCH_MS * 1000);
+        __atomic_store_n(&g_log_pending, 0, __ATOMIC_SEQ_CST);
+        log_drain();
+    }
+    return NULL;
+}
+
+void pwl_log_write(int level, const char *format, ...) {
+    char line[LOG_LINE_LEN];
+    char *text = line;
+    struct timespec time;
+    va_list args;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &time);
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= sizeof(line)) {
+        va_start(args, format);
+        text = g_strdup_vprintf(format, args);
+        va_end(args);
+    }
+
+    if (!g_log_async) {
+        log_output(level, &time, text);
+        log_output_flush();
+    } else {
+        // Full ring, write out on this thread rather than lose messages
+        if (!log_push(level, &time, text, len)) {
+            log_drain();
+            log_push(level, &time, text, len);
+        }
+        // Only the first message after a drain pays for the wakeup
+        if (__atomic_exchange_n(&g_log_pending, 1, __ATOMIC_SEQ_CST) == 0)
+            eventfd_write(g_log_event, 1);
+    }
+
+    if (text != line)
+        g_free(text);
+}
+
+void pwl_log_flush() {
+    if (g_log_async)
+        log_drain();
+}
+
+int pwl_log_get_level() {
+    return *gp_pwl_log_level;
+}
+
+int pwl_log_set_level(int level) {
+    if (level < PWL_LOG_LEVEL_ERR || level >= PWL_LOG_LEVEL_MAX)
+        return RET_FAILED;
+    *gp_pwl_log_level = level;
+    return RET_OK;
+}
+
+// Async signal safe, only flips the shared level
+static void log_toggle_verbose(int sig) {
+    *gp_pwl_log_level = (*gp_pwl_log_level == PWL_LOG_LEVEL_VERBOSE) ?
+                        PWL_LOG_LEVEL_DEFAULT : PWL_LOG_LEVEL_VERBOSE;
+}
+
+static void log_level_init() {
+    const char *env_level = getenv("PWL_LOG_LEVEL");
+    log_shared_t *shared;
+    int fd;
+
+    fd = shm_open(LOG_SHM_PATH, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(log_shared_t)) != 0) {
+        PWL_LOG_ERR("Log level shm failed: %s, level is not shared", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    shared = mmap(NULL, sizeof(log_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        PWL_LOG_ERR("Log level mmap failed: %s, level is not shared", strerror(errno));
+        return;
+    }
+
+    if (shared->magic != LOG_SHM_MAGIC) {
+        shared->level = PWL_LOG_LEVEL_DEFAULT;
+        shared->magic = LOG_SHM_MAGIC;
+    }
+    gp_pwl_log_level = &shared->level;
+
+    if (env_level && pwl_log_set_level(atoi(env_level)) != RET_OK)
+        PWL_LOG_ERR("Invalid PWL_LOG_LEVEL %s", env_level);
+}
+
+void pwl_log_init() {
+    struct sigaction action;
+    const char *file;
+    pthread_t thread;
+
+    if (g_log_async)
+        return;
+
+    log_level_init();
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = log_toggle_verbose;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
+
+    file = getenv("PWL_LOG_FILE");
+    if (file) {
+        gp_log_file = fopen(file, "a");
+        if (gp_log_file == NULL)
+            PWL_LOG_ERR("Open log file %s failed: %s", file, strerror(errno));
+    }
+
+    g_log_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_log_event < 0 || pthread_key_create(&g_log_ring_key, log_ring_release) != 0) {
+        PWL_LOG_ERR("Log init failed, log synchronously");
+        return;
+    }
+    if (pthread_create(&thread, NULL, log_drain_thread, NULL) != 0) {
+        PWL_LOG_ERR("Log drain thread failed, log synchronously");
+        return;
+    }
+    pthread_detach(thread);
+
+    g_log_async = TRUE;
+    atexit(pwl_log_flush);
+}
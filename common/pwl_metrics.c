@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_metrics.h"
+
+typedef void (*metrics_sample_cb)(const gchar *sample, double value, gpointer data);
+
+// Used until pwl_metrics_init() maps the shared table
+static pwl_metrics_table_t g_metrics_local;
+static pwl_metrics_table_t *gp_metrics = &g_metrics_local;
+
+G_STATIC_ASSERT((int) PWL_STATUS_KEY_MAX <= (int) PWL_METRICS_MAX_SERIES);
+G_STATIC_ASSERT(G_N_ELEMENTS(metric_info) == PWL_METRIC_MAX);
+
+uint64_t pwl_metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint32_t metrics_series_count(pwl_metric_t metric) {
+    switch (metric_info[metric].label) {
+        case PWL_METRIC_LABEL_CID:
+            return PWL_CID_MAX;
+        case PWL_METRIC_LABEL_STATUS_KEY:
+            return PWL_STATUS_KEY_MAX;
+        default:
+            return 1;
+    }
+}
+
+static pwl_metric_series_t *metrics_series(pwl_metric_t metric, uint32_t label) {
+    if (metric >= PWL_METRIC_MAX || label >= metrics_series_count(metric))
+        return NULL;
+    return &gp_metrics->series[metric][label];
+}
+
+void pwl_metrics_add(pwl_metric_t metric, uint32_t label, int64_t value) {
+    pwl_metric_series_t *series = metrics_series(metric, label);
+
+    if (series == NULL)
+        return;
+    __atomic_fetch_add(&series->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&series->sum, value, __ATOMIC_RELAXED);
+}
+
+void pwl_metrics_set(pwl_metric_t metric, uint32_t label, int64_t value) {
+    pwl_metric_series_t *series = metrics_series(metric, label);
+
+    if (series == NULL)
+        return;
+    __atomic_store_n(&series->sum, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&series->count, 1, __ATOMIC_RELAXED);
+}
+
+void pwl_metrics_observe(pwl_metric_t metric, uint32_t label, uint64_t duration_us) {
+    pwl_metric_series_t *series = metrics_series(metric, label);
+    int bucket = 0;
+
+    if (series == NULL)
+        return;
+    while (bucket < PWL_METRICS_BUCKETS - 1 && duration_us > metric_buckets_us[bucket])
+        bucket++;
+    __atomic_fetch_add(&series->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&series->sum, duration_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&series->count, 1, __ATOMIC_RELAXED);
+}
+
+void pwl_metrics_observe_since(pwl_metric_t metric, uint32_t label, uint64_t start_us) {
+    pwl_metrics_observe(metric, label, pwl_metrics_now() - start_us);
+}
+
+gboolean pwl_metrics_init() {
+    pwl_metrics_table_t *table;
+    int fd;
+
+    if (gp_metrics != &g_metrics_local)
+        return TRUE;
+
+    fd = shm_open(PWL_METRICS_SHM_PATH, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(pwl_metrics_table_t)) != 0) {
+        PWL_LOG_ERR("Metrics shm failed: %s, metrics are not shared", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    table = mmap(NULL, sizeof(pwl_metrics_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED) {
+        PWL_LOG_ERR("Metrics mmap failed: %s, metrics are not shared", strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    // Survives daemon restarts, reset only when the layout changed
+    flock(fd, LOCK_EX);
+    if (table->magic != PWL_METRICS_MAGIC || table->version != PWL_METRICS_VERSION ||
+        table->metrics != PWL_METRIC_MAX || table->size != sizeof(pwl_metrics_table_t) ||
+        table->series_max != PWL_METRICS_MAX_SERIES) {
+        memset(table, 0, sizeof(pwl_metrics_table_t));
+        table->version = PWL_METRICS_VERSION;
+        table->metrics = PWL_METRIC_MAX;
+        table->size = sizeof(pwl_metrics_table_t);
+        table->series_max = PWL_METRICS_MAX_SERIES;
+        table->magic = PWL_METRICS_MAGIC;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    gp_metrics = table;
+    return TRUE;
+}
+
+static void metrics_label(pwl_metric_t metric, uint32_t label, gchar *text, size_t size) {
+    switch (metric_info[metric].label) {
+        case PWL_METRIC_LABEL_CID:
+            snprintf(text, size, "cid=\"%s\"", cid_name[label] ? cid_name[label] : "?");
+            break;
+        case PWL_METRIC_LABEL_STATUS_KEY:
+            snprintf(text, size, "key=\"%s\"", status_key_info[label].name);
+            break;
+        default:
+            text[0] = '\0';
+            break;
+    }
+}
+
+// Every sample of a metric in exposition format, series never touched are left out
+static void metrics_foreach_sample(pwl_metric_t metric, metrics_sample_cb cb, gpointer data) {
+    const pwl_metric_info_t *info = &metric_info[metric];
+    gchar label[64], sample[160];
+
+    for (uint32_t i = 0; i < metrics_series_count(metric); i++) {
+        pwl_metric_series_t series;
+
+        memcpy(&series, &gp_metrics->series[metric][i], sizeof(series));
+        if (series.count == 0 && info->label != PWL_METRIC_LABEL_NONE)
+            continue;
+        metrics_label(metric, i, label, sizeof(label));
+
+        if (info->type != PWL_METRIC_HISTOGRAM) {
+            if (label[0])
+                snprintf(sample, sizeof(sample), "%s{%s}", info->name, label);
+            else
+                snprintf(sample, sizeof(sample), "%s", info->name);
+            cb(sample, series.sum, data);
+            continue;
+        }
+
+        uint64_t cumulative = 0;
+        for (int b = 0; b < PWL_METRICS_BUCKETS; b++) {
+            gchar le[16];
+
+            cumulative += series.buckets[b];
+            if (b < PWL_METRICS_BUCKETS - 1)
+                snprintf(le, sizeof(le), "%g", metric_buckets_us[b] / 1e6);
+            else
+                strcpy(le, "+Inf");
+            snprintf(sample, sizeof(sample), "%s_bucket{%s%sle=\"%s\"}", info->name,
+                     label, label[0] ? "," : "", le);
+            cb(sample, cumulative, data);
+        }
+        snprintf(sample, sizeof(sample), label[0] ? "%s_sum{%s}" : "%s_sum", info->name, label);
+        cb(sample, series.sum / 1e6, data);
+        snprintf(sample, sizeof(sample), label[0] ? "%s_count{%s}" : "%s_count", info->name, label);
+        cb(sample, series.count, data);
+    }
+}
+
+static void metrics_add_to_builder(const gchar *sample, double value, gpointer data) {
+    g_variant_builder_add((GVariantBuilder *) data, "{sd}", sample, value);
+}
+
+GVariant *pwl_metrics_to_variant() {
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sd}"));
+    for (int metric = 0; metric < PWL_METRIC_MAX; metric++)
+        metrics_foreach_sample(metric, metrics_add_to_builder, &builder);
+    return g_variant_builder_end(&builder);
+}
+
+static void metrics_write_sample(const gchar *sample, double value, gpointer data) {
+    fprintf((FILE *) data, "%s %.10g\n", sample, value);
+}
+
+// Written aside and renamed, the node exporter must never read half a file
+gboolean pwl_metrics_write_textfile(const gchar *dir) {
+    gchar path[128], tmp_path[136];
+    struct stat st;
+    FILE *fp;
+
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+        return FALSE;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, PWL_METRICS_TEXTFILE_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        PWL_LOG_ERR("Create %s failed: %s", tmp_path, strerror(errno));
+        return FALSE;
+    }
+
+    for (int metric = 0; metric < PWL_METRIC_MAX; metric++) {
+        static const gchar * const type_name[] = {
+            [PWL_METRIC_COUNTER] = "counter",
+            [PWL_METRIC_GAUGE] = "gauge",
+            [PWL_METRIC_HISTOGRAM] = "histogram",
+        };
+
+        fprintf(fp, "# HELP %s %s\n", metric_info[metric].name, metric_info[metric].help);
+        fprintf(fp, "# TYPE %s %s\n", metric_info[metric].name, type_name[metric_info[metric].type]);
+        metrics_foreach_sample(metric, metrics_write_sample, fp);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        PWL_LOG_ERR("Write %s failed: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return FALSE;
+    }
+    return TRUE;
+}
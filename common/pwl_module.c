@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_module.h"
+
+#define MODULE_READ_RETRY               100
+
+static pwl_module_state_t *gp_module_state = NULL;
+static int g_module_fd = -1;
+static pthread_mutex_t g_module_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+gboolean pwl_module_init() {
+    pwl_module_state_t *state;
+    int fd;
+
+    pthread_mutex_lock(&g_module_mutex);
+    if (gp_module_state) {
+        pthread_mutex_unlock(&g_module_mutex);
+        return TRUE;
+    }
+
+    fd = shm_open(PWL_MODULE_SHM_PATH, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(pwl_module_state_t)) != 0) {
+        PWL_LOG_ERR("Module state shm failed: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        pthread_mutex_unlock(&g_module_mutex);
+        return FALSE;
+    }
+    state = mmap(NULL, sizeof(pwl_module_state_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED) {
+        PWL_LOG_ERR("Module state mmap failed: %s", strerror(errno));
+        close(fd);
+        pthread_mutex_unlock(&g_module_mutex);
+        return FALSE;
+    }
+
+    flock(fd, LOCK_EX);
+    if (state->magic != PWL_MODULE_MAGIC || state->version != PWL_MODULE_VERSION ||
+        state->size != sizeof(pwl_module_state_t)) {
+        memset(state, 0, sizeof(pwl_module_state_t));
+        state->version = PWL_MODULE_VERSION;
+        state->size = sizeof(pwl_module_state_t);
+        __atomic_store_n(&state->magic, PWL_MODULE_MAGIC, __ATOMIC_RELEASE);
+    }
+    // A writer that died mid-write left seq odd, readers would retry forever
+    if (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) & 1)
+        __atomic_add_fetch(&state->seq, 1, __ATOMIC_RELEASE);
+    flock(fd, LOCK_UN);
+
+    // Kept open, writers of all daemons serialize on its flock
+    g_module_fd = fd;
+    gp_module_state = state;
+    pthread_mutex_unlock(&g_module_mutex);
+    return TRUE;
+}
+
+// The mutex orders our own threads, the flock the other daemons
+static gboolean module_write_begin() {
+    if (!pwl_module_init())
+        return FALSE;
+    pthread_mutex_lock(&g_module_mutex);
+    flock(g_module_fd, LOCK_EX);
+    // Odd whatever a dead writer left behind
+    __atomic_store_n(&gp_module_state->seq, gp_module_state->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static void module_write_end() {
+    __atomic_store_n(&gp_module_state->seq, (gp_module_state->seq | 1) + 1, __ATOMIC_RELEASE);
+    flock(g_module_fd, LOCK_UN);
+    pthread_mutex_unlock(&g_module_mutex);
+}
+
+void pwl_module_set_caps(const pwl_module_caps_t *caps) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (!module_write_begin())
+        return;
+    memcpy(&gp_module_state->snapshot.caps, caps, sizeof(pwl_module_caps_t));
+    gp_module_state->snapshot.caps_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    gp_module_state->snapshot.caps_valid = 1;
+    module_write_end();
+}
+
+void pwl_module_clear_caps() {
+    if (!module_write_begin())
+        return;
+    gp_module_state->snapshot.caps_valid = 0;
+    module_write_end();
+}
+
+// Unchanged values are not written, readers only see seq move on real changes
+void pwl_module_set_str(pwl_module_str_t key, const gchar *value) {
+    char *field;
+
+    if (key >= PWL_MODULE_STR_MAX || !pwl_module_init())
+        return;
+    if (value == NULL)
+        value = "";
+    field = gp_module_state->snapshot.strings[key];
+    if (strncmp(field, value, PWL_MODULE_STR_LEN - 1) == 0)
+        return;
+
+    if (!module_write_begin())
+        return;
+    memset(field, 0, PWL_MODULE_STR_LEN);
+    strncpy(field, value, PWL_MODULE_STR_LEN - 1);
+    module_write_end();
+}
+
+void pwl_module_set_int(pwl_module_int_t key, gint value) {
+    if (key >= PWL_MODULE_INT_MAX || !pwl_module_init())
+        return;
+    if (__atomic_load_n(&gp_module_state->snapshot.values[key], __ATOMIC_RELAXED) == value)
+        return;
+
+    if (!module_write_begin())
+        return;
+    gp_module_state->snapshot.values[key] = value;
+    module_write_end();
+}
+
+uint32_t pwl_module_seq() {
+    if (!pwl_module_init())
+        return 0;
+    return __atomic_load_n(&gp_module_state->seq, __ATOMIC_ACQUIRE);
+}
+
+gboolean pwl_module_get_snapshot(pwl_module_snapshot_t *snapshot) {
+    uint32_t seq;
+
+    if (!pwl_module_init())
+        return FALSE;
+
+    for (int i = 0; i < MODULE_READ_RETRY; i++) {
+        seq = __atomic_load_n(&gp_module_state->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(snapshot, &gp_module_state->snapshot, sizeof(pwl_module_snapshot_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&gp_module_state->seq, __ATOMIC_RELAXED) == seq) {
+            // Strings are copied as a whole, terminate them anyway
+            snapshot->caps.device_id[PWL_MODULE_CAPS_STR_LEN - 1] = '\0';
+            snapshot->caps.firmware_info[PWL_MODULE_CAPS_STR_LEN - 1] = '\0';
+            snapshot->caps.hardware_info[PWL_MODULE_CAPS_STR_LEN - 1] = '\0';
+            snapshot->caps.custom_data_class[PWL_MODULE_CAPS_STR_LEN - 1] = '\0';
+            for (int key = 0; key < PWL_MODULE_STR_MAX; key++)
+                snapshot->strings[key][PWL_MODULE_STR_LEN - 1] = '\0';
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean pwl_module_get_caps(pwl_module_caps_t *caps) {
+    pwl_module_snapshot_t snapshot;
+
+    if (!pwl_module_get_snapshot(&snapshot) || !snapshot.caps_valid)
+        return FALSE;
+    memcpy(caps, &snapshot.caps, sizeof(pwl_module_caps_t));
+    return TRUE;
+}
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_port.h"
+
+#define PORT_DEV_DIR                    "/dev"
+#define PORT_UEVENT_BUFFER_SIZE         4096
+#define PORT_UEVENT_RCVBUF_SIZE         (1024 * 1024)
+#define PORT_MAX_SUBSCRIBERS            8
+
+typedef struct {
+    pwl_port_type_t     type;
+    pwl_device_type_t   device_type;
+    const gchar         *pattern;
+} port_pattern_t;
+
+// Same names the old "find /dev/ -name ..." calls looked for
+static const port_pattern_t g_port_patterns[] = {
+    { PWL_PORT_MBIM, PWL_DEVICE_TYPE_USB, "cdc-wdm*" },
+    { PWL_PORT_MBIM, PWL_DEVICE_TYPE_PCIE, "wwan0mbim*" },
+    { PWL_PORT_AT, PWL_DEVICE_TYPE_USB, "ttyUSB*" },
+    { PWL_PORT_AT, PWL_DEVICE_TYPE_PCIE, "wwan0at*" },
+    { PWL_PORT_FASTBOOT, PWL_DEVICE_TYPE_PCIE, "wwan*fast*" },
+};
+
+#define PORT_PATTERN_COUNT (sizeof(g_port_patterns) / sizeof(g_port_patterns[0]))
+
+typedef struct {
+    gchar               path[PWL_PORT_PATH_LEN];
+    pwl_device_type_t   device_type;
+} port_entry_t;
+
+typedef struct {
+    guint               id;
+    pwl_port_event_cb   cb;
+    gpointer            user_data;
+} port_subscriber_t;
+
+static pthread_once_t g_port_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_port_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_port_cond;
+static port_entry_t g_ports[PWL_PORT_TYPE_MAX][PWL_PORT_MAX_PER_TYPE];
+static gint g_port_count[PWL_PORT_TYPE_MAX];
+static port_subscriber_t g_port_subscribers[PORT_MAX_SUBSCRIBERS];
+static guint g_port_subscriber_id = 0;
+static gint g_port_uevent_fd = -1;
+
+static const port_pattern_t *port_classify(const gchar *name) {
+    for (gint i = 0; i < PORT_PATTERN_COUNT; i++) {
+        if (fnmatch(g_port_patterns[i].pattern, name, 0) == 0)
+            return &g_port_patterns[i];
+    }
+    return NULL;
+}
+
+// Sorted by name so ttyUSB0 is probed before ttyUSB1
+static gboolean port_add_locked(const gchar *name) {
+    const port_pattern_t *pattern = port_classify(name);
+    port_entry_t *ports;
+    gchar path[PWL_PORT_PATH_LEN];
+    gint i, count;
+
+    if (pattern == NULL)
+        return FALSE;
+
+    ports = g_ports[pattern->type];
+    count = g_port_count[pattern->type];
+    snprintf(path, sizeof(path), "%s/%s", PORT_DEV_DIR, name);
+    for (i = 0; i < count; i++) {
+        if (strcmp(ports[i].path, path) == 0)
+            return FALSE;
+    }
+    if (count >= PWL_PORT_MAX_PER_TYPE) {
+        PWL_LOG_ERR("Too many %s ports, ignore %s", port_type_name[pattern->type], path);
+        return FALSE;
+    }
+
+    for (i = count; i > 0 && strverscmp(ports[i - 1].path, path) > 0; i--)
+        ports[i] = ports[i - 1];
+    g_strlcpy(ports[i].path, path, sizeof(ports[i].path));
+    ports[i].device_type = pattern->device_type;
+    g_port_count[pattern->type]++;
+    return TRUE;
+}
+
+static gboolean port_remove_locked(const gchar *name) {
+    const port_pattern_t *pattern = port_classify(name);
+    port_entry_t *ports;
+    gchar path[PWL_PORT_PATH_LEN];
+
+    if (pattern == NULL)
+        return FALSE;
+
+    ports = g_ports[pattern->type];
+    snprintf(path, sizeof(path), "%s/%s", PORT_DEV_DIR, name);
+    for (gint i = 0; i < g_port_count[pattern->type]; i++) {
+        if (strcmp(ports[i].path, path) == 0) {
+            memmove(&ports[i], &ports[i + 1], (g_port_count[pattern->type] - i - 1) * sizeof(port_entry_t));
+            g_port_count[pattern->type]--;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void port_scan_locked() {
+    DIR *dp = opendir(PORT_DEV_DIR);
+    struct dirent *entry;
+
+    memset(g_port_count, 0, sizeof(g_port_count));
+    if (dp == NULL) {
+        PWL_LOG_ERR("Open %s failed", PORT_DEV_DIR);
+        return;
+    }
+    while ((entry = readdir(dp)) != NULL)
+        port_add_locked(entry->d_name);
+    closedir(dp);
+}
+
+static void port_notify(pwl_port_type_t type, const gchar *path, gboolean added) {
+    port_subscriber_t subscribers[PORT_MAX_SUBSCRIBERS];
+
+    pthread_mutex_lock(&g_port_mutex);
+    memcpy(subscribers, g_port_subscribers, sizeof(subscribers));
+    pthread_mutex_unlock(&g_port_mutex);
+
+    for (gint i = 0; i < PORT_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].cb)
+            subscribers[i].cb(type, path, added, subscribers[i].user_data);
+    }
+}
+
+static gboolean port_listed(port_entry_t *ports, gint count, const gchar *path) {
+    for (gint i = 0; i < count; i++) {
+        if (strcmp(ports[i].path, path) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Lost events, start over from /dev and tell subscribers what changed meanwhile
+static void port_rescan() {
+    static port_entry_t old_ports[PWL_PORT_TYPE_MAX][PWL_PORT_MAX_PER_TYPE];
+    static port_entry_t new_ports[PWL_PORT_TYPE_MAX][PWL_PORT_MAX_PER_TYPE];
+    gint old_count[PWL_PORT_TYPE_MAX], new_count[PWL_PORT_TYPE_MAX];
+
+    pthread_mutex_lock(&g_port_mutex);
+    memcpy(old_ports, g_ports, sizeof(old_ports));
+    memcpy(old_count, g_port_count, sizeof(old_count));
+    port_scan_locked();
+    memcpy(new_ports, g_ports, sizeof(new_ports));
+    memcpy(new_count, g_port_count, sizeof(new_count));
+    pthread_cond_broadcast(&g_port_cond);
+    pthread_mutex_unlock(&g_port_mutex);
+
+    for (gint type = 0; type < PWL_PORT_TYPE_MAX; type++) {
+        for (gint i = 0; i < old_count[type]; i++) {
+            if (port_listed(new_ports[type], new_count[type], old_ports[type][i].path))
+                continue;
+            PWL_LOG_INFO("%s port %s remove", port_type_name[type], old_ports[type][i].path);
+            port_notify(type, old_ports[type][i].path, FALSE);
+        }
+        for (gint i = 0; i < new_count[type]; i++) {
+            if (port_listed(old_ports[type], old_count[type], new_ports[type][i].path))
+                continue;
+            PWL_LOG_INFO("%s port %s add", port_type_name[type], new_ports[type][i].path);
+            port_notify(type, new_ports[type][i].path, TRUE);
+        }
+    }
+}
+
+// Kernel uevent is "action@devpath" followed by KEY=value strings, all '\0' separated
+static void port_handle_uevent(gchar *buffer, gint len) {
+    const gchar *action = NULL;
+    const gchar *devname = NULL;
+    const port_pattern_t *pattern;
+    gchar path[PWL_PORT_PATH_LEN];
+    gboolean changed = FALSE;
+
+    for (gint i = 0; i < len; i += strlen(buffer + i) + 1) {
+        if (strncmp(buffer + i, "ACTION=", 7) == 0)
+            action = buffer + i + 7;
+        else if (strncmp(buffer + i, "DEVNAME=", 8) == 0)
+            devname = buffer + i + 8;
+    }
+    if (action == NULL || devname == NULL || strchr(devname, '/') != NULL)
+        return;
+    pattern = port_classify(devname);
+    if (pattern == NULL)
+        return;
+
+    pthread_mutex_lock(&g_port_mutex);
+    if (strcmp(action, "add") == 0)
+        changed = port_add_locked(devname);
+    else if (strcmp(action, "remove") == 0)
+        changed = port_remove_locked(devname);
+    if (changed)
+        pthread_cond_broadcast(&g_port_cond);
+    pthread_mutex_unlock(&g_port_mutex);
+
+    if (changed) {
+        snprintf(path, sizeof(path), "%s/%s", PORT_DEV_DIR, devname);
+        PWL_LOG_INFO("%s port %s %s", port_type_name[pattern->type], path, action);
+        port_notify(pattern->type, path, strcmp(action, "add") == 0);
+    }
+}
+
+static void *port_monitor_thread(void *data) {
+    gchar buffer[PORT_UEVENT_BUFFER_SIZE];
+
+    while (TRUE) {
+        gint len = recv(g_port_uevent_fd, buffer, sizeof(buffer) - 1, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                PWL_LOG_ERR("uevent overflow, rescan ports");
+                port_rescan();
+                continue;
+            }
+            PWL_LOG_ERR("uevent recv failed: %s", strerror(errno));
+            break;
+        }
+        buffer[len] = '\0';
+        port_handle_uevent(buffer, len);
+    }
+
+    pthread_mutex_lock(&g_port_mutex);
+    close(g_port_uevent_fd);
+    g_port_uevent_fd = -1;
+    pthread_mutex_unlock(&g_port_mutex);
+    return NULL;
+}
+
+static gint port_uevent_open() {
+    struct sockaddr_nl addr;
+    gint size = PORT_UEVENT_RCVBUF_SIZE;
+    gint fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel events, the device node already exists in devtmpfs
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+}
+
+static void port_registry_init() {
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_port_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Listen before the scan so nothing in between is missed
+    g_port_uevent_fd = port_uevent_open();
+
+    pthread_mutex_lock(&g_port_mutex);
+    port_scan_locked();
+    pthread_mutex_unlock(&g_port_mutex);
+
+    if (g_port_uevent_fd < 0) {
+        PWL_LOG_ERR("uevent socket failed: %s, scan ports on demand", strerror(errno));
+        return;
+    }
+    if (pthread_create(&thread, NULL, port_monitor_thread, NULL) != 0) {
+        PWL_LOG_ERR("Create port monitor thread failed");
+        close(g_port_uevent_fd);
+        g_port_uevent_fd = -1;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Without monitor the table is only as fresh as the last scan
+static void port_refresh_locked() {
+    if (g_port_uevent_fd < 0)
+        port_scan_locked();
+}
+
+static gint port_first_locked(pwl_port_type_t type, pwl_device_type_t device_type) {
+    for (gint i = 0; i < g_port_count[type]; i++) {
+        if (device_type == PWL_DEVICE_TYPE_UNKNOWN || g_ports[type][i].device_type == device_type)
+            return i;
+    }
+    return -1;
+}
+
+gboolean pwl_port_get(pwl_port_type_t type, gchar *path, guint32 path_len) {
+    pwl_device_type_t device_type = pwl_get_device_type();
+    gboolean ret = FALSE;
+    gint index;
+
+    if (type >= PWL_PORT_TYPE_MAX)
+        return FALSE;
+    pthread_once(&g_port_once, port_registry_init);
+
+    pthread_mutex_lock(&g_port_mutex);
+    port_refresh_locked();
+    index = port_first_locked(type, device_type);
+    if (index >= 0) {
+        if (strlen(g_ports[type][index].path) + 1 > path_len) {
+            PWL_LOG_ERR("port buffer size %d not enough!!!", path_len);
+        } else {
+            strcpy(path, g_ports[type][index].path);
+            ret = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&g_port_mutex);
+    return ret;
+}
+
+gint pwl_port_list(pwl_port_type_t type, gchar ports[][PWL_PORT_PATH_LEN], gint max) {
+    pwl_device_type_t device_type = pwl_get_device_type();
+    gint count = 0;
+
+    if (type >= PWL_PORT_TYPE_MAX)
+        return 0;
+    pthread_once(&g_port_once, port_registry_init);
+
+    pthread_mutex_lock(&g_port_mutex);
+    port_refresh_locked();
+    for (gint i = 0; i < g_port_count[type] && count < max; i++) {
+        if (device_type == PWL_DEVICE_TYPE_UNKNOWN || g_ports[type][i].device_type == device_type)
+            strcpy(ports[count++], g_ports[type][i].path);
+    }
+    pthread_mutex_unlock(&g_port_mutex);
+    return count;
+}
+
+gboolean pwl_port_wait(pwl_port_type_t type, gboolean present, gint timeout_sec) {
+    pwl_device_type_t device_type = pwl_get_device_type();
+    struct timespec deadline, wake;
+    gboolean ret = FALSE;
+
+    if (type >= PWL_PORT_TYPE_MAX)
+        return FALSE;
+    pthread_once(&g_port_once, port_registry_init);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_sec;
+
+    pthread_mutex_lock(&g_port_mutex);
+    while (TRUE) {
+        port_refresh_locked();
+        if ((port_first_locked(type, device_type) >= 0) == present) {
+            ret = TRUE;
+            break;
+        }
+
+        if (g_port_uevent_fd < 0) {
+            // Poll once a second, never past the deadline
+            clock_gettime(CLOCK_MONOTONIC, &wake);
+            wake.tv_sec += 1;
+            if (wake.tv_sec > deadline.tv_sec ||
+                (wake.tv_sec == deadline.tv_sec && wake.tv_nsec > deadline.tv_nsec))
+                wake = deadline;
+        } else {
+            wake = deadline;
+        }
+        if (pthread_cond_timedwait(&g_port_cond, &g_port_mutex, &wake) == ETIMEDOUT &&
+            wake.tv_sec == deadline.tv_sec && wake.tv_nsec == deadline.tv_nsec) {
+            port_refresh_locked();
+            ret = (port_first_locked(type, device_type) >= 0) == present;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_port_mutex);
+
+    if (DEBUG) PWL_LOG_DEBUG("Wait %s port %s: %s", port_type_name[type],
+                             present ? "present" : "gone", ret ? "done" : "timeout");
+    return ret;
+}
+
+guint pwl_port_subscribe(pwl_port_event_cb cb, gpointer user_data) {
+    guint id = 0;
+
+    pthread_once(&g_port_once, port_registry_init);
+
+    pthread_mutex_lock(&g_port_mutex);
+    for (gint i = 0; i < PORT_MAX_SUBSCRIBERS; i++) {
+        if (g_port_subscribers[i].cb == NULL) {
+            id = ++g_port_subscriber_id;
+            g_port_subscribers[i].id = id;
+            g_port_subscribers[i].cb = cb;
+            g_port_subscribers[i].user_data = user_data;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_port_mutex);
+
+    if (id == 0)
+        PWL_LOG_ERR("Too many port subscribers");
+    return id;
+}
+
+void pwl_port_unsubscribe(guint id) {
+    pthread_mutex_lock(&g_port_mutex);
+    for (gint i = 0; i < PORT_MAX_SUBSCRIBERS; i++) {
+        if (g_port_subscribers[i].id == id && g_port_subscribers[i].cb) {
+            memset(&g_port_subscribers[i], 0, sizeof(port_subscriber_t));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_port_mutex);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_record.h"
+#include "pwl_trace.h"
+
+static pthread_mutex_t g_record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *gp_record_fp = NULL;
+static gchar g_record_path[128];
+static uint32_t g_record_owner_id = PWL_MQ_ID_INVALID;
+static long g_record_size = 0;
+
+static uint64_t record_now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static gboolean record_open() {
+    pwl_record_header_t header;
+
+    gp_record_fp = fopen(g_record_path, "wb");
+    if (gp_record_fp == NULL) {
+        PWL_LOG_ERR("Open record file %s failed: %s", g_record_path, strerror(errno));
+        return FALSE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = PWL_RECORD_MAGIC;
+    header.version = PWL_RECORD_VERSION;
+    header.owner_id = g_record_owner_id;
+    header.start_realtime_ns = record_now_ns(CLOCK_REALTIME);
+    header.start_monotonic_ns = record_now_ns(CLOCK_MONOTONIC);
+    fwrite(&header, sizeof(header), 1, gp_record_fp);
+    fflush(gp_record_fp);
+    g_record_size = sizeof(header);
+    return TRUE;
+}
+
+gboolean pwl_record_init(uint32_t owner_id) {
+    struct stat st;
+    gboolean ret = TRUE;
+
+    if (stat(PWL_RECORD_DIR, &st) != 0 || !S_ISDIR(st.st_mode))
+        return FALSE;
+
+    pthread_mutex_lock(&g_record_mutex);
+    if (gp_record_fp == NULL) {
+        g_record_owner_id = owner_id;
+        // PWL_MQ_PATH starts with '/'
+        snprintf(g_record_path, sizeof(g_record_path), "%s%s.rec", PWL_RECORD_DIR, PWL_MQ_PATH(owner_id));
+        ret = record_open();
+        if (ret)
+            PWL_LOG_INFO("Recording ipc traffic to %s", g_record_path);
+    }
+    pthread_mutex_unlock(&g_record_mutex);
+    return ret;
+}
+
+gboolean pwl_record_enabled() {
+    return gp_record_fp != NULL;
+}
+
+static void record_write(pwl_record_entry_t *entry, const void *payload) {
+    pthread_mutex_lock(&g_record_mutex);
+    if (gp_record_fp == NULL) {
+        pthread_mutex_unlock(&g_record_mutex);
+        return;
+    }
+
+    // Keep one previous file, the interesting part is usually the latest session
+    if (g_record_size + sizeof(*entry) + entry->payload_len > PWL_RECORD_MAX_FILE_SIZE) {
+        gchar old_path[sizeof(g_record_path) + 2];
+        fclose(gp_record_fp);
+        snprintf(old_path, sizeof(old_path), "%s.1", g_record_path);
+        rename(g_record_path, old_path);
+        if (!record_open()) {
+            pthread_mutex_unlock(&g_record_mutex);
+            return;
+        }
+    }
+
+    entry->timestamp_ns = record_now_ns(CLOCK_MONOTONIC);
+    fwrite(entry, sizeof(*entry), 1, gp_record_fp);
+    if (entry->payload_len)
+        fwrite(payload, entry->payload_len, 1, gp_record_fp);
+    fflush(gp_record_fp);
+    g_record_size += sizeof(*entry) + entry->payload_len;
+    pthread_mutex_unlock(&g_record_mutex);
+}
+
+void pwl_record_ipc(pwl_record_type_t type, uint32_t peer_id, msg_buffer_t *message, uint32_t request_id, uint8_t lane) {
+    pwl_record_entry_t entry;
+    gchar payload[PWL_RECORD_MAX_PAYLOAD];
+    size_t content_len, response_len;
+
+    // Record and trace types share the ipc, AT and MBIM values
+    pwl_trace((pwl_trace_type_t) type, message->pwl_cid, message->status, message->content);
+    if (gp_record_fp == NULL)
+        return;
+
+    content_len = strnlen(message->content, PWL_MQ_MAX_CONTENT_LEN - 1);
+    response_len = strnlen(message->response, PWL_MSG_MAX_RESP - 1);
+    memcpy(payload, message->content, content_len);
+    payload[content_len] = '\0';
+    memcpy(payload + content_len + 1, message->response, response_len);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.type = type;
+    entry.lane = lane;
+    entry.payload_len = content_len + 1 + response_len;
+    entry.peer_id = peer_id;
+    entry.pwl_cid = message->pwl_cid;
+    entry.status = message->status;
+    entry.request_id = request_id;
+    record_write(&entry, payload);
+}
+
+void pwl_record_text(pwl_record_type_t type, const char *text) {
+    pwl_record_entry_t entry;
+    size_t len;
+
+    pwl_trace((pwl_trace_type_t) type, 0, 0, text);
+    if (gp_record_fp == NULL)
+        return;
+
+    len = text ? strnlen(text, PWL_RECORD_MAX_PAYLOAD) : 0;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = type;
+    entry.payload_len = len;
+    entry.peer_id = PWL_MQ_ID_INVALID;
+    record_write(&entry, text);
+}
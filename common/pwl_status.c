@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_status.h"
+#include "pwl_trace.h"
+
+typedef struct {
+    gchar               name[PWL_STATUS_KEY_LEN];
+    gint                value;
+} status_entry_t;
+
+typedef struct {
+    const gchar         *path;
+    pthread_mutex_t     mutex;
+    gboolean            loaded;
+    gboolean            exist;
+    ino_t               ino;
+    struct timespec     mtime;
+    off_t               size;
+    gint                count;
+    status_entry_t      entries[PWL_STATUS_MAX_ENTRIES];
+    gint                depth;      // nested begin/set
+    gint                lock_fd;
+    gboolean            dirty;
+} status_store_t;
+
+static status_store_t g_status_stores[] = {
+    [PWL_STATUS_STORE_FW_UPDATE] = { .path = FW_UPDATE_STATUS_RECORD,
+                                     .mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, .lock_fd = -1 },
+    [PWL_STATUS_STORE_BOOTUP] = { .path = BOOTUP_STATUS_RECORD,
+                                  .mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, .lock_fd = -1 },
+    [PWL_STATUS_STORE_ESIM_PROFILE_REMOVE] = { .path = ESIM_PROFILE_REMOVE_RECORD,
+                                               .mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, .lock_fd = -1 },
+};
+
+// Reload only when another writer replaced the file, rename always gives a new inode
+static void status_load(status_store_t *store) {
+    struct stat st;
+    gchar line[STATUS_LINE_LENGTH];
+    FILE *fp;
+
+    if (stat(store->path, &st) != 0) {
+        store->loaded = TRUE;
+        store->exist = FALSE;
+        store->count = 0;
+        return;
+    }
+    if (store->loaded && store->exist && st.st_ino == store->ino && st.st_size == store->size &&
+        st.st_mtim.tv_sec == store->mtime.tv_sec && st.st_mtim.tv_nsec == store->mtime.tv_nsec)
+        return;
+
+    fp = fopen(store->path, "r");
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open %s failed: %s", store->path, strerror(errno));
+        return;
+    }
+    store->count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL && store->count < PWL_STATUS_MAX_ENTRIES) {
+        gchar *value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        g_strlcpy(store->entries[store->count].name, line, PWL_STATUS_KEY_LEN);
+        store->entries[store->count].value = atoi(value);
+        store->count++;
+    }
+    fclose(fp);
+
+    store->loaded = TRUE;
+    store->exist = TRUE;
+    store->ino = st.st_ino;
+    store->size = st.st_size;
+    store->mtime = st.st_mtim;
+}
+
+static gboolean status_write(status_store_t *store) {
+    gchar tmp_path[128];
+    gchar dir_path[128];
+    struct stat st;
+    FILE *fp;
+    gint fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        PWL_LOG_ERR("Create %s failed: %s", tmp_path, strerror(errno));
+        return FALSE;
+    }
+    for (gint i = 0; i < store->count; i++)
+        fprintf(fp, "%s=%d\n", store->entries[i].name, store->entries[i].value);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        PWL_LOG_ERR("Write %s failed: %s", tmp_path, strerror(errno));
+        fclose(fp);
+        unlink(tmp_path);
+        return FALSE;
+    }
+    fclose(fp);
+
+    if (rename(tmp_path, store->path) != 0) {
+        PWL_LOG_ERR("Rename %s failed: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return FALSE;
+    }
+
+    // The rename itself has to reach the disk too
+    g_strlcpy(dir_path, store->path, sizeof(dir_path));
+    fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    if (stat(store->path, &st) == 0) {
+        store->exist = TRUE;
+        store->ino = st.st_ino;
+        store->size = st.st_size;
+        store->mtime = st.st_mtim;
+    }
+    return TRUE;
+}
+
+static void status_lock(status_store_t *store) {
+    gchar lock_path[128];
+
+    pthread_mutex_lock(&store->mutex);
+    if (store->depth++ > 0)
+        return;
+
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", store->path);
+    store->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->lock_fd < 0 || flock(store->lock_fd, LOCK_EX) != 0)
+        PWL_LOG_ERR("Lock %s failed: %s", lock_path, strerror(errno));
+    store->dirty = FALSE;
+    status_load(store);
+}
+
+static gboolean status_unlock(status_store_t *store) {
+    gboolean ret = TRUE;
+
+    if (--store->depth == 0) {
+        if (store->dirty)
+            ret = status_write(store);
+        store->dirty = FALSE;
+        if (store->lock_fd >= 0) {
+            close(store->lock_fd);
+            store->lock_fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
+}
+
+static status_entry_t *status_find(status_store_t *store, const gchar *name) {
+    for (gint i = 0; i < store->count; i++) {
+        if (strcmp(store->entries[i].name, name) == 0)
+            return &store->entries[i];
+    }
+    return NULL;
+}
+
+gboolean pwl_status_init(pwl_status_store_t store_id) {
+    status_store_t *store = &g_status_stores[store_id];
+
+    status_lock(store);
+    if (!store->exist) {
+        PWL_LOG_DEBUG("%s not exist, create", store->path);
+        store->count = 0;
+        for (gint i = 0; i < PWL_STATUS_KEY_MAX; i++) {
+            if (status_key_info[i].store != store_id)
+                continue;
+            g_strlcpy(store->entries[store->count].name, status_key_info[i].name, PWL_STATUS_KEY_LEN);
+            store->entries[store->count].value = status_key_info[i].default_value;
+            store->count++;
+        }
+        store->dirty = TRUE;
+    }
+    return status_unlock(store);
+}
+
+gboolean pwl_status_get(pwl_status_key_t key, gint *value) {
+    status_store_t *store;
+    status_entry_t *entry;
+
+    if (key >= PWL_STATUS_KEY_MAX)
+        return FALSE;
+    store = &g_status_stores[status_key_info[key].store];
+
+    pthread_mutex_lock(&store->mutex);
+    // Inside a batch the cache already is the latest
+    if (store->depth == 0)
+        status_load(store);
+    entry = status_find(store, status_key_info[key].name);
+    *value = entry ? entry->value : status_key_info[key].default_value;
+    pthread_mutex_unlock(&store->mutex);
+
+    return store->exist;
+}
+
+gboolean pwl_status_set(pwl_status_key_t key, gint value) {
+    status_store_t *store;
+    status_entry_t *entry;
+
+    if (key >= PWL_STATUS_KEY_MAX)
+        return FALSE;
+    store = &g_status_stores[status_key_info[key].store];
+
+    status_lock(store);
+    entry = status_find(store, status_key_info[key].name);
+    if (entry == NULL && store->count < PWL_STATUS_MAX_ENTRIES) {
+        entry = &store->entries[store->count++];
+        g_strlcpy(entry->name, status_key_info[key].name, PWL_STATUS_KEY_LEN);
+        entry->value = value;
+        store->dirty = TRUE;
+        pwl_trace(PWL_TRACE_STATUS, key, value, entry->name);
+    } else if (entry && entry->value != value) {
+        entry->value = value;
+        store->dirty = TRUE;
+        // Retry counters and stages, the trail of a failing update
+        pwl_trace(PWL_TRACE_STATUS, key, value, entry->name);
+    }
+    return status_unlock(store);
+}
+
+void pwl_status_begin(pwl_status_store_t store_id) {
+    status_lock(&g_status_stores[store_id]);
+}
+
+gboolean pwl_status_commit(pwl_status_store_t store_id) {
+    return status_unlock(&g_status_stores[store_id]);
+}
+
+static pwl_status_key_t status_key_lookup(pwl_status_store_t store_id, const gchar *name) {
+    for (gint i = 0; i < PWL_STATUS_KEY_MAX; i++) {
+        if (status_key_info[i].store == store_id && strcmp(status_key_info[i].name, name) == 0)
+            return i;
+    }
+    PWL_LOG_ERR("Unknown status key %s", name);
+    return PWL_STATUS_KEY_MAX;
+}
+
+int fw_update_status_init() {
+    return pwl_status_init(PWL_STATUS_STORE_FW_UPDATE) ? 0 : -1;
+}
+
+int set_fw_update_status_value(char *key, int value) {
+    return pwl_status_set(status_key_lookup(PWL_STATUS_STORE_FW_UPDATE, key), value) ? 0 : -1;
+}
+
+int get_fw_update_status_value(char *key, int *result) {
+    return pwl_status_get(status_key_lookup(PWL_STATUS_STORE_FW_UPDATE, key), result) ? 0 : -1;
+}
+
+int esim_profile_remove_status_init() {
+    return pwl_status_init(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE) ? 0 : -1;
+}
+
+int set_esim_profile_remove_status_value(char *key, int value) {
+    return pwl_status_set(status_key_lookup(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE, key), value) ? 0 : -1;
+}
+
+int get_esim_profile_remove_status_value(char *key, int *result) {
+    return pwl_status_get(status_key_lookup(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE, key), result) ? 0 : -1;
+}
+
+int bootup_status_init() {
+    return pwl_status_init(PWL_STATUS_STORE_BOOTUP) ? 0 : -1;
+}
+
+int set_bootup_status_value(char *key, int value) {
+    return pwl_status_set(status_key_lookup(PWL_STATUS_STORE_BOOTUP, key), value) ? 0 : -1;
+}
+
+int get_bootup_status_value(char *key, int *result) {
+    return pwl_status_get(status_key_lookup(PWL_STATUS_STORE_BOOTUP, key), result) ? 0 : -1;
+}
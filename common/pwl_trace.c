@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_trace.h"
+
+static pwl_trace_buffer_t *gp_trace_buffer = NULL;
+static uint16_t g_trace_source = PWL_MQ_ID_INVALID;
+static gchar g_trace_crash_path[128];
+static pthread_mutex_t g_trace_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t g_trace_last_dump = 0;
+
+static const int trace_crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static uint64_t trace_now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void pwl_trace(pwl_trace_type_t type, uint32_t id, int32_t value, const char *text) {
+    pwl_trace_event_t *event;
+    uint32_t seq;
+    size_t len = 0;
+
+    if (gp_trace_buffer == NULL)
+        return;
+
+    // Oldest slot is overwritten, seq stays 0 until the event is complete
+    seq = __atomic_fetch_add(&gp_trace_buffer->head, 1, __ATOMIC_RELAXED);
+    event = &gp_trace_buffer->ring[seq & (PWL_TRACE_EVENTS - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    event->type = type;
+    event->source = g_trace_source;
+    event->timestamp_ns = trace_now_ns(CLOCK_MONOTONIC);
+    event->id = id;
+    event->value = value;
+    if (text) {
+        len = strnlen(text, PWL_TRACE_TEXT_LEN - 1);
+        memcpy(event->text, text, len);
+    }
+    event->text[len] = '\0';
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_dump_header(pwl_trace_dump_header_t *header, const char *reason) {
+    memset(header, 0, sizeof(*header));
+    header->magic = PWL_TRACE_MAGIC;
+    header->version = PWL_TRACE_VERSION;
+    header->source = g_trace_source;
+    header->realtime_ns = trace_now_ns(CLOCK_REALTIME);
+    header->monotonic_ns = trace_now_ns(CLOCK_MONOTONIC);
+    strncpy(header->reason, reason, sizeof(header->reason) - 1);
+}
+
+// Keep the newest PWL_TRACE_MAX_DUMPS dumps, crash dumps are one per daemon anyway
+static void trace_prune_dumps() {
+    struct dirent **entries;
+    time_t oldest_time;
+    gchar path[PATH_MAX], oldest[PATH_MAX];
+    struct stat st;
+    int count, dumps;
+
+    while (TRUE) {
+        count = scandir(PWL_TRACE_DUMP_DIR, &entries, NULL, alphasort);
+        if (count < 0)
+            return;
+
+        dumps = 0;
+        oldest[0] = '\0';
+        oldest_time = 0;
+        for (int i = 0; i < count; i++) {
+            if (g_str_has_suffix(entries[i]->d_name, ".bin") &&
+                !g_str_has_prefix(entries[i]->d_name, "crash_")) {
+                snprintf(path, sizeof(path), "%s/%s", PWL_TRACE_DUMP_DIR, entries[i]->d_name);
+                if (stat(path, &st) == 0) {
+                    dumps++;
+                    if (oldest[0] == '\0' || st.st_mtime < oldest_time) {
+                        oldest_time = st.st_mtime;
+                        strcpy(oldest, path);
+                    }
+                }
+            }
+            free(entries[i]);
+        }
+        free(entries);
+
+        if (dumps <= PWL_TRACE_MAX_DUMPS || unlink(oldest) != 0)
+            return;
+    }
+}
+
+gboolean pwl_trace_dump(const char *reason) {
+    pwl_trace_dump_header_t header;
+    pwl_trace_buffer_t *snapshot;
+    gchar path[PATH_MAX], stamp[32];
+    time_t now = time(NULL);
+    struct tm local_time;
+    FILE *fp;
+
+    if (gp_trace_buffer == NULL)
+        return FALSE;
+
+    pthread_mutex_lock(&g_trace_dump_mutex);
+    // The failure usually goes through several error paths, the first dump has it all
+    if (g_trace_last_dump && now - g_trace_last_dump < PWL_TRACE_DUMP_INTERVAL_SEC) {
+        pthread_mutex_unlock(&g_trace_dump_mutex);
+        return TRUE;
+    }
+    g_trace_last_dump = now;
+    pthread_mutex_unlock(&g_trace_dump_mutex);
+
+    pwl_trace(PWL_TRACE_DUMP, 0, 0, reason);
+
+    // Copy first, the other daemons keep writing
+    snapshot = malloc(sizeof(pwl_trace_buffer_t));
+    if (snapshot == NULL)
+        return FALSE;
+    memcpy(snapshot, gp_trace_buffer, sizeof(pwl_trace_buffer_t));
+    trace_dump_header(&header, reason);
+
+    localtime_r(&now, &local_time);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local_time);
+    // PWL_MQ_PATH starts with '/'
+    snprintf(path, sizeof(path), "%s/%s_%s_%s.bin", PWL_TRACE_DUMP_DIR,
+             PWL_MQ_PATH(g_trace_source) + 1, reason, stamp);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open trace dump %s failed: %s", path, strerror(errno));
+        free(snapshot);
+        return FALSE;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(snapshot, sizeof(pwl_trace_buffer_t), 1, fp);
+    fclose(fp);
+    free(snapshot);
+
+    PWL_LOG_INFO("Trace dumped to %s", path);
+    trace_prune_dumps();
+    return TRUE;
+}
+
+// Async signal safe: no allocation, no stdio, path prepared at init
+static void trace_crash_handler(int sig) {
+    pwl_trace_dump_header_t header;
+    int fd;
+
+    pwl_trace(PWL_TRACE_DUMP, sig, 0, "crash");
+    trace_dump_header(&header, "crash");
+
+    fd = open(g_trace_crash_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write(fd, &header, sizeof(header)) == sizeof(header))
+            write(fd, gp_trace_buffer, sizeof(pwl_trace_buffer_t));
+        close(fd);
+    }
+
+    // Handler was reset, the default action runs with the original signal
+    raise(sig);
+}
+
+gboolean pwl_trace_init(uint32_t source) {
+    pwl_trace_buffer_t *buffer;
+    struct sigaction action;
+    int fd;
+
+    if (gp_trace_buffer)
+        return TRUE;
+
+    fd = shm_open(PWL_TRACE_SHM_PATH, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(pwl_trace_buffer_t)) != 0) {
+        PWL_LOG_ERR("Trace shm failed: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    buffer = mmap(NULL, sizeof(pwl_trace_buffer_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer == MAP_FAILED) {
+        PWL_LOG_ERR("Trace mmap failed: %s", strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    // First daemon up formats the buffer
+    flock(fd, LOCK_EX);
+    if (buffer->magic != PWL_TRACE_MAGIC || buffer->version != PWL_TRACE_VERSION ||
+        buffer->event_size != sizeof(pwl_trace_event_t)) {
+        memset(buffer, 0, sizeof(pwl_trace_buffer_t));
+        buffer->version = PWL_TRACE_VERSION;
+        buffer->event_size = sizeof(pwl_trace_event_t);
+        buffer->events = PWL_TRACE_EVENTS;
+        __atomic_store_n(&buffer->magic, PWL_TRACE_MAGIC, __ATOMIC_RELEASE);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    g_trace_source = source;
+    gp_trace_buffer = buffer;
+
+    mkdir(PWL_TRACE_DUMP_DIR, 0755);
+    snprintf(g_trace_crash_path, sizeof(g_trace_crash_path), "%s/crash_%s.bin",
+             PWL_TRACE_DUMP_DIR, PWL_MQ_PATH(source) + 1);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_crash_handler;
+    action.sa_flags = SA_RESETHAND;
+    for (int i = 0; i < G_N_ELEMENTS(trace_crash_signals); i++)
+        sigaction(trace_crash_signals[i], &action, NULL);
+
+    pwl_trace(PWL_TRACE_MODE, 0, 0, "start");
+    return TRUE;
+}
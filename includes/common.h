@@ -30,11 +30,17 @@
 #define PWL_CLOSE_MBIM_TIMEOUT_SEC      5
 #define PWL_MBIM_READY_SEC              15
 #define PWL_RECOVERY_CHECK_DELAY_SEC    60
+#define PWL_SLEEP_QUIESCE_TIMEOUT_SEC   3   // logind delays a suspend 5s at most
 
 #define INFO_BUFFER_SIZE                100
 #define PWL_MAX_MFR_SIZE                10 // min size for "Dell Inc."
 #define PWL_MAX_SKUID_SIZE              15
 
+#define DMI_SYS_VENDOR_PATH             "/sys/class/dmi/id/sys_vendor"
+#define DMI_PRODUCT_SKU_PATH            "/sys/class/dmi/id/product_sku"
+#define SYSFS_USB_DEVICES_PATH          "/sys/bus/usb/devices"
+#define SYSFS_PCI_DEVICES_PATH          "/sys/bus/pci/devices"
+
 #define STATUS_LINE_LENGTH              128
 #define SN_MAX_LENGTH                   32
 #define IMEI_MAX_LENGTH                 32
@@ -52,6 +58,8 @@
 #define JP_FCC_CONFIG_COUNT             "jp_fcc_config_count"
 #define BOOTUP_FAILURE_COUNT            "Bootup_failure_count"
 #define ESIM_ENABLE_STATE               "esim_enable"
+#define SIM_ICCID_HASH                  "Sim_iccid_hash"
+#define SIM_MNC_LENGTH                  "Sim_mnc_length"
 #define ESIM_TESTPROFILE_DELETE_COUNTER "Testprofile_Delete_Counter"
 #define ESIM_TESTPROFILE_DELETE_DONE    "Testprofile_Delete_Done"
 #define ESIM_PROFILE_DELETE_SUCCESS      1
@@ -69,7 +77,8 @@
 
 #define PWL_MQ_MAX_MSG                  10
 #define PWL_MQ_MAX_CONTENT_LEN          30
-#define PWL_MQ_MAX_RESP                 500
+#define PWL_MQ_MAX_RESP                 500     // mqueue wire format, see pwl_mq_msg_t
+#define PWL_MSG_MAX_RESP                4096    // in memory and on the rings
 #define PWL_MQ_ID_INVALID               0
 #define PWL_MQ_ID_CORE                  1
 #define PWL_MQ_ID_MADPT                 2
@@ -132,6 +141,10 @@
     ((x >= 0                && x < PLW_CID_MAX_PREF)         ? PWL_MQ_PATH_PREF : \
     (x >= PLW_CID_MAX_PREF  && x < PLW_CID_MAX_MADPT)        ? PWL_MQ_PATH_MADPT : PWL_MQ_PATH_INVALID)
 
+#define CID_DESTINATION_ID(x) \
+    ((x >= 0                && x < PLW_CID_MAX_PREF)         ? PWL_MQ_ID_PREF : \
+    (x >= PLW_CID_MAX_PREF  && x < PLW_CID_MAX_MADPT)        ? PWL_MQ_ID_MADPT : PWL_MQ_ID_INVALID)
+
 
 typedef enum {
     /* request to pref */
@@ -262,10 +275,19 @@ typedef struct {
     uint32_t            sender_id;
     uint32_t            pwl_cid;
     pwl_cid_status_t    status;
-    char                response[PWL_MQ_MAX_RESP];
+    char                response[PWL_MSG_MAX_RESP];
     char                content[PWL_MQ_MAX_CONTENT_LEN];
 } msg_buffer_t;
 
+// Legacy mqueue message, pwl_unlock and the ring fallback, the response is cut at PWL_MQ_MAX_RESP
+typedef struct {
+    uint32_t            sender_id;
+    uint32_t            pwl_cid;
+    pwl_cid_status_t    status;
+    char                response[PWL_MQ_MAX_RESP];
+    char                content[PWL_MQ_MAX_CONTENT_LEN];
+} pwl_mq_msg_t;
+
 typedef enum {
     PWL_AT_INTF_NONE,
     PWL_AT_OVER_MBIM_CONTROL_MSG,
@@ -297,24 +319,19 @@ enum RETURNS {
     RET_OK = 0
 };
 
-typedef struct {
-    char* ssid;
-    char* sku_id;
-} SsidSkuMap;
-extern const SsidSkuMap ssid_sku_table[];
-extern size_t ssid_sku_table_count;
-
 gboolean pwl_discard_old_messages(const gchar *path);
 gboolean get_host_info(const gchar *cmd, gchar *buff, gint buff_len);
 gboolean filter_host_info_header(const gchar *header, gchar *info, gchar *buff, gint buff_len);
 void pwl_get_manufacturer(gchar *buff, gint buff_len);
 void pwl_get_skuid(gchar *buff, gint buff_len);
-gboolean pwl_module_usb_id_exist(gchar *usbid);
-gboolean pwl_module_pcie_id_exist(gchar *pcieid);
+gboolean pwl_read_sysfs_attr(const gchar *path, gchar *buff, gint buff_len);
+gboolean pwl_module_device_id_exist(pwl_device_type_t type, gchar *id);
+gboolean pwl_find_pcie_device(const gchar *id, gchar *domain, gint domain_len);
 pwl_device_type_t pwl_get_device_type();
 pwl_device_type_t pwl_get_device_type_await();
+pwl_device_type_t pwl_publish_device_identity();
 gboolean cond_wait(pthread_mutex_t *mutex, pthread_cond_t *cond, gint wait_time);
-void send_message_reply(uint32_t cid, uint32_t sender_id, uint32_t dest_id, pwl_cid_status_t status, char *msg);
+void send_message_reply(uint32_t cid, uint32_t sender_id, uint32_t dest_id, uint32_t request_id, pwl_cid_status_t status, char *msg);
 void print_message_info(msg_buffer_t* message);
 gboolean pwl_find_mbim_port(gchar *port_buff_ptr, guint32 port_buff_size);
 gboolean pwl_set_command(const gchar *command, gchar **response);
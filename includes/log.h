@@ -20,35 +20,52 @@
 
 #include <syslog.h>
 
-#define DEBUG                       0
 #define TIME_LOG                    0
 
-#if SYS_LOG
-#define PWL_LOG_DEBUG(format, ...)      syslog(LOG_DEBUG, format, ## __VA_ARGS__)
-#define PWL_LOG_INFO(format, ...)       syslog(LOG_INFO, format, ## __VA_ARGS__)
-#define PWL_LOG_ERR(format, ...)        syslog(LOG_ERR, format, ## __VA_ARGS__)
-#else
-#if (TIME_LOG)
-#include <sys/time.h>
-#define PWL_LOG_PRINT(format, ...) \
+/*
+ * Logging.
+ *
+ * The level is checked before the arguments are evaluated, a message below
+ * the current level costs one compare. After pwl_log_init() messages are
+ * formatted into a ring of the calling thread and written out in batches by
+ * a drain thread, to syslog with SYS_LOG, else to stdout/stderr (journald) or
+ * to the file named by PWL_LOG_FILE. Without pwl_log_init() they are written
+ * directly.
+ *
+ * The level is shared by all services: PWL_LOG_LEVEL in the environment sets
+ * it at start, the core SetLogLevelMethod or SIGUSR2 to any service (toggles
+ * verbose) change it at runtime. DEBUG is true at the verbose level, it used
+ * to be a compile time switch for the if (DEBUG) blocks.
+ */
+
+typedef enum {
+    PWL_LOG_LEVEL_ERR,
+    PWL_LOG_LEVEL_INFO,
+    PWL_LOG_LEVEL_DEBUG,
+    PWL_LOG_LEVEL_VERBOSE,
+    PWL_LOG_LEVEL_MAX
+} pwl_log_level_t;
+
+#define PWL_LOG_LEVEL_DEFAULT       PWL_LOG_LEVEL_DEBUG
+
+extern volatile int *gp_pwl_log_level;
+
+#define DEBUG                       (*gp_pwl_log_level >= PWL_LOG_LEVEL_VERBOSE)
+
+#define PWL_LOG(level, format, ...) \
     do { \
-        struct timeval tv; \
-        gettimeofday(&tv, NULL); \
-        struct tm *local_time = localtime(&tv.tv_sec); \
-        g_print("%04d-%02d-%02d %02d:%02d:%02d.%03ld ", \
-            local_time->tm_year + 1900, local_time->tm_mon + 1, local_time->tm_mday, \
-            local_time->tm_hour, local_time->tm_min, local_time->tm_sec, tv.tv_usec / 1000); \
-        g_print(format "\n", ## __VA_ARGS__); \
-    } while(0)
-
-#define PWL_LOG_DEBUG(format, ...)      PWL_LOG_PRINT(format, ## __VA_ARGS__)
-#define PWL_LOG_INFO(format, ...)       PWL_LOG_PRINT(format, ## __VA_ARGS__)
-#define PWL_LOG_ERR(format, ...)        PWL_LOG_PRINT(format, ## __VA_ARGS__)
-#else
-#define PWL_LOG_DEBUG(format, ...)      g_print(format "\n", ## __VA_ARGS__)
-#define PWL_LOG_INFO(format, ...)       g_print(format "\n", ## __VA_ARGS__)
-#define PWL_LOG_ERR(format, ...)        g_printerr(format "\n", ## __VA_ARGS__)
-#endif
-#endif
+        if (*gp_pwl_log_level >= (level)) \
+            pwl_log_write(level, format, ## __VA_ARGS__); \
+    } while (0)
+
+#define PWL_LOG_DEBUG(format, ...)      PWL_LOG(PWL_LOG_LEVEL_DEBUG, format, ## __VA_ARGS__)
+#define PWL_LOG_INFO(format, ...)       PWL_LOG(PWL_LOG_LEVEL_INFO, format, ## __VA_ARGS__)
+#define PWL_LOG_ERR(format, ...)        PWL_LOG(PWL_LOG_LEVEL_ERR, format, ## __VA_ARGS__)
+
+void pwl_log_init();
+void pwl_log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void pwl_log_flush();
+int pwl_log_get_level();
+int pwl_log_set_level(int level);
 
 #endif
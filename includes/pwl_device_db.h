@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_DEVICE_DB_H__
+#define __PWL_DEVICE_DB_H__
+
+#include "common.h"
+
+/*
+ * Device database.
+ *
+ * common/pwl_device_db.csv is turned into constant tables at configure time
+ * by common/pwl_device_db.cmake. Every table comes with an open addressing
+ * hash, a lookup is a few probes. Edit the csv to add a SSID or a modem id.
+ */
+
+#define PWL_DEVICE_DB_BUS_USB           (1 << 0)
+#define PWL_DEVICE_DB_BUS_PCIE          (1 << 1)
+
+#define PWL_DEVICE_DB_GPIO_UNSUPPORTED  -1
+#define PWL_DEVICE_DB_GPIO_UNKNOWN      -2
+
+typedef struct {
+    guint32         key;        // SSID as a number
+    gchar           ssid[5];
+    guint8          bus;        // PWL_DEVICE_DB_BUS_*
+    gboolean        iot;
+    const gchar     *oem_sku;   // NULL for the default
+    gint            gpio;       // legacy global number
+    const gchar     *gpio_chip; // gpiochip label, NULL when only the legacy number is known
+    gint            gpio_line;  // line offset on gpio_chip
+} pwl_ssid_info_t;
+
+typedef struct {
+    guint32         key;        // vid << 16 | pid
+    gchar           id[10];     // vid:pid as written in the csv
+    guint8          bus;
+    gboolean        autosuspend;
+} pwl_modem_id_t;
+
+typedef struct {
+    guint32         key;
+    gint16          index;      // -1 for an empty slot
+} pwl_device_db_slot_t;
+
+// Generated tables
+extern const pwl_ssid_info_t pwl_device_db_ssids[];
+extern const pwl_device_db_slot_t pwl_device_db_ssid_slots[];
+extern const guint32 pwl_device_db_ssid_mask;
+extern const pwl_modem_id_t pwl_device_db_ids[];
+extern const gint pwl_device_db_id_count;
+extern const pwl_device_db_slot_t pwl_device_db_id_slots[];
+extern const guint32 pwl_device_db_id_mask;
+extern const pwl_device_db_slot_t pwl_device_db_subsys_slots[];
+extern const guint32 pwl_device_db_subsys_mask;
+
+const pwl_ssid_info_t *pwl_device_db_find_ssid(const gchar *skuid);
+const pwl_modem_id_t *pwl_device_db_find_id(guint8 bus, const gchar *id);
+const pwl_modem_id_t *pwl_device_db_autosuspend_id();
+gboolean pwl_device_db_subsys_supported(const gchar *subsys_id);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_IDENTITY_H__
+#define __PWL_IDENTITY_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Device identity shared by the daemons.
+ *
+ * pwl_core detects the device once and publishes the result to
+ * PWL_IDENTITY_RUN_PATH, the other daemons read it at start up or wait for
+ * it with inotify. Every publish bumps the generation. A copy is kept in
+ * PWL_IDENTITY_SAVE_PATH, on the next boot pwl_core reuses it when the DMI
+ * SKU and the modem sysfs entry still match, without running detection.
+ */
+
+#define PWL_IDENTITY_RUN_DIR            "/run/pwl"
+#define PWL_IDENTITY_FILE_NAME          "device_identity"
+#define PWL_IDENTITY_RUN_PATH           PWL_IDENTITY_RUN_DIR "/" PWL_IDENTITY_FILE_NAME
+#define PWL_IDENTITY_SAVE_PATH          "/opt/pwl/" PWL_IDENTITY_FILE_NAME
+#define PWL_IDENTITY_MAGIC              0x50574c49 // "PWLI"
+#define PWL_IDENTITY_VERSION            1
+// pwl_core may poll for the device up to 60 seconds before publishing
+#define PWL_IDENTITY_WAIT_SEC           70
+
+typedef struct {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            generation;
+    uint32_t            device_type;    // pwl_device_type_t
+    uint32_t            is_iot_ssid;
+    gchar               skuid[PWL_MAX_SKUID_SIZE + 1];
+    gchar               manufacturer[INFO_BUFFER_SIZE];
+    gchar               device_name[32];    // pci domain address or usb sysfs entry
+    gchar               device_id[10];      // vid:pid
+    gchar               subsys_id[10];      // pcie subsystem VID:PID
+    gchar               mbim_port[32];      // last seen, empty if unknown
+} pwl_device_identity_t;
+
+gboolean pwl_identity_read(const gchar *path, pwl_device_identity_t *identity);
+gboolean pwl_identity_publish(pwl_device_identity_t *identity);
+gboolean pwl_identity_wait(pwl_device_identity_t *identity, uint32_t min_generation, gint timeout_sec);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_IPC_H__
+#define __PWL_IPC_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+
+/*
+ * Inter-daemon transport.
+ *
+ * Every receiving daemon owns shared memory rings (PWL_IPC_RING_PATH) that
+ * carry variable-length frames, plus its legacy mqueue (PWL_MQ_PATH).
+ * Senders push frames into the ring and only touch the mqueue to wake up an
+ * idle receiver (zero-length doorbell message). When the ring does not exist
+ * or stays full the message falls back to the mqueue as a full pwl_mq_msg_t,
+ * which is also the format used by pwl_unlock. Only the rings carry
+ * responses longer than PWL_MQ_MAX_RESP. A sender that finds the ring full
+ * sleeps on a futex on tail, the consumer wakes it when it frees space.
+ */
+
+#define PWL_IPC_RING_MAGIC              0x50574c52 // "PWLR"
+#define PWL_IPC_RING_SIZE               (64 * 1024)
+#define PWL_IPC_FRAME_ALIGN             8
+#define PWL_IPC_CID_WRAP                0xFFFFFFFF
+#define PWL_IPC_REQUEST_ID_NONE         0
+#define PWL_IPC_MAX_PENDING             16
+#define PWL_IPC_MAX_EXPIRED             32
+
+#define PWL_IPC_RING_PATH_MADPT         "/pwl_ring_madpt"
+#define PWL_IPC_RING_PATH_PREF          "/pwl_ring_pref"
+#define PWL_IPC_RING_PATH_FWUPDATE      "/pwl_ring_fwupdate"
+
+#define PWL_IPC_RING_PATH(x) \
+    ((x == PWL_MQ_ID_MADPT)       ? PWL_IPC_RING_PATH_MADPT : \
+    (x == PWL_MQ_ID_PREF)         ? PWL_IPC_RING_PATH_PREF : \
+    (x == PWL_MQ_ID_FWUPDATE)     ? PWL_IPC_RING_PATH_FWUPDATE : NULL)
+
+/*
+ * Priority lanes.
+ *
+ * Each endpoint has one ring per lane, named PWL_IPC_RING_PATH plus the lane
+ * number. The receiver always drains higher lanes first. Control and update
+ * critical messages wait for room like before, informational requests never
+ * block the sender: when their lane is full they are merged into an identical
+ * queued request or dropped. Replies on any lane wait for room and then fall
+ * back to the mqueue, their requester is waiting for them. On the mqueue
+ * fallback the lane is used as the mq_send() priority.
+ */
+typedef enum {
+    PWL_IPC_LANE_INFO,
+    PWL_IPC_LANE_UPDATE,
+    PWL_IPC_LANE_CONTROL,
+    PWL_IPC_LANES
+} pwl_ipc_lane_t;
+
+static const gchar * const ipc_lane_name[] = {
+    [PWL_IPC_LANE_INFO] = "INFO",
+    [PWL_IPC_LANE_UPDATE] = "UPDATE",
+    [PWL_IPC_LANE_CONTROL] = "CONTROL",
+};
+
+typedef struct {
+    uint32_t            magic;
+    uint32_t            size;
+    pthread_mutex_t     lock;       // serialize producers
+    uint32_t            head;       // written by producers
+    uint32_t            tail;       // written by the consumer
+    uint32_t            sleeping;   // consumer is blocked on the mqueue
+    uint32_t            full_waiters; // producers blocked on tail, the ring was full
+    uint8_t             data[PWL_IPC_RING_SIZE];
+} pwl_ipc_ring_t;
+
+typedef struct {
+    uint32_t            frame_len;
+    uint32_t            sender_id;
+    uint32_t            pwl_cid;
+    uint32_t            status;
+    uint16_t            content_len;
+    uint16_t            response_len;
+    uint32_t            request_id;
+} pwl_ipc_frame_t;
+
+/*
+ * Request correlation.
+ *
+ * Every request carries a request id in its frame and the receiver echoes it
+ * back in the reply. A caller that needs the answer registers the request in
+ * the pending table (track = TRUE) and blocks in pwl_ipc_wait_reply() on that
+ * id only, so several requests can be outstanding at the same time. The handler
+ * gets the id with the request and hands it to send_message_reply(). Replies to
+ * requests whose waiter already timed out are recognized and dropped instead
+ * of being taken as the answer to the next request. Legacy mqueue messages
+ * (pwl_unlock, ring fallback) have no id and are matched by CID.
+ */
+typedef struct {
+    uint32_t            request_id;
+    uint32_t            wire_id;    // differs from request_id when merged into a queued request
+    uint32_t            pwl_cid;
+    gboolean            done;
+    pwl_cid_status_t    status;
+    struct timespec     deadline;
+    uint64_t            sent_us;    // pwl_metrics_now() at send, for the round trip time
+} pwl_ipc_pending_t;
+
+/*
+ * Main loop dispatch.
+ *
+ * pwl_ipc_attach() opens the endpoint and adds its mqueue fd to the default
+ * GMainContext, every message is then passed to the handler on the main loop
+ * thread instead of a dedicated receiver thread. pwl_ipc_wait_reply() called
+ * on that thread keeps reading while it waits, so D-Bus callbacks can still
+ * block on a reply. Only the awaited reply is passed to the handler then,
+ * other messages are queued and handled once the waiting handler returned.
+ */
+typedef void (*pwl_ipc_handler_t)(msg_buffer_t *message, uint32_t request_id);
+
+gboolean pwl_ipc_open_endpoint(uint32_t self_id);
+guint pwl_ipc_attach(uint32_t self_id, pwl_ipc_handler_t handler);
+gboolean pwl_ipc_receive(msg_buffer_t *message, uint32_t *request_id);
+gboolean pwl_ipc_send(uint32_t dest_id, msg_buffer_t *message, uint32_t request_id);
+uint32_t pwl_ipc_request(uint32_t sender_id, uint32_t cid, const char *content, gboolean track);
+gboolean pwl_ipc_wait_reply(uint32_t request_id, gint wait_time);
+gboolean pwl_ipc_reply_accept(msg_buffer_t *message, uint32_t *request_id);
+void pwl_ipc_reply_done(uint32_t request_id, pwl_cid_status_t status);
+pwl_ipc_lane_t pwl_ipc_cid_lane(uint32_t cid);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_METRICS_H__
+#define __PWL_METRICS_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "pwl_status.h"
+
+/*
+ * Metrics registry.
+ *
+ * Counters, gauges and latency histograms of all daemons live in one shared
+ * memory table, updates are single atomic operations. Every metric is known
+ * at compile time: add it to pwl_metric_t and metric_info. A metric is either
+ * unlabeled or has one series per CID or per status key. Durations are in
+ * microseconds and exported in seconds.
+ *
+ * pwl_core exports the table as the Metrics property of com.pwl.core and, when
+ * PWL_METRICS_TEXTFILE_DIR exists, as a Prometheus textfile for the node
+ * exporter.
+ */
+
+#define PWL_METRICS_SHM_PATH            "/pwl_metrics"
+#define PWL_METRICS_MAGIC               0x50574d54 // "PWMT"
+#define PWL_METRICS_VERSION             2
+#define PWL_METRICS_MAX_SERIES          PWL_CID_MAX
+#define PWL_METRICS_BUCKETS             12
+#define PWL_METRICS_TEXTFILE_DIR        "/var/lib/prometheus/node-exporter"
+#define PWL_METRICS_TEXTFILE_NAME       "pwl.prom"
+#define PWL_METRICS_EXPORT_INTERVAL_SEC 30
+
+typedef enum {
+    PWL_METRIC_COUNTER,
+    PWL_METRIC_GAUGE,
+    PWL_METRIC_HISTOGRAM
+} pwl_metric_type_t;
+
+typedef enum {
+    PWL_METRIC_LABEL_NONE,
+    PWL_METRIC_LABEL_CID,
+    PWL_METRIC_LABEL_STATUS_KEY
+} pwl_metric_label_t;
+
+typedef enum {
+    PWL_METRIC_IPC_RTT,
+    PWL_METRIC_IPC_TIMEOUT,
+    PWL_METRIC_AT_LATENCY,
+    PWL_METRIC_AT_TIMEOUT,
+    PWL_METRIC_MBIM_LATENCY,
+    PWL_METRIC_MBIM_TIMEOUT,
+    PWL_METRIC_STATUS,
+    PWL_METRIC_RESCAN_FAILURE,
+    PWL_METRIC_FLASH_BYTES,
+    PWL_METRIC_FLASH_THROUGHPUT,
+    PWL_METRIC_MBIM_READY,
+    PWL_METRIC_RECOVERY,
+    PWL_METRIC_RESUME,
+    PWL_METRIC_GPIO_RESET,
+    PWL_METRIC_POSTFLASH_READY,
+    PWL_METRIC_MAX
+} pwl_metric_t;
+
+typedef struct {
+    const gchar         *name;
+    pwl_metric_type_t   type;
+    pwl_metric_label_t  label;
+    const gchar         *help;
+} pwl_metric_info_t;
+
+static const pwl_metric_info_t metric_info[] = {
+    [PWL_METRIC_IPC_RTT] = { "pwl_ipc_rtt_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_CID,
+                             "IPC request to reply time" },
+    [PWL_METRIC_IPC_TIMEOUT] = { "pwl_ipc_timeouts_total", PWL_METRIC_COUNTER, PWL_METRIC_LABEL_CID,
+                                 "IPC requests without reply in time" },
+    [PWL_METRIC_AT_LATENCY] = { "pwl_at_latency_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_CID,
+                                "AT command time in madpt" },
+    [PWL_METRIC_AT_TIMEOUT] = { "pwl_at_timeouts_total", PWL_METRIC_COUNTER, PWL_METRIC_LABEL_CID,
+                                "AT commands that failed or timed out" },
+    [PWL_METRIC_MBIM_LATENCY] = { "pwl_mbim_latency_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_CID,
+                                  "AT over MBIM command time in madpt" },
+    [PWL_METRIC_MBIM_TIMEOUT] = { "pwl_mbim_timeouts_total", PWL_METRIC_COUNTER, PWL_METRIC_LABEL_CID,
+                                  "AT over MBIM commands that failed or timed out" },
+    [PWL_METRIC_STATUS] = { "pwl_status", PWL_METRIC_GAUGE, PWL_METRIC_LABEL_STATUS_KEY,
+                            "Persistent status values, retry counters" },
+    [PWL_METRIC_RESCAN_FAILURE] = { "pwl_rescan_failures_total", PWL_METRIC_COUNTER, PWL_METRIC_LABEL_NONE,
+                                    "Recovery checks that found no modem port and rescanned" },
+    [PWL_METRIC_FLASH_BYTES] = { "pwl_flash_bytes_total", PWL_METRIC_COUNTER, PWL_METRIC_LABEL_NONE,
+                                 "Bytes flashed by fastboot" },
+    [PWL_METRIC_FLASH_THROUGHPUT] = { "pwl_flash_throughput_bytes_per_second", PWL_METRIC_GAUGE,
+                                      PWL_METRIC_LABEL_NONE, "Throughput of the last flashed image" },
+    [PWL_METRIC_MBIM_READY] = { "pwl_mbim_ready_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_NONE,
+                                "Start or resume until the MBIM device is open" },
+    [PWL_METRIC_RECOVERY] = { "pwl_recovery_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_NONE,
+                              "Duration of the PCIe recovery check" },
+    [PWL_METRIC_RESUME] = { "pwl_resume_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_NONE,
+                            "Host resume until the modem answers MBIM again" },
+    [PWL_METRIC_GPIO_RESET] = { "pwl_gpio_reset_seconds", PWL_METRIC_HISTOGRAM, PWL_METRIC_LABEL_NONE,
+                                "GPIO reset pulse until the MBIM port is back" },
+    [PWL_METRIC_POSTFLASH_READY] = { "pwl_postflash_ready_seconds", PWL_METRIC_HISTOGRAM,
+                                     PWL_METRIC_LABEL_NONE, "Madpt restart after a flash until the modem answers AT" },
+};
+
+// Upper bounds in microseconds, the last bucket is +Inf
+static const uint64_t metric_buckets_us[PWL_METRICS_BUCKETS - 1] = {
+    1000, 5000, 10000, 50000, 100000, 500000,
+    1000000, 5000000, 10000000, 30000000, 120000000
+};
+
+typedef struct {
+    uint64_t            count;
+    int64_t             sum;        // counter and gauge value, histogram sum
+    uint64_t            buckets[PWL_METRICS_BUCKETS];
+} pwl_metric_series_t;
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            metrics;
+    uint32_t            size;       // sizeof(pwl_metrics_table_t)
+    uint32_t            series_max; // PWL_METRICS_MAX_SERIES, follows PWL_CID_MAX
+    pwl_metric_series_t series[PWL_METRIC_MAX][PWL_METRICS_MAX_SERIES];
+} pwl_metrics_table_t;
+
+gboolean pwl_metrics_init();
+uint64_t pwl_metrics_now();
+void pwl_metrics_add(pwl_metric_t metric, uint32_t label, int64_t value);
+void pwl_metrics_set(pwl_metric_t metric, uint32_t label, int64_t value);
+void pwl_metrics_observe(pwl_metric_t metric, uint32_t label, uint64_t duration_us);
+void pwl_metrics_observe_since(pwl_metric_t metric, uint32_t label, uint64_t start_us);
+GVariant *pwl_metrics_to_variant();
+gboolean pwl_metrics_write_textfile(const gchar *dir);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_MODULE_H__
+#define __PWL_MODULE_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Shared module state.
+ *
+ * What the daemons learned about the module, in one shared memory page so the
+ * others read it instead of asking the modem again over AT. pwl_core writes
+ * the MBIM device caps, SIM state and device type, pwl_pref the versions and
+ * carriers, pwl_fwupdate the update state. pwl_core exports the snapshot on
+ * com.pwl.core, the property names are the names below.
+ *
+ * Writers bump seq to odd before and to even after an update under a flock,
+ * readers retry until they copied a stable even seq. Device caps are queried
+ * each time the MBIM device opens and dropped when it goes away, so valid caps
+ * always belong to the running firmware.
+ */
+
+#define PWL_MODULE_SHM_PATH             "/pwl_module"
+#define PWL_MODULE_MAGIC                0x50574d44 // "PWMD"
+#define PWL_MODULE_VERSION              2
+#define PWL_MODULE_CAPS_STR_LEN         128
+#define PWL_MODULE_STR_LEN              64
+#define PWL_MODULE_POLL_INTERVAL_MS     1000
+
+typedef enum {
+    PWL_MODULE_AP_VERSION,
+    PWL_MODULE_MD_VERSION,
+    PWL_MODULE_OP_VERSION,
+    PWL_MODULE_OEM_VERSION,
+    PWL_MODULE_DPV_VERSION,
+    PWL_MODULE_SIM_CARRIER,
+    PWL_MODULE_PREF_CARRIER,
+    PWL_MODULE_SKU,
+    PWL_MODULE_STR_MAX
+} pwl_module_str_t;
+
+static const gchar * const module_str_name[] = {
+    [PWL_MODULE_AP_VERSION] = "ApVersion",
+    [PWL_MODULE_MD_VERSION] = "MdVersion",
+    [PWL_MODULE_OP_VERSION] = "OpVersion",
+    [PWL_MODULE_OEM_VERSION] = "OemVersion",
+    [PWL_MODULE_DPV_VERSION] = "DpvVersion",
+    [PWL_MODULE_SIM_CARRIER] = "SimCarrier",
+    [PWL_MODULE_PREF_CARRIER] = "PreferredCarrier",
+    [PWL_MODULE_SKU] = "Sku",
+};
+
+typedef enum {
+    PWL_MODULE_SIM_STATE,       // pwl_sim_state_t
+    PWL_MODULE_DEVICE_TYPE,     // pwl_device_type_t
+    PWL_MODULE_UPDATE_STATE,    // pwl_update_state_t
+    PWL_MODULE_INT_MAX
+} pwl_module_int_t;
+
+static const gchar * const module_int_name[] = {
+    [PWL_MODULE_SIM_STATE] = "SimState",
+    [PWL_MODULE_DEVICE_TYPE] = "DeviceType",
+    [PWL_MODULE_UPDATE_STATE] = "UpdateState",
+};
+
+typedef enum {
+    PWL_UPDATE_STATE_IDLE,
+    PWL_UPDATE_STATE_IN_PROGRESS,
+    PWL_UPDATE_STATE_COMPLETED,
+    PWL_UPDATE_STATE_FAILED
+} pwl_update_state_t;
+
+typedef struct {
+    uint32_t            device_type;        // MbimDeviceType
+    uint32_t            cellular_class;     // MbimCellularClass
+    uint32_t            data_class;         // MbimDataClass
+    uint32_t            max_sessions;
+    char                device_id[PWL_MODULE_CAPS_STR_LEN];
+    char                firmware_info[PWL_MODULE_CAPS_STR_LEN];
+    char                hardware_info[PWL_MODULE_CAPS_STR_LEN];
+    char                custom_data_class[PWL_MODULE_CAPS_STR_LEN];
+} pwl_module_caps_t;
+
+typedef struct {
+    uint32_t            caps_valid;
+    uint64_t            caps_realtime_ns;   // when the caps were read
+    pwl_module_caps_t   caps;
+    int32_t             values[PWL_MODULE_INT_MAX];
+    char                strings[PWL_MODULE_STR_MAX][PWL_MODULE_STR_LEN];
+} pwl_module_snapshot_t;
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            size;
+    uint32_t            seq;                // odd while being written
+    pwl_module_snapshot_t snapshot;
+} pwl_module_state_t;
+
+gboolean pwl_module_init();
+void pwl_module_set_caps(const pwl_module_caps_t *caps);
+void pwl_module_clear_caps();
+gboolean pwl_module_get_caps(pwl_module_caps_t *caps);
+void pwl_module_set_str(pwl_module_str_t key, const gchar *value);
+void pwl_module_set_int(pwl_module_int_t key, gint value);
+uint32_t pwl_module_seq();
+gboolean pwl_module_get_snapshot(pwl_module_snapshot_t *snapshot);
+
+#endif
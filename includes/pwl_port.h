@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_PORT_H__
+#define __PWL_PORT_H__
+
+#include "common.h"
+
+/*
+ * Modem port registry.
+ *
+ * Started on first use: /dev is scanned once, after that kernel uevents keep
+ * the registry up to date. Lookups only read the table. Waiters wake up as
+ * soon as a port is added or removed. Subscribers are called from the monitor
+ * thread and should not block. Without the uevent socket every lookup scans
+ * /dev again and waiters poll once a second.
+ */
+
+#define PWL_PORT_MAX_PER_TYPE           8
+#define PWL_PORT_PATH_LEN               32
+
+typedef enum {
+    PWL_PORT_MBIM,
+    PWL_PORT_AT,
+    PWL_PORT_FASTBOOT,  // also the pcie abnormal mode port
+    PWL_PORT_TYPE_MAX
+} pwl_port_type_t;
+
+static const gchar * const port_type_name[] = {
+    [PWL_PORT_MBIM] = "MBIM",
+    [PWL_PORT_AT] = "AT",
+    [PWL_PORT_FASTBOOT] = "FASTBOOT",
+};
+
+typedef void (*pwl_port_event_cb)(pwl_port_type_t type, const gchar *path, gboolean added, gpointer user_data);
+
+gboolean pwl_port_get(pwl_port_type_t type, gchar *path, guint32 path_len);
+gint pwl_port_list(pwl_port_type_t type, gchar ports[][PWL_PORT_PATH_LEN], gint max);
+gboolean pwl_port_wait(pwl_port_type_t type, gboolean present, gint timeout_sec);
+guint pwl_port_subscribe(pwl_port_event_cb cb, gpointer user_data);
+void pwl_port_unsubscribe(guint id);
+
+#endif
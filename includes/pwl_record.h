@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_RECORD_H__
+#define __PWL_RECORD_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * IPC traffic recorder.
+ *
+ * Disabled unless PWL_RECORD_DIR exists. Each daemon then appends to its own
+ * <dir>/<mqueue name>.rec file: a pwl_record_header_t followed by entries,
+ * every entry is a pwl_record_entry_t plus payload_len bytes of payload.
+ * IPC payload is content, '\0', response. AT and MBIM payload is the command
+ * or the response text. Timestamps are CLOCK_MONOTONIC, the header keeps the
+ * wall clock of the start for reference. pwl_replay reads these files.
+ */
+
+#define PWL_RECORD_DIR                  "/opt/pwl/record"
+#define PWL_RECORD_MAGIC                0x50574c43 // "PWLC"
+#define PWL_RECORD_VERSION              1
+#define PWL_RECORD_MAX_FILE_SIZE        (8 * 1024 * 1024)
+#define PWL_RECORD_MAX_PAYLOAD          (PWL_MQ_MAX_CONTENT_LEN + PWL_MSG_MAX_RESP)
+
+// Same values as the first pwl_trace_type_t
+typedef enum {
+    PWL_RECORD_IPC_SEND,
+    PWL_RECORD_IPC_RECV,
+    PWL_RECORD_AT_CMD,
+    PWL_RECORD_AT_RESP,
+    PWL_RECORD_MBIM_CMD,
+    PWL_RECORD_MBIM_RESP,
+    PWL_RECORD_TYPE_MAX
+} pwl_record_type_t;
+
+static const gchar * const record_type_name[] = {
+    [PWL_RECORD_IPC_SEND] = "SEND",
+    [PWL_RECORD_IPC_RECV] = "RECV",
+    [PWL_RECORD_AT_CMD] = "AT_CMD",
+    [PWL_RECORD_AT_RESP] = "AT_RESP",
+    [PWL_RECORD_MBIM_CMD] = "MBIM_CMD",
+    [PWL_RECORD_MBIM_RESP] = "MBIM_RESP",
+};
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            owner_id;   // PWL_MQ_ID_* of the recording daemon
+    uint64_t            start_realtime_ns;
+    uint64_t            start_monotonic_ns;
+} pwl_record_header_t;
+
+typedef struct {
+    uint64_t            timestamp_ns;
+    uint8_t             type;
+    uint8_t             lane;
+    uint16_t            payload_len;
+    uint32_t            peer_id;    // destination for SEND, sender for RECV
+    uint32_t            pwl_cid;
+    uint32_t            status;
+    uint32_t            request_id;
+} pwl_record_entry_t;
+
+gboolean pwl_record_init(uint32_t owner_id);
+gboolean pwl_record_enabled();
+void pwl_record_ipc(pwl_record_type_t type, uint32_t peer_id, msg_buffer_t *message, uint32_t request_id, uint8_t lane);
+void pwl_record_text(pwl_record_type_t type, const char *text);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_STATUS_H__
+#define __PWL_STATUS_H__
+
+#include "common.h"
+
+/*
+ * Persistent status records.
+ *
+ * Each store is one of the existing key=value files. Values are cached in
+ * memory and the file is only read again when another process replaced it.
+ * Commits write a temporary file, fsync and rename it over the old one, under
+ * a flock on <file>.lock so daemons sharing a store do not lose updates.
+ * Between pwl_status_begin() and pwl_status_commit() sets are only cached and
+ * written together. Unchanged values are never written.
+ */
+
+#define PWL_STATUS_MAX_ENTRIES          32
+#define PWL_STATUS_KEY_LEN              64
+
+typedef enum {
+    PWL_STATUS_STORE_FW_UPDATE,
+    PWL_STATUS_STORE_BOOTUP,
+    PWL_STATUS_STORE_ESIM_PROFILE_REMOVE,
+    PWL_STATUS_STORE_MAX
+} pwl_status_store_t;
+
+typedef enum {
+    PWL_STATUS_FIND_FASTBOOT_RETRY_COUNT,
+    PWL_STATUS_WAIT_MODEM_PORT_RETRY_COUNT,
+    PWL_STATUS_WAIT_AT_PORT_RETRY_COUNT,
+    PWL_STATUS_FW_UPDATE_RETRY_COUNT,
+    PWL_STATUS_DO_HW_RESET_COUNT,
+    PWL_STATUS_NEED_RETRY_FW_UPDATE,
+    PWL_STATUS_JP_FCC_CONFIG_COUNT,
+    PWL_STATUS_BOOTUP_FAILURE_COUNT,
+    PWL_STATUS_ESIM_ENABLE_STATE,
+    PWL_STATUS_SIM_ICCID_HASH,
+    PWL_STATUS_SIM_MNC_LENGTH,
+    PWL_STATUS_ESIM_TESTPROFILE_DELETE_COUNTER,
+    PWL_STATUS_ESIM_TESTPROFILE_DELETE_DONE,
+    PWL_STATUS_KEY_MAX
+} pwl_status_key_t;
+
+typedef struct {
+    pwl_status_store_t  store;
+    const gchar         *name;
+    gint                default_value;
+} pwl_status_key_info_t;
+
+// Order of a store's keys is the order a new file is written in
+static const pwl_status_key_info_t status_key_info[] = {
+    [PWL_STATUS_FIND_FASTBOOT_RETRY_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, FIND_FASTBOOT_RETRY_COUNT, 0 },
+    [PWL_STATUS_WAIT_MODEM_PORT_RETRY_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, WAIT_MODEM_PORT_RETRY_COUNT, 0 },
+    [PWL_STATUS_WAIT_AT_PORT_RETRY_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, WAIT_AT_PORT_RETRY_COUNT, 0 },
+    [PWL_STATUS_FW_UPDATE_RETRY_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, FW_UPDATE_RETRY_COUNT, 0 },
+    [PWL_STATUS_DO_HW_RESET_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, DO_HW_RESET_COUNT, 0 },
+    [PWL_STATUS_NEED_RETRY_FW_UPDATE] = { PWL_STATUS_STORE_FW_UPDATE, NEED_RETRY_FW_UPDATE, 0 },
+    [PWL_STATUS_JP_FCC_CONFIG_COUNT] = { PWL_STATUS_STORE_FW_UPDATE, JP_FCC_CONFIG_COUNT, 0 },
+    [PWL_STATUS_BOOTUP_FAILURE_COUNT] = { PWL_STATUS_STORE_BOOTUP, BOOTUP_FAILURE_COUNT, 0 },
+    [PWL_STATUS_ESIM_ENABLE_STATE] = { PWL_STATUS_STORE_BOOTUP, ESIM_ENABLE_STATE, 1 },
+    // Last SIM whose EF_AD was read, the values only hold ints so the ICCID is hashed
+    [PWL_STATUS_SIM_ICCID_HASH] = { PWL_STATUS_STORE_BOOTUP, SIM_ICCID_HASH, 0 },
+    [PWL_STATUS_SIM_MNC_LENGTH] = { PWL_STATUS_STORE_BOOTUP, SIM_MNC_LENGTH, 0 },
+    [PWL_STATUS_ESIM_TESTPROFILE_DELETE_COUNTER] = { PWL_STATUS_STORE_ESIM_PROFILE_REMOVE, ESIM_TESTPROFILE_DELETE_COUNTER, 0 },
+    [PWL_STATUS_ESIM_TESTPROFILE_DELETE_DONE] = { PWL_STATUS_STORE_ESIM_PROFILE_REMOVE, ESIM_TESTPROFILE_DELETE_DONE, 0 },
+};
+
+gboolean pwl_status_init(pwl_status_store_t store);
+gboolean pwl_status_get(pwl_status_key_t key, gint *value);
+gboolean pwl_status_set(pwl_status_key_t key, gint value);
+void pwl_status_begin(pwl_status_store_t store);
+gboolean pwl_status_commit(pwl_status_store_t store);
+
+#endif
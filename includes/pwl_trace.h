@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_TRACE_H__
+#define __PWL_TRACE_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Flight recorder.
+ *
+ * Always on, unlike the pwl_record traffic recorder. All daemons append fixed
+ * size events to one ring in shared memory, the oldest events are overwritten.
+ * Appending takes a slot with an atomic increment and needs no lock or system
+ * call. pwl_trace_dump() writes the ring to PWL_TRACE_DUMP_DIR, fwupdate does
+ * that when an update fails and every daemon when it crashes. A dump is a
+ * pwl_trace_dump_header_t followed by the pwl_trace_buffer_t, pwl_replay
+ * prints it. Timestamps are CLOCK_MONOTONIC.
+ */
+
+#define PWL_TRACE_SHM_PATH              "/pwl_trace"
+#define PWL_TRACE_MAGIC                 0x50574c54 // "PWLT"
+#define PWL_TRACE_VERSION               1
+#define PWL_TRACE_EVENTS                4096    // power of 2
+#define PWL_TRACE_TEXT_LEN              40
+#define PWL_TRACE_DUMP_DIR              "/opt/pwl/trace"
+#define PWL_TRACE_MAX_DUMPS             10
+#define PWL_TRACE_DUMP_INTERVAL_SEC     10      // one dump per failure, not one per error path
+
+typedef enum {
+    PWL_TRACE_IPC_SEND,     // id: cid, value: status
+    PWL_TRACE_IPC_RECV,
+    PWL_TRACE_AT_CMD,
+    PWL_TRACE_AT_RESP,
+    PWL_TRACE_MBIM_CMD,
+    PWL_TRACE_MBIM_RESP,
+    PWL_TRACE_FASTBOOT_CMD, // id: command case
+    PWL_TRACE_FASTBOOT_RESP,// id: command case, value: result
+    PWL_TRACE_MODE,         // value: new state
+    PWL_TRACE_STATUS,       // text: status key, value: new value
+    PWL_TRACE_SLEEP,        // value: 1 suspend, 0 resume, text: coordinator step
+    PWL_TRACE_DUMP,         // text: reason
+    PWL_TRACE_WAIT,         // id: attempt, value: seconds, text: what the update waits for
+    PWL_TRACE_RETRY,        // id: attempt, or cid for a request, value: result, text: what failed
+    PWL_TRACE_TYPE_MAX
+} pwl_trace_type_t;
+
+static const gchar * const trace_type_name[] = {
+    [PWL_TRACE_IPC_SEND] = "SEND",
+    [PWL_TRACE_IPC_RECV] = "RECV",
+    [PWL_TRACE_AT_CMD] = "AT_CMD",
+    [PWL_TRACE_AT_RESP] = "AT_RESP",
+    [PWL_TRACE_MBIM_CMD] = "MBIM_CMD",
+    [PWL_TRACE_MBIM_RESP] = "MBIM_RESP",
+    [PWL_TRACE_FASTBOOT_CMD] = "FB_CMD",
+    [PWL_TRACE_FASTBOOT_RESP] = "FB_RESP",
+    [PWL_TRACE_MODE] = "MODE",
+    [PWL_TRACE_STATUS] = "STATUS",
+    [PWL_TRACE_SLEEP] = "SLEEP",
+    [PWL_TRACE_DUMP] = "DUMP",
+    [PWL_TRACE_WAIT] = "WAIT",
+    [PWL_TRACE_RETRY] = "RETRY",
+};
+
+typedef struct {
+    uint32_t            seq;        // sequence + 1 once written, 0 while being written
+    uint16_t            type;
+    uint16_t            source;     // PWL_MQ_ID_* of the daemon
+    uint64_t            timestamp_ns;
+    uint32_t            id;
+    int32_t             value;
+    char                text[PWL_TRACE_TEXT_LEN];
+} pwl_trace_event_t;
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            event_size;
+    uint32_t            events;
+    uint32_t            head;       // next sequence
+    uint8_t             reserved[48];
+    pwl_trace_event_t   ring[PWL_TRACE_EVENTS];
+} pwl_trace_buffer_t;
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            source;
+    uint64_t            realtime_ns;    // when the dump was taken
+    uint64_t            monotonic_ns;
+    char                reason[48];
+} pwl_trace_dump_header_t;
+
+gboolean pwl_trace_init(uint32_t source);
+void pwl_trace(pwl_trace_type_t type, uint32_t id, int32_t value, const char *text);
+gboolean pwl_trace_dump(const char *reason);
+
+#endif
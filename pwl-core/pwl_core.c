@@ -17,18 +17,26 @@
 
 #include <stdio.h>
 #include <sys/msg.h>
+#include <gio/gunixfdlist.h>
 
 #include "common.h"
 #include "dbus_common.h"
 #include "log.h"
+#include "pwl_device_db.h"
+#include "pwl_gpio.h"
+#include "pwl_ipc.h"
+#include "pwl_metrics.h"
+#include "pwl_module.h"
+#include "pwl_port.h"
+#include "pwl_record.h"
+#include "pwl_trace.h"
 #include "pwl_core.h"
 
-extern gchar* pcieid_info[];
-
 #define AUTOSUSPEND_DELAY_NODE_PATH     "/sys/bus/pci/devices/%s/power/autosuspend_delay_ms"
 #define AUTOSUSPEND_DELAY_VALUE         "5000"
 
 static gpointer mbim_device_thread(gpointer data);
+static void device_reopen(MbimDevice *dev);
 
 static GMainLoop *gp_loop;
 static pwlCore *gp_skeleton = NULL;
@@ -39,6 +47,22 @@ static MbimDevice *g_pci_device;
 static GCancellable *g_pci_cancellable;
 
 static gboolean gb_recoverying = FALSE;
+// Port hotplug and device caps wake up the recovery monitor
+static pthread_mutex_t g_recovery_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_recovery_cond = PTHREAD_COND_INITIALIZER;
+static gboolean g_recovery_event = FALSE;
+static gboolean g_caps_done = FALSE;
+static uint64_t g_mbim_wait_start_us = 0;   // start or resume, 0 once the device is open
+static gboolean g_system_sleeping = FALSE;  // under g_recovery_mutex
+static guint g_sleep_generation = 0;        // bumped on every suspend and resume
+
+// Suspend/resume coordinator
+static GDBusProxy *gp_login_proxy = NULL;
+static gint g_sleep_inhibit_fd = -1;
+static guint g_sleep_quiesce_source = 0;
+static uint64_t g_resume_start_us = 0;      // resume, 0 once the modem answered
+static gint g_reset_gpio = PWL_DEVICE_DB_GPIO_UNKNOWN;
+static gint g_gpio_reset_running = 0;
 
 // For GPIO reset
 // int g_check_fastboot_retry_count;
@@ -272,57 +296,13 @@ static void pci_device_new_cb(GObject *unused, GAsyncResult *res) {
 }
 
 gboolean find_mbim_port(gchar *port_buff_ptr, guint32 port_buff_size) {
-    FILE *fp = popen("find /dev/ -name wwan0mbim*", "r");
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("find port cmd error!!!");
-        return RET_FAILED;
-    }
-
-    char buffer[50];
-    memset(buffer, 0, sizeof(buffer));
-    char *ret = fgets(buffer, sizeof(buffer), fp);
-    pclose(fp);
-
-    buffer[strcspn(buffer, "\n")] = 0;
-
-    if ((strlen(buffer) + 1) > port_buff_size) {
-        PWL_LOG_ERR("port buffer size %d not enough!!!", port_buff_size);
-        return RET_FAILED;
-    }
-
-    if (strlen(buffer) <= 0)
-        return RET_FAILED;
-
-    strncpy(port_buff_ptr, buffer, strlen(buffer));
-
-    return RET_OK;
+    return pwl_port_get(PWL_PORT_MBIM, port_buff_ptr, port_buff_size) ? RET_OK : RET_FAILED;
 }
 
 gboolean find_abnormal_port(gchar *port_buff_ptr, guint32 port_buff_size) {
-    FILE *fp = popen("find /dev/ -name wwan0fastboot*", "r");
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("find port cmd error!!!");
-        return RET_FAILED;
-    }
-
-    char buffer[50];
-    memset(buffer, 0, sizeof(buffer));
-    char *ret = fgets(buffer, sizeof(buffer), fp);
-    pclose(fp);
-
-    buffer[strcspn(buffer, "\n")] = 0;
-
-    if ((strlen(buffer) + 1) > port_buff_size) {
-        PWL_LOG_ERR("port buffer size %d not enough!!!", port_buff_size);
-        return RET_FAILED;
-    }
-
-    if (strlen(buffer) <= 0)
+    if (!pwl_port_get(PWL_PORT_FASTBOOT, port_buff_ptr, port_buff_size))
         return RET_FAILED;
 
-    strncpy(port_buff_ptr, buffer, strlen(buffer));
     PWL_LOG_DEBUG("Found abnormal port: %s", port_buff_ptr);
     return RET_OK;
 }
@@ -369,20 +349,86 @@ void pci_mbim_device_deinit(void) {
     // g_ready_cb = NULL;
 }
 
+static void recovery_notify(gboolean *flag) {
+    pthread_mutex_lock(&g_recovery_mutex);
+    *flag = TRUE;
+    pthread_cond_broadcast(&g_recovery_cond);
+    pthread_mutex_unlock(&g_recovery_mutex);
+}
+
+// TRUE when the flag was raised before the timeout, the flag is consumed
+static gboolean recovery_wait(gboolean *flag, gint timeout_sec) {
+    struct timespec deadline;
+    gboolean raised;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_sec;
+    pthread_mutex_lock(&g_recovery_mutex);
+    while (!*flag) {
+        if (pthread_cond_timedwait(&g_recovery_cond, &g_recovery_mutex, &deadline) != 0)
+            break;
+    }
+    raised = *flag;
+    *flag = FALSE;
+    pthread_mutex_unlock(&g_recovery_mutex);
+    return raised;
+}
+
+// Parks the monitor while the host suspends. TRUE when the host suspended or
+// resumed since *generation, time spent asleep must not count as module downtime.
+static gboolean recovery_sleep_check(guint *generation) {
+    gboolean changed;
+
+    pthread_mutex_lock(&g_recovery_mutex);
+    // logind sends PrepareForSleep(false) after every suspend, failed ones included
+    while (g_system_sleeping)
+        pthread_cond_wait(&g_recovery_cond, &g_recovery_mutex);
+    changed = (*generation != g_sleep_generation);
+    *generation = g_sleep_generation;
+    pthread_mutex_unlock(&g_recovery_mutex);
+    return changed;
+}
+
+static void recovery_set_sleeping(gboolean sleeping) {
+    pthread_mutex_lock(&g_recovery_mutex);
+    g_system_sleeping = sleeping;
+    g_sleep_generation++;
+    // Wake a monitor waiting for a port event so it parks or rechecks
+    g_recovery_event = TRUE;
+    pthread_cond_broadcast(&g_recovery_cond);
+    pthread_mutex_unlock(&g_recovery_mutex);
+}
+
 static void device_caps_cb(MbimDevice *dev, GAsyncResult *res) {
     PWL_LOG_DEBUG("== Device Caps CB ===");
     g_autoptr(MbimMessage) response = NULL;
     g_autoptr(GError) error = NULL;
+    g_autofree gchar *out_custom_data_class = NULL;
     g_autofree gchar *out_device_id = NULL;
     g_autofree gchar *out_firmware_info = NULL;
     g_autofree gchar *out_hardware_info = NULL;
+    MbimDeviceType out_device_type = MBIM_DEVICE_TYPE_UNKNOWN;
+    MbimCellularClass out_cellular_class = 0;
+    MbimDataClass out_data_class = 0;
+    guint32 out_max_sessions = 0;
+    pwl_module_caps_t caps;
 
     response = mbim_device_command_finish(dev, res, &error);
 
-    mbim_message_device_caps_response_parse(response, NULL, NULL, NULL, NULL,
-                                            NULL, NULL, NULL, NULL, NULL,
-                                            &out_device_id, &out_firmware_info,
-                                            &out_hardware_info, &error);
+    if (response == NULL ||
+        !mbim_message_device_caps_response_parse(response, &out_device_type, &out_cellular_class, NULL, NULL,
+                                                 &out_data_class, NULL, NULL, &out_max_sessions,
+                                                 &out_custom_data_class, &out_device_id, &out_firmware_info,
+                                                 &out_hardware_info, &error)) {
+        PWL_LOG_ERR("Device caps query failed: %s", error ? error->message : "unknown");
+        recovery_notify(&g_caps_done);
+        if (g_resume_start_us && dev == g_device) {
+            // Session did not survive the suspend, reopen now instead of waiting for an error
+            PWL_LOG_ERR("MBIM device not answering after resume, reopen");
+            device_reopen(dev);
+        }
+        return;
+    }
 
     if (DEBUG) PWL_LOG_DEBUG("[device_id]: %s", out_device_id);
     if (DEBUG) PWL_LOG_DEBUG("[firmware_info]: %s", out_firmware_info);
@@ -395,6 +441,35 @@ static void device_caps_cb(MbimDevice *dev, GAsyncResult *res) {
             PWL_LOG_INFO("Device cap info responsed");
         }
     }
+
+    // Published for pref and fwupdate, they skip the AT version queries with it. Only caps
+    // that pass the check, the recovery thread takes published caps as a ready module.
+    if (!g_device_cap_check_pass) {
+        pwl_module_clear_caps();
+        recovery_notify(&g_caps_done);
+        return;
+    }
+    memset(&caps, 0, sizeof(caps));
+    caps.device_type = out_device_type;
+    caps.cellular_class = out_cellular_class;
+    caps.data_class = out_data_class;
+    caps.max_sessions = out_max_sessions;
+    g_strlcpy(caps.device_id, out_device_id ? out_device_id : "", sizeof(caps.device_id));
+    g_strlcpy(caps.firmware_info, out_firmware_info ? out_firmware_info : "", sizeof(caps.firmware_info));
+    g_strlcpy(caps.hardware_info, out_hardware_info ? out_hardware_info : "", sizeof(caps.hardware_info));
+    g_strlcpy(caps.custom_data_class, out_custom_data_class ? out_custom_data_class : "",
+              sizeof(caps.custom_data_class));
+    pwl_module_set_caps(&caps);
+    recovery_notify(&g_caps_done);
+
+    if (g_resume_start_us && dev == g_device) {
+        uint64_t elapsed_us = pwl_metrics_now() - g_resume_start_us;
+
+        g_resume_start_us = 0;
+        pwl_metrics_observe(PWL_METRIC_RESUME, 0, elapsed_us);
+        pwl_trace(PWL_TRACE_SLEEP, 0, 0, "modem ready");
+        PWL_LOG_INFO("Modem ready %llu ms after resume", (unsigned long long) elapsed_us / 1000);
+    }
 }
 
 static void pci_mbim_device_ready_cb() {
@@ -419,12 +494,16 @@ int check_module_info_v2() {
     int check_result;
     g_mode = MODE_DEVICE_CAP;
     g_device_cap_check_pass = FALSE;
+    pthread_mutex_lock(&g_recovery_mutex);
+    g_caps_done = FALSE;
+    pthread_mutex_unlock(&g_recovery_mutex);
     if (RET_FAILED == pci_mbim_device_init(pci_mbim_device_ready_cb)) {
         PWL_LOG_ERR("Module cap info check fail!");
         pci_mbim_device_deinit();
         return RET_FAILED;
     }
-    sleep(3);
+    // Answer or error of the caps query, whichever comes first
+    recovery_wait(&g_caps_done, TIMEOUT_SEC);
     // Check module cap info
     if (g_device_cap_check_pass) {
         PWL_LOG_DEBUG("Check module cap pass");
@@ -438,17 +517,7 @@ int check_module_info_v2() {
 }
 
 void send_message_queue(uint32_t cid) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
-
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_CORE;
-
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    pwl_ipc_request(PWL_MQ_ID_CORE, cid, NULL, FALSE);
 }
 
 static gboolean madpt_ready_method(pwlCore     *object,
@@ -490,13 +559,160 @@ static gboolean ready_to_fcc_unlock_method(pwlCore     *object,
 
 }
 
+static gboolean set_log_level_method(pwlCore *object, GDBusMethodInvocation *invocation, gint level) {
+    // Shared by all services
+    if (pwl_log_set_level(level) != RET_OK) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                              "Invalid log level %d", level);
+        return TRUE;
+    }
+    PWL_LOG_INFO("Log level %d", level);
+    pwl_core_complete_set_log_level_method(object, invocation);
+    return TRUE;
+}
+
+// Retry counters live in the status files, refresh them before every export
+static gboolean metrics_export(gpointer data) {
+    GVariantBuilder counters;
+    gint value;
+
+    g_variant_builder_init(&counters, G_VARIANT_TYPE("a{si}"));
+    for (gint key = 0; key < PWL_STATUS_KEY_MAX; key++) {
+        if (pwl_status_get(key, &value)) {
+            pwl_metrics_set(PWL_METRIC_STATUS, key, value);
+            g_variant_builder_add(&counters, "{si}", status_key_info[key].name, value);
+        }
+    }
+    if (gp_skeleton) {
+        pwl_core_set_metrics(gp_skeleton, pwl_metrics_to_variant());
+        pwl_core_set_retry_counters(gp_skeleton, g_variant_builder_end(&counters));
+    } else {
+        g_variant_builder_clear(&counters);
+    }
+    pwl_metrics_write_textfile(PWL_METRICS_TEXTFILE_DIR);
+    return G_SOURCE_CONTINUE;
+}
+
+// Mirror the shared module state into the properties, the skeleton only emits
+// what changed and all of it in one PropertiesChanged
+static gboolean module_state_refresh(gpointer data) {
+    static uint32_t last_seq = 1;   // odd, never a published seq
+    pwl_module_snapshot_t snapshot;
+    uint32_t seq = pwl_module_seq();
+
+    if (gp_skeleton == NULL || seq == last_seq || !pwl_module_get_snapshot(&snapshot))
+        return G_SOURCE_CONTINUE;
+    last_seq = seq;
+
+    pwl_core_set_ap_version(gp_skeleton, snapshot.strings[PWL_MODULE_AP_VERSION]);
+    pwl_core_set_md_version(gp_skeleton, snapshot.strings[PWL_MODULE_MD_VERSION]);
+    pwl_core_set_op_version(gp_skeleton, snapshot.strings[PWL_MODULE_OP_VERSION]);
+    pwl_core_set_oem_version(gp_skeleton, snapshot.strings[PWL_MODULE_OEM_VERSION]);
+    pwl_core_set_dpv_version(gp_skeleton, snapshot.strings[PWL_MODULE_DPV_VERSION]);
+    pwl_core_set_sim_carrier(gp_skeleton, snapshot.strings[PWL_MODULE_SIM_CARRIER]);
+    pwl_core_set_preferred_carrier(gp_skeleton, snapshot.strings[PWL_MODULE_PREF_CARRIER]);
+    pwl_core_set_sku(gp_skeleton, snapshot.strings[PWL_MODULE_SKU]);
+    pwl_core_set_sim_state(gp_skeleton, snapshot.values[PWL_MODULE_SIM_STATE]);
+    pwl_core_set_device_type(gp_skeleton, snapshot.values[PWL_MODULE_DEVICE_TYPE]);
+    pwl_core_set_update_state(gp_skeleton, snapshot.values[PWL_MODULE_UPDATE_STATE]);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean get_module_state_method(pwlCore *object, GDBusMethodInvocation *invocation) {
+    pwl_module_snapshot_t snapshot;
+    GVariantBuilder builder;
+    GVariant *counters;
+
+    if (!pwl_module_get_snapshot(&snapshot)) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                              "Module state not available");
+        return TRUE;
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    for (gint key = 0; key < PWL_MODULE_STR_MAX; key++)
+        g_variant_builder_add(&builder, "{sv}", module_str_name[key], g_variant_new_string(snapshot.strings[key]));
+    for (gint key = 0; key < PWL_MODULE_INT_MAX; key++)
+        g_variant_builder_add(&builder, "{sv}", module_int_name[key], g_variant_new_int32(snapshot.values[key]));
+    counters = pwl_core_get_retry_counters(object);
+    g_variant_builder_add(&builder, "{sv}", "RetryCounters",
+                          counters ? counters : g_variant_new_array(G_VARIANT_TYPE("{si}"), NULL, 0));
+
+    pwl_core_complete_get_module_state_method(object, invocation, g_variant_builder_end(&builder));
+    return TRUE;
+}
+
+// Delay lock, logind holds a suspend back until it is closed (InhibitDelayMaxSec at most)
+static void sleep_inhibit_take() {
+    g_autoptr(GUnixFDList) fd_list = NULL;
+    g_autoptr(GVariant) result = NULL;
+    g_autoptr(GError) error = NULL;
+    gint32 index;
+
+    if (gp_login_proxy == NULL || g_sleep_inhibit_fd >= 0)
+        return;
+
+    result = g_dbus_proxy_call_with_unix_fd_list_sync(gp_login_proxy, "Inhibit",
+                 g_variant_new("(ssss)", "sleep", "pwl_core", "Quiesce modem requests", "delay"),
+                 G_DBUS_CALL_FLAGS_NONE, -1, NULL, &fd_list, NULL, &error);
+    if (result == NULL) {
+        PWL_LOG_ERR("Sleep inhibit failed: %s", error->message);
+        return;
+    }
+    g_variant_get(result, "(h)", &index);
+    g_sleep_inhibit_fd = g_unix_fd_list_get(fd_list, index, &error);
+    if (g_sleep_inhibit_fd < 0)
+        PWL_LOG_ERR("Sleep inhibit fd failed: %s", error->message);
+}
+
+static void sleep_inhibit_release() {
+    if (g_sleep_quiesce_source) {
+        g_source_remove(g_sleep_quiesce_source);
+        g_sleep_quiesce_source = 0;
+    }
+    if (g_sleep_inhibit_fd >= 0) {
+        close(g_sleep_inhibit_fd);
+        g_sleep_inhibit_fd = -1;
+    }
+}
+
+static gboolean sleep_quiesce_timeout(gpointer data) {
+    PWL_LOG_ERR("Madpt not quiesced in %ds, suspend anyway", PWL_SLEEP_QUIESCE_TIMEOUT_SEC);
+    g_sleep_quiesce_source = 0;
+    sleep_inhibit_release();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean sleep_ready_method(pwlCore *object, GDBusMethodInvocation *invocation) {
+    // Late answers after the timeout or a resume are ignored
+    if (g_sleep_quiesce_source) {
+        PWL_LOG_INFO("Madpt quiesced, release sleep inhibitor");
+        pwl_trace(PWL_TRACE_SLEEP, 0, 1, "quiesced");
+        sleep_inhibit_release();
+    }
+    pwl_core_complete_sleep_ready_method(object, invocation);
+    return TRUE;
+}
+
+// Rate limited by pwl_fwupdate already, only forwarded
+static gboolean update_progress_method(pwlCore *object, GDBusMethodInvocation *invocation,
+                                       gint percent, const gchar *phase, guint64 bytes_per_sec, gint eta_sec) {
+    pwl_core_emit_update_progress(gp_skeleton, percent, phase, bytes_per_sec, eta_sec);
+    pwl_core_complete_update_progress_method(object, invocation);
+    return TRUE;
+}
+
 static gboolean gpio_reset_method(pwlCore     *object,
                            GDBusMethodInvocation *invocation) {
     get_fw_update_status_value(DO_HW_RESET_COUNT, &g_do_hw_reset_count);
     if (g_do_hw_reset_count <= HW_RESET_RETRY_TH) {
         g_do_hw_reset_count++;
         set_fw_update_status_value(DO_HW_RESET_COUNT, g_do_hw_reset_count);
-        hw_reset();
+        // Waits for the module to come back, keep the main loop running meanwhile
+        if (g_atomic_int_compare_and_exchange(&g_gpio_reset_running, 0, 1))
+            g_thread_new("gpio_reset_thread", gpio_reset_thread_func, NULL);
+        else
+            PWL_LOG_INFO("GPIO reset already running");
     } else {
         PWL_LOG_ERR("Reached HW reset retry limit!!! (%d,%d)", g_fw_update_retry_count, g_do_hw_reset_count);
     }
@@ -546,186 +762,80 @@ int show_gpio_reset_failed() {
     }
 }
 
+// Pulse the reset line, then restart madpt as soon as the module re-enumerated
 static gboolean hw_reset() {
     PWL_LOG_DEBUG("!!=== Do GPIO reset ===!!");
-    int ret = 0;
-    FILE *fp = NULL;
-    char system_cmd[128];
-    char SKU_id[16];
-    int search_array_len = sizeof(g_skuid_to_gpio) / sizeof(s_skuid_to_gpio);
-    int i = 0;
-    int gpio;
-
-    // Check gpio export exist
-    if(0 == access("/sys/class/gpio/export", F_OK)) {
-        PWL_LOG_DEBUG("/sys/class/gpio/export exists");
-    } else {
-        PWL_LOG_DEBUG("/sys/class/gpio/export does not exist");
-        return -1;
-    }
-
-    // Get SKU ID
-    sprintf(system_cmd, "dmidecode -t 1 | grep SKU | awk -F ' ' '{print$3}'");
-    fp = popen(system_cmd, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("[GPIO] gpio init system_cmd dmidecode error");
-        return -1;
-    }
+    uint64_t start_us;
 
-    while (fgets(SKU_id, sizeof(SKU_id), fp) != NULL) {
-        SKU_id[strcspn(SKU_id, "\n")] = 0;
-        PWL_LOG_DEBUG("[GPIO] gpio reset SKU_id: %s", SKU_id);
-    }
-    pclose(fp);
-    fp = NULL;
-
-    for (i = 0; i < search_array_len; ++i){
-        if(strstr(SKU_id, g_skuid_to_gpio[i].skuid) == NULL){
-            continue;
-        }else{
-            gpio = g_skuid_to_gpio[i].gpio;
-            break;
-        }
-    }
-
-    if(i == search_array_len){
-        PWL_LOG_ERR("[GPIO] gpio reset don't find skuid form table");
-        return -1;
-    }
-
-    if (gpio == -1) {
-        PWL_LOG_ERR("[GPIO] GPIO not support yet, abort!");
-        show_gpio_reset_failed();
-        return -1;
+    if (!pwl_gpio_ready() && gpio_init() != 0) {
+        if (g_reset_gpio == PWL_DEVICE_DB_GPIO_UNSUPPORTED)
+            show_gpio_reset_failed();
+        return FALSE;
     }
 
+    start_us = pwl_metrics_now();
     // Disable gpio
-    if (set_gpio_status(0, gpio) != 0) {
+    if (!pwl_gpio_set(0)) {
         PWL_LOG_ERR("[GPIO] Disable GPIO error");
-        return -1;
+        return FALSE;
     }
-    sleep(1);
+    g_usleep(GPIO_RESET_HOLD_MS * 1000);
 
     // Enable gpio
-    if (set_gpio_status(1, gpio) != 0) {
+    if (!pwl_gpio_set(1)) {
         PWL_LOG_ERR("[GPIO] Enable GPIO error");
-        return -1;
+        return FALSE;
+    }
+
+    if (!pwl_port_wait(PWL_PORT_MBIM, FALSE, GPIO_RESET_DETACH_SEC)) {
+        PWL_LOG_ERR("[GPIO] MBIM port still there %ds after reset", GPIO_RESET_DETACH_SEC);
+    } else if (!pwl_port_wait(PWL_PORT_MBIM, TRUE, GPIO_RESET_ENUM_SEC)) {
+        PWL_LOG_ERR("[GPIO] MBIM port not back %ds after reset", GPIO_RESET_ENUM_SEC);
+    } else {
+        pwl_metrics_observe_since(PWL_METRIC_GPIO_RESET, 0, start_us);
+        PWL_LOG_INFO("[GPIO] Module back %llu ms after reset",
+                     (unsigned long long) (pwl_metrics_now() - start_us) / 1000);
     }
 
     // restart madpt for module port init
-    sleep(5);
     send_message_queue(PWL_CID_MADPT_RESTART);
 
     return TRUE;
 }
 
-int set_gpio_status(int enable, int gpio) {
-    FILE *fp = NULL;
-    char gpio_cmd[64] = {0};
-
-    if (enable == 1 || enable == 0) {
-        sprintf(gpio_cmd, "echo %d > /sys/class/gpio/gpio%d/value", enable, gpio);
-    } else {
-        PWL_LOG_ERR("gpio incorrect value %d", enable);
-        return -1;
-    }
-
-    if (DEBUG) PWL_LOG_DEBUG("[GPIO] gpio_cmd: %s", gpio_cmd);
-    fp = popen(gpio_cmd, "w");
-    if (fp == NULL) {
-        PWL_LOG_DEBUG("gpio cmd error");
-        return -1;
-    }
-
-    pclose(fp);
-    fp = NULL;
-    return 0;
+static gpointer gpio_reset_thread_func(gpointer data) {
+    hw_reset();
+    g_atomic_int_set(&g_gpio_reset_running, 0);
+    return NULL;
 }
 
+// SKU to reset line once, the line stays requested for later resets
 int gpio_init() {
-    FILE *fp = NULL;
-    char system_cmd[64] = {0};
     char SKU_id[16];
-    char gpio_path[64] = {0};
-    int search_array_len = sizeof(g_skuid_to_gpio) / sizeof(s_skuid_to_gpio);
-    int i, gpio;
-    int ret = -1;
-
-    // Check gpio export exist
-    if (0 == access("/sys/class/gpio/export", F_OK)) {
-        PWL_LOG_ERR("/sys/class/gpio/export exists");
-    } else {
-        PWL_LOG_ERR("/sys/class/gpio/export does not exist");
-        return -1;
-    }
+    const pwl_ssid_info_t *info;
 
     // Get SKU ID
-    sprintf(system_cmd, "dmidecode -t 1 | grep SKU | awk -F ' ' '{print$3}'");
-    fp = popen(system_cmd, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("[GPIO] gpio init system_cmd dmidecode error");
-        return -1;
-    }
-
-    while (fgets(SKU_id, sizeof(SKU_id), fp) != NULL) {
-        SKU_id[strcspn(SKU_id, "\n")] = 0;
-        PWL_LOG_DEBUG("[GPIO] gpio init SKU_id: %s", SKU_id);
-    }
-    pclose(fp);
-    fp = NULL;
+    pwl_get_skuid(SKU_id, sizeof(SKU_id));
+    PWL_LOG_DEBUG("[GPIO] gpio init SKU_id: %s", SKU_id);
 
-    for (i = 0; i < search_array_len; ++i) {
-        if (strstr(SKU_id, g_skuid_to_gpio[i].skuid) == NULL) {
-            continue;
-        } else {
-            gpio = g_skuid_to_gpio[i].gpio;
-            break;
-        }
-    }
-
-    if (gpio == -1) {
-        PWL_LOG_ERR("[GPIO] gpio not support yet, abort!");
-        return -1;
-    }
-
-    if (i == search_array_len) {
+    info = pwl_device_db_find_ssid(SKU_id);
+    if (info == NULL || (info->gpio == PWL_DEVICE_DB_GPIO_UNKNOWN && info->gpio_chip == NULL)) {
         PWL_LOG_ERR("[GPIO] gpio init don't find skuid form table");
         return -1;
     }
+    g_reset_gpio = info->gpio;
 
-    if (DEBUG) PWL_LOG_DEBUG("[GPIO] SKU ID: %s, GPIO: %d", SKU_id, gpio);
-
-    // Export gpio and enable
-    memset(gpio_path, 0, sizeof(gpio_path));
-    sprintf(gpio_path, "/sys/class/gpio/gpio%d", gpio);
-
-    if (0 == access(gpio_path, F_OK)) {
-        PWL_LOG_DEBUG("[GPIO] GPIO already export, continue init process.");
-    } else {
-        PWL_LOG_DEBUG("[GPIO] GPIO not export yet, start export %d", gpio);
-        sprintf(system_cmd, "echo %d > /sys/class/gpio/export", gpio);
-        fp = popen(system_cmd, "w");
-        if (fp == NULL) {
-            PWL_LOG_ERR("[GPIO] gpio init system_cmd gpio export error");
-            return -1;
-        }
-        pclose(fp);
-        fp = NULL;
-    }
-
-    sprintf(system_cmd, "echo out > /sys/class/gpio/gpio%d/direction", gpio);
-    if (DEBUG) PWL_LOG_DEBUG("[GPIO] system_cmd: %s", system_cmd);
-    fp = popen(system_cmd, "w");
-    if (fp == NULL) {
-        PWL_LOG_ERR("[GPIO] gpio init system_cmd set gpio direction error");
+    if (g_reset_gpio == PWL_DEVICE_DB_GPIO_UNSUPPORTED) {
+        PWL_LOG_ERR("[GPIO] gpio not support yet, abort!");
         return -1;
     }
-    pclose(fp);
-    fp = NULL;
 
-    // Enable GPIO
-    if (set_gpio_status(1, gpio) != 0) {
-        PWL_LOG_ERR("[GPIO] gpio init system_cmd gpio value error");
+    if (DEBUG) PWL_LOG_DEBUG("[GPIO] SKU ID: %s, GPIO: %d, chip: %s, line: %d", SKU_id, g_reset_gpio,
+                             info->gpio_chip ? info->gpio_chip : "-", info->gpio_line);
+
+    // Request the line as output and enable
+    if (!pwl_gpio_init(info->gpio_chip, info->gpio_line, g_reset_gpio)) {
+        PWL_LOG_ERR("[GPIO] gpio init request reset line error");
         return -1;
     }
     return 0;
@@ -745,6 +855,10 @@ static void bus_acquired_hdl(GDBusConnection *connection,
     (void) g_signal_connect(gp_skeleton, "handle-request-fw-update-check-method", G_CALLBACK(request_fw_update_check), NULL);
     (void) g_signal_connect(gp_skeleton, "handle-ready-to-fcc-unlock-method", G_CALLBACK(ready_to_fcc_unlock_method), NULL);
     (void) g_signal_connect(gp_skeleton, "handle-gpio-reset-method", G_CALLBACK(gpio_reset_method), NULL);
+    (void) g_signal_connect(gp_skeleton, "handle-update-progress-method", G_CALLBACK(update_progress_method), NULL);
+    (void) g_signal_connect(gp_skeleton, "handle-set-log-level-method", G_CALLBACK(set_log_level_method), NULL);
+    (void) g_signal_connect(gp_skeleton, "handle-get-module-state-method", G_CALLBACK(get_module_state_method), NULL);
+    (void) g_signal_connect(gp_skeleton, "handle-sleep-ready-method", G_CALLBACK(sleep_ready_method), NULL);
     //(void) g_signal_connect(gp_skeleton, "handle-request-retry-fw-update-method", G_CALLBACK(request_retry_fw_update_method), NULL);
 
     /** Fourth step: Export interface skeleton. */
@@ -779,15 +893,17 @@ static void name_lost_hdl(GDBusConnection *connection,
 
 static void subscriber_ready_status_update(MbimDevice *dev, MbimMessage *message) {
     MbimSubscriberReadyState ready_state;
+    g_autofree gchar *subscriber_id = NULL;
+    g_autofree gchar *sim_iccid = NULL;
     gboolean success = FALSE;
 
     if (mbim_device_check_ms_mbimex_version(dev, 3, 0)) {
         success = mbim_message_ms_basic_connect_v3_subscriber_ready_status_notification_parse(
-                  message, &ready_state, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+                  message, &ready_state, NULL, &subscriber_id, &sim_iccid, NULL, NULL, NULL, NULL);
         if (!success) return;
     } else {
         success = mbim_message_subscriber_ready_status_notification_parse(
-                  message, &ready_state, NULL, NULL, NULL, NULL, NULL, NULL);
+                  message, &ready_state, &subscriber_id, &sim_iccid, NULL, NULL, NULL, NULL);
         if (!success) return;
     }
 
@@ -825,7 +941,11 @@ static void subscriber_ready_status_update(MbimDevice *dev, MbimMessage *message
         break;
     }
 
+    pwl_module_set_int(PWL_MODULE_SIM_STATE, state);
     pwl_core_emit_subscriber_ready_state_change(gp_skeleton, state);
+    // IMSI and ICCID are only filled in once the SIM is initialized
+    pwl_core_emit_subscriber_identity_change(gp_skeleton, state, subscriber_id ? subscriber_id : "",
+                                             sim_iccid ? sim_iccid : "");
 }
 
 static void register_state_update(MbimDevice *dev, MbimMessage *message) {
@@ -913,21 +1033,26 @@ static void device_close() {
     g_clear_object(&g_device);
 }
 
-static void mbim_device_error_cb(MbimDevice *dev, GError *error) {
-    if (g_error_matches(error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
-        PWL_LOG_ERR("device error %s", mbim_device_get_path(dev));
-        mbim_device_close_force(dev, NULL);
+static void device_reopen(MbimDevice *dev) {
+    mbim_device_close_force(dev, NULL);
+    pwl_module_clear_caps();
 
-        if (g_cancellable)
-            g_object_unref(g_cancellable);
-        if (g_device)
-            g_object_unref(g_device);
+    if (g_cancellable)
+        g_object_unref(g_cancellable);
+    if (g_device)
+        g_object_unref(g_device);
 
-        g_cancellable = NULL;
-        g_device = NULL;
+    g_cancellable = NULL;
+    g_device = NULL;
 
-        // retry
-        GThread *mbim_thread = g_thread_new("mbim_thread", mbim_device_thread, NULL);
+    // retry
+    GThread *mbim_thread = g_thread_new("mbim_thread", mbim_device_thread, NULL);
+}
+
+static void mbim_device_error_cb(MbimDevice *dev, GError *error) {
+    if (g_error_matches(error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
+        PWL_LOG_ERR("device error %s", mbim_device_get_path(dev));
+        device_reopen(dev);
     }
 }
 
@@ -937,6 +1062,9 @@ static void mbim_device_removed_cb(MbimDevice *dev) {
     g_signal_handlers_disconnect_by_func(dev, mbim_device_error_cb, NULL);
     g_signal_handlers_disconnect_by_func(dev, mbim_device_removed_cb, NULL);
     pwl_core_emit_subscriber_ready_state_change(gp_skeleton, PWL_SIM_STATE_NOT_INSERTED);
+    pwl_core_emit_subscriber_identity_change(gp_skeleton, PWL_SIM_STATE_NOT_INSERTED, "", "");
+    pwl_module_set_int(PWL_MODULE_SIM_STATE, PWL_SIM_STATE_NOT_INSERTED);
+    pwl_module_clear_caps();
     device_close();
 
     if (g_cancellable)
@@ -977,6 +1105,10 @@ static void device_open_cb(MbimDevice *dev, GAsyncResult *res) {
     }
 
     PWL_LOG_DEBUG("MBIM Device %s opened.", mbim_device_get_path_display(dev));
+    if (g_mbim_wait_start_us) {
+        pwl_metrics_observe_since(PWL_METRIC_MBIM_READY, 0, g_mbim_wait_start_us);
+        g_mbim_wait_start_us = 0;
+    }
 
     g_signal_connect(g_device, MBIM_DEVICE_SIGNAL_REMOVED,
                      G_CALLBACK(mbim_device_removed_cb), NULL);
@@ -986,6 +1118,10 @@ static void device_open_cb(MbimDevice *dev, GAsyncResult *res) {
 
     g_signal_connect(g_device, MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
                      G_CALLBACK(mbim_indication_cb), NULL);
+
+    // Firmware may have changed since the last open
+    g_autoptr(MbimMessage) message = mbim_message_device_caps_query_new(NULL);
+    mbim_device_command(g_device, message, 10, NULL, (GAsyncReadyCallback)device_caps_cb, NULL);
 }
 
 
@@ -1032,99 +1168,158 @@ static gpointer mbim_device_thread(gpointer data) {
     return ((void*)0);
 }
 
-static gpointer mbim_monitor_thread_func(gpointer data) {
-    //TODO: Check better way to check device ready
-    PWL_LOG_DEBUG("Sleep %ds wait to device", PWL_RECOVERY_CHECK_DELAY_SEC);
-    sleep(PWL_RECOVERY_CHECK_DELAY_SEC);
+static void recovery_port_event_cb(pwl_port_type_t type, const gchar *path, gboolean added, gpointer user_data) {
+    if (added && (type == PWL_PORT_MBIM || type == PWL_PORT_FASTBOOT))
+        recovery_notify(&g_recovery_event);
+}
 
-    gb_recoverying = TRUE;
+static void recovery_notify_ready() {
+    // Check module ok, clear bootup failure count to 0 than idle
+    g_bootup_failure_count = 0;
+    set_bootup_status_value(BOOTUP_FAILURE_COUNT, g_bootup_failure_count);
+    PWL_LOG_DEBUG("Check module pass!");
+    PWL_LOG_DEBUG("Notify fwupdate start extract flz and check for update");
+
+    // Notice pref to update fw version
+    PWL_LOG_INFO("Notify pref to update fw version");
+    pwl_core_emit_get_fw_version_signal(gp_skeleton);
+    pwl_core_emit_notice_module_recovery_finish(gp_skeleton, PCIE_UPDATE_BASE_FLZ);
+}
 
+static void recovery_notify_flash() {
+    // Check if flash data folder exist
+    if (access(UPDATE_FW_FOLDER_FILE, F_OK) == 0 ||
+        access(UPDATE_DEV_FOLDER_FILE, F_OK) == 0) {
+        // Notice pref to update fw version
+        PWL_LOG_INFO("Notify pref to update fw version");
+        pwl_core_emit_get_fw_version_signal(gp_skeleton);
+        pwl_core_emit_notice_module_recovery_finish(gp_skeleton, PCIE_UPDATE_BASE_FLASH_FOLDER);
+    } else {
+        PWL_LOG_DEBUG("Flash data folder not exist, in to idle");
+    }
+}
+
+// Checks again on every port event. Escalates rescan -> hw reset -> flash
+// recovery only when the module stays without a usable port for the whole wait.
+static gpointer mbim_monitor_thread_func(gpointer data) {
+    uint64_t start_us = pwl_metrics_now();
+    gint caps_retry_sec = RECOVERY_CAPS_RETRY_MIN_SEC;
+    gboolean hw_reset_done = FALSE;
+    guint sleep_generation = 0;
+    time_t deadline;
+    guint subscription;
+    pwl_module_caps_t caps;
     gchar port [20];
-    memset(port, 0, sizeof(port));
+
+    gb_recoverying = TRUE;
+    subscription = pwl_port_subscribe(recovery_port_event_cb, NULL);
+    // Grace period for a module that is still booting
+    deadline = time(NULL) + PWL_RECOVERY_CHECK_DELAY_SEC;
 
     while (TRUE) {
+        // No probing across a suspend, the module gets the whole wait again after resume
+        if (recovery_sleep_check(&sleep_generation))
+            deadline = MAX(deadline, time(NULL) + RECOVERY_RESET_WAIT_SEC);
+
+        memset(port, 0, sizeof(port));
         if (find_mbim_port(port, sizeof(port)) == RET_OK) {
-            // Found MBIM port, try to get module cap info
-            if (check_module_info_v2() == RET_OK) {
-                // Check module ok, clear bootup failure count to 0 than idle
-                g_bootup_failure_count = 0;
-                set_bootup_status_value(BOOTUP_FAILURE_COUNT, g_bootup_failure_count);
-                PWL_LOG_DEBUG("Check module pass!");
-                PWL_LOG_DEBUG("Notify fwupdate start extract flz and check for update");
-
-                // Notice pref to update fw version
-                PWL_LOG_INFO("Notify pref to update fw version");
-                pwl_core_emit_get_fw_version_signal(gp_skeleton);
-                pwl_core_emit_notice_module_recovery_finish(gp_skeleton, PCIE_UPDATE_BASE_FLZ);
+            // Caps already read when the main MBIM device opened, only published when they passed
+            // the check, else ask once
+            if (pwl_module_get_caps(&caps) || check_module_info_v2() == RET_OK) {
+                recovery_notify_ready();
                 break;
             }
-        }
-        // Check if module in abnormal state
-        memset(port, 0, sizeof(port));
-        if (find_abnormal_port(port, sizeof(port)) == RET_OK) {
+        } else if (find_abnormal_port(port, sizeof(port)) == RET_OK) {
             // Module in abnormal state, check if hw reset
             g_bootup_failure_count++;
             set_bootup_status_value(BOOTUP_FAILURE_COUNT, g_bootup_failure_count);
             if (g_bootup_failure_count <= g_bootup_failure_limit) {
                 // Bootup Failure < Max failure, do hw reset
                 PWL_LOG_DEBUG("Do flash recovery check");
-
-                // Check if flash data folder exist
-                if (access(UPDATE_FW_FOLDER_FILE, F_OK) == 0 ||
-                    access(UPDATE_DEV_FOLDER_FILE, F_OK) == 0) {
-                    // Notice pref to update fw version
-                    PWL_LOG_INFO("Notify pref to update fw version");
-                    pwl_core_emit_get_fw_version_signal(gp_skeleton);
-                    pwl_core_emit_notice_module_recovery_finish(gp_skeleton, PCIE_UPDATE_BASE_FLASH_FOLDER);
-                } else {
-                    PWL_LOG_DEBUG("Flash data folder not exist, in to idle");
-                }
-                break;
+                recovery_notify_flash();
             } else {
                 // Bootup Failure >= Max failure, into idle
                 PWL_LOG_DEBUG("Bootup Failure count reach max count, in to idle");
-                break;
             }
-        } else {
-            // Can't found mbim and abnormal port, do re-scan
-            g_rescan_failure_count++;
-            PWL_LOG_DEBUG("Rescan failure count: %d", g_rescan_failure_count);
-            if (g_rescan_failure_count <= MAX_RESCAN_FAILURE) {
-                PWL_LOG_DEBUG("Do re-scan");
-                do_pci_hw_reset(DEVICE_HW_RESCAN);
+            break;
+        }
+
+        if (time(NULL) < deadline) {
+            // Port up but caps not answered yet: retry with backoff, else sleep until a port shows up
+            if (port[0] != '\0') {
+                recovery_wait(&g_recovery_event, caps_retry_sec);
+                caps_retry_sec = MIN(caps_retry_sec * 2, RECOVERY_CAPS_RETRY_MAX_SEC);
             } else {
-                // Rescan failure >= Max Failure, do hw reset
-                PWL_LOG_DEBUG("Rescan count reach max limit, do flash recovery check.");
-                // Check if flash data folder exist
-                if (access(UPDATE_FW_FOLDER_FILE, F_OK) == 0 ||
-                    access(UPDATE_DEV_FOLDER_FILE, F_OK) == 0) {
-                    // Notice pref to update fw version
-                    PWL_LOG_INFO("Notify pref to update fw version");
-                    pwl_core_emit_get_fw_version_signal(gp_skeleton);
-                    pwl_core_emit_notice_module_recovery_finish(gp_skeleton, PCIE_UPDATE_BASE_FLASH_FOLDER);
-                } else {
-                    PWL_LOG_DEBUG("Flash data folder not exist, in to idle");
-                }
-                break;
+                recovery_wait(&g_recovery_event, MAX(1, deadline - time(NULL)));
             }
+            continue;
+        }
+
+        // Stuck for the whole wait, escalate one step
+        caps_retry_sec = RECOVERY_CAPS_RETRY_MIN_SEC;
+        if (g_rescan_failure_count < MAX_RESCAN_FAILURE) {
+            g_rescan_failure_count++;
+            pwl_metrics_add(PWL_METRIC_RESCAN_FAILURE, 0, 1);
+            PWL_LOG_DEBUG("Rescan failure count: %d, do re-scan", g_rescan_failure_count);
+            do_pci_hw_reset(DEVICE_HW_RESCAN);
+        } else if (!hw_reset_done) {
+            hw_reset_done = TRUE;
+            PWL_LOG_DEBUG("Rescan count reach max limit, do hw reset");
+            do_pci_hw_reset(DEVICE_HW_RESET);
+        } else {
+            PWL_LOG_DEBUG("Module still not ready after hw reset, do flash recovery check.");
+            recovery_notify_flash();
+            break;
         }
+        deadline = time(NULL) + RECOVERY_RESET_WAIT_SEC;
     }
+    pwl_port_unsubscribe(subscription);
     gb_recoverying = FALSE;
+    pwl_metrics_observe_since(PWL_METRIC_RECOVERY, 0, start_us);
 
     return ((void*)0);
 }
 
+// One caps query tells whether the MBIM session survived, device_caps_cb
+// reports the time to the first answer or reopens the device
+static void resume_probe() {
+    g_autoptr(MbimMessage) message = NULL;
+
+    if (g_device == NULL || !mbim_device_is_open(g_device)) {
+        // Reopen already running, device_open_cb queries the caps once it is done
+        g_mbim_wait_start_us = g_resume_start_us;
+        return;
+    }
+    message = mbim_message_device_caps_query_new(NULL);
+    mbim_device_command(g_device, message, PWL_CMD_TIMEOUT_SEC, NULL,
+                        (GAsyncReadyCallback)device_caps_cb, NULL);
+}
+
 static void prepare_for_sleep_handler(GDBusProxy *proxy, const gchar *sendername,
                                       const gchar *signalname, GVariant *args,
                                       gpointer data) {
     if (strcmp(signalname, "PrepareForSleep") == 0) {
         gboolean suspend;
         g_variant_get(args, "(b)", &suspend);
+        pwl_trace(PWL_TRACE_SLEEP, 0, suspend, NULL);
 
         if (suspend) {
             PWL_LOG_INFO("Host system about to suspend");
+            recovery_set_sleeping(TRUE);
+            // Madpt lets its AT request in flight finish and answers with SleepReadyMethod
+            pwl_core_emit_sleep_state_change(gp_skeleton, TRUE);
+            if (g_sleep_inhibit_fd >= 0 && g_sleep_quiesce_source == 0)
+                g_sleep_quiesce_source = g_timeout_add_seconds(PWL_SLEEP_QUIESCE_TIMEOUT_SEC,
+                                                               sleep_quiesce_timeout, NULL);
         } else {
             PWL_LOG_INFO("Host system resuming");
+            g_resume_start_us = pwl_metrics_now();
+            sleep_inhibit_release();
+            recovery_set_sleeping(FALSE);
+            // Madpt re-arms its MBIM session while we probe ours
+            pwl_core_emit_sleep_state_change(gp_skeleton, FALSE);
+            resume_probe();
+            sleep_inhibit_take();
         }
     }
 }
@@ -1153,33 +1348,19 @@ void suspend_monitor_init() {
     }
 
     g_signal_connect(proxy, "g-signal", G_CALLBACK(prepare_for_sleep_handler), NULL);
+    gp_login_proxy = proxy;
+    sleep_inhibit_take();
 }
 
 void update_autosuspend_delay() {
-    gchar *command = "lspci -D -n | grep ";
-    if (DEBUG) PWL_LOG_DEBUG("pcieid_info[0]: %s", pcieid_info[0]);
-
-    gchar cmd[strlen(command) + strlen(pcieid_info[0]) + 1];
-    memset(cmd, 0, sizeof(cmd));
-    sprintf(cmd, "%s%s", command, pcieid_info[0]);
+    const pwl_modem_id_t *id = pwl_device_db_autosuspend_id();
+    gchar domain[32];
 
-    FILE *fp = popen(cmd, "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("device id check cmd error!!!");
-    }
-
-    char response[200];
-    memset(response, 0, sizeof(response));
-    char *ret = fgets(response, sizeof(response), fp);
-
-    pclose(fp);
-
-    if (ret != NULL && strlen(response) > 0) {
-        const char s[2] = " ";
-        char *domain;
-        domain = strtok(response, s);
-        if (!domain) return;
+    if (id == NULL)
+        return;
+    if (DEBUG) PWL_LOG_DEBUG("autosuspend device id: %s", id->id);
 
+    if (pwl_find_pcie_device(id->id, domain, sizeof(domain))) {
         char node_path[strlen(AUTOSUSPEND_DELAY_NODE_PATH) + 20];
         memset(node_path, 0, sizeof(node_path));
         sprintf(node_path, AUTOSUSPEND_DELAY_NODE_PATH, domain);
@@ -1196,7 +1377,15 @@ void update_autosuspend_delay() {
 }
 
 gint main() {
+    pwl_log_init();
     PWL_LOG_INFO("start");
+    pwl_record_init(PWL_MQ_ID_CORE);
+    pwl_trace_init(PWL_MQ_ID_CORE);
+    pwl_metrics_init();
+    // Caps of a previous run may be from another firmware, read again at MBIM open
+    pwl_module_init();
+    pwl_module_clear_caps();
+    g_mbim_wait_start_us = pwl_metrics_now();
 
     GThread *mbim_thread = g_thread_new("mbim_thread", mbim_device_thread, NULL);
 
@@ -1219,7 +1408,11 @@ gint main() {
         get_fw_update_status_value(NEED_RETRY_FW_UPDATE, &g_need_retry_fw_update);
     }
 
-    pwl_device_type_t type = pwl_get_device_type_await();
+    pwl_device_type_t type = pwl_publish_device_identity();
+    gchar skuid[PWL_MAX_SKUID_SIZE];
+    pwl_get_skuid(skuid, sizeof(skuid));
+    pwl_module_set_str(PWL_MODULE_SKU, skuid);
+    pwl_module_set_int(PWL_MODULE_DEVICE_TYPE, type);
     if (type == PWL_DEVICE_TYPE_USB) {
         gpio_init();
     } else if (type == PWL_DEVICE_TYPE_PCIE) {
@@ -1244,11 +1437,15 @@ gint main() {
         GThread *mbim_monitor_thread = g_thread_new("mbim_monitor_thread", mbim_monitor_thread_func, NULL);
     }
 
+    g_timeout_add_seconds(PWL_METRICS_EXPORT_INTERVAL_SEC, metrics_export, NULL);
+    g_timeout_add(PWL_MODULE_POLL_INTERVAL_MS, module_state_refresh, NULL);
+
     gp_loop = g_main_loop_new(NULL, FALSE);
 
     g_main_loop_run(gp_loop);
 
     pci_mbim_device_deinit();
+    pwl_gpio_deinit();
     if (g_cancellable)
         g_object_unref(g_cancellable);
     if (g_device)
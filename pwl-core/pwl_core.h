@@ -42,79 +42,15 @@
 #define DEVICE_RESCAN_DELAY         5   //Delay before rescan device
 #define TIMEOUT_SEC                 10
 
-typedef struct {
-    char *skuid;
-    int gpio;
-} s_skuid_to_gpio;
+// Recovery monitor, a healthy module is declared ready as soon as its caps answer
+#define RECOVERY_CAPS_RETRY_MIN_SEC 1   //Caps retry backoff while the port is up
+#define RECOVERY_CAPS_RETRY_MAX_SEC 16
+#define RECOVERY_RESET_WAIT_SEC     30  //Time for the port to come back after a rescan or reset
 
-s_skuid_to_gpio g_skuid_to_gpio[] = {
-        {"0CBD", 883},
-        {"0CC1", 883},
-        {"0CC4", 883},
-        {"0CB5", 717},
-        {"0CB7", 595},
-        {"0CB2", 717},
-        {"0CB3", 717},
-        {"0CB4", 595},
-        {"0CB9", 717},
-        {"0CBA", 717},
-        {"0CBB", 717},
-        {"0CBC", 595},
-        {"0CD9", 717},
-        {"0CDA", 717},
-        {"0CF4", 883},
-        {"0CE8", 883},
-        {"0CF9", 595},
-        {"0CF5", 883},
-        {"0CF6", 595},
-        {"0D5F", 528},
-        {"0D60", 528},
-        {"0D5C", 528},
-        {"0D5E", 528},
-        {"0D47", 528},
-        {"0D48", 528},
-        {"0D49", 528},
-        {"0D61", 528},
-        {"0D4D", 528},
-        {"0D4E", 528},
-        {"0D4F", 528},
-        {"0D65", 528},
-        //=== IOT ===
-        { "0DF4", -1 },
-        { "0E39", -1 },
-        { "0E35", -1 },
-        { "0E1C", -1 },
-        { "0E38", -1 },
-        { "0E1D", -1 },
-        { "0DF2", -1 },
-        { "0E33", -1 },
-        { "0E1F", -1 },
-        { "0E26", -1 },
-        { "0E25", -1 },
-        { "0E23", -1 },
-        { "0E24", -1 },
-        { "0E29", -1 },
-        { "0E31", -1 },
-        { "0E3A", -1 },
-        { "0E3C", -1 },
-        { "0DF5", -1 },
-        { "0E40", -1 },
-        { "0E36", -1 },
-        { "0E1A", -1 },
-        { "0E1B", -1 },
-        { "0E1E", -1 },
-        { "0DF3", -1 },
-        { "0E34", -1 },
-        { "0E20", -1 },
-        { "0E28", -1 },
-        { "0E22", -1 },
-        { "0E21", -1 },
-        { "0E27", -1 },
-        { "0E2A", -1 },
-        { "0E32", -1 },
-        { "0E3B", -1 },
-        { "0E3D", -1 },
-};
+// GPIO reset, madpt is restarted once the module re-enumerated
+#define GPIO_RESET_HOLD_MS          1000
+#define GPIO_RESET_DETACH_SEC       5   //Time for the port to go away after the pulse
+#define GPIO_RESET_ENUM_SEC         30  //Time for the port to come back
 
 typedef void (*mbim_device_ready_callback)(void);
 
@@ -125,8 +61,8 @@ enum CHECK_MODULE_RETURNS {
 };
 
 int gpio_init(void);
-int set_gpio_status(int enable, int gpio);
 static gboolean hw_reset();
+static gpointer gpio_reset_thread_func(gpointer data);
 // PCI device monitor and hw reset
 gboolean pci_mbim_device_init(mbim_device_ready_callback cb);
 gboolean find_mbim_port(gchar*, guint32);
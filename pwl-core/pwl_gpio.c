@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_gpio.h"
+
+static pthread_mutex_t g_gpio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pwl_gpio_backend_t g_gpio_backend = PWL_GPIO_BACKEND_NONE;
+static gint g_gpio_line_fd = -1;
+static gint g_gpio_number = -1;
+
+static gboolean gpio_sysfs_write(const gchar *path, const gchar *value) {
+    FILE *fp = fopen(path, "w");
+    gboolean ok;
+
+    if (fp == NULL) {
+        PWL_LOG_ERR("[GPIO] open %s failed: %s", path, strerror(errno));
+        return FALSE;
+    }
+    ok = (fputs(value, fp) >= 0);
+    if (fclose(fp) != 0)
+        ok = FALSE;
+    if (!ok)
+        PWL_LOG_ERR("[GPIO] write %s to %s failed: %s", value, path, strerror(errno));
+    return ok;
+}
+
+// Kernels from 6.2 on number the chips upwards from PWL_GPIO_DYNAMIC_BASE in registration
+// order, earlier ones downwards from a per-arch limit that user space cannot see
+static gboolean gpio_dynamic_base_known() {
+    struct utsname name;
+    gint major = 0, minor = 0;
+
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return FALSE;
+    return major > 6 || (major == 6 && minor >= 2);
+}
+
+static gint gpio_chip_filter(const struct dirent *entry) {
+    return strncmp(entry->d_name, "gpiochip", strlen("gpiochip")) == 0;
+}
+
+// Same as gpio_sysfs_find_chip() from the character devices alone. /dev/gpiochipN are
+// numbered in registration order, which is also the order the bases were handed out in.
+static gboolean gpio_cdev_find_chip(gint gpio, gchar *label, gint label_len, guint32 *lines, guint32 *offset) {
+    struct dirent **entries;
+    gint count, base = PWL_GPIO_DYNAMIC_BASE;
+    gboolean found = FALSE;
+
+    if (!gpio_dynamic_base_known())
+        return FALSE;
+    count = scandir("/dev", &entries, gpio_chip_filter, versionsort);
+    if (count < 0)
+        return FALSE;
+
+    for (gint i = 0; i < count; i++) {
+        struct gpiochip_info info;
+        gchar path[300];
+        gint fd;
+
+        snprintf(path, sizeof(path), "/dev/%s", entries[i]->d_name);
+        free(entries[i]);
+        if (found)
+            continue;
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        memset(&info, 0, sizeof(info));
+        if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) {
+            if (gpio >= base && gpio < base + (gint) info.lines) {
+                g_strlcpy(label, info.label, label_len);
+                *lines = info.lines;
+                *offset = gpio - base;
+                found = TRUE;
+            }
+            base += info.lines;
+        }
+        close(fd);
+    }
+    free(entries);
+    return found;
+}
+
+// Label, line count and offset of the chip that holds a global GPIO number
+static gboolean gpio_sysfs_find_chip(gint gpio, gchar *label, gint label_len, guint32 *lines, guint32 *offset) {
+    DIR *dir = opendir(PWL_GPIO_SYSFS_DIR);
+    struct dirent *entry;
+    gboolean found = FALSE;
+
+    if (dir == NULL) {
+        PWL_LOG_ERR("[GPIO] %s not available: %s", PWL_GPIO_SYSFS_DIR, strerror(errno));
+        return FALSE;
+    }
+
+    while (!found && (entry = readdir(dir)) != NULL) {
+        gchar path[300], value[16];
+        gint base, ngpio;
+
+        if (strncmp(entry->d_name, "gpiochip", strlen("gpiochip")) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/base", PWL_GPIO_SYSFS_DIR, entry->d_name);
+        if (!pwl_read_sysfs_attr(path, value, sizeof(value)))
+            continue;
+        base = atoi(value);
+        snprintf(path, sizeof(path), "%s/%s/ngpio", PWL_GPIO_SYSFS_DIR, entry->d_name);
+        if (!pwl_read_sysfs_attr(path, value, sizeof(value)))
+            continue;
+        ngpio = atoi(value);
+        if (gpio < base || gpio >= base + ngpio)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s/label", PWL_GPIO_SYSFS_DIR, entry->d_name);
+        if (!pwl_read_sysfs_attr(path, label, label_len))
+            continue;
+        *lines = ngpio;
+        *offset = gpio - base;
+        found = TRUE;
+    }
+    closedir(dir);
+    return found;
+}
+
+// A line still exported through sysfs by an older release is busy for the character device
+static gboolean gpio_sysfs_unexport(gint gpio) {
+    gchar path[64], value[16];
+
+    snprintf(path, sizeof(path), "%s/gpio%d", PWL_GPIO_SYSFS_DIR, gpio);
+    if (access(path, F_OK) != 0)
+        return FALSE;
+    snprintf(path, sizeof(path), "%s/unexport", PWL_GPIO_SYSFS_DIR);
+    snprintf(value, sizeof(value), "%d", gpio);
+    return gpio_sysfs_write(path, value);
+}
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+// Line fd, or -errno. The chip is matched by label, and by size when lines is not 0, its /dev
+// number is not stable.
+static gint gpio_cdev_request(const gchar *label, guint32 lines, guint32 offset) {
+    DIR *dir = opendir("/dev");
+    struct dirent *entry;
+    gint result = -ENODEV;
+
+    if (dir == NULL)
+        return -errno;
+
+    while (result == -ENODEV && (entry = readdir(dir)) != NULL) {
+        struct gpiochip_info info;
+        struct gpio_v2_line_request request;
+        gchar path[300];
+        gint fd;
+
+        if (strncmp(entry->d_name, "gpiochip", strlen("gpiochip")) != 0)
+            continue;
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        memset(&info, 0, sizeof(info));
+        if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) != 0 || (lines && info.lines != lines) ||
+            strncmp(info.label, label, sizeof(info.label)) != 0) {
+            close(fd);
+            continue;
+        }
+
+        // Output driven high, the module keeps running while the line is requested
+        memset(&request, 0, sizeof(request));
+        request.offsets[0] = offset;
+        request.num_lines = 1;
+        g_strlcpy(request.consumer, PWL_GPIO_CONSUMER, sizeof(request.consumer));
+        request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        request.config.num_attrs = 1;
+        request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        request.config.attrs[0].attr.values = 1;
+        request.config.attrs[0].mask = 1;
+        if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request) == 0) {
+            PWL_LOG_INFO("[GPIO] line %u of %s (%s) requested", offset, path, label);
+            result = request.fd;
+        } else {
+            result = -errno;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    return result;
+}
+#endif
+
+static gboolean gpio_sysfs_setup(gint gpio) {
+    gchar path[64], value[16];
+
+    snprintf(path, sizeof(path), "%s/gpio%d", PWL_GPIO_SYSFS_DIR, gpio);
+    if (access(path, F_OK) != 0) {
+        PWL_LOG_DEBUG("[GPIO] GPIO not export yet, start export %d", gpio);
+        snprintf(path, sizeof(path), "%s/export", PWL_GPIO_SYSFS_DIR);
+        snprintf(value, sizeof(value), "%d", gpio);
+        if (!gpio_sysfs_write(path, value))
+            return FALSE;
+    }
+    // "high" sets the direction and the value in one write
+    snprintf(path, sizeof(path), "%s/gpio%d/direction", PWL_GPIO_SYSFS_DIR, gpio);
+    return gpio_sysfs_write(path, "high");
+}
+
+// Resolved and requested once, later calls only report the state
+gboolean pwl_gpio_init(const gchar *chip, gint line, gint gpio) {
+    gchar label[PWL_GPIO_LABEL_LEN];
+    guint32 lines = 0, offset = line;
+    gboolean ready;
+
+    pthread_mutex_lock(&g_gpio_mutex);
+    if (g_gpio_backend != PWL_GPIO_BACKEND_NONE) {
+        pthread_mutex_unlock(&g_gpio_mutex);
+        return TRUE;
+    }
+
+    if (chip != NULL) {
+        g_strlcpy(label, chip, sizeof(label));
+    } else if (gpio < 0 || (!gpio_cdev_find_chip(gpio, label, sizeof(label), &lines, &offset) &&
+                            !gpio_sysfs_find_chip(gpio, label, sizeof(label), &lines, &offset))) {
+        // Legacy mapping only, the chip is then unknown
+        PWL_LOG_ERR("[GPIO] no gpiochip holds GPIO %d", gpio);
+        pthread_mutex_unlock(&g_gpio_mutex);
+        return FALSE;
+    }
+    if (DEBUG) PWL_LOG_DEBUG("[GPIO] reset line %u of %s", offset, label);
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    gint fd = gpio_cdev_request(label, lines, offset);
+    if (fd == -EBUSY && gpio >= 0 && gpio_sysfs_unexport(gpio))
+        fd = gpio_cdev_request(label, lines, offset);
+    if (fd >= 0) {
+        g_gpio_line_fd = fd;
+        g_gpio_backend = PWL_GPIO_BACKEND_CDEV;
+    } else {
+        PWL_LOG_ERR("[GPIO] character device request failed: %s", strerror(-fd));
+    }
+#endif
+
+    // The sysfs interface only knows global numbers
+    if (g_gpio_backend == PWL_GPIO_BACKEND_NONE && gpio >= 0 && gpio_sysfs_setup(gpio))
+        g_gpio_backend = PWL_GPIO_BACKEND_SYSFS;
+    g_gpio_number = gpio;
+    ready = (g_gpio_backend != PWL_GPIO_BACKEND_NONE);
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ready;
+}
+
+gboolean pwl_gpio_ready() {
+    gboolean ready;
+
+    pthread_mutex_lock(&g_gpio_mutex);
+    ready = (g_gpio_backend != PWL_GPIO_BACKEND_NONE);
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ready;
+}
+
+gboolean pwl_gpio_set(gint value) {
+    gboolean ok = FALSE;
+
+    pthread_mutex_lock(&g_gpio_mutex);
+    if (g_gpio_backend == PWL_GPIO_BACKEND_CDEV) {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+        struct gpio_v2_line_values values;
+
+        memset(&values, 0, sizeof(values));
+        values.bits = value ? 1 : 0;
+        values.mask = 1;
+        ok = (ioctl(g_gpio_line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == 0);
+        if (!ok)
+            PWL_LOG_ERR("[GPIO] set line %d failed: %s", value, strerror(errno));
+#endif
+    } else if (g_gpio_backend == PWL_GPIO_BACKEND_SYSFS) {
+        gchar path[64];
+
+        snprintf(path, sizeof(path), "%s/gpio%d/value", PWL_GPIO_SYSFS_DIR, g_gpio_number);
+        ok = gpio_sysfs_write(path, value ? "1" : "0");
+    } else {
+        PWL_LOG_ERR("[GPIO] reset line not initialized");
+    }
+    pthread_mutex_unlock(&g_gpio_mutex);
+    return ok;
+}
+
+void pwl_gpio_deinit() {
+    pthread_mutex_lock(&g_gpio_mutex);
+    if (g_gpio_line_fd >= 0)
+        close(g_gpio_line_fd);
+    g_gpio_line_fd = -1;
+    g_gpio_backend = PWL_GPIO_BACKEND_NONE;
+    pthread_mutex_unlock(&g_gpio_mutex);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_GPIO_H__
+#define __PWL_GPIO_H__
+
+#include <glib.h>
+
+/*
+ * Modem reset line.
+ *
+ * The device database has the label of the gpiochip and the line offset. The
+ * chip is found among the /dev/gpiochipN character devices and the line is
+ * requested as an output and kept: a reset is two ioctls on the line fd.
+ *
+ * Rows that only have the legacy global GPIO number map it to chip and offset
+ * from the character devices: kernels from 6.2 on hand out the numbers from
+ * PWL_GPIO_DYNAMIC_BASE upwards in /dev/gpiochipN order, so no
+ * CONFIG_GPIO_SYSFS is needed. Older kernels count down from an arch limit,
+ * there the mapping reads the chip bases in /sys/class/gpio. Kernels without
+ * the v2 character device uAPI drive the line through /sys/class/gpio.
+ */
+
+#define PWL_GPIO_SYSFS_DIR              "/sys/class/gpio"
+#define PWL_GPIO_CONSUMER               "pwl_core"
+#define PWL_GPIO_LABEL_LEN              32
+#define PWL_GPIO_DYNAMIC_BASE           512     // GPIO_DYNAMIC_BASE of the kernel
+
+typedef enum {
+    PWL_GPIO_BACKEND_NONE,
+    PWL_GPIO_BACKEND_CDEV,
+    PWL_GPIO_BACKEND_SYSFS
+} pwl_gpio_backend_t;
+
+// chip NULL for the legacy mapping of gpio, gpio < 0 when there is no legacy number
+gboolean pwl_gpio_init(const gchar *chip, gint line, gint gpio);
+gboolean pwl_gpio_ready();
+gboolean pwl_gpio_set(gint value);
+void pwl_gpio_deinit();
+
+#endif
@@ -47,6 +47,7 @@
 
 #include "extra_fb_struct.h" 
 #include "fastboot.h"
+#include "pwl_progress.h"
 #include "transport.h"
 
 
@@ -191,22 +192,32 @@ static int64_t _command_start(Transport* transport, const std::string& cmd, uint
 }
 
 static int64_t _command_write_data(Transport* transport, const void* data, uint32_t size, fastboot_data_t *fastboot_data_ptr) {
-    int64_t r = transport->Write(data, size);
-    if (r < 0) {
-        ///g_error = android::base::StringPrintf("data write failure (%s)", strerror(errno));
-        sprintf( fastboot_data_ptr->gfb_error_msg, "data write failure (%s)", strerror(errno) );
-        //g_error = gfb_error_msg;
-        transport->Close();
-        return -1;
-    }
-    if (r != static_cast<int64_t>(size)) {
-        sprintf( fastboot_data_ptr->gfb_error_msg, "data write failure (short transfer)" );
-        //g_error = gfb_error_msg;
-        //g_error = "data write failure (short transfer)";
-        transport->Close();
-        return -1;
+    const char *ptr = static_cast<const char*>(data);
+    uint32_t remaining = size;
+
+    // Written in chunks so the update progress follows the transfer
+    while (remaining) {
+        uint32_t len = std::min(remaining, static_cast<uint32_t>(PWL_PROGRESS_CHUNK_SIZE));
+        int64_t r = transport->Write(ptr, len);
+        if (r < 0) {
+            ///g_error = android::base::StringPrintf("data write failure (%s)", strerror(errno));
+            sprintf( fastboot_data_ptr->gfb_error_msg, "data write failure (%s)", strerror(errno) );
+            //g_error = gfb_error_msg;
+            transport->Close();
+            return -1;
+        }
+        if (r != static_cast<int64_t>(len)) {
+            sprintf( fastboot_data_ptr->gfb_error_msg, "data write failure (short transfer)" );
+            //g_error = gfb_error_msg;
+            //g_error = "data write failure (short transfer)";
+            transport->Close();
+            return -1;
+        }
+        pwl_progress_bytes(len);
+        remaining -= len;
+        ptr += len;
     }
-    return r;
+    return size;
 }
 
 #if 0
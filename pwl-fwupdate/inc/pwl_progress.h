@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_PROGRESS_H__
+#define __PWL_PROGRESS_H__
+
+#include <stdint.h>
+
+/*
+ * Firmware update progress.
+ *
+ * The steps of an update set the percent directly. During the image download
+ * the bytes the transport wrote are mapped into PWL_PROGRESS_DOWNLOAD_SHARE
+ * percent of the bar, with the transfer rate and the time left. Updates go to
+ * one subscriber callback: phase changes and steps at once, byte progress at
+ * most every PWL_PROGRESS_INTERVAL_MS. Plain C types and no designated
+ * initializers here, the fastboot transport including this is C++.
+ */
+
+#define PWL_PROGRESS_INTERVAL_MS        500
+#define PWL_PROGRESS_DOWNLOAD_SHARE     40
+#define PWL_PROGRESS_CHUNK_SIZE         (1024 * 1024)   // transport writes are reported per chunk
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PWL_PROGRESS_PHASE_IDLE,
+    PWL_PROGRESS_PHASE_PREPARE,
+    PWL_PROGRESS_PHASE_DOWNLOAD,
+    PWL_PROGRESS_PHASE_REBOOT,
+    PWL_PROGRESS_PHASE_FINALIZE,
+    PWL_PROGRESS_PHASE_DONE,
+    PWL_PROGRESS_PHASE_FAILED,
+    PWL_PROGRESS_PHASE_MAX
+} pwl_progress_phase_t;
+
+// eta_sec is -1 when not known, outside the download
+typedef void (*pwl_progress_callback)(int percent, pwl_progress_phase_t phase,
+                                      uint64_t bytes_per_sec, int eta_sec);
+
+void pwl_progress_init(pwl_progress_callback cb);
+void pwl_progress_phase(pwl_progress_phase_t phase);
+void pwl_progress_set(int percent);
+void pwl_progress_download_begin(uint64_t total_bytes);
+void pwl_progress_bytes(uint64_t bytes);
+void pwl_progress_download_end();
+int pwl_progress_percent();
+const char *pwl_progress_phase_name(pwl_progress_phase_t phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -35,6 +35,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <time.h>
@@ -42,6 +43,14 @@
 #include "pwl_fwupdate.h"
 #include "common.h"
 #include "dbus_common.h"
+#include "pwl_device_db.h"
+#include "pwl_ipc.h"
+#include "pwl_metrics.h"
+#include "pwl_module.h"
+#include "pwl_port.h"
+#include "pwl_progress.h"
+#include "pwl_status.h"
+#include "pwl_trace.h"
 #include "extra_fb_struct.h"
 #include "fdtl.h"
 
@@ -163,9 +172,6 @@ const char *gp_pri_temp_file_name = "TempImagePri";
 const char *gp_decode_key_temp_file_name = "download_temp.dat";
 const char *gp_log_output_file = "log.txt";
 
-pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
-
 pthread_mutex_t g_madpt_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t g_madpt_wait_cond = PTHREAD_COND_INITIALIZER;
 
@@ -173,7 +179,6 @@ pthread_cond_t g_madpt_wait_cond = PTHREAD_COND_INITIALIZER;
 FILE *g_progress_fp = NULL;
 FILE *g_module_config_prompt_fp = NULL;
 int g_progress_percent = 0;
-char g_progress_percent_text[32];
 char g_progress_status[200];
 char g_progress_command[1024];
 char g_module_config_prompt_command[1024];
@@ -272,10 +277,10 @@ char* get_test_sku_id()
 
 char* get_oem_sku_id(char *ssid)
 {
-    for (size_t i = 0; i < ssid_sku_table_count; i++) {
-        if (strcmp(ssid, ssid_sku_table[i].ssid) == 0)
-            return ssid_sku_table[i].sku_id;
-    }
+    const pwl_ssid_info_t *info = pwl_device_db_find_ssid(ssid);
+
+    if (strlen(ssid) == 4 && info && info->oem_sku)
+        return (char *)info->oem_sku;
     return "4131001";
 
 }
@@ -321,7 +326,7 @@ int get_env_variable(char env_variable[],int length)
     return 0;
 }
 
-int detect_gpu_status() {
+static int detect_gpu_device() {
     DIR *dir;
     struct dirent *entry;
     char path[512] = {0};
@@ -358,18 +363,68 @@ int detect_gpu_status() {
     return -1; // Not detect GPU
 }
 
-void update_progress_dialog(int percent_add, char *message, char *additional_message)
-{
-    if (detect_gpu_status() == -1) {
-        PWL_LOG_DEBUG("Can't detect GPU, update dialog abort!");
+// A GPU stays, a missing one is looked for again after GPU_STATUS_RECHECK_SEC
+int detect_gpu_status() {
+    static int gpu_status = -1;
+    static uint64_t checked_us = 0;
+    uint64_t now_us = pwl_metrics_now();
+
+    if (gpu_status == 0)
+        return 0;
+    if (checked_us != 0 && now_us - checked_us < GPU_STATUS_RECHECK_SEC * 1000000ULL)
+        return gpu_status;
+
+    gpu_status = detect_gpu_device();
+    checked_us = now_us;
+    return gpu_status;
+}
+
+static gboolean progress_dialog_enabled() {
+    return ENABLE_PROGRESS_DIALOG && detect_gpu_status() != -1;
+}
+
+static void progress_dialog_write(int percent, const char *status) {
+    if (g_progress_fp == NULL)
         return;
+    if (percent >= 0)
+        fprintf(g_progress_fp, "%d\n", percent);
+    if (status != NULL && status[0] != '\0')
+        fputs(status, g_progress_fp);
+    fflush(g_progress_fp);
+}
+
+// Progress subscriber: pwl_core relays it as the UpdateProgress signal, zenity shows the percent
+static void progress_changed_cb(int percent, pwl_progress_phase_t phase, uint64_t bytes_per_sec, int eta_sec) {
+    gboolean changed = (percent != g_progress_percent);
+
+    g_progress_percent = percent;
+    if (gp_proxy != NULL)
+        pwl_core_call_update_progress_method(gp_proxy, percent, pwl_progress_phase_name(phase),
+                                             bytes_per_sec, eta_sec, NULL, NULL, NULL);
+    // The close message goes with 100, zenity closes on it
+    if (changed && phase < PWL_PROGRESS_PHASE_DONE)
+        progress_dialog_write(percent, NULL);
+}
+
+// Publish the outcome, then show the close message before the dialog goes away
+static void progress_dialog_finish(pwl_progress_phase_t outcome, const char *message) {
+    pwl_progress_phase(outcome);
+    if (g_progress_fp != NULL && message == NULL) {
+        pclose(g_progress_fp);
+        g_progress_fp = NULL;
+    } else if (g_progress_fp != NULL) {
+        if (DEBUG) PWL_LOG_DEBUG("close message: %s", message);
+        progress_dialog_write(99, message);
+        g_usleep(1000*1000*3);
+        progress_dialog_write(100, message);
+        pclose(g_progress_fp);
+        g_progress_fp = NULL;
     }
+}
 
-    if (percent_add >= 100)
-        g_progress_percent = 100;
-    else
-        g_progress_percent += percent_add;
-    sprintf(g_progress_percent_text, "%d\n", g_progress_percent);
+void update_progress_dialog(int percent_add, char *message, char *additional_message)
+{
+    int percent = (percent_add >= 100) ? 100 : pwl_progress_percent() + percent_add;
 
 #if (0) // remove text status update on popup message box
     if (additional_message == NULL)
@@ -382,11 +437,8 @@ void update_progress_dialog(int percent_add, char *message, char *additional_mes
         strcpy(g_progress_status, additional_message);
     }
 #endif
-    if (g_progress_fp != NULL) {
-        fwrite(g_progress_percent_text, sizeof(char), strlen(g_progress_percent_text), g_progress_fp);
-        fwrite(g_progress_status, sizeof(char), strlen(g_progress_status), g_progress_fp);
-        fflush(g_progress_fp);
-    }
+    pwl_progress_set(percent);
+    progress_dialog_write(-1, g_progress_status);
 }
 
 int check_fastboot_device()
@@ -490,55 +542,42 @@ void stop_modem_mgr()
 }
 
 void send_message_queue(uint32_t cid) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
-
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_FWUPDATE;
+    pwl_ipc_request(PWL_MQ_ID_FWUPDATE, cid, NULL, FALSE);
+}
 
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+// Send request and wait for its own reply, FALSE on timeout or error
+gboolean send_message_queue_wait(uint32_t cid, char *content, gint wait_time) {
+    if (pwl_ipc_wait_reply(pwl_ipc_request(PWL_MQ_ID_FWUPDATE, cid, content, TRUE), wait_time))
+        return TRUE;
+    // The callers retry on this
+    pwl_trace(PWL_TRACE_RETRY, cid, wait_time, cid_name[cid]);
+    return FALSE;
 }
 
 void send_message_queue_with_content(uint32_t cid, char *content) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
-
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_FWUPDATE;
-    strcpy(message.content, content);
-
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    pwl_ipc_request(PWL_MQ_ID_FWUPDATE, cid, content, FALSE);
 }
 
 void* msg_queue_thread_func(void *args) {
-    mqd_t mq;
-    struct mq_attr attr;
     msg_buffer_t message;
+    uint32_t request_id;
 
-    /* initialize the queue attributes */
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = PWL_MQ_MAX_MSG;
-    attr.mq_msgsize = sizeof(message);
-    attr.mq_curmsgs = 0;
-
-    /* create the message queue */
-    mq = mq_open(PWL_MQ_PATH_FWUPDATE, O_CREAT | O_RDONLY, 0644, &attr);
+    /* create the message ring and queue */
+    if (!pwl_ipc_open_endpoint(PWL_MQ_ID_FWUPDATE))
+        return NULL;
 
     while (1) {
-        ssize_t bytes_read;
-
         /* receive the message */
-        bytes_read = mq_receive(mq, (gchar *)&message, sizeof(message), NULL);
+        if (!pwl_ipc_receive(&message, &request_id)) {
+            sleep(1);
+            continue;
+        }
 
         print_message_info(&message);
+
+        // Reply whose requester already gave up, do not let it update the state
+        if (message.status != PWL_CID_STATUS_NONE && !pwl_ipc_reply_accept(&message, &request_id))
+            continue;
         update_cid_record(g_pwl_cid_map, message.pwl_cid, message.status);
         switch (message.pwl_cid)
         {
@@ -547,7 +586,6 @@ void* msg_queue_thread_func(void *args) {
             /* CID request from myself */
             case PWL_CID_GET_ATE:
                 PWL_LOG_DEBUG("CID ATE: %s", message.response);
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_ATI:
                 if (message.status == PWL_CID_STATUS_OK) {
@@ -555,12 +593,10 @@ void* msg_queue_thread_func(void *args) {
                     strncpy(g_ati_info, message.response, MAX_COMMAND_LEN - 1);
                     g_ati_info[MAX_COMMAND_LEN - 1] = '\0';
                 }
-                pthread_cond_signal(&g_cond);
                 // pthread_exit(NULL);
                 break;
             case PWL_CID_GET_OEM_PRI_INFO:
                 PWL_LOG_DEBUG("OEM PRI Info: %s", message.response);
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_MAIN_FW_VER:
                 PWL_LOG_DEBUG("MAIN FW VER: %s", message.response);
@@ -571,7 +607,7 @@ void* msg_queue_thread_func(void *args) {
                     if (strlen(message.response) > 3) {
                         // TODO: Find a good way to detect if correct AP version
                         if (strncmp(message.response, "00.", 3) == 0) {
-                            strcpy(g_current_fw_ver, message.response);
+                            g_strlcpy(g_current_fw_ver, message.response, sizeof(g_current_fw_ver));
                             PWL_LOG_DEBUG("AP VER: %s", g_current_fw_ver);
                             g_is_get_fw_ver = TRUE;
                         } else {
@@ -585,7 +621,7 @@ void* msg_queue_thread_func(void *args) {
                     }
                 } else if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
                     if (strlen(message.response) > 3) {
-                        strcpy(g_current_fw_ver, message.response);
+                        g_strlcpy(g_current_fw_ver, message.response, sizeof(g_current_fw_ver));
                         PWL_LOG_DEBUG("AP VER: %s", g_current_fw_ver);
                         g_is_get_fw_ver = TRUE;
                     } else {
@@ -596,51 +632,46 @@ void* msg_queue_thread_func(void *args) {
                     PWL_LOG_ERR("Device type unknow, abort!");
                     g_is_get_fw_ver = FALSE;
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_MD_VER:
                 if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
                     if (strlen(message.response) > 3) {
                         if (strncmp(message.response, "RMM", 3) == 0) {
-                            strcpy(g_current_md_ver, message.response);
+                            g_strlcpy(g_current_md_ver, message.response, sizeof(g_current_md_ver));
                             PWL_LOG_DEBUG("MD VER: %s", g_current_md_ver);
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_OP_VER:
                 if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
                     if (strlen(message.response) > 3) {
                         if (strncmp(message.response, "OP.", 3) == 0) {
-                            strcpy(g_current_op_ver, message.response);
+                            g_strlcpy(g_current_op_ver, message.response, sizeof(g_current_op_ver));
                             PWL_LOG_DEBUG("OP VER: %s", g_current_op_ver);
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_OEM_VER:
                 if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
                     if (strlen(message.response) > 3) {
                         if (strncmp(message.response, "OEM", 3) == 0) {
-                            strcpy(g_current_oem_ver, message.response);
+                            g_strlcpy(g_current_oem_ver, message.response, sizeof(g_current_oem_ver));
                             PWL_LOG_DEBUG("OEM VER: %s", g_current_oem_ver);
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_DPV_VER:
                 if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
                     if (strlen(message.response) > 3) {
                         if (strncmp(message.response, "DPV", 3) == 0) {
-                            strcpy(g_current_dpv_ver, message.response);
+                            g_strlcpy(g_current_dpv_ver, message.response, sizeof(g_current_dpv_ver));
                             PWL_LOG_DEBUG("DPV VER: %s", g_current_dpv_ver);
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_SWITCH_TO_FASTBOOT:
                 PWL_LOG_DEBUG("switch fastboot status %s, %s", cid_status_name[message.status], message.response);
@@ -661,7 +692,6 @@ void* msg_queue_thread_func(void *args) {
                         PWL_LOG_ERR("Failed to get oem pri version!");
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_PREF_CARRIER:
                 if (message.status == PWL_CID_STATUS_OK) {
@@ -670,9 +700,10 @@ void* msg_queue_thread_func(void *args) {
                     if (sub_result) {
                         int start_pos = sub_result - message.response + strlen("preferred carrier name:  ");
                         sub_result = strstr(message.response, "preferred config name");
-                        int end_pos = sub_result - message.response;
+                        int end_pos = sub_result ? sub_result - message.response : (int) strlen(message.response) + 2;
                         int sub_str_size = end_pos - start_pos - 2;
-                        strncpy(g_pref_carrier, &message.response[start_pos], sub_str_size);
+                        if (sub_str_size > 0)
+                            g_strlcpy(g_pref_carrier, &message.response[start_pos], MIN(sub_str_size + 1, sizeof(g_pref_carrier)));
                         for (int n=0; n < MAX_PREFERRED_CARRIER_NUMBER; n++) {
                             if (DEBUG) PWL_LOG_DEBUG("Compare: %s with %s", g_pref_carrier, g_preferred_carriers[n]);
                             if (strcasecmp(g_pref_carrier, g_preferred_carriers[n]) == 0)
@@ -682,43 +713,37 @@ void* msg_queue_thread_func(void *args) {
                         PWL_LOG_ERR("Can't find preferred carrier!");
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_SKUID:
                 if (message.status == PWL_CID_STATUS_OK) {
-                    strcpy(g_skuid, message.response);
+                    g_strlcpy(g_skuid, message.response, sizeof(g_skuid));
                 } else {
                     memset(g_skuid, 0, sizeof(g_skuid));
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_DEL_TUNE_CODE:
                 if (message.status == PWL_CID_STATUS_OK) {
                     gb_del_tune_code_ret = TRUE;
                     if (DEBUG) PWL_LOG_DEBUG("Del tune code result: %s", message.response);
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_SET_PREF_CARRIER:
                 if (message.status == PWL_CID_STATUS_OK) {
                     gb_set_pref_carrier_ret = TRUE;
                     if (DEBUG) PWL_LOG_DEBUG("Set preferred carrier result: %s", message.response);
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_SET_OEM_PRI_VERSION:
                 if (message.status == PWL_CID_STATUS_OK) {
                     gb_set_oem_pri_ver_ret = TRUE;
                     if (DEBUG) PWL_LOG_DEBUG("Set oem pri version result: %s", message.response);
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_SIM_CARRIER:
                 if (message.status == PWL_CID_STATUS_OK) {
                     PWL_LOG_DEBUG("Sim Carrier: %s", message.response);
-                    strcpy(g_pref_carrier, message.response);
+                    g_strlcpy(g_pref_carrier, message.response, sizeof(g_pref_carrier));
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_MADPT_RESTART:
                 pthread_cond_signal(&g_madpt_wait_cond);
@@ -732,12 +757,11 @@ void* msg_queue_thread_func(void *args) {
             case PWL_CID_GET_PREF_CARRIER_ID:
                 if (strlen(message.response) > 0 && (strlen(message.response) < sizeof(g_carrier_id))) {
                     PWL_LOG_DEBUG("Carrier ID: %s", message.response);
-                    strcpy(g_carrier_id, message.response);
+                    g_strlcpy(g_carrier_id, message.response, sizeof(g_carrier_id));
                 } else {
                     PWL_LOG_ERR("Carrier id abnormal, clear g_carrier_id");
                     memset(g_carrier_id, 0, sizeof(g_carrier_id));
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_CXP_REBOOT_FLAG:
                 if (strlen(message.response) > 0) {
@@ -746,13 +770,11 @@ void* msg_queue_thread_func(void *args) {
                     else
                         g_need_cxp_reboot = FALSE;
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_OEM_PRI_RESET_STATE:
                 if (strlen(message.response) > 0) {
                     get_oempri_reset_state(message.response);
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_MODULE_SKU_ID:
                 if (strlen(message.response) > 0) {
@@ -761,15 +783,12 @@ void* msg_queue_thread_func(void *args) {
                     else
                         PWL_LOG_ERR("Get sku response error!");
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_SETUP_JP_FCC_CONFIG:
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_ESIM_STATE:
                 PWL_LOG_DEBUG("[ESIM] %s", message.response);
                 update_esim_enable_state(message.response);
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_CHECK_ESIM_TEST_PROF:
                 if (strstr(message.response, "BCHKTESTPROF")) {
@@ -779,33 +798,31 @@ void* msg_queue_thread_func(void *args) {
                         PWL_LOG_DEBUG("PROF: %d", g_esim_profile_chk_result);
                     }
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_DELETE_ESIM_TEST_PROF:
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_BACKUP_SN_IMEI:
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_GET_BACKUP_SN_IMEI:
                 if (message.status == PWL_CID_STATUS_OK && strlen(message.response) > 0) {
                     split_backup_sn_imei(message.response, g_sn, g_imei);
                     if (DEBUG) PWL_LOG_DEBUG("Backup sn: %s, imei: %s", g_sn, g_imei);
                 }
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_RESTORE_SN:
                 PWL_LOG_DEBUG("Restore SN, status: %d, response: %s", message.status, message.response);
-                pthread_cond_signal(&g_cond);
                 break;
             case PWL_CID_RESTORE_IMEI:
                 PWL_LOG_DEBUG("Restore IMEI, status: %d, response: %s", message.status, message.response);
-                pthread_cond_signal(&g_cond);
                 break;
             default:
                 PWL_LOG_ERR("Unknown pwl cid: %d", message.pwl_cid);
                 break;
         }
+
+        // Wake up the sender waiting for this reply
+        if (message.status != PWL_CID_STATUS_NONE)
+            pwl_ipc_reply_done(request_id, message.status);
     }
 
     return NULL;
@@ -919,10 +936,13 @@ int fastboot_send_command_v3( fdtl_data_t *fdtl_data, int exe_case, const char *
 {
     int rtn = 0;
     fastboot_data_t  fastboot_data;
+    uint64_t start_us = pwl_metrics_now();
 
     if( fdtl_data->total_device_count > 1 )     strcpy( fastboot_data.g_device_serial_number, fdtl_data->g_device_serial_number );
     else       strcpy( fastboot_data.g_device_serial_number, "" );
 
+    pwl_trace(PWL_TRACE_FASTBOOT_CMD, exe_case, flash_step, argv1);
+
     if (g_fb_installed) {
         char command[100];
         // PWL_LOG_DEBUG("exe_case: %d 1: %s 2: %s 3: %s 4: %d", exe_case, argv1, argv2, &fastboot_data, fdtl_data->device_idx);
@@ -958,6 +978,7 @@ int fastboot_send_command_v3( fdtl_data_t *fdtl_data, int exe_case, const char *
         if (fp == 0)
         {
             PWL_LOG_DEBUG("Send fastboot command error");
+            pwl_trace(PWL_TRACE_FASTBOOT_RESP, exe_case, -1, "popen failed");
             return -1;
         }
         rtn = post_process_fastboot( fdtl_data, fp, flash_step, &fastboot_data );
@@ -967,6 +988,21 @@ int fastboot_send_command_v3( fdtl_data_t *fdtl_data, int exe_case, const char *
         fastboot_main( exe_case, (char *)argv1, (char *)argv2, (char *)&fastboot_data, fdtl_data->device_idx );
         rtn = post_process_fastboot( fdtl_data, 0, flash_step, &fastboot_data );
     }
+    pwl_trace(PWL_TRACE_FASTBOOT_RESP, exe_case, rtn, argv1);
+
+    // argv2 is the image file of a flash command
+    if (exe_case == FASTBOOT_FLASH_COMMAND && rtn > 0 && argv2 != NULL) {
+        struct stat st;
+        uint64_t elapsed_us = pwl_metrics_now() - start_us;
+
+        if (stat(argv2, &st) == 0 && elapsed_us > 0) {
+            // The built-in transport reports its writes, the fastboot binary only the whole image
+            if (g_fb_installed)
+                pwl_progress_bytes(st.st_size);
+            pwl_metrics_add(PWL_METRIC_FLASH_BYTES, 0, st.st_size);
+            pwl_metrics_set(PWL_METRIC_FLASH_THROUGHPUT, 0, st.st_size * 1000000ULL / elapsed_us);
+        }
+    }
     return rtn;
 }
 
@@ -1105,6 +1141,20 @@ int setup_parameter( int Argc, char **Argv )
   return 1;
 }
 
+// The image files are the size the download progress is measured against
+static uint64_t image_files_total_bytes()
+{
+    uint64_t total = 0;
+    struct stat st;
+    int count;
+
+    for( count = 0 ; count < g_image_file_count ; count++ )
+    {
+        if( stat( g_image_file_list[ count ], &st ) == 0 )     total += st.st_size;
+    }
+    return total;
+}
+
 int fastboot_flash_process_v2( fdtl_data_t *fdtl_data )
 {
     fdtl_data->g_pri_count = 0;
@@ -1133,7 +1183,6 @@ int fastboot_flash_process_v2( fdtl_data_t *fdtl_data )
         }
     //    sprintf( output_message, "%sflash image header, %s \n", fdtl_data->g_prefix_string, fdtl_data->g_first_temp_file_name );
     //    printf_fdtl_d( output_message );
-        update_progress_dialog(1, "fastboot flash update files... ", NULL);
         PWL_LOG_DEBUG("%sflash image header, %s", fdtl_data->g_prefix_string, fdtl_data->g_first_temp_file_name );
         rtn = fastboot_send_command_v3( fdtl_data, FASTBOOT_FLASH_COMMAND, "sop-hdr", fdtl_data->g_first_temp_file_name, FASTBOOT_SOP_HDR );
         PWL_LOG_DEBUG("flash image header, result: %d", rtn);
@@ -1144,7 +1193,6 @@ int fastboot_flash_process_v2( fdtl_data_t *fdtl_data )
             {
                 // sprintf( output_message, "%sflash %s, %s, %d, %d \n", fdtl_data->g_prefix_string, "firmware image or oem image", fdtl_data->g_image_temp_file_name, fdtl_data->g_image_offset[c], fdtl_data->g_image_size[c] );
                 // printf_fdtl_d( output_message );
-                update_progress_dialog(2, "fastboot flash ", NULL);
                 PWL_LOG_DEBUG("%sflash %s, %s, %d, %d \n", fdtl_data->g_prefix_string, "firmware image or oem image", fdtl_data->g_image_temp_file_name, fdtl_data->g_image_offset[c], fdtl_data->g_image_size[c] );
                 write_temp_image_file( g_image_file_list[ count ], fdtl_data->g_image_offset[c], fdtl_data->g_image_size[c], 0, fdtl_data->g_image_temp_file_name, fdtl_data->g_prefix_string );
 
@@ -1316,6 +1364,11 @@ int get_time_info( char print_time )
 
 void close_progress_msg_box(int close_type) {
     char close_message[64] = {0};
+
+    // Keep what led to the failure before the next attempt overwrites it
+    if (close_type == CLOSE_TYPE_ERROR || close_type == CLOSE_TYPE_RETRY)
+        pwl_trace_dump("update_failed");
+
     switch (close_type) {
         case CLOSE_TYPE_ERROR:
             sprintf(close_message, "%s", "#Modem firmware update failed!\\n\\n\n");
@@ -1332,15 +1385,8 @@ void close_progress_msg_box(int close_type) {
         default:
             break;
     }
-    if (g_progress_fp != NULL) {
-        g_progress_percent = 98;
-        if (DEBUG) PWL_LOG_DEBUG("close message: %s", close_message);
-        update_progress_dialog(1, NULL, close_message);
-        g_usleep(1000*1000*3);
-        update_progress_dialog(1, NULL, close_message);
-        pclose(g_progress_fp);
-        g_progress_fp = NULL;
-    }
+    progress_dialog_finish((close_type == CLOSE_TYPE_ERROR || close_type == CLOSE_TYPE_RETRY) ?
+                           PWL_PROGRESS_PHASE_FAILED : PWL_PROGRESS_PHASE_DONE, close_message);
 }
 
 /////
@@ -1366,6 +1412,7 @@ int waiting_modem_download_port( fdtl_data_t *fdtl_data )
     int update_count_down;
     char output_message[1024];
 
+    pwl_trace(PWL_TRACE_WAIT, 0, 300, "download port");
     for( update_count_down = 300 ; update_count_down > 0 ; update_count_down-- )
     {
          if( update_count_down > 30 )
@@ -1383,6 +1430,7 @@ int waiting_modem_download_port( fdtl_data_t *fdtl_data )
 
     if( update_count_down == 0 )
     {
+        pwl_trace(PWL_TRACE_RETRY, 300, -1, "download port");
         sprintf( output_message, "\n%sCan't find USB port %s. \n", fdtl_data->g_prefix_string, fdtl_data->modem_port );
         printf_fdtl_s( output_message );
         fflush(stdout);
@@ -1396,6 +1444,28 @@ int waiting_modem_download_port( fdtl_data_t *fdtl_data )
     return update_count_down;
 }
 
+static const gchar * const download_state_name[] = {
+    [DOWNLOAD_INIT] = "init",
+    [DOWNLOAD_START] = "start",
+    [DOWNLOAD_FASTBOOT_START] = "fastboot start",
+    [DOWNLOAD_FASTBOOT_END] = "fastboot end",
+    [DOWNLOAD_COMPLETED] = "completed",
+    [DOWNLOAD_FAILED] = "failed",
+};
+
+static void download_state_set(fdtl_data_t *fdtl_data, int state) {
+    fdtl_data->download_process_state = state;
+    pwl_trace(PWL_TRACE_MODE, fdtl_data->device_idx, state, download_state_name[state]);
+    if (state == DOWNLOAD_START)
+        pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_IN_PROGRESS);
+    else if (state == DOWNLOAD_COMPLETED)
+        pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_COMPLETED);
+    else if (state == DOWNLOAD_FAILED) {
+        pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_FAILED);
+        pwl_trace_dump("download_failed");
+    }
+}
+
 int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     int count;
     int rtn;
@@ -1408,12 +1478,12 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     fdtl_data_t *fdtl_data;
     fdtl_data = argu_ptr;
 
-    fdtl_data->download_process_state = DOWNLOAD_START;
+    download_state_set(fdtl_data, DOWNLOAD_START);
 
     recv_buffer = (unsigned char *) malloc(USB_SERIAL_BUF_SIZE);
     if( recv_buffer == NULL )    
     {
-        fdtl_data->download_process_state = DOWNLOAD_FAILED;
+        download_state_set(fdtl_data, DOWNLOAD_FAILED);
         fdtl_data->error_code = MEMORY_ALLOCATION_FAILED;
         return MEMORY_ALLOCATION_FAILED;
     }
@@ -1421,7 +1491,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     if( send_buffer == NULL )    
     {
         free(recv_buffer);
-        fdtl_data->download_process_state = DOWNLOAD_FAILED;
+        download_state_set(fdtl_data, DOWNLOAD_FAILED);
         fdtl_data->error_code = MEMORY_ALLOCATION_FAILED;
         return MEMORY_ALLOCATION_FAILED;
     }
@@ -1442,6 +1512,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     g_is_fastboot_cmd_error = FALSE;
     send_message_queue(PWL_CID_SWITCH_TO_FASTBOOT);
 
+    pwl_trace(PWL_TRACE_WAIT, 0, 5, "fastboot switch");
     sleep(5);
 
     if (g_is_fastboot_cmd_error) {
@@ -1456,6 +1527,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     printf_fdtl_s( output_message );
 
     update_progress_dialog(3, "Waiting fastboot port...", NULL);
+    pwl_trace(PWL_TRACE_WAIT, 0, 60, "fastboot port");
     for( count = 0 ; count < 60 ; count++ )
     {
         if (g_fb_installed)
@@ -1476,6 +1548,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
                 else
                 {
                     PWL_LOG_ERR("Switch to fastboot mode error, abort!");
+                    pwl_trace(PWL_TRACE_RETRY, check_fastboot_count, -1, "fastboot port");
                     // TODO: Request gpio reset here
                     return SWITCHING_TO_DOWNLOAD_MODE_FAILED;
                 }
@@ -1495,6 +1568,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
 
     if( count >= 60 )     
     {
+        pwl_trace(PWL_TRACE_RETRY, count, -1, "fastboot port");
         update_progress_dialog(5, "Switch to download mode failed.", NULL);
         sprintf(output_message, "\n%sSwitch to download mode failed.\n", fdtl_data->g_prefix_string );
         printf_fdtl_s( output_message );
@@ -1506,7 +1580,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
         sprintf(output_message, "%sExit download process.\n\n", fdtl_data->g_prefix_string );
         printf_fdtl_s( output_message );
 
-        fdtl_data->download_process_state = DOWNLOAD_FAILED;
+        download_state_set(fdtl_data, DOWNLOAD_FAILED);
         fdtl_data->error_code = SWITCHING_TO_DOWNLOAD_MODE_FAILED;
         g_usleep(1000*1000*3);
         if (g_progress_fp != NULL) {
@@ -1520,7 +1594,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     //printf_fdtl_s( output_message );
 
     ////////  Pre-Setup
-    fdtl_data->download_process_state = DOWNLOAD_FASTBOOT_START;
+    download_state_set(fdtl_data, DOWNLOAD_FASTBOOT_START);
 
     if( fdtl_data->total_device_count > 1 )    printf("\n" );
 
@@ -1569,15 +1643,17 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
 
         free(recv_buffer);
         free(send_buffer);
-        fdtl_data->download_process_state = DOWNLOAD_FAILED;
+        download_state_set(fdtl_data, DOWNLOAD_FAILED);
         fdtl_data->error_code = FASTBOOT_COMMAND_FAILED;
         return FASTBOOT_COMMAND_FAILED;
     }
 
     rtn = 1;
 
+    pwl_progress_download_begin(image_files_total_bytes());
     rtn = fastboot_flash_process_v2( fdtl_data );
     PWL_LOG_DEBUG("fastboot_flash_process, result: %d", rtn);
+    if( rtn > 0 )       pwl_progress_download_end();
     if( rtn <= 0 )
     {  
         PWL_LOG_DEBUG("\nrtn: %d, FASTBOOT_REBOOT_COMMAND", rtn);
@@ -1585,7 +1661,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
 
         free(recv_buffer);
         free(send_buffer);
-        fdtl_data->download_process_state = DOWNLOAD_FAILED;
+        download_state_set(fdtl_data, DOWNLOAD_FAILED);
         fdtl_data->error_code = FASTBOOT_FLASHING_FAILED;
         return FASTBOOT_FLASHING_FAILED;
     }
@@ -1602,11 +1678,12 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     ///////////// Reboot
     // sprintf( output_message, "%sfastboot reboot \n", fdtl_data->g_prefix_string );
     // printf_fdtl_d( output_message );
+    pwl_progress_phase(PWL_PROGRESS_PHASE_REBOOT);
     update_progress_dialog(2, "fastboot reboot...", NULL);
     PWL_LOG_DEBUG("%sfastboot reboot \n", fdtl_data->g_prefix_string );
     fastboot_send_command_v3( fdtl_data, FASTBOOT_REBOOT_COMMAND, NULL, NULL, FASTBOOT_IGNORE );
 
-    fdtl_data->download_process_state = DOWNLOAD_FASTBOOT_END;
+    download_state_set(fdtl_data, DOWNLOAD_FASTBOOT_END);
     if( fdtl_data->total_device_count == 1 )       printf_fdtl_s("\n\n"); 
 
     //elapsed_time = get_time_info(0) - raw_time;
@@ -1621,7 +1698,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
         PWL_LOG_DEBUG("\n%sExit download process. \n", fdtl_data->g_prefix_string );
         fflush(stdout);
 
-        fdtl_data->download_process_state = DOWNLOAD_COMPLETED;
+        download_state_set(fdtl_data, DOWNLOAD_COMPLETED);
 
         return 1;
     }
@@ -1644,7 +1721,7 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     {  
          free(recv_buffer);
          free(send_buffer);
-         fdtl_data->download_process_state = DOWNLOAD_FAILED;
+         download_state_set(fdtl_data, DOWNLOAD_FAILED);
          fdtl_data->error_code = MODEM_PORT_OPENING_FAILS_AFTER_FIRMWARE_DOWNLOAD;
          return MODEM_PORT_OPENING_FAILS_AFTER_FIRMWARE_DOWNLOAD;
     }
@@ -1674,6 +1751,9 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
         PWL_LOG_INFO("Modem back online");
     }
 
+    // No settle sleeps in between, every request below already waits for its own reply
+    pwl_progress_phase(PWL_PROGRESS_PHASE_FINALIZE);
+
     // Set preferred carrier
     // TODO record preferred carrier and download status to ROM file.
     update_progress_dialog(5, "Set preferred carrier...", NULL);
@@ -1699,18 +1779,15 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
 
     // Set oem pri version
     if (g_has_update_include_oem_img) {
-        sleep(5);
         update_progress_dialog(5, "Set oem pri version...", NULL);
         if (set_oem_pri_version() != 0)
             PWL_LOG_ERR("Set oem pri version fail.");
     }
 
     // Notice pwl-pref to update fw version
-    sleep(1);
     send_message_queue(PWL_CID_UPDATE_FW_VER);
 
     // Send ATI cmd
-    sleep(5);
     if (get_ati_info() != 0)
         PWL_LOG_ERR("Get ATI fail.");
 
@@ -1723,15 +1800,8 @@ int download_process( void *argu_ptr, gboolean efs_recovery_mode ) {
     printf_fdtl_s( output_message );
     fflush(stdout);
 
-    g_progress_percent = 98;
-    update_progress_dialog(1, "Exit download process.", "#The Modem update Success!\\n\\n\n");
-    g_usleep(1000*1000*3);
-    update_progress_dialog(1, "Exit download process.", "#The Modem update Success!\\n\\n\n");
-    if (g_progress_fp != NULL) {
-        pclose(g_progress_fp);
-        g_progress_fp = NULL;
-    }
-    fdtl_data->download_process_state = DOWNLOAD_COMPLETED;
+    progress_dialog_finish(PWL_PROGRESS_PHASE_DONE, "#The Modem update Success!\\n\\n\n");
+    download_state_set(fdtl_data, DOWNLOAD_COMPLETED);
     fdtl_data->error_code = 1;
     return 1;
 }
@@ -1846,6 +1916,7 @@ INOTIFY_AGAIN:
                                     // Notice pref update version.
                                     if (DEBUG) PWL_LOG_DEBUG("[Notice] Send signal to pref to get version and wait 7 secs");
                                     pwl_core_call_request_update_fw_version_method(gp_proxy, NULL, NULL, NULL);
+                                    pwl_trace(PWL_TRACE_WAIT, 0, 7, "pref fw version");
                                     sleep(7);
                                     if (g_is_fw_update_processing == NOT_IN_FW_UPDATE_PROCESSING) {
                                         if (start_update_process_pcie(FALSE, PCIE_UPDATE_BASE_FLZ) == RET_OK) {
@@ -1860,6 +1931,7 @@ INOTIFY_AGAIN:
                                                 PWL_LOG_DEBUG("[Notice] already_retry_count: %d", already_retry_count);
                                                 while (already_retry_count < FW_UPDATE_RETRY_TH) {
                                                     PWL_LOG_DEBUG("[Notice] Retry fw udpate");
+                                                    pwl_trace(PWL_TRACE_RETRY, already_retry_count, 0, "fw update");
                                                     if (start_update_process_pcie(TRUE, PCIE_UPDATE_BASE_FLZ) == RET_OK) {
                                                         remove_flash_data(g_update_type);
                                                         close_progress_msg_box(CLOSE_TYPE_SUCCESS);
@@ -1938,18 +2010,10 @@ gint get_sim_carrier()
             return -1;
         } else {
             err = 0;
-            send_message_queue(PWL_CID_GET_SIM_CARRIER);
-            pthread_mutex_lock(&g_mutex);
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-
-            int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-            if (result == ETIMEDOUT || result != 0) {
+            if (!send_message_queue_wait(PWL_CID_GET_SIM_CARRIER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("Time out to get sim carrier, retry");
                 err = 1;
             }
-            pthread_mutex_unlock(&g_mutex);
 
             if (err || strlen(g_pref_carrier) == 0) {
                 retry++;
@@ -1970,18 +2034,10 @@ gint get_preferred_carrier()
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        send_message_queue(PWL_CID_GET_PREF_CARRIER);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_PREF_CARRIER, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get pref carrier, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
 
         if (err || strlen(g_pref_carrier) == 0) {
             retry++;
@@ -1996,18 +2052,10 @@ int do_esim_test_profile_remove_command() {
     int err, retry = 0;
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_DELETE_ESIM_TEST_PROF);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_DELETE_ESIM_TEST_PROF, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to remove eSIM test profile, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
 
         if (err || g_esim_profile_chk_result == -1) {
             retry++;
@@ -2017,9 +2065,11 @@ int do_esim_test_profile_remove_command() {
     }
     // Delete profile at command error, abort!
     g_testprofile_delete_counter = 0;
-    set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
     g_testprofile_delete_done = 2;
-    set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
+    pwl_status_begin(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
+    pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
+    pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
+    pwl_status_commit(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
     return RET_FAILED;
 }
 
@@ -2030,18 +2080,10 @@ int check_esim_test_profile_process() {
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_CHECK_ESIM_TEST_PROF);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_CHECK_ESIM_TEST_PROF, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get eSIM test profile remove result, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
 
         if (err || g_esim_profile_chk_result == -1) {
             retry++;
@@ -2055,8 +2097,10 @@ int check_esim_test_profile_process() {
         PWL_LOG_DEBUG("eSIM test profile remove success.");
         g_testprofile_delete_counter = 0;
         g_testprofile_delete_done = 1;
-        set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
-        set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
+        pwl_status_begin(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
+        pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
+        pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
+        pwl_status_commit(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
         return RET_OK;
     } else {
         // Test profile remove failed (include at command error)
@@ -2067,11 +2111,13 @@ int check_esim_test_profile_process() {
             set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
         } else {
             g_testprofile_delete_counter--;
-            set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
+            pwl_status_begin(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
+            pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_COUNTER, g_testprofile_delete_counter);
             if (g_testprofile_delete_counter == 0) {
                 g_testprofile_delete_done = 2;
-                set_esim_profile_remove_status_value(ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
+                pwl_status_set(PWL_STATUS_ESIM_TESTPROFILE_DELETE_DONE, g_testprofile_delete_done);
             }
+            pwl_status_commit(PWL_STATUS_STORE_ESIM_PROFILE_REMOVE);
         }
         // Send remove esim profile at cmd here
         if (do_esim_test_profile_remove_command() == RET_OK)
@@ -2084,17 +2130,10 @@ int check_oempri_reset_state() {
     int err, retry = 0;
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_OEM_PRI_RESET_STATE);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_OEM_PRI_RESET_STATE, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get oem pri reset state, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || g_oem_pri_reset_state == -1) {
             retry++;
             continue;
@@ -2131,17 +2170,10 @@ gint get_sku_id()
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        send_message_queue(PWL_CID_GET_SKUID);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_SKUID, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get SKU ID, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || strlen(g_skuid) == 0) {
             retry++;
             continue;
@@ -2156,17 +2188,11 @@ gint get_carrier_id() {
     memset(g_carrier_id, 0, sizeof(g_carrier_id));
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_PREF_CARRIER_ID);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC + 2; // Carrier ID took longer to read, add fewer sec
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        // Carrier ID took longer to read, add fewer sec
+        if (!send_message_queue_wait(PWL_CID_GET_PREF_CARRIER_ID, NULL, PWL_CMD_TIMEOUT_SEC + 2)) {
             PWL_LOG_ERR("Time out to get Carrier ID, retry.");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err) {
             retry++;
             continue;
@@ -2181,17 +2207,11 @@ gint get_cxp_reboot_flag() {
     g_need_cxp_reboot = FALSE;
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_CXP_REBOOT_FLAG);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC + 2; // Carrier ID took longer to read, add fewer sec
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        // Carrier ID took longer to read, add fewer sec
+        if (!send_message_queue_wait(PWL_CID_GET_CXP_REBOOT_FLAG, NULL, PWL_CMD_TIMEOUT_SEC + 2)) {
             PWL_LOG_ERR("Time out to get CXP reboot flag, retry.");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err) {
             retry++;
             continue;
@@ -2201,25 +2221,41 @@ gint get_cxp_reboot_flag() {
     }
 }
 
+// Device caps firmware info from pwl_core has the at*bfwver layout MAIN_AP_CARRIER_OEM
+static gboolean get_ap_version_from_caps() {
+    pwl_module_caps_t caps;
+    char *versions[4] = { NULL };
+    char *save = NULL;
+
+    if (!pwl_module_get_caps(&caps))
+        return FALSE;
+
+    versions[0] = strtok_r(caps.firmware_info, "_", &save);
+    for (int i = 1; i < 4 && versions[i - 1]; i++)
+        versions[i] = strtok_r(NULL, "_", &save);
+    // Same check as the PWL_CID_GET_AP_VER reply
+    if (versions[3] == NULL || strlen(versions[1]) <= 3 || strncmp(versions[1], "00.", 3) != 0)
+        return FALSE;
+
+    strncpy(g_current_fw_ver, versions[1], sizeof(g_current_fw_ver) - 1);
+    PWL_LOG_DEBUG("AP VER from device caps: %s", g_current_fw_ver);
+    return TRUE;
+}
+
 gint get_current_fw_version()
 {
     int err, retry = 0;
     memset(g_current_fw_ver, 0, FW_VERSION_LENGTH);
 
     memset(g_current_fw_ver, 0, sizeof(g_current_fw_ver));
+    if (g_device_type == PWL_DEVICE_TYPE_USB && get_ap_version_from_caps())
+        return RET_OK;
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_AP_VER);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_AP_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get AP version, retry.");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err) {
             retry++;
             continue;
@@ -2244,17 +2280,10 @@ gint get_current_fw_version()
         memset(g_current_md_ver, 0, sizeof(g_current_md_ver));
         while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
             err = 0;
-            send_message_queue(PWL_CID_GET_MD_VER);
-            pthread_mutex_lock(&g_mutex);
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-            int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-            if (result == ETIMEDOUT || result != 0) {
+            if (!send_message_queue_wait(PWL_CID_GET_MD_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("Time out to get MD version, retry.");
                 err = 1;
             }
-            pthread_mutex_unlock(&g_mutex);
             if (err) {
                 retry++;
                 continue;
@@ -2270,17 +2299,10 @@ gint get_current_fw_version()
         memset(g_current_op_ver, 0, sizeof(g_current_op_ver));
         while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
             err = 0;
-            send_message_queue(PWL_CID_GET_OP_VER);
-            pthread_mutex_lock(&g_mutex);
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-            int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-            if (result == ETIMEDOUT || result != 0) {
+            if (!send_message_queue_wait(PWL_CID_GET_OP_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("Time out to get OP version, retry.");
                 err = 1;
             }
-            pthread_mutex_unlock(&g_mutex);
             if (err) {
                 retry++;
                 continue;
@@ -2296,17 +2318,10 @@ gint get_current_fw_version()
         memset(g_current_oem_ver, 0, sizeof(g_current_oem_ver));
         while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
             err = 0;
-            send_message_queue(PWL_CID_GET_OEM_VER);
-            pthread_mutex_lock(&g_mutex);
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-            int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-            if (result == ETIMEDOUT || result != 0) {
+            if (!send_message_queue_wait(PWL_CID_GET_OEM_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("Time out to get OEM version, retry.");
                 err = 1;
             }
-            pthread_mutex_unlock(&g_mutex);
             if (err) {
                 retry++;
                 continue;
@@ -2322,17 +2337,10 @@ gint get_current_fw_version()
         memset(g_current_dpv_ver, 0, sizeof(g_current_dpv_ver));
         while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
             err = 0;
-            send_message_queue(PWL_CID_GET_DPV_VER);
-            pthread_mutex_lock(&g_mutex);
-            struct timespec timeout;
-            clock_gettime(CLOCK_REALTIME, &timeout);
-            timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-            int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-            if (result == ETIMEDOUT || result != 0) {
+            if (!send_message_queue_wait(PWL_CID_GET_DPV_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("Time out to get DPV version, retry.");
                 err = 1;
             }
-            pthread_mutex_unlock(&g_mutex);
             if (err) {
                 retry++;
                 continue;
@@ -2377,22 +2385,15 @@ gint set_preferred_carrier()
         }
     }
     // Set 
-    int err, ret, retry = 0;
+    int err, retry = 0;
     gb_set_pref_carrier_ret = FALSE;
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        send_message_queue_with_content(PWL_CID_SET_PREF_CARRIER, (char *)g_preferred_carriers[carrier_index]);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        ret = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (ret == ETIMEDOUT || ret != 0) {
+        if (!send_message_queue_wait(PWL_CID_SET_PREF_CARRIER, (char *)g_preferred_carriers[carrier_index], PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Set preferred carrier error, retry!");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || !gb_set_pref_carrier_ret) {
             retry++;
             continue;
@@ -2405,23 +2406,16 @@ gint set_preferred_carrier()
 gint del_tune_code()
 {
     PWL_LOG_DEBUG("Del tune code");
-    int err, ret, retry = 0;
+    int err, retry = 0;
     gb_del_tune_code_ret = FALSE;
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        send_message_queue(PWL_CID_DEL_TUNE_CODE);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        ret = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (ret == ETIMEDOUT || ret != 0) {
+        if (!send_message_queue_wait(PWL_CID_DEL_TUNE_CODE, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Del tune code error, retry!");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || !gb_del_tune_code_ret) {
             retry++;
             continue;
@@ -2432,24 +2426,16 @@ gint del_tune_code()
 }
 
 int clean_oem_pri_version() {
-    int err, ret, retry = 0;
+    int err, retry = 0;
     gb_set_oem_pri_ver_ret = FALSE;
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         PWL_LOG_DEBUG("Clean oem pri version");
         err = 0;
-        send_message_queue_with_content(PWL_CID_SET_OEM_PRI_VERSION, "DPV00.00.00.00");
-
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        ret = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (ret == ETIMEDOUT || ret != 0) {
+        if (!send_message_queue_wait(PWL_CID_SET_OEM_PRI_VERSION, "DPV00.00.00.00", PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Clean oem pri version error, retry!");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || !gb_set_oem_pri_ver_ret) {
             retry++;
             continue;
@@ -2461,30 +2447,22 @@ int clean_oem_pri_version() {
 
 gint set_oem_pri_version()
 {
-    int err, ret, retry = 0;
+    int err, retry = 0;
     PWL_LOG_DEBUG("Set oem pri version");
     gb_set_oem_pri_ver_ret = FALSE;
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        if (strstr(g_device_package_ver, "DPV")) {
-            send_message_queue_with_content(PWL_CID_SET_OEM_PRI_VERSION, g_device_package_ver);
-        } else {
+        if (!strstr(g_device_package_ver, "DPV")) {
             PWL_LOG_INFO("Skip oem pri set");
             return 0;
         }
 
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        ret = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (ret == ETIMEDOUT || ret != 0) {
+        if (!send_message_queue_wait(PWL_CID_SET_OEM_PRI_VERSION, g_device_package_ver, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Set oem pri version error, retry!");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || !gb_set_oem_pri_ver_ret) {
             retry++;
             continue;
@@ -2501,17 +2479,10 @@ gint get_ati_info()
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT)
     {
         err = 0;
-        send_message_queue(PWL_CID_GET_ATI);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_ATI, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get ATI, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err)
         {
             retry++;
@@ -2561,8 +2532,7 @@ gboolean get_oem_pri_version() {
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_CHECK_OEM_PRI_VERSION);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_CHECK_OEM_PRI_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get oem pri version, retry");
             err = 1;
         }
@@ -2577,7 +2547,7 @@ gboolean get_oem_pri_version() {
 }
 
 int parse_sku_id(char *response, char *module_sku_id) {
-    char temp_resp[PWL_MQ_MAX_RESP] = {0};
+    char temp_resp[PWL_MSG_MAX_RESP] = {0};
     char *token;
     int count = 0;
     strcpy(temp_resp, response);
@@ -2598,18 +2568,10 @@ int get_module_sku_id() {
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_MODULE_SKU_ID);
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-
-        int result = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
-        if (result == ETIMEDOUT || result != 0) {
+        if (!send_message_queue_wait(PWL_CID_GET_MODULE_SKU_ID, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get pref carrier, retry");
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err || strlen(g_module_sku_id) == 0) {
             retry++;
             continue;
@@ -2620,7 +2582,7 @@ int get_module_sku_id() {
 }
 
 int get_oempri_reset_state(char *response) {
-    char temp_resp[PWL_MQ_MAX_RESP] = {0};
+    char temp_resp[PWL_MSG_MAX_RESP] = {0};
     char *token;
     int count = 0;
     strcpy(temp_resp, response);
@@ -2687,8 +2649,7 @@ int get_esim_enable_state() {
 
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_ESIM_STATE);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_GET_ESIM_STATE, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out or error to get esim state, retry");
             err = 1;
         }
@@ -2910,8 +2871,8 @@ gint setup_download_parameter(fdtl_data_t  *fdtl_data, gboolean efs_recovery_mod
 
     strcpy( fdtl_data[0].modem_port, g_diag_modem_port[0] );
     strcpy( fdtl_data[0].g_device_model_name, "" );
-    fdtl_data[0].download_process_state = DOWNLOAD_INIT;
     fdtl_data[0].device_idx = 0;
+    download_state_set(&fdtl_data[0], DOWNLOAD_INIT);
     fdtl_data[0].unlock_key = 0;
     fdtl_data[0].update_oem_pri = 0;
     fdtl_data[0].total_device_count = 1;
@@ -3246,7 +3207,7 @@ int start_update_process(gboolean is_startup, gboolean efs_recovery_mode) {
     }
 
     // Init progress dialog
-    g_progress_percent = 0;
+    pwl_progress_phase(PWL_PROGRESS_PHASE_PREPARE);
     g_is_get_fw_ver = FALSE;
 
     // Check AP version before download, TEMP
@@ -3270,7 +3231,7 @@ int start_update_process(gboolean is_startup, gboolean efs_recovery_mode) {
         pclose(g_progress_fp);
         g_progress_fp = NULL;
     }
-    if ((detect_gpu_status() != -1) && !is_startup) g_progress_fp = popen(g_progress_command,"w");
+    if (progress_dialog_enabled() && !is_startup) g_progress_fp = popen(g_progress_command,"w");
 
     if (!is_startup) update_progress_dialog(2, "Start update process...", NULL);
     PWL_LOG_INFO("Start update Process...");
@@ -3290,8 +3251,7 @@ int start_update_process(gboolean is_startup, gboolean efs_recovery_mode) {
 
         // Enable JP FCC config
         set_fw_update_status_value(JP_FCC_CONFIG_COUNT, 1);
-        send_message_queue(PWL_CID_SETUP_JP_FCC_CONFIG);
-        if (!cond_wait(&g_mutex, &g_cond, 600)) {
+        if (!send_message_queue_wait(PWL_CID_SETUP_JP_FCC_CONFIG, NULL, 600)) {
             PWL_LOG_ERR("timed out or error for jpp config, continue...");
         }
 
@@ -3350,21 +3310,13 @@ int start_update_process(gboolean is_startup, gboolean efs_recovery_mode) {
 
         // === Compare main fw version ===
         if (!is_startup) update_progress_dialog(2, "Compare fw image version", NULL);
-        if ((detect_gpu_status() != -1) && is_startup) g_progress_fp = popen(g_progress_command, "w");
+        if (progress_dialog_enabled() && is_startup) g_progress_fp = popen(g_progress_command, "w");
         gboolean up_to_date = FALSE;
         up_to_date = check_if_need_update();
 
         if (up_to_date) {
             PWL_LOG_INFO("Current fw image already up to date, abort! ");
-            if (!is_startup) {
-                update_progress_dialog(80, "up to date", "#Modem firmware is up to date\\n\\n\n");
-                g_usleep(1000 * 1000 * 3);
-                update_progress_dialog(100, "Finish update.", "#Modem firmware is up to date\\n\\n\n");
-            }
-            if (g_progress_fp != NULL) {
-                pclose(g_progress_fp);
-                g_progress_fp = NULL;
-            }
+            progress_dialog_finish(PWL_PROGRESS_PHASE_DONE, is_startup ? NULL : "#Modem firmware is up to date\\n\\n\n");
             return -1;
         } else {
             // Check eSIM profile Testprofile_Deletion_Done here
@@ -3412,14 +3364,7 @@ int start_update_process(gboolean is_startup, gboolean efs_recovery_mode) {
         }
 
         if (ret <= 0) {
-            g_progress_percent = 98;
-            update_progress_dialog(1, "Reset", "#Modem download error, will automatically retry later\\n\\n\n");
-            g_usleep(1000*1000*3);
-            update_progress_dialog(1, "Reset", "#Modem download error, will automatically retry later\\n\\n\n");
-            if (g_progress_fp != NULL) {
-                pclose(g_progress_fp);
-                g_progress_fp = NULL;
-            }
+            progress_dialog_finish(PWL_PROGRESS_PHASE_FAILED, "#Modem download error, will automatically retry later\\n\\n\n");
         }
         if (gpio_reset) {
             set_fw_update_status_value(NEED_RETRY_FW_UPDATE, 1);
@@ -4336,14 +4281,42 @@ int check_image_downlaod_table() {
     return RET_OK;
 }
 
+// One "|" separated line of the download table
+static void parse_download_table_line(char *download_string, char *partition, char *image, char *checksum) {
+    char *p;
+    int index = 0;
+
+    memset(partition, 0, MAX_IMG_FILE_NAME_LEN);
+    memset(image, 0, MAX_IMG_FILE_NAME_LEN);
+    memset(checksum, 0, MAX_CHECKSUM_LEN);
+
+    p = strtok(download_string, "|");
+    while(p != NULL) {
+        p = strtok(NULL, "|");
+        if (p != NULL) {
+            index++;
+            if (index == INDEX_PARTITION) {
+                strcpy(partition, p);
+            } else if (index == INDEX_IMAGE) {
+                strcpy(image, p);
+                if (!CHECK_CHECKSUM)
+                    break;
+            } else if (index == INDEX_CHECKSUM) {
+                strcpy(checksum, p);
+                checksum[strcspn(checksum, "\n")] = 0;
+            }
+        }
+    }
+}
+
 int parse_download_table_and_flash() {
     FILE *fp = NULL;
     char download_string[MAX_COMMAND_LEN] = {0};
     char partition[MAX_IMG_FILE_NAME_LEN] = {0};
     char image[MAX_IMG_FILE_NAME_LEN] = {0};
     char checksum[MAX_CHECKSUM_LEN] = {0};
-    char *p;
-    int index = 0;
+    uint64_t total_bytes = 0;
+    struct stat st;
 
     fp = fopen(FLASH_TABLE_FILE_NAME, "r");
     if (fp == NULL) {
@@ -4351,31 +4324,18 @@ int parse_download_table_and_flash() {
         return RET_FAILED;
     }
 
+    // Size of the images to send, the download progress is measured against it
     while(fscanf(fp, "%s", download_string) == 1) {
-        index = 0;
-        memset(partition, 0, sizeof(partition));
-        memset(image, 0, sizeof(image));
-        memset(checksum, 0, sizeof(checksum));
-
-        p = strtok(download_string, "|");
-        while(p != NULL) {
-            p = strtok(NULL, "|");
-            if (p != NULL) {
-                index++;
-                if (index == INDEX_PARTITION) {
-                    strcpy(partition, p);
-                } else if (index == INDEX_IMAGE) {
-                    strcpy(image, p);
-                    if (!CHECK_CHECKSUM)
-                        break;
-                } else if (index == INDEX_CHECKSUM) {
-                    strcpy(checksum, p);
-                    checksum[strcspn(checksum, "\n")] = 0;
-                }
-            }
-        }
+        parse_download_table_line(download_string, partition, image, checksum);
+        if (!strstr(image, "SKIP_") && stat(image, &st) == 0)
+            total_bytes += st.st_size;
+    }
+    rewind(fp);
+    pwl_progress_download_begin(total_bytes);
+
+    while(fscanf(fp, "%s", download_string) == 1) {
+        parse_download_table_line(download_string, partition, image, checksum);
         if (DEBUG) PWL_LOG_DEBUG("flash %s %s", partition, image);
-        update_progress_dialog(40/g_pcie_img_number_count, "Download images...", NULL);
 
         // Ignore SKIP images
         if (strstr(image, "SKIP_")) {
@@ -4389,6 +4349,7 @@ int parse_download_table_and_flash() {
         }
     }
     fclose(fp);
+    pwl_progress_download_end();
     return RET_OK;
 }
 
@@ -4411,24 +4372,7 @@ int query_t7xx_mode(char *mode) {
 }
 
 int find_fastboot_port(char *fastboot_port) {
-    FILE *fp;
-    fp = popen("find /dev/ -name wwan*fast*", "r");
-    if (fp == NULL) {
-        PWL_LOG_ERR("find port cmd error!!!");
-        return RET_FAILED;
-    }
-
-    char buffer[50];
-    memset(buffer, 0, sizeof(buffer));
-    char *ret = fgets(buffer, sizeof(buffer), fp);
-    pclose(fp);
-    buffer[strcspn(buffer, "\n")] = 0;
-
-    if (strlen(buffer) <= 0)
-        return RET_FAILED;
-
-    strcpy(fastboot_port, buffer);
-    return RET_OK;
+    return pwl_port_get(PWL_PORT_FASTBOOT, fastboot_port, PWL_PORT_PATH_LEN) ? RET_OK : RET_FAILED;
 }
 
 int send_fastboot_command(char *command, char *response) {
@@ -4597,6 +4541,7 @@ int flash_image(char *partition, char *image_file, char *checksum) {
                 PWL_LOG_ERR("Failed to write to fastboot port");
                 break;
             }
+            pwl_progress_bytes(bytes_written);
         }
         fclose(fp);
     } else {
@@ -4612,6 +4557,8 @@ int flash_image(char *partition, char *image_file, char *checksum) {
             return RET_FAILED;
         }
         pclose(fp2);
+        // cat is not followed, the image counts once it is through
+        pwl_progress_bytes(size);
     }
 
     pthread_t get_resp_thread;
@@ -4939,7 +4886,7 @@ int start_update_process_pcie(gboolean is_startup, int based_type) {
 
     // Init progress dialog
     g_is_fw_update_processing = IN_FW_UPDATE_PROCESSING;
-    g_progress_percent = 0;
+    pwl_progress_phase(PWL_PROGRESS_PHASE_PREPARE);
     g_is_get_fw_ver = FALSE;
     get_env_variable(env_variable, env_variable_length);
 
@@ -4954,7 +4901,7 @@ int start_update_process_pcie(gboolean is_startup, int based_type) {
         g_progress_fp = NULL;
     }
 
-    if ((detect_gpu_status() != -1) && !is_startup) g_progress_fp = popen(g_progress_command,"w");
+    if (progress_dialog_enabled() && !is_startup) g_progress_fp = popen(g_progress_command,"w");
 
     // if (!is_startup) update_progress_dialog(2, "Start update process...", NULL);
     PWL_LOG_INFO("Start update Process...");
@@ -5008,9 +4955,10 @@ int start_update_process_pcie(gboolean is_startup, int based_type) {
         return update_result;
     }
 
-    if ((detect_gpu_status() != -1) && is_startup) g_progress_fp = popen(g_progress_command, "w");
+    if (progress_dialog_enabled() && is_startup) g_progress_fp = popen(g_progress_command, "w");
 
     // Switch to download mode
+    pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_IN_PROGRESS);
     update_progress_dialog(3, "Switch to download mode...", NULL);
     if (switch_t7xx_mode(MODE_FASTBOOT_SWITCHING) != RET_OK) {
         PWL_LOG_ERR("Switch to fastboot mode error!");
@@ -5027,6 +4975,7 @@ int start_update_process_pcie(gboolean is_startup, int based_type) {
 
 DO_RESET:
     g_need_cxp_reboot = FALSE;
+    pwl_progress_phase(PWL_PROGRESS_PHASE_REBOOT);
     PWL_LOG_DEBUG("[Notice] DO RESET, update_result: %d", update_result);
 
     update_progress_dialog(20, "Preparing reset...", NULL);
@@ -5061,6 +5010,7 @@ DO_RESET:
     update_progress_dialog(10, "Finish download...", NULL);
     g_is_fw_update_processing = NOT_IN_FW_UPDATE_PROCESSING;
     if (update_result == RET_FAILED) {
+        pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_FAILED);
         set_fw_update_status_value(FW_UPDATE_RETRY_COUNT, g_fw_update_retry_count);
         g_fw_update_retry_count++;
         return RET_FAILED;
@@ -5071,11 +5021,13 @@ DO_RESET:
         memset(port, 0, sizeof(port));
         if (pwl_find_mbim_port(port, sizeof(port))) {
             // Download process pass and find mbim port success
+            pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_COMPLETED);
             set_fw_update_status_value(FW_UPDATE_RETRY_COUNT, 0);
             g_fw_update_retry_count = 0;
             return RET_OK;
         } else {
             // Download process pass, but can't find mbim port.
+            pwl_module_set_int(PWL_MODULE_UPDATE_STATE, PWL_UPDATE_STATE_FAILED);
             set_fw_update_status_value(FW_UPDATE_RETRY_COUNT, g_fw_update_retry_count);
             g_fw_update_retry_count++;
             return RET_FAILED;
@@ -5245,60 +5197,55 @@ int parse_checksum(char *checksum_file, char *key_image, char *checksum_value) {
 }
 
 gint post_message_queue_action(int action) {
-    int err, ret, retry, cid = 0;
+    int err, retry = 0, cid = 0;
+    char *content = NULL;
     char retry_msg[128] = {0};
+    char backup_str[SN_MAX_LENGTH + IMEI_MAX_LENGTH] = {0};
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
         switch (action) {
             // Get ATI info
             case MESSAGE_QUEUE_ACTION_GET_ATI_INFO:
                 cid = PWL_CID_GET_ATI;
-                send_message_queue(PWL_CID_GET_ATI);
                 snprintf(retry_msg, sizeof(retry_msg), "Get ATI info error, retry!");
                 break;
             // Backup current SN and IMEI
             case MESSAGE_QUEUE_ACTION_BACKUP_SN_IMEI:
                 cid = PWL_CID_BACKUP_SN_IMEI;
-                char backup_str[SN_MAX_LENGTH + IMEI_MAX_LENGTH] = {0};
                 snprintf(backup_str, sizeof(backup_str), "%s;%s", g_sn, g_imei);
                 snprintf(retry_msg, sizeof(retry_msg), "Backup SN/IMEI error, retry!");
-                send_message_queue_with_content(PWL_CID_BACKUP_SN_IMEI, backup_str);
+                content = backup_str;
                 break;
             // Get backup SN/IMEI
             case MESSAGE_QUEUE_ACTION_GET_BACKUP_SN_IMEI:
                 cid = PWL_CID_GET_BACKUP_SN_IMEI;
-                send_message_queue(PWL_CID_GET_BACKUP_SN_IMEI);
                 snprintf(retry_msg, sizeof(retry_msg), "Get Backup SN/IMEI error, retry!");
                 break;
             // Restore backup SN
             case MESSAGE_QUEUE_ACTION_RESTORE_SN:
                 cid = PWL_CID_RESTORE_SN;
-                send_message_queue_with_content(PWL_CID_RESTORE_SN, g_sn);
+                content = g_sn;
                 snprintf(retry_msg, sizeof(retry_msg), "Restore SN error, retry!");
                 break;
             // Restore backup IMEI
             case MESSAGE_QUEUE_ACTION_RESTORE_IMEI:
                 cid = PWL_CID_RESTORE_IMEI;
-                send_message_queue_with_content(PWL_CID_RESTORE_IMEI, g_imei);
+                content = g_imei;
                 snprintf(retry_msg, sizeof(retry_msg), "Restore IMEI error, retry!");
                 break;
             default:
-                break;
+                PWL_LOG_ERR("Unknown message queue action: %d", action);
+                return RET_FAILED;
         }
 
-        pthread_mutex_lock(&g_mutex);
-        struct timespec timeout;
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
-        ret = pthread_cond_timedwait(&g_cond, &g_mutex, &timeout);
+        gboolean replied = send_message_queue_wait(cid, content, PWL_CMD_TIMEOUT_SEC);
 
         if (DEBUG) PWL_LOG_DEBUG("CID: %s, Status: %d", cid_name[g_pwl_cid_map[cid].pwl_cid], g_pwl_cid_map[cid].status);
 
-        if (ret == ETIMEDOUT || ret != 0 || g_pwl_cid_map[cid].status == PWL_CID_STATUS_ERROR) {
+        if (!replied || g_pwl_cid_map[cid].status == PWL_CID_STATUS_ERROR) {
             PWL_LOG_ERR("%s", retry_msg);
             err = 1;
         }
-        pthread_mutex_unlock(&g_mutex);
         if (err) {
             retry++;
             continue;
@@ -5359,6 +5306,7 @@ gint prepare_recovery_image() {
 
 gint main( int Argc, char **Argv )
 {
+    pwl_log_init();
     PWL_LOG_INFO("start");
     gboolean efs_recovery_mode = FALSE;
 
@@ -5398,6 +5346,7 @@ gint main( int Argc, char **Argv )
     // signal_callback.callback_retry_fw_update = signal_callback_retry_fw_update;
     signal_callback.callback_notice_module_recovery_finish = signal_callback_notice_module_recovery_finish;
     registerSignalCallback(&signal_callback);
+    pwl_progress_init(progress_changed_cb);
 
     gdbus_init();
     while(!dbus_service_is_ready());
@@ -118,10 +118,13 @@
 #define MESSAGE_QUEUE_ACTION_RESTORE_SN             3
 #define MESSAGE_QUEUE_ACTION_RESTORE_IMEI           4
 
-
 //GPIO Reset 
 #define ENABLE_GPIO_RESET               1
 
+// zenity progress dialog, a subscriber of the update progress
+#define ENABLE_PROGRESS_DIALOG          1
+#define GPU_STATUS_RECHECK_SEC          60
+
 typedef void (*signal_get_retry_fw_update_callback)(const gchar*);
 typedef void (*signal_notice_module_recovery_finish_callback)(int);
 
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <pthread.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_metrics.h"
+#include "pwl_progress.h"
+
+static const char * const progress_phase_name[] = {
+    [PWL_PROGRESS_PHASE_IDLE] = "idle",
+    [PWL_PROGRESS_PHASE_PREPARE] = "prepare",
+    [PWL_PROGRESS_PHASE_DOWNLOAD] = "download",
+    [PWL_PROGRESS_PHASE_REBOOT] = "reboot",
+    [PWL_PROGRESS_PHASE_FINALIZE] = "finalize",
+    [PWL_PROGRESS_PHASE_DONE] = "done",
+    [PWL_PROGRESS_PHASE_FAILED] = "failed",
+};
+
+static pthread_mutex_t g_progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pwl_progress_callback g_progress_cb = NULL;
+static pwl_progress_phase_t g_phase = PWL_PROGRESS_PHASE_IDLE;
+static int g_percent = 0;
+static int g_download_from = 0;
+static uint64_t g_total_bytes = 0;
+static uint64_t g_sent_bytes = 0;
+static uint64_t g_rate = 0;             // bytes per second, smoothed
+static uint64_t g_rate_us = 0;          // when g_rate was last updated
+static uint64_t g_rate_sent = 0;        // g_sent_bytes at that time
+
+typedef struct {
+    pwl_progress_callback cb;
+    int percent;
+    pwl_progress_phase_t phase;
+    uint64_t rate;
+    int eta_sec;
+} progress_update_t;
+
+// Called with the mutex held, the callback runs after it is released
+static void progress_capture(progress_update_t *update) {
+    update->cb = g_progress_cb;
+    update->percent = g_percent;
+    update->phase = g_phase;
+    update->rate = (g_phase == PWL_PROGRESS_PHASE_DOWNLOAD) ? g_rate : 0;
+    update->eta_sec = -1;
+    if (g_phase == PWL_PROGRESS_PHASE_DOWNLOAD && g_rate > 0 && g_total_bytes >= g_sent_bytes)
+        update->eta_sec = (int)((g_total_bytes - g_sent_bytes) / g_rate);
+}
+
+static void progress_notify(const progress_update_t *update) {
+    if (update->cb != NULL)
+        update->cb(update->percent, update->phase, update->rate, update->eta_sec);
+}
+
+void pwl_progress_init(pwl_progress_callback cb) {
+    pthread_mutex_lock(&g_progress_mutex);
+    g_progress_cb = cb;
+    pthread_mutex_unlock(&g_progress_mutex);
+}
+
+void pwl_progress_phase(pwl_progress_phase_t phase) {
+    progress_update_t update;
+
+    if (phase >= PWL_PROGRESS_PHASE_MAX)
+        return;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    g_phase = phase;
+    if (phase == PWL_PROGRESS_PHASE_PREPARE)
+        g_percent = 0;
+    else if (phase == PWL_PROGRESS_PHASE_DONE)
+        g_percent = 100;
+    progress_capture(&update);
+    pthread_mutex_unlock(&g_progress_mutex);
+
+    PWL_LOG_INFO("[PROGRESS] %s at %d%%", progress_phase_name[phase], update.percent);
+    progress_notify(&update);
+}
+
+void pwl_progress_set(int percent) {
+    progress_update_t update;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    g_percent = CLAMP(percent, 0, 100);
+    progress_capture(&update);
+    pthread_mutex_unlock(&g_progress_mutex);
+
+    progress_notify(&update);
+}
+
+void pwl_progress_download_begin(uint64_t total_bytes) {
+    progress_update_t update;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    g_phase = PWL_PROGRESS_PHASE_DOWNLOAD;
+    g_download_from = g_percent;
+    g_total_bytes = total_bytes;
+    g_sent_bytes = 0;
+    g_rate = 0;
+    g_rate_us = pwl_metrics_now();
+    g_rate_sent = 0;
+    progress_capture(&update);
+    pthread_mutex_unlock(&g_progress_mutex);
+
+    PWL_LOG_INFO("[PROGRESS] download %llu bytes", (unsigned long long)total_bytes);
+    progress_notify(&update);
+}
+
+// Transport hook, once per written chunk
+void pwl_progress_bytes(uint64_t bytes) {
+    progress_update_t update;
+    uint64_t now_us = pwl_metrics_now();
+    uint64_t elapsed_us;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    if (g_phase != PWL_PROGRESS_PHASE_DOWNLOAD) {
+        pthread_mutex_unlock(&g_progress_mutex);
+        return;
+    }
+    g_sent_bytes += bytes;
+
+    elapsed_us = now_us - g_rate_us;
+    if (elapsed_us < PWL_PROGRESS_INTERVAL_MS * 1000ULL) {
+        pthread_mutex_unlock(&g_progress_mutex);
+        return;
+    }
+
+    // Smoothed, one slow USB bulk transfer should not make the ETA jump
+    uint64_t rate = (g_sent_bytes - g_rate_sent) * 1000000ULL / elapsed_us;
+    g_rate = (g_rate == 0) ? rate : (g_rate * 7 + rate * 3) / 10;
+    g_rate_us = now_us;
+    g_rate_sent = g_sent_bytes;
+
+    // The total is the image file sizes, stay below the share until the download ends
+    if (g_total_bytes > 0) {
+        uint64_t sent = MIN(g_sent_bytes, g_total_bytes);
+        int percent = g_download_from + (int)(sent * PWL_PROGRESS_DOWNLOAD_SHARE / g_total_bytes);
+
+        g_percent = MAX(g_percent, MIN(percent, g_download_from + PWL_PROGRESS_DOWNLOAD_SHARE - 1));
+    }
+    progress_capture(&update);
+    pthread_mutex_unlock(&g_progress_mutex);
+
+    progress_notify(&update);
+}
+
+void pwl_progress_download_end() {
+    progress_update_t update;
+    uint64_t sent;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    if (g_phase != PWL_PROGRESS_PHASE_DOWNLOAD) {
+        pthread_mutex_unlock(&g_progress_mutex);
+        return;
+    }
+    g_percent = MIN(g_download_from + PWL_PROGRESS_DOWNLOAD_SHARE, 100);
+    g_total_bytes = g_sent_bytes;
+    sent = g_sent_bytes;
+    progress_capture(&update);
+    pthread_mutex_unlock(&g_progress_mutex);
+
+    PWL_LOG_INFO("[PROGRESS] download done, %llu bytes", (unsigned long long)sent);
+    progress_notify(&update);
+}
+
+int pwl_progress_percent() {
+    int percent;
+
+    pthread_mutex_lock(&g_progress_mutex);
+    percent = g_percent;
+    pthread_mutex_unlock(&g_progress_mutex);
+    return percent;
+}
+
+const char *pwl_progress_phase_name(pwl_progress_phase_t phase) {
+    if (phase >= PWL_PROGRESS_PHASE_MAX)
+        return "unknown";
+    return progress_phase_name[phase];
+}
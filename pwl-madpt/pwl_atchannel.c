@@ -21,8 +21,10 @@
 
 #include "common.h"
 #include "pwl_atchannel.h"
+#include "pwl_port.h"
+#include "pwl_record.h"
 
-static gchar g_port[20];
+static gchar g_port[PWL_PORT_PATH_LEN];
 
 
 gboolean send_at_cmd(const char *port, const char *command, gchar **response) {
@@ -77,7 +79,7 @@ gboolean send_at_cmd(const char *port, const char *command, gchar **response) {
 
     fd_set rset;
     struct timeval time = {PWL_CMD_TIMEOUT_SEC, 0};
-    char resp[PWL_MQ_MAX_RESP] = {0};
+    char resp[PWL_MSG_MAX_RESP] = {0};
     int resp_len = 0;
 
     FD_ZERO(&rset);
@@ -91,13 +93,14 @@ gboolean send_at_cmd(const char *port, const char *command, gchar **response) {
     }
 
     while (select(fd + 1, &rset, NULL, NULL, &time) > 0) {
-        char buffer[PWL_MQ_MAX_RESP];
+        char buffer[PWL_MSG_MAX_RESP];
         memset(buffer, 0, sizeof(buffer));
 
         ssize_t len = read(fd, buffer, sizeof(resp));
         if (len > 0) {
-            if (resp_len < PWL_MQ_MAX_RESP) {
-                ssize_t copy_len = (((resp_len + len) > PWL_MQ_MAX_RESP) ? (PWL_MQ_MAX_RESP - resp_len) : len);
+            // Keep the terminator, resp is used as a string
+            if (resp_len < PWL_MSG_MAX_RESP - 1) {
+                ssize_t copy_len = (((resp_len + len) > PWL_MSG_MAX_RESP - 1) ? (PWL_MSG_MAX_RESP - 1 - resp_len) : len);
                 memcpy(resp + resp_len, buffer, copy_len);
                 resp_len += copy_len;
                 if (DEBUG) PWL_LOG_DEBUG("response read(%ld): %s", len, resp);
@@ -160,25 +163,11 @@ exit:
 gboolean pwl_atchannel_find_at_port() {
     PWL_LOG_INFO("looking for port..");
     gboolean found = FALSE;
-    FILE *fp = NULL;
-
-    pwl_device_type_t type = pwl_get_device_type();
-    if (type == PWL_DEVICE_TYPE_USB) {
-        fp = popen("find /dev/ -name ttyUSB*", "r");
-    } else if (type == PWL_DEVICE_TYPE_PCIE) {
-        fp = popen("find /dev/ -name wwan0at*", "r");
-    }
-
-    if (fp == NULL) {
-        PWL_LOG_ERR("find at port cmd error!!!");
-        return found;
-    }
-
-    char port[20];
-    memset(port, 0, sizeof(port));
-    while (fgets(port, sizeof(port), fp) != NULL) {
-        port[strcspn(port, "\n")] = 0;
+    gchar ports[PWL_PORT_MAX_PER_TYPE][PWL_PORT_PATH_LEN];
+    gint count = pwl_port_list(PWL_PORT_AT, ports, PWL_PORT_MAX_PER_TYPE);
 
+    for (gint i = 0; i < count; i++) {
+        gchar *port = ports[i];
         gchar *response = NULL;
         gboolean result = send_at_cmd(port, "AT", &response);
         if (!result) {
@@ -200,7 +189,6 @@ gboolean pwl_atchannel_find_at_port() {
             free(response);
         }
     }
-    pclose(fp);
 
     return found;
 }
@@ -215,33 +203,16 @@ gboolean pwl_atchannel_at_req(const gchar *command, gchar **response) {
         }
     }
 
-    return send_at_cmd(g_port, command, response);
+    pwl_record_text(PWL_RECORD_AT_CMD, command);
+    gboolean ret = send_at_cmd(g_port, command, response);
+    pwl_record_text(PWL_RECORD_AT_RESP, ret ? *response : NULL);
+    return ret;
 }
 
 gboolean pwl_atchannel_at_port_wait() {
-    for (int i = 0; i < 10; i++) {
-
-        FILE *fp = NULL;
-        pwl_device_type_t type = pwl_get_device_type();
-        if (type == PWL_DEVICE_TYPE_USB) {
-            fp = popen("find /dev/ -name ttyUSB*", "r");
-        } else if (type == PWL_DEVICE_TYPE_PCIE) {
-            fp = popen("find /dev/ -name wwan0at*", "r");
-        }
-
-        if (fp == NULL) {
-            PWL_LOG_ERR("find at port cmd error!!!");
-            continue;
-        }
-        char port[20];
-        memset(port, 0, sizeof(port));
-        if (fgets(port, sizeof(port), fp) != NULL) {
-            PWL_LOG_INFO("AT port wait... found");
-            pclose(fp);
-            return TRUE;
-        }
-        pclose(fp);
-        sleep(5);
+    if (pwl_port_wait(PWL_PORT_AT, TRUE, 50)) {
+        PWL_LOG_INFO("AT port wait... found");
+        return TRUE;
     }
     return FALSE;
 }
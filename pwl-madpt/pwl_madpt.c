@@ -26,9 +26,13 @@
 #include "common.h"
 #include "dbus_common.h"
 #include "log.h"
+#include "pwl_ipc.h"
 #include "pwl_atchannel.h"
 #include "pwl_madpt.h"
 #include "pwl_mbimdeviceadpt.h"
+#include "pwl_metrics.h"
+#include "pwl_port.h"
+#include "pwl_trace.h"
 
 
 #define ATCMD_INDEX_MAP(cid) \
@@ -74,7 +78,7 @@ gint g_exit_code = EXIT_SUCCESS;
 pwl_at_intf_t g_at_intf = PWL_AT_OVER_MBIM_API;
 GThread *g_mbim_recv_thread = NULL;
 uint32_t mbim_err_cnt = 0;
-char g_response[PWL_MQ_MAX_RESP];
+char g_response[PWL_MSG_MAX_RESP];
 int g_oem_pri_state = -1;
 
 static pwl_device_type_t g_device_type = PWL_DEVICE_TYPE_UNKNOWN;
@@ -82,6 +86,15 @@ static GMainLoop *gp_loop = NULL;
 static pwlCore *gp_proxy = NULL;
 static gulong g_ret_signal_handler[RET_SIGNAL_HANDLE_SIZE];
 static signal_callback_t g_signal_callback;
+
+// Sleep gate, no AT request starts while the host suspends or MBIM is re-armed
+static pthread_mutex_t g_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_sleep_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t g_rearm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gboolean g_host_suspended = FALSE;
+static gint g_rearm_pending = 0;
+static gboolean g_request_busy = FALSE;
+static gboolean g_rearm_opened = FALSE;
 //static method_callback_t g_method_callback;
 
 static void mbim_device_ready_cb(gboolean opened);
@@ -100,7 +113,7 @@ gboolean at_resp_parsing(const gchar *rsp, gchar *buff_ptr, guint32 buff_size) {
         start = strstr(start, "\n");
     }
 
-    gchar pcie_buffer[PWL_MQ_MAX_RESP] = {0};
+    gchar pcie_buffer[PWL_MSG_MAX_RESP] = {0};
     if (start != NULL) {
         // check if start with '\n'
         while (strncmp(start, "\n", strlen("\n")) == 0) {
@@ -113,8 +126,9 @@ gboolean at_resp_parsing(const gchar *rsp, gchar *buff_ptr, guint32 buff_size) {
     if (end == NULL)
     {
         end = strstr(rsp, "OK");
-        if (end == NULL && (strlen(rsp) == PWL_MQ_MAX_RESP)) {
-            end = start + PWL_MQ_MAX_RESP;
+        // Filled the whole AT channel buffer, the rest was not read
+        if (end == NULL && start != NULL && strlen(rsp) >= PWL_MSG_MAX_RESP - 1) {
+            end = start + strlen(start);
         }
         if (strstr(rsp, "ERROR") != NULL) {
             return FALSE;
@@ -136,7 +150,7 @@ gboolean at_resp_parsing(const gchar *rsp, gchar *buff_ptr, guint32 buff_size) {
                 if (strstr(rsp, "ESIM")) {
                     start = strstr(rsp, "ESIM");
                 }
-                strcpy(pcie_buffer, start);
+                g_strlcpy(pcie_buffer, start, sizeof(pcie_buffer));
                 pcie_buffer[strcspn(pcie_buffer, "\n")] = 0;
                 memset(buff_ptr, 0, strlen(pcie_buffer));
                 strncpy(buff_ptr, pcie_buffer, strlen(pcie_buffer));
@@ -186,7 +200,7 @@ pwl_cid_status_t at_cmd_request(gchar *command) {
             res = pwl_atchannel_at_req(command, &response);
         }
         if (res) {
-            if (!at_resp_parsing(response, g_response, PWL_MQ_MAX_RESP)) {
+            if (!at_resp_parsing(response, g_response, PWL_MSG_MAX_RESP)) {
                 if (response) free(response);
                 return PWL_CID_STATUS_ERROR;
             }
@@ -236,7 +250,7 @@ static void mbim_at_resp_cb(const gchar* response) {
     } else if (strcmp(response, "QUERY ERROR") == 0) {
         mbim_err_cnt++;
     } else {
-        at_resp_parsing(response, g_response, PWL_MQ_MAX_RESP);
+        at_resp_parsing(response, g_response, PWL_MSG_MAX_RESP);
         pthread_cond_signal(&g_cond);
     }
 }
@@ -262,11 +276,21 @@ static gboolean signal_notice_module_recovery_finish_handler(pwlCore *object, in
    return TRUE;
 }
 
+static gboolean signal_sleep_state_change_handler(pwlCore *object, gboolean arg_suspend, gpointer userdata) {
+   if (NULL != g_signal_callback.callback_sleep_state_change) {
+       g_signal_callback.callback_sleep_state_change(arg_suspend);
+   }
+
+   return TRUE;
+}
+
 gboolean register_client_signal_handler(pwlCore *p_proxy) {
     PWL_LOG_DEBUG("register_client_signal_handler call.");
     g_ret_signal_handler[0] = g_signal_connect(p_proxy, "notify::g-name-owner", G_CALLBACK(cb_owner_name_changed_notify), NULL);
     g_ret_signal_handler[1] = g_signal_connect(p_proxy, "notice-module-recovery-finish",
                                                G_CALLBACK(signal_notice_module_recovery_finish_handler), NULL);
+    g_ret_signal_handler[2] = g_signal_connect(p_proxy, "sleep-state-change",
+                                               G_CALLBACK(signal_sleep_state_change_handler), NULL);
     return TRUE;
 }
 
@@ -337,17 +361,7 @@ gboolean dbus_service_is_ready(void) {
 }
 
 void send_message_queue(uint32_t cid) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
-
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_MADPT;
-
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    pwl_ipc_request(PWL_MQ_ID_MADPT, cid, NULL, FALSE);
 }
 
 gboolean mbim_init(gboolean boot) {
@@ -358,42 +372,172 @@ gboolean mbim_init(gboolean boot) {
         cb = mbim_device_ready_cb;
     }
 
+    // Retry when the port shows up instead of on a fixed period
     while (!pwl_mbimdeviceadpt_init(cb)) {
-        sleep(5);
+        pwl_port_wait(PWL_PORT_MBIM, TRUE, 5);
     }
 
     return TRUE;
 }
 
+static gboolean sleep_gate_closed() {
+    return g_host_suspended || g_rearm_pending > 0;
+}
+
+// Waits for the gate to open. The bound only covers a resume signal that never came,
+// a re-arm in progress ends on its own timeouts and is always waited for.
+static void sleep_gate_enter() {
+    struct timespec timeout;
+    gint waited = 0;
+
+    pthread_mutex_lock(&g_sleep_mutex);
+    // One second slices, a slice that spans the suspend itself only ends early
+    while (g_rearm_pending > 0 || (g_host_suspended && waited < PWL_SLEEP_GATE_MAX_SEC)) {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += 1;
+        pthread_cond_timedwait(&g_sleep_cond, &g_sleep_mutex, &timeout);
+        waited++;
+    }
+    if (sleep_gate_closed())
+        PWL_LOG_ERR("Host not resumed in %ds, send request anyway", PWL_SLEEP_GATE_MAX_SEC);
+    g_request_busy = TRUE;
+    pthread_mutex_unlock(&g_sleep_mutex);
+}
+
+static void sleep_gate_leave() {
+    pthread_mutex_lock(&g_sleep_mutex);
+    g_request_busy = FALSE;
+    pthread_cond_broadcast(&g_sleep_cond);
+    pthread_mutex_unlock(&g_sleep_mutex);
+}
+
+// TRUE once no request is in flight
+static gboolean sleep_wait_idle(gint timeout_sec) {
+    struct timespec timeout;
+    gboolean idle;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += timeout_sec;
+    pthread_mutex_lock(&g_sleep_mutex);
+    while (g_request_busy) {
+        if (pthread_cond_timedwait(&g_sleep_cond, &g_sleep_mutex, &timeout) != 0)
+            break;
+    }
+    idle = !g_request_busy;
+    pthread_mutex_unlock(&g_sleep_mutex);
+    return idle;
+}
+
+static void sleep_mbim_ready_cb(gboolean opened) {
+    pthread_mutex_lock(&g_sleep_mutex);
+    g_rearm_opened = TRUE;
+    pthread_cond_broadcast(&g_sleep_cond);
+    pthread_mutex_unlock(&g_sleep_mutex);
+}
+
+// Reopen the MBIM session unless one cheap AT round trip shows it survived
+static void sleep_rearm_mbim() {
+    struct timespec timeout;
+
+    at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_GET_ATE)]);
+    if (cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        PWL_LOG_INFO("MBIM session survived the suspend");
+        return;
+    }
+
+    PWL_LOG_INFO("MBIM session lost over suspend, reopen");
+    pwl_mbimdeviceadpt_deinit();
+    if (!pwl_mbimdeviceadpt_port_wait()) {
+        PWL_LOG_ERR("mbim port still not available after resume");
+        return;
+    }
+
+    pthread_mutex_lock(&g_sleep_mutex);
+    g_rearm_opened = FALSE;
+    pthread_mutex_unlock(&g_sleep_mutex);
+    if (!pwl_mbimdeviceadpt_init(sleep_mbim_ready_cb))
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += PWL_CMD_TIMEOUT_SEC;
+    pthread_mutex_lock(&g_sleep_mutex);
+    while (!g_rearm_opened) {
+        if (pthread_cond_timedwait(&g_sleep_cond, &g_sleep_mutex, &timeout) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&g_sleep_mutex);
+}
+
+static gpointer sleep_quiesce_thread_func(gpointer data) {
+    if (sleep_wait_idle(PWL_SLEEP_QUIESCE_TIMEOUT_SEC)) {
+        PWL_LOG_INFO("No request in flight, ready to suspend");
+        pwl_core_call_sleep_ready_method(gp_proxy, NULL, NULL, NULL);
+    } else {
+        PWL_LOG_ERR("Request still in flight, core suspends on timeout");
+    }
+    return NULL;
+}
+
+static gpointer sleep_resume_thread_func(gpointer data) {
+    // Back to back resumes re-arm one after the other
+    pthread_mutex_lock(&g_rearm_mutex);
+    if (sleep_wait_idle(PWL_CMD_TIMEOUT_SEC) && g_at_intf == PWL_AT_OVER_MBIM_API)
+        sleep_rearm_mbim();
+    mbim_err_cnt = 0;
+    pthread_mutex_unlock(&g_rearm_mutex);
+
+    pthread_mutex_lock(&g_sleep_mutex);
+    g_rearm_pending--;
+    pthread_cond_broadcast(&g_sleep_cond);
+    pthread_mutex_unlock(&g_sleep_mutex);
+    return NULL;
+}
+
+void signal_callback_sleep_state_change(gboolean suspend) {
+    pthread_mutex_lock(&g_sleep_mutex);
+    g_host_suspended = suspend;
+    if (!suspend)
+        g_rearm_pending++;
+    pthread_mutex_unlock(&g_sleep_mutex);
+
+    // Both wait for the request in flight, keep the main loop free for its answer
+    if (suspend)
+        g_thread_new("sleep_quiesce_thread", sleep_quiesce_thread_func, NULL);
+    else
+        g_thread_new("sleep_resume_thread", sleep_resume_thread_func, NULL);
+}
+
 static gpointer msg_queue_thread_func(gpointer data) {
-    mqd_t mq;
-    struct mq_attr attr;
     msg_buffer_t message;
+    uint32_t request_id;
     pwl_cid_status_t status = PWL_CID_STATUS_OK;
     char *cust_set_cmd;
     char device_package_ver[DEVICE_PACKAGE_VERSION_LENGTH];
     int cmd_len = 0;
-    /* initialize the queue attributes */
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = PWL_MQ_MAX_MSG;
-    attr.mq_msgsize = sizeof(message);
-    attr.mq_curmsgs = 0;
     gboolean has_flash_oem_img = FALSE;
     gboolean efs_recovery_mode = FALSE;
-    /* create the message queue */
-    mq = mq_open(PWL_MQ_PATH_MADPT, O_CREAT | O_RDONLY, 0644, &attr);
+    /* create the message ring and queue */
+    if (!pwl_ipc_open_endpoint(PWL_MQ_ID_MADPT))
+        return NULL;
 
     while (1) {
-        ssize_t bytes_read;
-
         /* receive the message */
-        bytes_read = mq_receive(mq, (gchar *)&message, sizeof(message), NULL);
+        if (!pwl_ipc_receive(&message, &request_id)) {
+            sleep(1);
+            continue;
+        }
 
         print_message_info(&message);
+        // Post flash sequences run for minutes, they pass the gate per AT command instead
+        gboolean gated = message.pwl_cid != PWL_CID_MADPT_RESTART &&
+                         message.pwl_cid != PWL_CID_SETUP_JP_FCC_CONFIG;
+        if (gated)
+            sleep_gate_enter();
 
         gboolean timedwait = TRUE;
+        uint64_t start_us = pwl_metrics_now();
         status = PWL_CID_STATUS_OK;
-        memset(g_response, 0, PWL_MQ_MAX_RESP);
+        memset(g_response, 0, PWL_MSG_MAX_RESP);
 
         if (message.pwl_cid == PWL_CID_MADPT_RESTART) {
             has_flash_oem_img = FALSE;
@@ -495,58 +639,70 @@ static gpointer msg_queue_thread_func(gpointer data) {
             }
         }
 
+        // timedwait is only cleared for cids that send no AT command
+        if (timedwait) {
+            gboolean mbim = (g_at_intf != PWL_AT_CHANNEL);
+
+            pwl_metrics_observe_since(mbim ? PWL_METRIC_MBIM_LATENCY : PWL_METRIC_AT_LATENCY,
+                                      message.pwl_cid, start_us);
+            if (status != PWL_CID_STATUS_OK)
+                pwl_metrics_add(mbim ? PWL_METRIC_MBIM_TIMEOUT : PWL_METRIC_AT_TIMEOUT, message.pwl_cid, 1);
+        }
+        if (gated)
+            sleep_gate_leave();
+
         PWL_LOG_INFO("total error (%d)", mbim_err_cnt);
 
         switch (message.pwl_cid)
         {   
             case PWL_CID_GET_ATE:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, "OK");
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, "OK");
                 break;
             case PWL_CID_GET_ATI:
                 // PWL_LOG_DEBUG("g_response: %s", g_response);
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_FW_VER:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PCIE_DEVICE_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PCIE_AP_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_SWITCH_TO_FASTBOOT:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, "Switch to fastboot cmd done");
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, "Switch to fastboot cmd done");
                 break;
             case PWL_CID_CHECK_OEM_PRI_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PREF_CARRIER:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_DEL_TUNE_CODE:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_SET_PREF_CARRIER:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_SET_OEM_PRI_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_CRSM:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_CIMI:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PCIE_OP_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PCIE_OEM_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_PCIE_DPV_VERSION:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_CARRIER_ID:
                 if (strlen(g_response) > 0) {
@@ -562,52 +718,52 @@ static gpointer msg_queue_thread_func(gpointer data) {
                                 if (index == 1)
                                     break;
                             }
-                            send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, id);
+                            send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, id);
                         } else {
                             PWL_LOG_ERR("SBP response format not correct, can't parse carrier id");
-                            send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, PWL_CID_STATUS_ERROR, "");
+                            send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, PWL_CID_STATUS_ERROR, "");
                         }
                     } else {
                         PWL_LOG_ERR("SBP response format not correct, can't parse carrier id");
-                        send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, PWL_CID_STATUS_ERROR, "");
+                        send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, PWL_CID_STATUS_ERROR, "");
                     }
                 } else {
                     PWL_LOG_ERR("Can't get sim SBP id, clear carrier id.");
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, PWL_CID_STATUS_ERROR, "");
+                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, PWL_CID_STATUS_ERROR, "");
                 }
                 break;
             case PWL_CID_GET_OEM_PRI_RESET_STATE:
                 PWL_LOG_DEBUG("PWL_CID_GET_OEM_PRI_RESET_STATE, g_response: %s", g_response);
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_GET_MODULE_SKU_ID:
                 if (strlen(g_response) > 0) {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 } else {
                     PWL_LOG_ERR("Can't get module SKU ID");
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, PWL_CID_STATUS_ERROR, g_response);
+                    send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, PWL_CID_STATUS_ERROR, g_response);
                 }
                 break;
             case PWL_CID_SETUP_JP_FCC_CONFIG:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, "");
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, "");
                 break;
             case PWL_CID_GET_ESIM_STATE:
                 PWL_LOG_DEBUG("[DPV] esim: %s", g_response);
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_CHECK_ESIM_TEST_PROF:
                 if (DEBUG) PWL_LOG_DEBUG("Check eSIM test profile");
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_DELETE_ESIM_TEST_PROF:
                 if (DEBUG) PWL_LOG_DEBUG("Delete eSIM test profile");
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_RESTORE_SN:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             case PWL_CID_RESTORE_IMEI:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, status, g_response);
+                send_message_reply(message.pwl_cid, PWL_MQ_ID_MADPT, message.sender_id, request_id, status, g_response);
                 break;
             default:
                 PWL_LOG_ERR("Unknown pwl cid: %d", message.pwl_cid);
@@ -627,11 +783,14 @@ static gpointer jp_fcc_thread_func(gpointer data) {
         set_fw_update_status_value(JP_FCC_CONFIG_COUNT, jp_fcc_config_retry);
         jp_fcc_config(TRUE, FALSE, FALSE);
     } else {
+        // The boot open is already in flight, answer as soon as it completes
         PWL_LOG_INFO("wait for modem to get ready");
-        sleep(PWL_MBIM_READY_SEC);
+        time_t start = time(NULL);
+        if (!pwl_mbimdeviceadpt_wait_open(PWL_MBIM_READY_SEC) && time(NULL) - start < PWL_MBIM_READY_SEC)
+            sleep(PWL_MBIM_READY_SEC - (time(NULL) - start));
     }
 
-    send_message_reply(PWL_CID_MADPT_RESTART, PWL_MQ_ID_MADPT, PWL_MQ_ID_FWUPDATE, PWL_CID_STATUS_OK, "Madpt started");
+    send_message_reply(PWL_CID_MADPT_RESTART, PWL_MQ_ID_MADPT, PWL_MQ_ID_FWUPDATE, PWL_IPC_REQUEST_ID_NONE, PWL_CID_STATUS_OK, "Madpt started");
     return NULL;
 }
 
@@ -645,21 +804,79 @@ static gpointer recovery_wait_thread_func(gpointer data) {
     //Send signal to pwl_pref to get fw version
     pwl_core_call_madpt_ready_method (gp_proxy, NULL, NULL, NULL);
 
-    send_message_reply(PWL_CID_MADPT_RESTART, PWL_MQ_ID_MADPT, PWL_MQ_ID_FWUPDATE, PWL_CID_STATUS_OK, "Madpt started");
+    send_message_reply(PWL_CID_MADPT_RESTART, PWL_MQ_ID_MADPT, PWL_MQ_ID_FWUPDATE, PWL_IPC_REQUEST_ID_NONE, PWL_CID_STATUS_OK, "Madpt started");
     return NULL;
 }
 
+// Sleeps the current backoff step, FALSE when it would run past the deadline
+static gboolean postflash_backoff(gint *delay, time_t deadline, const char *what) {
+    if (time(NULL) + *delay > deadline) {
+        pwl_trace(PWL_TRACE_RETRY, 0, -1, what);
+        return FALSE;
+    }
+    pwl_trace(PWL_TRACE_WAIT, 0, *delay, what);
+    sleep(*delay);
+    *delay = MIN(*delay * 2, POSTFLASH_BACKOFF_MAX_SEC);
+    return TRUE;
+}
+
+// Query a madpt AT cid, the answer is in g_response. Also runs off the message thread
+// (jp fcc retry, recovery), so every round trip passes the sleep gate on its own.
+static gboolean postflash_at_query(pwl_cid_t cid) {
+    pwl_cid_status_t status;
+    gboolean ret = TRUE;
+
+    sleep_gate_enter();
+    status = madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(cid)]);
+    if (g_at_intf != PWL_AT_OVER_MBIM_API) {
+        ret = status == PWL_CID_STATUS_OK;
+    } else if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        PWL_LOG_ERR("timed out or error for cid %s", cid_name[cid]);
+        ret = FALSE;
+    }
+    sleep_gate_leave();
+    return ret;
+}
+
+// Reopen MBIM once the port is back, each try waits for the open to complete
+static gboolean postflash_mbim_open(gint timeout_sec) {
+    time_t deadline = time(NULL) + timeout_sec;
+    gint delay = POSTFLASH_BACKOFF_MIN_SEC;
+
+    mbim_err_cnt = 0;
+    do {
+        if (pwl_port_wait(PWL_PORT_MBIM, TRUE, MAX(deadline - time(NULL), 1))) {
+            pwl_mbimdeviceadpt_deinit();
+            if (pwl_mbimdeviceadpt_init(NULL) && pwl_mbimdeviceadpt_wait_open(PWL_CMD_TIMEOUT_SEC))
+                return TRUE;
+        }
+        PWL_LOG_INFO("mbim not open yet, retry in %ds", delay);
+    } while (postflash_backoff(&delay, deadline, "mbim open"));
+
+    return FALSE;
+}
+
+// The first AT answer after the open, the modem accepts the config commands from then on
+static gboolean postflash_at_ready(gint timeout_sec) {
+    time_t deadline = time(NULL) + timeout_sec;
+    gint delay = POSTFLASH_BACKOFF_MIN_SEC;
+
+    do {
+        if (postflash_at_query(PWL_CID_GET_ATE))
+            return TRUE;
+    } while (postflash_backoff(&delay, deadline, "at ready"));
+
+    return FALSE;
+}
+
 void enable_jp_fcc_auto_reboot() {
     PWL_LOG_DEBUG("Enable JP FCC auto reboot");
     // enable this flag so modem will do switch when sim changed to corresponding carrier
     pwl_get_enable_state_t state = PWL_CID_GET_ENABLE_STATE_ERROR;
+    gint delay = POSTFLASH_BACKOFF_MIN_SEC;
 
     for (gint i = 0; i < PWL_OEM_PRI_RESET_RETRY; i++) {
-        madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_GET_JP_FCC_AUTO_REBOOT)]);
-
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
-            PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_JP_FCC_AUTO_REBOOT]);
-        } else {
+        if (postflash_at_query(PWL_CID_GET_JP_FCC_AUTO_REBOOT)) {
             if (strlen(g_response) != 0) {
                 state = atoi(g_response);
             }
@@ -668,33 +885,29 @@ void enable_jp_fcc_auto_reboot() {
             } else if (state == PWL_CID_GET_ENABLE_STATE_DISABLED) {
                 PWL_LOG_INFO("JP fcc auto reboot state is disabled");
 
-                // enable JP FCC Auto Reboot
-                madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_ENABLE_JP_FCC_AUTO_REBOOT)]);
-
-                if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
-                    PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_ENABLE_JP_FCC_AUTO_REBOOT]);
-                }
-
+                // enable JP FCC Auto Reboot, the next query confirms it right away
+                if (postflash_at_query(PWL_CID_ENABLE_JP_FCC_AUTO_REBOOT))
+                    continue;
             } else if (state == PWL_CID_GET_ENABLE_STATE_ENABLED) {
                 PWL_LOG_INFO("JP fcc auto reboot state enabled");
                 set_fw_update_status_value(JP_FCC_CONFIG_COUNT, 0);
                 return;
             }
-            sleep(1);
         }
+        pwl_trace(PWL_TRACE_WAIT, i, delay, "jp fcc auto reboot");
+        sleep(delay);
+        delay = MIN(delay * 2, POSTFLASH_BACKOFF_MAX_SEC);
     }
+    pwl_trace(PWL_TRACE_RETRY, PWL_OEM_PRI_RESET_RETRY, state, "jp fcc auto reboot");
 }
 
 void wait_for_modem_oem_pri_reset() {
     gint oem_reset_state = OEM_PRI_RESET_NOT_READY;
+    time_t deadline = time(NULL) + POSTFLASH_OEM_RESET_WAIT_SEC;
+    gint delay = POSTFLASH_BACKOFF_MIN_SEC;
 
-    for (gint i = 0; i < 20; i++) {
-        sleep(3);
-        madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_GET_OEM_PRI_RESET)]);
-
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
-            PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_OEM_PRI_RESET]);
-        } else {
+    do {
+        if (postflash_at_query(PWL_CID_GET_OEM_PRI_RESET)) {
             if (strlen(g_response) != 0) {
                 oem_reset_state = atoi(g_response);
             }
@@ -708,40 +921,33 @@ void wait_for_modem_oem_pri_reset() {
                 return;
             }
         }
-    }
+    } while (postflash_backoff(&delay, deadline, "oem pri reset"));
+    PWL_LOG_ERR("oem pri reset not done in %ds", POSTFLASH_OEM_RESET_WAIT_SEC);
 }
 
 void jp_fcc_config(gboolean enable_jp_fcc, gboolean has_flash_oem, gboolean efs_recovery_mode) {
-    gboolean is_mbim_ready = FALSE;
-    // just after flash, wait a bit for modem to get ready
-    PWL_LOG_INFO("wait for modem to get ready");
-    sleep(PWL_MBIM_READY_SEC);
-
-    // Check mbim init (timout 5 mins 6s*50)
-    for (int i = 0; i < 50; i++) {
-        if (!mbim_init(FALSE)) {
-            sleep(6);
-            continue;
-        } else {
-            is_mbim_ready = TRUE;
-            break;
-        }
-    }
+    uint64_t start_us = pwl_metrics_now();
+    time_t efs_done = 0;
 
-    if (!is_mbim_ready) {
+    // just after flash, start as soon as the port is back and the open completes
+    PWL_LOG_INFO("wait for modem to get ready");
+    if (!postflash_mbim_open(POSTFLASH_MBIM_WAIT_SEC)) {
         PWL_LOG_ERR("Mbim init failed, do GPIO reset.");
-        //gdbus_init();
-        //while(!dbus_service_is_ready());
-        //PWL_LOG_DEBUG("DBus Service is ready");
         pwl_core_call_gpio_reset_method_sync (gp_proxy, NULL, NULL);
         // hw reset function will send PWL_CID_MADPT_RESTART msg but can't receive at this point
         // so restart it self
-        //g_exit_code = EXIT_FAILURE;
         restart();
         return;
     }
 
-    sleep(5); // immediatly use of mbim will cause error, wait a bit
+    // EFS recovery runs in the modem from the open on, the probe below overlaps with it
+    if (has_flash_oem && efs_recovery_mode)
+        efs_done = time(NULL) + POSTFLASH_EFS_RECOVERY_SEC;
+
+    if (postflash_at_ready(POSTFLASH_AT_WAIT_SEC))
+        pwl_metrics_observe_since(PWL_METRIC_POSTFLASH_READY, 0, start_us);
+    else
+        PWL_LOG_ERR("modem not answering AT after open, continue");
 
     if (enable_jp_fcc)
         enable_jp_fcc_auto_reboot();
@@ -752,56 +958,50 @@ void jp_fcc_config(gboolean enable_jp_fcc, gboolean has_flash_oem, gboolean efs_
     // REST(2) > reset module
     if (has_flash_oem) {
         gint retry = 0;
-        if (efs_recovery_mode) {
-            PWL_LOG_DEBUG("Sleep 2 mins for efs recovery");
-            sleep(60 * 2);
+        gint delay = POSTFLASH_BACKOFF_MIN_SEC;
+        time_t deadline;
+
+        if (efs_done > time(NULL)) {
+            PWL_LOG_DEBUG("Wait %lds more for efs recovery", (long)(efs_done - time(NULL)));
+            pwl_trace(PWL_TRACE_WAIT, 0, efs_done - time(NULL), "efs recovery");
+            sleep(efs_done - time(NULL));
         }
+        deadline = time(NULL) + POSTFLASH_OEM_INFO_WAIT_SEC;
         while (g_oem_pri_state != OEM_PRI_UPDATE_NORESET) {
-            if (retry > 10) break;  // retry wait for OEM_PRI_UPDATE_RESET for 50s then exit
-
             PWL_LOG_DEBUG("===== Get OEM pri info =====, def: %d, retry: %d", g_oem_pri_state, retry);
-            madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_GET_OEM_PRI_INFO)]);
-            sleep(5);
             retry++;
-            g_oem_pri_state = atoi(g_response);
+            if (postflash_at_query(PWL_CID_GET_OEM_PRI_INFO))
+                g_oem_pri_state = atoi(g_response);
             PWL_LOG_DEBUG("===== OEM info int: %d", g_oem_pri_state);
-            if (g_oem_pri_state == OEM_PRI_UPDATE_START || g_oem_pri_state == OEM_PPI_UPDATE_INIT) {
-                continue;
-            } else if (g_oem_pri_state == OEM_PRI_UPDATE_RESET) {
+            if (g_oem_pri_state == OEM_PRI_UPDATE_RESET) {
                 PWL_LOG_DEBUG("===== Oem pri need reset =====");
                 wait_for_modem_oem_pri_reset();
                 break;
-            } else {
-                continue;
             }
+            // START/INIT or no answer, ask again until OEM_PRI_UPDATE_RESET shows up or time is out
+            if (g_oem_pri_state != OEM_PRI_UPDATE_NORESET && !postflash_backoff(&delay, deadline, "oem pri info"))
+                break;
         }
         PWL_LOG_DEBUG("retry times: %d", retry);
         PWL_LOG_DEBUG("===== OEM info check END =====");
 
         for (int i = 0; i < 5; i++) {
-            madpt_at_cmd_request(at_cmd_map[ATCMD_INDEX_MAP(PWL_CID_RESET)]);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
-                PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_RESET]);
-            } else {
+            if (postflash_at_query(PWL_CID_RESET))
                 break;
-            }
+            pwl_trace(PWL_TRACE_RETRY, i, PWL_CID_RESET, "module reset");
         }
 
         // wait till mbim port gone
-        for (int i = 0; i < 10; i++) {
-            gchar port[20];
-            memset(port, 0, sizeof(port));
-            if (!pwl_find_mbim_port(port, sizeof(port))) {
-                break;
-            }
-            sleep(2);
-        }
+        pwl_trace(PWL_TRACE_WAIT, 0, 20, "mbim port gone");
+        pwl_port_wait(PWL_PORT_MBIM, FALSE, 20);
         PWL_LOG_INFO("mbim port gone now");
 
+        pwl_trace(PWL_TRACE_WAIT, 0, 50, "mbim port back");
         if (pwl_mbimdeviceadpt_port_wait()) {
             PWL_LOG_INFO("mbim port available now");
         } else {
             PWL_LOG_INFO("mbim port still not available after wait");
+            pwl_trace(PWL_TRACE_RETRY, 0, -1, "mbim port back");
         }
     }
 
@@ -874,6 +1074,7 @@ int check_if_mbim_api_exist() {
 }
 
 gint main() {
+    pwl_log_init();
     PWL_LOG_INFO("start");
 
     g_device_type = pwl_get_device_type_await();
@@ -897,13 +1098,14 @@ gint main() {
             // to register cb for signaling madpt_ready at this point
             mbim_init(FALSE);
         }
-        sleep(5);
+        pwl_mbimdeviceadpt_wait_open(5);
     }
 
     GThread *msg_queue_thread = g_thread_new("msg_queue_thread", msg_queue_thread_func, NULL);
 
     signal_callback_t signal_callback;
     signal_callback.callback_notice_module_recovery_finish = signal_callback_notice_module_recovery_finish;
+    signal_callback.callback_sleep_state_change = signal_callback_sleep_state_change;
     registerSignalCallback(&signal_callback);
 
     gdbus_init();
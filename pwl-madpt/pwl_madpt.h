@@ -25,6 +25,16 @@
 #define RET_SIGNAL_HANDLE_SIZE 3
 #define PWL_MBIM_OPEN_WAIT_MAX 3
 #define PWL_MBIM_ERR_MAX       2
+#define PWL_SLEEP_GATE_MAX_SEC 60   // requests wait at most this long for resume, re-arm is always awaited
+
+// Post-flash bring-up polls with a doubling delay between these bounds
+#define POSTFLASH_BACKOFF_MIN_SEC       1
+#define POSTFLASH_BACKOFF_MAX_SEC       4
+#define POSTFLASH_MBIM_WAIT_SEC         300
+#define POSTFLASH_AT_WAIT_SEC           30
+#define POSTFLASH_OEM_INFO_WAIT_SEC     50
+#define POSTFLASH_OEM_RESET_WAIT_SEC    60
+#define POSTFLASH_EFS_RECOVERY_SEC      120
 
 #define OEM_PRI_UPDATE_START     0
 #define OEM_PPI_UPDATE_INIT      1   // waiting for modem initialize the RF NV item
@@ -37,9 +47,11 @@
 #define OEM_PRI_RESET_NO_NEED_UPDATE    9  // trigger modem reboot
 
 typedef void (*signal_notice_module_recovery_finish_callback)(int);
+typedef void (*signal_sleep_state_change_callback)(gboolean);
 
 typedef struct {
     signal_notice_module_recovery_finish_callback callback_notice_module_recovery_finish;
+    signal_sleep_state_change_callback callback_sleep_state_change;
 } signal_callback_t;
 
 gboolean at_resp_parsing(const gchar *rsp, gchar *buff_ptr, guint32 buff_size);
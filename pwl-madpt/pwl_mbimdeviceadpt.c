@@ -20,6 +20,8 @@
 
 #include "common.h"
 #include "pwl_mbimdeviceadpt.h"
+#include "pwl_port.h"
+#include "pwl_record.h"
 
 pthread_mutex_t g_device_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t g_device_cond = PTHREAD_COND_INITIALIZER;
@@ -28,6 +30,9 @@ static MbimDevice *g_device;
 static GCancellable *g_cancellable;
 mbim_device_ready_callback g_ready_cb;
 static gboolean g_device_opened = FALSE;
+static pthread_mutex_t g_open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_open_cond = PTHREAD_COND_INITIALIZER;
+static gboolean g_open_done = TRUE;
 
 
 static void at_command_query_cb(MbimDevice *dev, GAsyncResult *res, gpointer user_data) {
@@ -46,11 +51,13 @@ static void at_command_query_cb(MbimDevice *dev, GAsyncResult *res, gpointer use
                                                       &command_resp, &error)) {
 
         if (DEBUG) PWL_LOG_DEBUG("MBIM Response: %s\n", command_resp);
+        pwl_record_text(PWL_RECORD_MBIM_RESP, (const char *)command_resp);
         if (cb) cb((unsigned char *)command_resp);
 
     } else {
         PWL_LOG_ERR("Couldn't query at command services, error: %s", error->message);
         guint8 *error_resp = "QUERY ERROR";
+        pwl_record_text(PWL_RECORD_MBIM_RESP, (const char *)error_resp);
         if (cb) cb(error_resp);
     }
 }
@@ -72,11 +79,13 @@ static void at_tunnel_query_cb(MbimDevice *dev, GAsyncResult *res, gpointer user
                                                               &command_resp, &error)) {
 
         if (DEBUG) PWL_LOG_DEBUG("MBIM Response: %s\n", command_resp);
+        pwl_record_text(PWL_RECORD_MBIM_RESP, (const char *)command_resp);
         if (cb) cb((unsigned char *)command_resp);
 
     } else {
         PWL_LOG_ERR("Couldn't set at tunnel services, error: %s", error->message);
         guint8 *error_resp = "QUERY ERROR";
+        pwl_record_text(PWL_RECORD_MBIM_RESP, (const char *)error_resp);
         if (cb) cb(error_resp);
     }
 }
@@ -84,6 +93,7 @@ static void at_tunnel_query_cb(MbimDevice *dev, GAsyncResult *res, gpointer user
 void pwl_mbimdeviceadpt_at_req(madpt_mbim_intf_t intf, char *command, mbim_at_resp_callback cb) {
 
     if (DEBUG) PWL_LOG_DEBUG("cmd: %s", command);
+    pwl_record_text(PWL_RECORD_MBIM_CMD, command);
 
     g_autoptr(MbimMessage) message = NULL;
 
@@ -129,6 +139,13 @@ static void device_close() {
     g_clear_object(&g_device);
 }
 
+static void open_complete() {
+    pthread_mutex_lock(&g_open_mutex);
+    g_open_done = TRUE;
+    pthread_cond_broadcast(&g_open_cond);
+    pthread_mutex_unlock(&g_open_mutex);
+}
+
 static void device_open_cb(MbimDevice *dev, GAsyncResult *res) {
     PWL_LOG_INFO("MBIM Device open");
     g_autoptr(GError) error = NULL;
@@ -140,6 +157,7 @@ static void device_open_cb(MbimDevice *dev, GAsyncResult *res) {
         PWL_LOG_DEBUG("MBIM Device %s opened.", mbim_device_get_path_display(dev));
         g_device_opened = TRUE;
     }
+    open_complete();
 
     if (g_ready_cb != NULL) {
         g_ready_cb(g_device_opened);
@@ -154,6 +172,7 @@ static void device_new_cb(GObject *unused, GAsyncResult *res) {
     g_device = mbim_device_new_finish(res, &error);
     if (!g_device) {
         PWL_LOG_ERR("Couldn't create MbimDevice object: %s\n", error->message);
+        open_complete();
         return;
     }
 
@@ -175,6 +194,9 @@ gboolean pwl_mbimdeviceadpt_init(mbim_device_ready_callback cb) {
     }
 
     g_device_opened = FALSE;
+    pthread_mutex_lock(&g_open_mutex);
+    g_open_done = FALSE;
+    pthread_mutex_unlock(&g_open_mutex);
 
     file = g_file_new_for_path(port);
     g_cancellable = g_cancellable_new();
@@ -189,6 +211,13 @@ gboolean pwl_mbimdeviceadpt_init(mbim_device_ready_callback cb) {
 void pwl_mbimdeviceadpt_deinit() {
     PWL_LOG_INFO("MBIM Device deinit");
 
+    // Nothing to close when the last init found no port or the device failed to create
+    if (g_device == NULL) {
+        g_clear_object(&g_cancellable);
+        g_ready_cb = NULL;
+        return;
+    }
+
     device_close();
     if (!cond_wait(&g_device_mutex, &g_device_cond, PWL_CLOSE_MBIM_TIMEOUT_SEC)) {
         if (DEBUG) PWL_LOG_ERR("timed out or error during mbim deinit");
@@ -204,14 +233,23 @@ void pwl_mbimdeviceadpt_deinit() {
     g_ready_cb = NULL;
 }
 
-gboolean pwl_mbimdeviceadpt_port_wait() {
-    for (int i = 0; i < 10; i++) {
-        gchar port[20];
-        memset(port, 0, sizeof(port));
-        if (pwl_find_mbim_port(port, sizeof(port))) {
-            return TRUE;
-        }
-        sleep(5);
+// Waits for the open started by the last init, TRUE when it succeeded
+gboolean pwl_mbimdeviceadpt_wait_open(gint timeout_sec) {
+    struct timespec timeout;
+    gboolean done;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += timeout_sec;
+    pthread_mutex_lock(&g_open_mutex);
+    while (!g_open_done) {
+        if (pthread_cond_timedwait(&g_open_cond, &g_open_mutex, &timeout) != 0)
+            break;
     }
-    return FALSE;
+    done = g_open_done;
+    pthread_mutex_unlock(&g_open_mutex);
+    return done && g_device_opened;
+}
+
+gboolean pwl_mbimdeviceadpt_port_wait() {
+    return pwl_port_wait(PWL_PORT_MBIM, TRUE, 50);
 }
@@ -35,6 +35,7 @@ typedef void (*mbim_at_resp_callback)(const gchar*);
 gboolean pwl_mbimdeviceadpt_init(mbim_device_ready_callback cb);
 void pwl_mbimdeviceadpt_deinit();
 void pwl_mbimdeviceadpt_at_req(madpt_mbim_intf_t intf, gchar *command, mbim_at_resp_callback cb);
+gboolean pwl_mbimdeviceadpt_wait_open(gint timeout_sec);
 gboolean pwl_mbimdeviceadpt_port_wait();
 
 __attribute__((weak)) gboolean mbim_message_intel_at_tunnel_at_command_response_parse (
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "pwl_carrier.h"
+
+#define CARRIER_LINE_LEN                255
+#define CARRIER_MCC_LEN                 3
+#define CARRIER_MNC_MAX_LEN             3
+// A field of only '*' matches any value of that many digits
+#define CARRIER_WILDCARD                0x3ff
+// 10 bits mcc, 10 bits mnc, 2 bits mnc length, "01" and "001" are different
+#define CARRIER_KEY(mcc, mnc, len)      (((mcc) << 12) | ((mnc) << 2) | (len))
+
+static pthread_mutex_t g_carrier_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *gp_carrier_table = NULL;
+static struct stat g_carrier_stat;
+
+static gboolean carrier_parse_field(const gchar *field, gint max_len, guint *value, gint *len) {
+    gint digits = 0, stars = 0;
+
+    *len = strlen(field);
+    if (*len == 0 || *len > max_len)
+        return FALSE;
+
+    for (gint i = 0; i < *len; i++) {
+        if (isdigit((unsigned char)field[i]))
+            digits++;
+        else if (field[i] == '*')
+            stars++;
+        else
+            return FALSE;
+    }
+    if (stars == *len)
+        *value = CARRIER_WILDCARD;
+    else if (digits == *len)
+        *value = atoi(field);
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static gboolean carrier_parse_line(gchar *line, guint *key, pwl_carrier_t *carrier) {
+    gchar *fields[4] = { NULL };
+    gchar *save = NULL;
+    guint mcc, mnc;
+    gint mcc_len, mnc_len;
+    gint count = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    for (gchar *token = strtok_r(line, ",", &save); token && count < 4; token = strtok_r(NULL, ",", &save))
+        fields[count++] = g_strstrip(token);
+    if (count < 3)
+        return FALSE;
+
+    // The title row fails here too
+    if (!carrier_parse_field(fields[0], CARRIER_MCC_LEN, &mcc, &mcc_len) || mcc_len != CARRIER_MCC_LEN ||
+        !carrier_parse_field(fields[1], CARRIER_MNC_MAX_LEN, &mnc, &mnc_len))
+        return FALSE;
+
+    *key = CARRIER_KEY(mcc, mnc, mnc_len);
+    memset(carrier, 0, sizeof(*carrier));
+    g_strlcpy(carrier->name, fields[2], sizeof(carrier->name));
+    carrier->index = fields[3] ? atoi(fields[3]) : 0;
+    return TRUE;
+}
+
+static gboolean carrier_load_locked() {
+    GHashTable *table;
+    gchar line[CARRIER_LINE_LEN];
+    struct stat st;
+    FILE *fp;
+
+    if (stat(PWL_CARRIER_LIST_FILE, &st) != 0 || (fp = fopen(PWL_CARRIER_LIST_FILE, "r")) == NULL) {
+        PWL_LOG_ERR("Open %s failed", PWL_CARRIER_LIST_FILE);
+        if (gp_carrier_table) {
+            g_hash_table_destroy(gp_carrier_table);
+            gp_carrier_table = NULL;
+        }
+        return FALSE;
+    }
+
+    table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    while (fgets(line, sizeof(line), fp)) {
+        pwl_carrier_t carrier;
+        guint key;
+
+        if (!carrier_parse_line(line, &key, &carrier))
+            continue;
+        // First row wins, same as the old line by line search
+        if (!g_hash_table_contains(table, GUINT_TO_POINTER(key))) {
+            pwl_carrier_t *entry = g_new(pwl_carrier_t, 1);
+            *entry = carrier;
+            g_hash_table_insert(table, GUINT_TO_POINTER(key), entry);
+        }
+    }
+    fclose(fp);
+
+    if (gp_carrier_table)
+        g_hash_table_destroy(gp_carrier_table);
+    gp_carrier_table = table;
+    g_carrier_stat = st;
+    PWL_LOG_INFO("Loaded %d carriers from %s", g_hash_table_size(table), PWL_CARRIER_LIST_FILE);
+    return TRUE;
+}
+
+gboolean pwl_carrier_load() {
+    gboolean ret;
+
+    pthread_mutex_lock(&g_carrier_mutex);
+    ret = carrier_load_locked();
+    pthread_mutex_unlock(&g_carrier_mutex);
+    return ret;
+}
+
+// Reload when the list was replaced or edited
+static void carrier_check_reload_locked() {
+    struct stat st;
+
+    if (stat(PWL_CARRIER_LIST_FILE, &st) != 0) {
+        if (gp_carrier_table)
+            carrier_load_locked();
+        return;
+    }
+    if (gp_carrier_table == NULL || st.st_ino != g_carrier_stat.st_ino || st.st_size != g_carrier_stat.st_size ||
+        st.st_mtim.tv_sec != g_carrier_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != g_carrier_stat.st_mtim.tv_nsec)
+        carrier_load_locked();
+}
+
+// Exact entry first, then the wildcard rows from the most to the least specific
+static pwl_carrier_t *carrier_find_locked(guint mcc, guint mnc, gint mnc_len) {
+    const guint keys[] = {
+        CARRIER_KEY(mcc, mnc, mnc_len),
+        CARRIER_KEY(mcc, CARRIER_WILDCARD, mnc_len),
+        CARRIER_KEY(CARRIER_WILDCARD, mnc, mnc_len),
+        CARRIER_KEY(CARRIER_WILDCARD, CARRIER_WILDCARD, mnc_len),
+    };
+    pwl_carrier_t *found = NULL;
+
+    for (gint i = 0; i < G_N_ELEMENTS(keys) && found == NULL; i++)
+        found = g_hash_table_lookup(gp_carrier_table, GUINT_TO_POINTER(keys[i]));
+    return found;
+}
+
+gboolean pwl_carrier_lookup(const gchar *mcc, const gchar *mnc, pwl_carrier_t *carrier) {
+    pwl_carrier_t *found = NULL;
+    guint mcc_value, mnc_value;
+    gint mcc_len, mnc_len;
+
+    pthread_mutex_lock(&g_carrier_mutex);
+    carrier_check_reload_locked();
+    if (gp_carrier_table == NULL) {
+        pthread_mutex_unlock(&g_carrier_mutex);
+        return FALSE;
+    }
+
+    if (carrier_parse_field(mcc, CARRIER_MCC_LEN, &mcc_value, &mcc_len) && mcc_len == CARRIER_MCC_LEN &&
+        mcc_value != CARRIER_WILDCARD &&
+        carrier_parse_field(mnc, CARRIER_MNC_MAX_LEN, &mnc_value, &mnc_len) && mnc_value != CARRIER_WILDCARD)
+        found = carrier_find_locked(mcc_value, mnc_value, mnc_len);
+
+    if (found) {
+        *carrier = *found;
+    } else {
+        memset(carrier, 0, sizeof(*carrier));
+        g_strlcpy(carrier->name, PWL_CARRIER_GENERIC, sizeof(carrier->name));
+    }
+    pthread_mutex_unlock(&g_carrier_mutex);
+    return TRUE;
+}
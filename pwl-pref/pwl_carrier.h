@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __PWL_CARRIER_H__
+#define __PWL_CARRIER_H__
+
+#include <glib.h>
+
+#define PWL_CARRIER_LIST_FILE           "/opt/pwl/mcc_mnc_list.csv"
+#define PWL_CARRIER_NAME_LEN            15
+#define PWL_CARRIER_GENERIC             "Generic"
+
+typedef struct {
+    gchar       name[PWL_CARRIER_NAME_LEN];
+    gint        index;
+} pwl_carrier_t;
+
+gboolean pwl_carrier_load();
+gboolean pwl_carrier_lookup(const gchar *mcc, const gchar *mnc, pwl_carrier_t *carrier);
+
+#endif
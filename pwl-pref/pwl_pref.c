@@ -23,11 +23,11 @@
 #include "common.h"
 #include "dbus_common.h"
 #include "log.h"
+#include "pwl_carrier.h"
+#include "pwl_ipc.h"
+#include "pwl_module.h"
 #include "pwl_pref.h"
-
-// For general mutex usage
-pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+#include "pwl_status.h"
 
 static GMainLoop *gp_loop = NULL;
 static pwlCore *gp_proxy = NULL;
@@ -50,9 +50,12 @@ static char *g_dpv_version;
 static char g_sn_imei[SN_MAX_LENGTH + IMEI_MAX_LENGTH];
 //SIM info
 static int g_mnc_len;
-static char g_sim_carrier[15];
+static char g_sim_carrier[PWL_CARRIER_NAME_LEN];
 static char g_pref_carrier[MAX_PATH];
 static bool g_is_get_cimi = FALSE;
+// Last SIM seen in a SubscriberIdentityChange, its mnc length is kept in the bootup status
+static char g_sim_iccid[PWL_SIM_ICCID_LEN];
+static gboolean g_sim_carrier_from_identity = FALSE;
 gboolean g_is_sim_insert = FALSE;
 gboolean g_set_pref_carrier_ret = FALSE;
 gboolean g_check_sim_carrier_on_going = FALSE;
@@ -95,10 +98,11 @@ static gboolean signal_get_fw_version_handler(pwlCore *object, const gchar *arg,
     return TRUE;
 }
 
-static gboolean signal_sim_state_change_handler(pwlCore *object, gint arg_status, gpointer userdata) {
+static gboolean signal_sim_state_change_handler(pwlCore *object, gint arg_status, const gchar *arg_imsi,
+                                                const gchar *arg_iccid, gpointer userdata) {
     PWL_LOG_DEBUG("signal_sim_state_change_handler");
     if (NULL != g_signal_callback.callback_sim_state_change) {
-        g_signal_callback.callback_sim_state_change(arg_status);
+        g_signal_callback.callback_sim_state_change(arg_status, arg_imsi, arg_iccid);
     }
 
     return TRUE;
@@ -122,7 +126,7 @@ bool register_client_signal_handler(pwlCore *p_proxy) {
     memset(g_ret_signal_handler, 0, sizeof(g_ret_signal_handler));
     g_ret_signal_handler[0] = g_signal_connect(p_proxy, "notify::g-name-owner", G_CALLBACK(cb_owner_name_changed_notify), NULL);
     g_ret_signal_handler[1] = g_signal_connect(p_proxy, "get-fw-version-signal", G_CALLBACK(signal_get_fw_version_handler), NULL);
-    g_ret_signal_handler[2] = g_signal_connect(p_proxy, "subscriber-ready-state-change",
+    g_ret_signal_handler[2] = g_signal_connect(p_proxy, "subscriber-identity-change",
                                                G_CALLBACK(signal_sim_state_change_handler), NULL);
     return TRUE;
 }
@@ -209,17 +213,40 @@ gboolean dbus_service_is_ready(void) {
 }
 
 void send_message_queue(uint32_t cid) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
+    pwl_ipc_request(PWL_MQ_ID_PREF, cid, NULL, FALSE);
+}
+
+// Send request and wait for its own reply, FALSE on timeout or error
+gboolean send_message_queue_wait(uint32_t cid, char *content, gint wait_time) {
+    return pwl_ipc_wait_reply(pwl_ipc_request(PWL_MQ_ID_PREF, cid, content, TRUE), wait_time);
+}
+
+// What pref knows goes to the shared module state, pwl_core exports it on D-Bus
+static void publish_module_state() {
+    pwl_module_set_str(PWL_MODULE_AP_VERSION, g_ap_version);
+    pwl_module_set_str(PWL_MODULE_MD_VERSION, g_modem_version);
+    pwl_module_set_str(PWL_MODULE_OP_VERSION, g_op_version);
+    pwl_module_set_str(PWL_MODULE_OEM_VERSION, g_oem_version);
+    pwl_module_set_str(PWL_MODULE_DPV_VERSION, g_dpv_version);
+    pwl_module_set_str(PWL_MODULE_SIM_CARRIER, g_sim_carrier);
+    pwl_module_set_str(PWL_MODULE_PREF_CARRIER, g_pref_carrier);
+}
 
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_PREF;
+// Device caps firmware info from pwl_core has the same layout as the at*bfwver reply
+static gboolean get_fw_version_from_caps() {
+    pwl_module_caps_t caps;
 
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    if (!pwl_module_get_caps(&caps) || strlen(caps.firmware_info) == 0)
+        return FALSE;
+
+    g_strlcpy(g_fwver, caps.firmware_info, sizeof(g_fwver));
+    split_fw_versions(caps.firmware_info);
+    if (g_ap_version == NULL || strncmp(g_ap_version, "00.", 3) != 0) {
+        PWL_LOG_DEBUG("Device caps firmware info unusable, query the modem");
+        return FALSE;
+    }
+    publish_module_state();
+    return TRUE;
 }
 
 void signal_callback_get_fw_version(const gchar* arg) {
@@ -227,9 +254,10 @@ void signal_callback_get_fw_version(const gchar* arg) {
     g_check_sim_carrier_on_going = TRUE;
 
     if (g_device_type == PWL_DEVICE_TYPE_USB) {
-        for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_FW_VER);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        gboolean from_caps = get_fw_version_from_caps();
+
+        for (int i = 0; i < 3 && !from_caps; i++) {
+            if (!send_message_queue_wait(PWL_CID_GET_FW_VER, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_FW_VER]);
             }
             if (g_main_fw_version != NULL && strlen(g_main_fw_version) > 0) {
@@ -249,8 +277,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         memset(g_ap_version, 0, MAX_PCIE_AP_VERSION_LENGTH);
 
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_PCIE_AP_VERSION);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_PCIE_AP_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_PCIE_AP_VERSION]);
             }
             g_usleep(1000*100); // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -272,8 +299,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         memset(g_modem_version, 0, MAX_PCIE_VERSION_LENGTH);
 
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_PCIE_DEVICE_VERSION);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_PCIE_DEVICE_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_FW_VER]);
             }
             g_usleep(1000*100); // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -295,8 +321,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         memset(g_op_version, 0, MAX_PCIE_VERSION_LENGTH);
 
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_PCIE_OP_VERSION);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_PCIE_OP_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_PCIE_OP_VERSION]);
             }
             g_usleep(1000*100); // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -317,8 +342,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         memset(g_oem_version, 0, MAX_PCIE_VERSION_LENGTH);
 
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_PCIE_OEM_VERSION);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_PCIE_OEM_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_PCIE_OEM_VERSION]);
             }
             g_usleep(1000*100); // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -339,8 +363,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         memset(g_dpv_version, 0, MAX_PCIE_VERSION_LENGTH);
 
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_PCIE_DPV_VERSION);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_PCIE_DPV_VERSION, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_PCIE_DPV_VERSION]);
             }
             g_usleep(1000*100); // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -360,8 +383,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
         // Get Sim carrier id
         g_current_carrier_id = -1;
         for (int i = 0; i < 3; i++) {
-            send_message_queue(PWL_CID_GET_CARRIER_ID);
-            if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+            if (!send_message_queue_wait(PWL_CID_GET_CARRIER_ID, NULL, PWL_CMD_TIMEOUT_SEC)) {
                 PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_CARRIER_ID]);
             }
             g_usleep(1000 * 100);  // modem return without OK/ERROR, wait a bit for timeout response parse
@@ -379,9 +401,9 @@ void signal_callback_get_fw_version(const gchar* arg) {
         if (DEBUG) PWL_LOG_DEBUG("[CXP] Need CXP Reboot: %d", g_need_cxp_reboot);
     }
 
-    for (int i = 0; i < 3; i++) {
-        send_message_queue(PWL_CID_GET_CRSM);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+    // Resolved from the subscriber identity already, no CRSM/CIMI needed
+    for (int i = 0; i < 3 && !g_sim_carrier_from_identity; i++) {
+        if (!send_message_queue_wait(PWL_CID_GET_CRSM, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_CRSM]);
         }
         if (g_mnc_len == 0) {
@@ -389,8 +411,7 @@ void signal_callback_get_fw_version(const gchar* arg) {
             continue;
         } else {
             for (int j = 0; j < 3; j++) {
-                send_message_queue(PWL_CID_GET_CIMI);
-                if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+                if (!send_message_queue_wait(PWL_CID_GET_CIMI, NULL, PWL_CMD_TIMEOUT_SEC)) {
                     PWL_LOG_ERR("timed out or error for cid %s", cid_name[PWL_CID_GET_CIMI]);
                 }
                 if (strlen(g_sim_carrier) > 0) {
@@ -417,6 +438,29 @@ void signal_callback_get_fw_version(const gchar* arg) {
     return;
 }
 
+// Mnc length read from EF_AD for this ICCID before, 0 when unknown
+static gint sim_mnc_len_lookup(const gchar *iccid) {
+    gint hash = 0, mnc_len = 0;
+
+    if (strlen(iccid) == 0)
+        return 0;
+    pwl_status_get(PWL_STATUS_SIM_ICCID_HASH, &hash);
+    pwl_status_get(PWL_STATUS_SIM_MNC_LENGTH, &mnc_len);
+    if (hash != (gint) g_str_hash(iccid) || mnc_len < 2 || mnc_len > 3)
+        return 0;
+    return mnc_len;
+}
+
+// Without an ICCID there is nothing to tell the next SIM apart
+static void sim_mnc_len_store(const gchar *iccid, gint mnc_len) {
+    if (strlen(iccid) == 0 || mnc_len <= 0)
+        return;
+    pwl_status_begin(PWL_STATUS_STORE_BOOTUP);
+    pwl_status_set(PWL_STATUS_SIM_ICCID_HASH, (gint) g_str_hash(iccid));
+    pwl_status_set(PWL_STATUS_SIM_MNC_LENGTH, mnc_len);
+    pwl_status_commit(PWL_STATUS_STORE_BOOTUP);
+}
+
 gint get_sim_carrier_info(int retry_delay, int retry_limit) {
     int err, retry = 0;
 
@@ -433,8 +477,7 @@ gint get_sim_carrier_info(int retry_delay, int retry_limit) {
         g_is_get_cimi = FALSE;
         g_mnc_len = 0;
         PWL_LOG_DEBUG("Get CRSM");
-        send_message_queue(PWL_CID_GET_CRSM);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_GET_CRSM, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get CRSM, retry");
             err = 1;
         }
@@ -457,8 +500,7 @@ gint get_sim_carrier_info(int retry_delay, int retry_limit) {
         err = 0;
         g_is_get_cimi = FALSE;
         PWL_LOG_DEBUG("Get CIMI");
-        send_message_queue(PWL_CID_GET_CIMI);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_GET_CIMI, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get CIMI, retry");
             err = 1;
         }
@@ -468,6 +510,7 @@ gint get_sim_carrier_info(int retry_delay, int retry_limit) {
             sleep(retry_delay);
             continue;
         }
+        sim_mnc_len_store(g_sim_iccid, g_mnc_len);
         g_check_sim_carrier_on_going = FALSE;
         return 0;
     }
@@ -475,14 +518,52 @@ gint get_sim_carrier_info(int retry_delay, int retry_limit) {
     return -1;
 }
 
+// Carrier from the IMSI pushed by pwl_core. The IMSI does not tell the mnc length, a list
+// hit on either length proves nothing (310-480 also matches 310-48), so it comes from EF_AD:
+// read once per SIM and kept for its ICCID across restarts.
+gint get_sim_carrier_from_identity(const gchar *imsi, const gchar *iccid) {
+    gchar mcc[4] = {0}, mnc[4] = {0};
+    gint mnc_len;
+
+    g_sim_carrier_from_identity = FALSE;
+    if (imsi == NULL || strlen(imsi) == 0)
+        return RET_FAILED;
+
+    g_strlcpy(g_sim_iccid, iccid ? iccid : "", sizeof(g_sim_iccid));
+    mnc_len = sim_mnc_len_lookup(g_sim_iccid);
+    if (mnc_len == 0) {
+        g_mnc_len = 0;
+        PWL_LOG_DEBUG("Mnc length unknown, read EF_AD");
+        if (!send_message_queue_wait(PWL_CID_GET_CRSM, NULL, PWL_CMD_TIMEOUT_SEC) || g_mnc_len <= 0) {
+            PWL_LOG_ERR("Read EF_AD failed, query the SIM");
+            return RET_FAILED;
+        }
+        mnc_len = g_mnc_len;
+        sim_mnc_len_store(g_sim_iccid, mnc_len);
+    }
+    if (strlen(imsi) < 3 + mnc_len) {
+        PWL_LOG_ERR("IMSI too short for mnc length %d", mnc_len);
+        return RET_FAILED;
+    }
+
+    strncpy(mcc, imsi, 3);
+    strncpy(mnc, imsi + 3, mnc_len);
+    get_carrier_from_sim(mcc, mnc);
+
+    PWL_LOG_DEBUG("Sim carrier from identity: %s", g_sim_carrier);
+    publish_module_state();
+    g_sim_carrier_from_identity = TRUE;
+    g_check_sim_carrier_on_going = FALSE;
+    return RET_OK;
+}
+
 gint get_preferred_carrier() {
     int err, retry = 0;
     memset(g_pref_carrier, 0, sizeof(g_pref_carrier));
     sleep(3);
     while (retry < PWL_FW_UPDATE_RETRY_LIMIT) {
         err = 0;
-        send_message_queue(PWL_CID_GET_PREF_CARRIER);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_GET_PREF_CARRIER, NULL, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get pref carrier, retry");
             err = 1;
         }
@@ -558,18 +639,7 @@ gboolean is_need_cxp_reboot(int current_carrier_id, int pref_carrier_id) {
     }
 }
 void send_message_queue_with_content(uint32_t cid, char *content) {
-    mqd_t mq;
-    mq = mq_open(CID_DESTINATION(cid), O_WRONLY);
-
-    // message to be sent
-    msg_buffer_t message;
-    message.pwl_cid = cid;
-    message.status = PWL_CID_STATUS_NONE;
-    message.sender_id = PWL_MQ_ID_PREF;
-    strcpy(message.content, content);
-
-    // msgsnd to send message
-    mq_send(mq, (gchar *)&message, sizeof(message), 0);
+    pwl_ipc_request(PWL_MQ_ID_PREF, cid, content, FALSE);
 }
 
 gint set_preferred_carrier(char *carrier, int retry_limit) {
@@ -578,8 +648,7 @@ gint set_preferred_carrier(char *carrier, int retry_limit) {
     while (retry < retry_limit) {
         err = 0;
         g_set_pref_carrier_ret = FALSE;
-        send_message_queue_with_content(PWL_CID_SET_PREF_CARRIER, carrier);
-        if (!cond_wait(&g_mutex, &g_cond, PWL_CMD_TIMEOUT_SEC)) {
+        if (!send_message_queue_wait(PWL_CID_SET_PREF_CARRIER, carrier, PWL_CMD_TIMEOUT_SEC)) {
             PWL_LOG_ERR("Time out to get pref carrier, retry");
             err = 1;
         }
@@ -594,7 +663,7 @@ gint set_preferred_carrier(char *carrier, int retry_limit) {
     return -1;
 }
 
-void signal_callback_sim_state_change(gint ready_state) {
+void signal_callback_sim_state_change(gint ready_state, const gchar *imsi, const gchar *iccid) {
     // PWL_LOG_DEBUG("!!! signal_callback_sim_state_change, arg: %d", arg);
 
     if (g_device_type == PWL_DEVICE_TYPE_USB) {
@@ -605,8 +674,9 @@ void signal_callback_sim_state_change(gint ready_state) {
                 if (!g_check_sim_carrier_on_going) {
                     g_check_sim_carrier_on_going = TRUE;
 
-                    // Try to get sim carrier
-                    if (get_sim_carrier_info(PWL_PREF_GET_SIM_INFO_DELAY, PWL_PREF_CMD_RETRY_LIMIT) == 0) {
+                    // Try to get sim carrier, AT queries only when the identity is not enough
+                    if (get_sim_carrier_from_identity(imsi, iccid) == RET_OK ||
+                        get_sim_carrier_info(PWL_PREF_GET_SIM_INFO_DELAY, PWL_PREF_CMD_RETRY_LIMIT) == 0) {
                         if (get_preferred_carrier() == 0) {
                             // Compare sim carrier and preferred carrier
                             PWL_LOG_DEBUG("Compare sim carrier: %s, pref carrier: %s", g_sim_carrier, g_pref_carrier);
@@ -627,6 +697,7 @@ void signal_callback_sim_state_change(gint ready_state) {
             case PWL_SIM_STATE_NOT_INSERTED:
                 PWL_LOG_DEBUG("Sim eject");
                 g_is_sim_insert = FALSE;
+                g_sim_carrier_from_identity = FALSE;
                 g_check_sim_carrier_on_going = FALSE;
                 break;
             default:
@@ -640,10 +711,13 @@ void signal_callback_sim_state_change(gint ready_state) {
             case PWL_SIM_STATE_INITIALIZED:
                 PWL_LOG_DEBUG("Sim insert, send signal to do fw update check");
                 pwl_core_call_request_fw_update_check_method(gp_proxy, NULL, NULL, NULL);
+                // After the request, a first seen SIM costs a CRSM round trip
+                get_sim_carrier_from_identity(imsi, iccid);
                 break;
             case PWL_SIM_STATE_NOT_INSERTED:
                 PWL_LOG_DEBUG("Sim eject");
                 g_is_sim_insert = FALSE;
+                g_sim_carrier_from_identity = FALSE;
                 g_check_sim_carrier_on_going = FALSE;
                 break;
             default:
@@ -658,11 +732,7 @@ void signal_callback_sim_state_change(gint ready_state) {
 
 void get_carrier_from_sim(char *mcc, char *mnc)
 {
-    int line, i, found = 0;
-    char buffer[255];
-    char *splitted_str;
-    char *carrier_config[4];
-    char carrier_name[15];
+    pwl_carrier_t carrier;
 
     if (DEBUG)
     {
@@ -670,47 +740,10 @@ void get_carrier_from_sim(char *mcc, char *mnc)
         PWL_LOG_DEBUG("mnc: %s", mnc);
     }
 
-    FILE *file = fopen("/opt/pwl/mcc_mnc_list.csv", "r");
-    if (file)
+    if (pwl_carrier_lookup(mcc, mnc, &carrier))
     {
-        while (fgets(buffer, 255, file))
-        {
-            line++;
-            // Skip title
-            if (line == 1)
-                continue;
-            i = 0;
-            splitted_str = strtok(buffer, ",");
-            while (splitted_str != NULL)
-            {
-                carrier_config[i] = splitted_str;
-                splitted_str = strtok(NULL, ",");
-                i++;
-            }
-            // Check mcc
-            if (strcmp(mcc, carrier_config[0]) != 0)
-                continue;
-            else
-            {
-                // Check mnc
-                if (strcmp(mnc, carrier_config[1]) != 0)
-                    continue;
-                else
-                {
-                    strcpy(carrier_name, carrier_config[2]);
-                    PWL_LOG_DEBUG("carrier_name: %s", carrier_name);
-                    found = 1;
-                    break;
-                }
-            }
-        }
-        if (found)
-            strcpy(g_sim_carrier, carrier_name);
-        else
-        {
-            strcpy(g_sim_carrier, "Generic");
-        }
-        fclose(file);
+        PWL_LOG_DEBUG("carrier_name: %s", carrier.name);
+        strcpy(g_sim_carrier, carrier.name);
     }
     else
         strcpy(g_sim_carrier, PWL_UNKNOWN_SIM_CARRIER);
@@ -806,321 +839,302 @@ static int load_sn_imei_from_file() {
 }
 */
 
-static gpointer msg_queue_thread_func(gpointer data) {
-    mqd_t mq;
-    struct mq_attr attr;
-    msg_buffer_t message;
-
-    /* initialize the queue attributes */
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = PWL_MQ_MAX_MSG;
-    attr.mq_msgsize = sizeof(message);
-    attr.mq_curmsgs = 0;
+static void msg_queue_handler(msg_buffer_t *message, uint32_t request_id) {
     char mnc_len_str[2];
     char sim_mcc_mnc[2][4];
     char pref_carrier_id[10] = {0};
-    /* create the message queue */
-    mq = mq_open(PWL_MQ_PATH_PREF, O_CREAT | O_RDONLY, 0644, &attr);
 
-    while (1) {
-        ssize_t bytes_read;
+    print_message_info(message);
 
-        /* receive the message */
-        bytes_read = mq_receive(mq, (gchar *)&message, sizeof(message), NULL);
-
-        print_message_info(&message);
+    // Reply whose requester already gave up, do not let it update the state
+    if (message->status != PWL_CID_STATUS_NONE && !pwl_ipc_reply_accept(message, &request_id))
+        return;
 
-        switch (message.pwl_cid)
-        {
-            /* CID request from others */
-            case PWL_CID_GET_MFR:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_manufacturer);
-                break;
-            case PWL_CID_GET_SKUID:
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_skuid);
-                break;
-            case PWL_CID_GET_MAIN_FW_VER:
-                if (g_main_fw_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_main_fw_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("Main FW version not ready!");
-                }
-                break;
-            case PWL_CID_GET_AP_VER:
-                if (g_ap_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_ap_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("AP version not ready!");
-                }
-                break;
-            case PWL_CID_GET_MD_VER:
-                if (g_modem_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_modem_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("Modem version not ready!");
-                }
-                break;
-            case PWL_CID_GET_OP_VER:
-                if (g_op_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_op_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("OP version not ready!");
-                }
-                break;
-            case PWL_CID_GET_OEM_VER:
-                if (g_oem_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_oem_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("OEM version not ready!");
-                }
-                break;
-            case PWL_CID_GET_DPV_VER:
-                if (g_dpv_version != NULL)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_dpv_version);
-                else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "");
-                    PWL_LOG_ERR("DPV version not ready!");
-                }
-                break;
-            case PWL_CID_GET_PREF_CARRIER_ID:
-                PWL_LOG_DEBUG("[CXP] PWL_CID_GET_PREF_CARRIER_ID");
-                get_preferred_carrier_id();
-                memset(pref_carrier_id, 0, sizeof(pref_carrier_id));
-                sprintf(pref_carrier_id, "%d", g_pref_carrier_id);
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, pref_carrier_id);
-                break;
-            case PWL_CID_GET_CXP_REBOOT_FLAG:
-                PWL_LOG_DEBUG("[CXP] PWL_CID_GET_CXP_REBOOT_FLAG");
-                if (g_need_cxp_reboot)
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, "1");
-                else
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, "0");
-                break;
-            case PWL_CID_UPDATE_FW_VER:
-                PWL_LOG_DEBUG("Receive update req, send req msg.");
-                send_message_queue(PWL_CID_GET_FW_VER);
-                break;
-            case PWL_CID_GET_CRSM:
-                g_mnc_len = 0;
-                if (message.status == PWL_CID_STATUS_OK) {
-                    if (strlen(message.response) > 0 && strncmp("+CRSM: ", message.response, strlen("+CRSM: ")) == 0)
-                    {
-                        // search first '"'
-                        gchar* match = strstr(message.response, "\"");
-                        if (match != NULL) {
-                            // search 2nd '"'
-                            match = strstr(match + 1, "\"");
-                        }
-                        if (match != NULL) {
-                            match--;
-                            memset(mnc_len_str, 0, sizeof(mnc_len_str));
-                            strncpy(mnc_len_str, match, 1);
-                            g_mnc_len = atoi(mnc_len_str);
-                            if (g_mnc_len > 3) g_mnc_len = 0;
-                        }
+    switch (message->pwl_cid)
+    {
+        /* CID request from others */
+        case PWL_CID_GET_MFR:
+            send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_manufacturer);
+            break;
+        case PWL_CID_GET_SKUID:
+            send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_skuid);
+            break;
+        case PWL_CID_GET_MAIN_FW_VER:
+            if (g_main_fw_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_main_fw_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("Main FW version not ready!");
+            }
+            break;
+        case PWL_CID_GET_AP_VER:
+            if (g_ap_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_ap_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("AP version not ready!");
+            }
+            break;
+        case PWL_CID_GET_MD_VER:
+            if (g_modem_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_modem_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("Modem version not ready!");
+            }
+            break;
+        case PWL_CID_GET_OP_VER:
+            if (g_op_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_op_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("OP version not ready!");
+            }
+            break;
+        case PWL_CID_GET_OEM_VER:
+            if (g_oem_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_oem_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("OEM version not ready!");
+            }
+            break;
+        case PWL_CID_GET_DPV_VER:
+            if (g_dpv_version != NULL)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_dpv_version);
+            else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "");
+                PWL_LOG_ERR("DPV version not ready!");
+            }
+            break;
+        case PWL_CID_GET_PREF_CARRIER_ID:
+            PWL_LOG_DEBUG("[CXP] PWL_CID_GET_PREF_CARRIER_ID");
+            get_preferred_carrier_id();
+            memset(pref_carrier_id, 0, sizeof(pref_carrier_id));
+            sprintf(pref_carrier_id, "%d", g_pref_carrier_id);
+            send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, pref_carrier_id);
+            break;
+        case PWL_CID_GET_CXP_REBOOT_FLAG:
+            PWL_LOG_DEBUG("[CXP] PWL_CID_GET_CXP_REBOOT_FLAG");
+            if (g_need_cxp_reboot)
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, "1");
+            else
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, "0");
+            break;
+        case PWL_CID_UPDATE_FW_VER:
+            PWL_LOG_DEBUG("Receive update req, send req msg.");
+            send_message_queue(PWL_CID_GET_FW_VER);
+            break;
+        case PWL_CID_GET_CRSM:
+            g_mnc_len = 0;
+            if (message->status == PWL_CID_STATUS_OK) {
+                if (strlen(message->response) > 0 && strncmp("+CRSM: ", message->response, strlen("+CRSM: ")) == 0)
+                {
+                    // search first '"'
+                    gchar* match = strstr(message->response, "\"");
+                    if (match != NULL) {
+                        // search 2nd '"'
+                        match = strstr(match + 1, "\"");
                     }
-                }
-                if (DEBUG) PWL_LOG_DEBUG("g_mnc_len: %d", g_mnc_len);
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_CIMI:
-                if (message.status == PWL_CID_STATUS_OK) {
-                    if (DEBUG) PWL_LOG_DEBUG("%s", message.response);
-                    memset(sim_mcc_mnc, 0, sizeof(sim_mcc_mnc));
-                    strncpy(&sim_mcc_mnc[0][0], message.response, 3);
-                    char *mnc = message.response + 3;
-                    strncpy(&sim_mcc_mnc[1][0], mnc, g_mnc_len);
-                    get_carrier_from_sim(sim_mcc_mnc[0], sim_mcc_mnc[1]);
-                    PWL_LOG_DEBUG("Sim carrier: %s", g_sim_carrier);
-                    g_is_get_cimi = TRUE;
-                }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_CARRIER_ID:
-                if (message.status == PWL_CID_STATUS_OK) {
-                    if (strlen(message.response) > 0) {
-                        g_current_carrier_id = atoi(message.response);
-                        if (DEBUG) PWL_LOG_DEBUG("Sim Carrier ID: %d", g_current_carrier_id);
+                    if (match != NULL) {
+                        match--;
+                        memset(mnc_len_str, 0, sizeof(mnc_len_str));
+                        strncpy(mnc_len_str, match, 1);
+                        g_mnc_len = atoi(mnc_len_str);
+                        if (g_mnc_len > 3) g_mnc_len = 0;
                     }
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_SIM_CARRIER:
-                if (strlen(g_sim_carrier) > 0) {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_sim_carrier);
-                } else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, g_sim_carrier);
-                }
-                break;
-            case PWL_CID_BACKUP_SN_IMEI:
-                int status = PWL_CID_STATUS_ERROR;
-                char *err_msg = "Backup SN/IMEI Error";
-                if (strlen(message.content) > 0 && handle_sn_imei_backup_file(BACKUP_FILE_SAVE, message.content) == RET_OK) {
-                    status = PWL_CID_STATUS_OK;
-                    err_msg = "";
-                }
-                send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, status, err_msg);
-                break;
-            case PWL_CID_GET_BACKUP_SN_IMEI:
-                if (handle_sn_imei_backup_file(BACKUP_FILE_LOAD, NULL) != RET_OK) {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_ERROR, "Get backup sn/imei Error!");
-                } else {
-                    send_message_reply(message.pwl_cid, PWL_MQ_ID_PREF, message.sender_id, PWL_CID_STATUS_OK, g_sn_imei);
-                }
-                break;
-            /* CID request from myself */
-            case PWL_CID_GET_FW_VER:
-                if (message.status == PWL_CID_STATUS_OK && strlen(message.response) > 0)
-                {
-                    strcpy(g_fwver, message.response);
-                    // PWL_LOG_DEBUG("g_fwver: %s", g_fwver);
-                    split_fw_versions(message.response);
+            }
+            if (DEBUG) PWL_LOG_DEBUG("g_mnc_len: %d", g_mnc_len);
+            break;
+        case PWL_CID_GET_CIMI:
+            if (message->status == PWL_CID_STATUS_OK) {
+                if (DEBUG) PWL_LOG_DEBUG("%s", message->response);
+                memset(sim_mcc_mnc, 0, sizeof(sim_mcc_mnc));
+                strncpy(&sim_mcc_mnc[0][0], message->response, 3);
+                char *mnc = message->response + 3;
+                strncpy(&sim_mcc_mnc[1][0], mnc, g_mnc_len);
+                get_carrier_from_sim(sim_mcc_mnc[0], sim_mcc_mnc[1]);
+                PWL_LOG_DEBUG("Sim carrier: %s", g_sim_carrier);
+                g_is_get_cimi = TRUE;
+            }
+            break;
+        case PWL_CID_GET_CARRIER_ID:
+            if (message->status == PWL_CID_STATUS_OK) {
+                if (strlen(message->response) > 0) {
+                    g_current_carrier_id = atoi(message->response);
+                    if (DEBUG) PWL_LOG_DEBUG("Sim Carrier ID: %d", g_current_carrier_id);
                 }
-                else
-                    PWL_LOG_DEBUG("FW version abnormal, abort!");
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PCIE_DEVICE_VERSION:
-                if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
-                    if (DEBUG) PWL_LOG_DEBUG("PWL_CID_GET_PCIE_DEVICE_VERSION");
-                    if (DEBUG) PWL_LOG_DEBUG("message.status: %d", message.status);
-                    if (DEBUG) PWL_LOG_DEBUG("message.response: %s", message.response);
-                    if ((message.status == PWL_CID_STATUS_OK || message.status == PWL_CID_STATUS_ERROR) &&
-                        strlen(message.response) > 0 &&
-                        strstr(message.response, "RMM")) {
-                        split_pcie_device_versions(message.response);
-                    }
+            }
+            break;
+        case PWL_CID_GET_SIM_CARRIER:
+            if (strlen(g_sim_carrier) > 0) {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_sim_carrier);
+            } else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, g_sim_carrier);
+            }
+            break;
+        case PWL_CID_BACKUP_SN_IMEI:
+            int status = PWL_CID_STATUS_ERROR;
+            char *err_msg = "Backup SN/IMEI Error";
+            if (strlen(message->content) > 0 && handle_sn_imei_backup_file(BACKUP_FILE_SAVE, message->content) == RET_OK) {
+                status = PWL_CID_STATUS_OK;
+                err_msg = "";
+            }
+            send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, status, err_msg);
+            break;
+        case PWL_CID_GET_BACKUP_SN_IMEI:
+            if (handle_sn_imei_backup_file(BACKUP_FILE_LOAD, NULL) != RET_OK) {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_ERROR, "Get backup sn/imei Error!");
+            } else {
+                send_message_reply(message->pwl_cid, PWL_MQ_ID_PREF, message->sender_id, request_id, PWL_CID_STATUS_OK, g_sn_imei);
+            }
+            break;
+        /* CID request from myself */
+        case PWL_CID_GET_FW_VER:
+            if (message->status == PWL_CID_STATUS_OK && strlen(message->response) > 0)
+            {
+                g_strlcpy(g_fwver, message->response, sizeof(g_fwver));
+                // PWL_LOG_DEBUG("g_fwver: %s", g_fwver);
+                split_fw_versions(message->response);
+            }
+            else
+                PWL_LOG_DEBUG("FW version abnormal, abort!");
+            break;
+        case PWL_CID_GET_PCIE_DEVICE_VERSION:
+            if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
+                if (DEBUG) PWL_LOG_DEBUG("PWL_CID_GET_PCIE_DEVICE_VERSION");
+                if (DEBUG) PWL_LOG_DEBUG("message->status: %d", message->status);
+                if (DEBUG) PWL_LOG_DEBUG("message->response: %s", message->response);
+                if ((message->status == PWL_CID_STATUS_OK || message->status == PWL_CID_STATUS_ERROR) &&
+                    strlen(message->response) > 0 &&
+                    strstr(message->response, "RMM")) {
+                    split_pcie_device_versions(message->response);
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PCIE_AP_VERSION:
-                if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
-                    if ((message.status == PWL_CID_STATUS_OK || message.status == PWL_CID_STATUS_ERROR) &&
-                        strlen(message.response) > 0 &&
-                        strstr(message.response, "APVERSION")) {
+            }
+            break;
+        case PWL_CID_GET_PCIE_AP_VERSION:
+            if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
+                if ((message->status == PWL_CID_STATUS_OK || message->status == PWL_CID_STATUS_ERROR) &&
+                    strlen(message->response) > 0 &&
+                    strstr(message->response, "APVERSION")) {
 
-                        char *splitted_str;
-                        splitted_str = strtok(message.response, "_");
+                    char *splitted_str;
+                    splitted_str = strtok(message->response, "_");
 
-                        if (splitted_str != NULL) {
-                            while (splitted_str != NULL) {
-                                splitted_str = strtok(NULL, "_");
-                                if (splitted_str != NULL) {
-                                    strcpy(g_ap_version, splitted_str);
-                                    g_ap_version[strcspn(g_ap_version, "\n")] = 0;
-                                    PWL_LOG_DEBUG("AP Version [new]: %s", g_ap_version);
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PCIE_OP_VERSION:
-                if (g_device_type == PWL_DEVICE_TYPE_PCIE ) {
-                    if ((message.status == PWL_CID_STATUS_OK || message.status == PWL_CID_STATUS_ERROR) &&
-                        strlen(message.response) > 0 &&
-                        strstr(message.response, "OP.")) {
-
-                        char *splitted_str;
-                        splitted_str = strtok(message.response, " ");
+                    if (splitted_str != NULL) {
                         while (splitted_str != NULL) {
-                            splitted_str = strtok(NULL, " ");
+                            splitted_str = strtok(NULL, "_");
                             if (splitted_str != NULL) {
-                                strcpy(g_op_version, splitted_str);
-                                g_op_version[strcspn(g_op_version, "\n")] = 0;
-                                PWL_LOG_DEBUG("OP Version: %s", g_op_version);
+                                strcpy(g_ap_version, splitted_str);
+                                g_ap_version[strcspn(g_ap_version, "\n")] = 0;
+                                PWL_LOG_DEBUG("AP Version [new]: %s", g_ap_version);
                                 break;
                             }
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PCIE_OEM_VERSION:
-                if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
-                    if ((message.status == PWL_CID_STATUS_OK || message.status == PWL_CID_STATUS_ERROR) &&
-                        strlen(message.response) > 0 &&
-                        strstr(message.response, "OEM.")) {
-
-                        char *splitted_str;
-                        splitted_str = strtok(message.response, " ");
-                        while (splitted_str != NULL) {
-                            splitted_str = strtok(NULL, " ");
-                            if (splitted_str != NULL) {
-                                strcpy(g_oem_version, splitted_str);
-                                g_oem_version[strcspn(g_oem_version, "\n")] = 0;
-                                PWL_LOG_DEBUG("OEM Version: %s", g_oem_version);
-                                break;
-                            }
+            }
+            break;
+        case PWL_CID_GET_PCIE_OP_VERSION:
+            if (g_device_type == PWL_DEVICE_TYPE_PCIE ) {
+                if ((message->status == PWL_CID_STATUS_OK || message->status == PWL_CID_STATUS_ERROR) &&
+                    strlen(message->response) > 0 &&
+                    strstr(message->response, "OP.")) {
+
+                    char *splitted_str;
+                    splitted_str = strtok(message->response, " ");
+                    while (splitted_str != NULL) {
+                        splitted_str = strtok(NULL, " ");
+                        if (splitted_str != NULL) {
+                            strcpy(g_op_version, splitted_str);
+                            g_op_version[strcspn(g_op_version, "\n")] = 0;
+                            PWL_LOG_DEBUG("OP Version: %s", g_op_version);
+                            break;
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PCIE_DPV_VERSION:
-                if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
-                    if ((message.status == PWL_CID_STATUS_OK || message.status == PWL_CID_STATUS_ERROR) &&
-                        strlen(message.response) > 0 &&
-                        strstr(message.response, "DPV")) {
-
-                        char *splitted_str;
-                        splitted_str = strtok(message.response, " ");
-                        while (splitted_str != NULL) {
-                            splitted_str = strtok(NULL, " ");
-                            if (splitted_str != NULL) {
-                                strcpy(g_dpv_version, splitted_str);
-                                g_dpv_version[strcspn(g_dpv_version, "\n")] = 0;
-                                PWL_LOG_DEBUG("DPV Version: %s", g_dpv_version);
-                                break;
-                            }
+            }
+            break;
+        case PWL_CID_GET_PCIE_OEM_VERSION:
+            if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
+                if ((message->status == PWL_CID_STATUS_OK || message->status == PWL_CID_STATUS_ERROR) &&
+                    strlen(message->response) > 0 &&
+                    strstr(message->response, "OEM.")) {
+
+                    char *splitted_str;
+                    splitted_str = strtok(message->response, " ");
+                    while (splitted_str != NULL) {
+                        splitted_str = strtok(NULL, " ");
+                        if (splitted_str != NULL) {
+                            strcpy(g_oem_version, splitted_str);
+                            g_oem_version[strcspn(g_oem_version, "\n")] = 0;
+                            PWL_LOG_DEBUG("OEM Version: %s", g_oem_version);
+                            break;
                         }
                     }
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_GET_PREF_CARRIER:
-                if (message.status == PWL_CID_STATUS_OK) {
-                    if (DEBUG) PWL_LOG_DEBUG("PREF Carrier: %s", message.response);
-                    char *sub_result = strstr(message.response, "preferred carrier name: ");
-                    if (sub_result) {
-                        int start_pos = sub_result - message.response + strlen("preferred carrier name:  ");
-                        sub_result = strstr(message.response, "preferred config name");
-                        int end_pos = sub_result - message.response;
-                        int sub_str_size = end_pos - start_pos - 2;
-                        strncpy(g_pref_carrier, &message.response[start_pos], sub_str_size);
-                        // for (int n = 0; n < MAX_PREFERRED_CARRIER_NUMBER; n++) {
-                        //     if (DEBUG) PWL_LOG_DEBUG("Compare: %s with %s", g_pref_carrier, g_preferred_carriers[n]);
-                        //     if (strcasecmp(g_pref_carrier, g_preferred_carriers[n]) == 0)
-                        //         g_pref_carrier_id = n;
-                        // }
-                        PWL_LOG_DEBUG("Preferred carrier: %s", g_pref_carrier);
-                    } else {
-                        PWL_LOG_ERR("Can't find preferred carrier!");
+            }
+            break;
+        case PWL_CID_GET_PCIE_DPV_VERSION:
+            if (g_device_type == PWL_DEVICE_TYPE_PCIE) {
+                if ((message->status == PWL_CID_STATUS_OK || message->status == PWL_CID_STATUS_ERROR) &&
+                    strlen(message->response) > 0 &&
+                    strstr(message->response, "DPV")) {
+
+                    char *splitted_str;
+                    splitted_str = strtok(message->response, " ");
+                    while (splitted_str != NULL) {
+                        splitted_str = strtok(NULL, " ");
+                        if (splitted_str != NULL) {
+                            strcpy(g_dpv_version, splitted_str);
+                            g_dpv_version[strcspn(g_dpv_version, "\n")] = 0;
+                            PWL_LOG_DEBUG("DPV Version: %s", g_dpv_version);
+                            break;
+                        }
                     }
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            case PWL_CID_SET_PREF_CARRIER:
-                if (message.status == PWL_CID_STATUS_OK) {
-                    g_set_pref_carrier_ret = TRUE;
-                    if (DEBUG) PWL_LOG_DEBUG("Set preferred carrier result: %s", message.response);
+            }
+            break;
+        case PWL_CID_GET_PREF_CARRIER:
+            if (message->status == PWL_CID_STATUS_OK) {
+                if (DEBUG) PWL_LOG_DEBUG("PREF Carrier: %s", message->response);
+                char *sub_result = strstr(message->response, "preferred carrier name: ");
+                if (sub_result) {
+                    int start_pos = sub_result - message->response + strlen("preferred carrier name:  ");
+                    sub_result = strstr(message->response, "preferred config name");
+                    int end_pos = sub_result ? sub_result - message->response : (int) strlen(message->response) + 2;
+                    int sub_str_size = end_pos - start_pos - 2;
+                    if (sub_str_size > 0)
+                        g_strlcpy(g_pref_carrier, &message->response[start_pos], MIN(sub_str_size + 1, sizeof(g_pref_carrier)));
+                    // for (int n = 0; n < MAX_PREFERRED_CARRIER_NUMBER; n++) {
+                    //     if (DEBUG) PWL_LOG_DEBUG("Compare: %s with %s", g_pref_carrier, g_preferred_carriers[n]);
+                    //     if (strcasecmp(g_pref_carrier, g_preferred_carriers[n]) == 0)
+                    //         g_pref_carrier_id = n;
+                    // }
+                    PWL_LOG_DEBUG("Preferred carrier: %s", g_pref_carrier);
+                } else {
+                    PWL_LOG_ERR("Can't find preferred carrier!");
                 }
-                pthread_cond_signal(&g_cond);
-                break;
-            default:
-                PWL_LOG_ERR("Unknown pwl cid: %d", message.pwl_cid);
-                break;
-        }
+            }
+            break;
+        case PWL_CID_SET_PREF_CARRIER:
+            if (message->status == PWL_CID_STATUS_OK) {
+                g_set_pref_carrier_ret = TRUE;
+                if (DEBUG) PWL_LOG_DEBUG("Set preferred carrier result: %s", message->response);
+            }
+            break;
+        default:
+            PWL_LOG_ERR("Unknown pwl cid: %d", message->pwl_cid);
+            break;
     }
 
-    return NULL;
+    // Before the sender wakes up, it may ask pwl_core for the state next
+    publish_module_state();
+
+    // Wake up the sender waiting for this reply
+    if (message->status != PWL_CID_STATUS_NONE)
+        pwl_ipc_reply_done(request_id, message->status);
 }
 
 void split_pcie_device_versions(char *sw_version) {
@@ -1224,6 +1238,7 @@ void split_fw_versions(char *fw_version) {
 }
 
 gint main() {
+    pwl_log_init();
     g_device_type = pwl_get_device_type_await();
     if (g_device_type == PWL_DEVICE_TYPE_UNKNOWN) {
         PWL_LOG_INFO("Unsupported device.");
@@ -1237,6 +1252,8 @@ gint main() {
     pwl_get_skuid(g_skuid, PWL_MAX_SKUID_SIZE);
     if (DEBUG) PWL_LOG_DEBUG("SKU Number: %s", g_skuid);
 
+    pwl_carrier_load();
+
     signal_callback_t signal_callback;
 
     signal_callback.callback_get_fw_version = signal_callback_get_fw_version;
@@ -1247,7 +1264,11 @@ gint main() {
 
     gdbus_init();
 
-    GThread *msg_queue_thread = g_thread_new("msg_queue_thread", msg_queue_thread_func, NULL);
+    // IPC is dispatched on the main loop together with the D-Bus signals
+    if (pwl_ipc_attach(PWL_MQ_ID_PREF, msg_queue_handler) == 0) {
+        PWL_LOG_ERR("Attach ipc endpoint failed");
+        return 0;
+    }
 
     while(!dbus_service_is_ready());
 
@@ -27,6 +27,7 @@
 #define MAX_PATH  260
 #define MAX_PCIE_VERSION_LENGTH         512
 #define MAX_PCIE_AP_VERSION_LENGTH      10
+#define PWL_SIM_ICCID_LEN               24
 
 #define SN_PREFIX   "SN: "
 #define IMEI_PREFIX "IMEI: "
@@ -34,7 +35,7 @@
 #define BACKUP_FILE_LOAD            1
 
 typedef void (*signal_get_fw_version_callback)(const gchar*);
-typedef void (*signal_get_sub_state_change_callback)(gint arg_status);
+typedef void (*signal_get_sub_state_change_callback)(gint arg_status, const gchar *arg_imsi, const gchar *arg_iccid);
 
 typedef struct {
     signal_get_fw_version_callback callback_get_fw_version;
@@ -43,6 +44,8 @@ typedef struct {
 
 void split_fw_versions(char *fw_version);
 gint get_sim_carrier_info(int retry_delay, int retry_limit);
+gint get_sim_carrier_from_identity(const gchar *imsi, const gchar *iccid);
+void get_carrier_from_sim(char *mcc, char *mnc);
 gint get_preferred_carrier();
 gint set_preferred_carrier(char *carrier, int retry_limit);
 gint get_preferred_carrier_id();
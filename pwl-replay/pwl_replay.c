@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2024 Palcom International Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "pwl_ipc.h"
+#include "pwl_record.h"
+#include "pwl_trace.h"
+
+typedef struct {
+    guint       count;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+} latency_t;
+
+static void usage(const char *name) {
+    printf("Usage:\n");
+    printf("  %s dump <file>           print the recording and reply latency per cid\n", name);
+    printf("  %s play <file> [speed]   feed the received requests back into the recording daemon\n", name);
+    printf("                           speed 1 is original timing, 0 is as fast as possible\n");
+    printf("  %s trace [file]          print a flight recorder dump, without file the live buffer\n", name);
+}
+
+static gboolean read_header(FILE *fp, pwl_record_header_t *header) {
+    if (fread(header, sizeof(*header), 1, fp) != 1 || header->magic != PWL_RECORD_MAGIC) {
+        PWL_LOG_ERR("Not a pwl record file");
+        return FALSE;
+    }
+    if (header->version != PWL_RECORD_VERSION) {
+        PWL_LOG_ERR("Unsupported record version %d", header->version);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean read_entry(FILE *fp, pwl_record_entry_t *entry, gchar *payload) {
+    if (fread(entry, sizeof(*entry), 1, fp) != 1)
+        return FALSE;
+    if (entry->payload_len > PWL_RECORD_MAX_PAYLOAD) {
+        PWL_LOG_ERR("Corrupted entry, payload %d bytes", entry->payload_len);
+        return FALSE;
+    }
+    // Both index name tables
+    if (entry->type >= PWL_RECORD_TYPE_MAX || entry->lane >= PWL_IPC_LANES) {
+        PWL_LOG_ERR("Corrupted entry, type %d lane %d", entry->type, entry->lane);
+        return FALSE;
+    }
+    if (entry->payload_len && fread(payload, entry->payload_len, 1, fp) != 1)
+        return FALSE;
+    payload[entry->payload_len] = '\0';
+    return TRUE;
+}
+
+// Rebuild the message from an IPC entry, payload is content '\0' response
+static void entry_to_message(pwl_record_entry_t *entry, gchar *payload, msg_buffer_t *message) {
+    size_t content_len = strnlen(payload, PWL_MQ_MAX_CONTENT_LEN - 1);
+    size_t response_len = 0;
+
+    memset(message, 0, sizeof(*message));
+    message->pwl_cid = entry->pwl_cid;
+    message->status = entry->status;
+    memcpy(message->content, payload, content_len);
+    if (entry->payload_len > content_len + 1) {
+        response_len = entry->payload_len - content_len - 1;
+        if (response_len > PWL_MSG_MAX_RESP - 1)
+            response_len = PWL_MSG_MAX_RESP - 1;
+        memcpy(message->response, payload + content_len + 1, response_len);
+    }
+}
+
+static void latency_add(latency_t *latency, uint64_t ns) {
+    latency->count++;
+    latency->total_ns += ns;
+    if (ns > latency->max_ns)
+        latency->max_ns = ns;
+}
+
+static void latency_print(const gchar *name, latency_t *latency) {
+    if (latency->count == 0)
+        return;
+    printf("  %-28s %6u  avg %8.3f ms  max %8.3f ms\n", name, latency->count,
+           latency->total_ns / 1e6 / latency->count, latency->max_ns / 1e6);
+}
+
+static int dump(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    pwl_record_header_t header;
+    pwl_record_entry_t entry;
+    gchar payload[PWL_RECORD_MAX_PAYLOAD + 1];
+    msg_buffer_t message;
+    GHashTable *sent;
+    latency_t cid_latency[PWL_CID_MAX];
+    latency_t at_latency, mbim_latency;
+    uint64_t at_start = 0, mbim_start = 0;
+
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open %s failed", path);
+        return -1;
+    }
+    if (!read_header(fp, &header)) {
+        fclose(fp);
+        return -1;
+    }
+
+    sent = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    memset(cid_latency, 0, sizeof(cid_latency));
+    memset(&at_latency, 0, sizeof(at_latency));
+    memset(&mbim_latency, 0, sizeof(mbim_latency));
+    printf("Recorded by %s\n", PWL_MQ_PATH(header.owner_id));
+
+    while (read_entry(fp, &entry, payload)) {
+        double ms = (entry.timestamp_ns - header.start_monotonic_ns) / 1e6;
+
+        if (entry.type != PWL_RECORD_IPC_SEND && entry.type != PWL_RECORD_IPC_RECV) {
+            printf("%12.3f %-9s %s\n", ms, record_type_name[entry.type], payload);
+            if (entry.type == PWL_RECORD_AT_CMD)
+                at_start = entry.timestamp_ns;
+            else if (entry.type == PWL_RECORD_AT_RESP && at_start)
+                latency_add(&at_latency, entry.timestamp_ns - at_start);
+            else if (entry.type == PWL_RECORD_MBIM_CMD)
+                mbim_start = entry.timestamp_ns;
+            else if (entry.type == PWL_RECORD_MBIM_RESP && mbim_start)
+                latency_add(&mbim_latency, entry.timestamp_ns - mbim_start);
+            continue;
+        }
+
+        entry_to_message(&entry, payload, &message);
+        printf("%12.3f %-9s %-14s %-28s %-6s id %-6u %-7s %s %s\n", ms,
+               record_type_name[entry.type], PWL_MQ_PATH(entry.peer_id),
+               entry.pwl_cid < PWL_CID_MAX ? cid_name[entry.pwl_cid] : "?",
+               entry.status == PWL_CID_STATUS_NONE ? "REQ" :
+               entry.status <= PWL_CID_STATUS_BUSY ? cid_status_name[entry.status] : "?",
+               entry.request_id, ipc_lane_name[entry.lane], message.content, message.response);
+
+        if (entry.request_id == PWL_IPC_REQUEST_ID_NONE || entry.pwl_cid >= PWL_CID_MAX)
+            continue;
+
+        // Round trip of our own requests: SEND request, then RECV reply with the same id
+        if (entry.type == PWL_RECORD_IPC_SEND && entry.status == PWL_CID_STATUS_NONE) {
+            uint64_t *ts = g_new(uint64_t, 1);
+            *ts = entry.timestamp_ns;
+            g_hash_table_insert(sent, GUINT_TO_POINTER(entry.request_id), ts);
+        } else if (entry.type == PWL_RECORD_IPC_RECV && entry.status != PWL_CID_STATUS_NONE) {
+            uint64_t *ts = g_hash_table_lookup(sent, GUINT_TO_POINTER(entry.request_id));
+            if (ts) {
+                latency_add(&cid_latency[entry.pwl_cid], entry.timestamp_ns - *ts);
+                g_hash_table_remove(sent, GUINT_TO_POINTER(entry.request_id));
+            }
+        }
+    }
+
+    printf("\nReply latency\n");
+    for (int i = 0; i < PWL_CID_MAX; i++) {
+        if (i != PLW_CID_MAX_PREF && i != PLW_CID_MAX_MADPT)
+            latency_print(cid_name[i], &cid_latency[i]);
+    }
+    latency_print("AT command", &at_latency);
+    latency_print("MBIM command", &mbim_latency);
+    if (g_hash_table_size(sent))
+        printf("  %u requests without reply\n", g_hash_table_size(sent));
+
+    g_hash_table_destroy(sent);
+    fclose(fp);
+    return 0;
+}
+
+static int play(const char *path, double speed) {
+    FILE *fp = fopen(path, "rb");
+    pwl_record_header_t header;
+    pwl_record_entry_t entry;
+    gchar payload[PWL_RECORD_MAX_PAYLOAD + 1];
+    msg_buffer_t message;
+    struct timespec start, now;
+    uint64_t first_ns = 0, late_ns = 0;
+    guint sent = 0, failed = 0;
+
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open %s failed", path);
+        return -1;
+    }
+    if (!read_header(fp, &header)) {
+        fclose(fp);
+        return -1;
+    }
+
+    PWL_LOG_INFO("Replay to %s at speed %.1f", PWL_MQ_PATH(header.owner_id), speed);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (read_entry(fp, &entry, payload)) {
+        // Only the requests the daemon received. The recorded replies answered requests of the
+        // recording run, the daemon gets fresh ones from the live peers for what it asks now.
+        if (entry.type != PWL_RECORD_IPC_RECV || entry.status != PWL_CID_STATUS_NONE)
+            continue;
+
+        if (first_ns == 0)
+            first_ns = entry.timestamp_ns;
+
+        if (speed > 0) {
+            uint64_t due_ns = (entry.timestamp_ns - first_ns) / speed;
+            uint64_t elapsed_ns;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_ns = (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+            if (due_ns > elapsed_ns)
+                g_usleep((due_ns - elapsed_ns) / 1000);
+            else
+                late_ns += elapsed_ns - due_ns;
+        }
+
+        // No sender, the daemon only records its reply and the live peers never see it
+        entry_to_message(&entry, payload, &message);
+        message.sender_id = PWL_MQ_ID_INVALID;
+        if (pwl_ipc_send(header.owner_id, &message, entry.request_id))
+            sent++;
+        else
+            failed++;
+    }
+
+    PWL_LOG_INFO("Replayed %u requests, %u failed, %.3f ms total lag", sent, failed, late_ns / 1e6);
+    fclose(fp);
+    return failed ? -1 : 0;
+}
+
+static gint trace_event_compare(gconstpointer a, gconstpointer b) {
+    const pwl_trace_event_t *event_a = *(pwl_trace_event_t * const *) a;
+    const pwl_trace_event_t *event_b = *(pwl_trace_event_t * const *) b;
+
+    return event_a->seq < event_b->seq ? -1 : event_a->seq > event_b->seq;
+}
+
+static gboolean trace_read_live(pwl_trace_buffer_t *buffer, pwl_trace_dump_header_t *header) {
+    pwl_trace_buffer_t *live;
+    struct timespec ts;
+    int fd = shm_open(PWL_TRACE_SHM_PATH, O_RDONLY, 0);
+
+    if (fd < 0) {
+        PWL_LOG_ERR("No trace buffer, no daemon is running");
+        return FALSE;
+    }
+    live = mmap(NULL, sizeof(*live), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (live == MAP_FAILED) {
+        PWL_LOG_ERR("Map trace buffer failed");
+        return FALSE;
+    }
+    memcpy(buffer, live, sizeof(*buffer));
+    munmap(live, sizeof(*live));
+
+    memset(header, 0, sizeof(*header));
+    header->magic = PWL_TRACE_MAGIC;
+    header->version = PWL_TRACE_VERSION;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    header->monotonic_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    strcpy(header->reason, "live");
+    return TRUE;
+}
+
+static gboolean trace_read_file(const char *path, pwl_trace_buffer_t *buffer, pwl_trace_dump_header_t *header) {
+    FILE *fp = fopen(path, "rb");
+    gboolean ret;
+
+    if (fp == NULL) {
+        PWL_LOG_ERR("Open %s failed", path);
+        return FALSE;
+    }
+    ret = fread(header, sizeof(*header), 1, fp) == 1 && header->magic == PWL_TRACE_MAGIC &&
+          fread(buffer, sizeof(*buffer), 1, fp) == 1;
+    fclose(fp);
+    if (!ret)
+        PWL_LOG_ERR("Not a pwl trace dump");
+    return ret;
+}
+
+static int trace(const char *path) {
+    pwl_trace_buffer_t *buffer = g_new0(pwl_trace_buffer_t, 1);
+    pwl_trace_dump_header_t header;
+    GPtrArray *events;
+    gboolean ret;
+
+    ret = path ? trace_read_file(path, buffer, &header) : trace_read_live(buffer, &header);
+    if (ret && (header.version != PWL_TRACE_VERSION || buffer->event_size != sizeof(pwl_trace_event_t))) {
+        PWL_LOG_ERR("Unsupported trace version %d", header.version);
+        ret = FALSE;
+    }
+    if (!ret) {
+        g_free(buffer);
+        return -1;
+    }
+
+    events = g_ptr_array_new();
+    for (int i = 0; i < PWL_TRACE_EVENTS; i++) {
+        if (buffer->ring[i].seq && buffer->ring[i].type < PWL_TRACE_TYPE_MAX)
+            g_ptr_array_add(events, &buffer->ring[i]);
+    }
+    g_ptr_array_sort(events, trace_event_compare);
+
+    if (header.realtime_ns) {
+        time_t when = header.realtime_ns / 1000000000ULL;
+        printf("Dumped by %s, reason %s, %s", PWL_MQ_PATH(header.source) + 1, header.reason, ctime(&when));
+    }
+    printf("%u events, seconds before the dump\n", events->len);
+
+    for (guint i = 0; i < events->len; i++) {
+        pwl_trace_event_t *event = g_ptr_array_index(events, i);
+        gboolean ipc = event->type == PWL_TRACE_IPC_SEND || event->type == PWL_TRACE_IPC_RECV;
+        gchar *text = g_strndup(event->text, PWL_TRACE_TEXT_LEN);
+        gchar id[16];
+
+        // id is the cid for ipc events, a plain number for the rest
+        snprintf(id, sizeof(id), "%u", event->id);
+        g_strdelimit(text, "\r\n", ' ');
+        printf("%12.6f %-13s %-9s %-28s %6d %s\n",
+               -((double)(int64_t)(header.monotonic_ns - event->timestamp_ns) / 1e9),
+               PWL_MQ_PATH(event->source) + 1, trace_type_name[event->type],
+               ipc && event->id < PWL_CID_MAX ? cid_name[event->id] : id, event->value, text);
+        g_free(text);
+    }
+
+    g_ptr_array_free(events, TRUE);
+    g_free(buffer);
+    return 0;
+}
+
+gint main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "dump") == 0)
+        return dump(argv[2]);
+
+    if (argc >= 3 && strcmp(argv[1], "play") == 0)
+        return play(argv[2], argc >= 4 ? atof(argv[3]) : 1.0);
+
+    if (argc >= 2 && strcmp(argv[1], "trace") == 0)
+        return trace(argc >= 3 ? argv[2] : NULL);
+
+    usage(argv[0]);
+    return -1;
+}